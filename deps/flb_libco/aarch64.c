@@ -122,6 +122,24 @@ cothread_t co_active(void)
    return co_active_handle;
 }
 
+cothread_t co_derive(void *memory, unsigned int size,
+                     void (*entrypoint)(void))
+{
+   uint64_t *ptr = (uint64_t*)memory;
+
+   if (!ptr)
+      return ptr;
+
+   /* The memory must be 1024 bytes aligned as in co_create() */
+   size &= ~1023;
+   memset(ptr, 0, 19 * sizeof(uint64_t)); /* non-volatiles and padding */
+   ptr[20] = (uintptr_t)ptr + size - 16;  /* x30, stack pointer */
+   ptr[19] = ptr[20];                     /* x29, frame pointer */
+   ptr[21] = (uintptr_t)entrypoint;       /* PC */
+
+   return ptr;
+}
+
 void co_delete(cothread_t handle)
 {
    free(handle);
@@ -149,6 +149,27 @@ cothread_t co_create(unsigned int size, void (*entrypoint)(void),
   return handle;
 }
 
+cothread_t co_derive(void *memory, unsigned int size,
+                     void (*entrypoint)(void)) {
+  cothread_t handle;
+  if(!co_swap) {
+    co_init();
+    co_swap = (void (*)(cothread_t, cothread_t))co_swap_function;
+  }
+
+  if(!co_active_handle) co_active_handle = &co_active_buffer;
+  size &= ~15;  /* align stack to 16-byte boundary */
+
+  if((handle = (cothread_t)memory)) {
+    long long *p = (long long*)((char*)handle + size);  /* seek to top of stack */
+    *--p = (long long)crash;                            /* crash if entrypoint returns */
+    *--p = (long long)entrypoint;                       /* start of function */
+    *(long long*)handle = (long long)p;                 /* stack pointer */
+  }
+
+  return handle;
+}
+
 void co_delete(cothread_t handle) {
   free(handle);
 }
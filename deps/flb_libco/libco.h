@@ -17,6 +17,8 @@ typedef void* cothread_t;
 
 cothread_t co_active();
 cothread_t co_create(unsigned int, void (*)(void), size_t *);
+/* create a cothread on caller provided memory, returns 0 if unsupported */
+cothread_t co_derive(void *, unsigned int, void (*)(void));
 void co_delete(cothread_t);
 void co_switch(cothread_t);
 
@@ -331,6 +331,15 @@ cothread_t co_create(unsigned int size, void (*entry_)(void),
   return t;
 }
 
+cothread_t co_derive(void *memory, unsigned int size,
+                     void (*entrypoint)(void)) {
+  /* not supported by this backend, callers fall back to co_create() */
+  (void)memory;
+  (void)size;
+  (void)entrypoint;
+  return 0;
+}
+
 void co_delete(cothread_t t) {
   free(t);
 }
@@ -84,6 +84,15 @@ cothread_t co_create(unsigned int size, void (*coentry)(void),
   return (cothread_t)thread;
 }
 
+cothread_t co_derive(void *memory, unsigned int size,
+                     void (*entrypoint)(void)) {
+  /* not supported by this backend, callers fall back to co_create() */
+  (void)memory;
+  (void)size;
+  (void)entrypoint;
+  return 0;
+}
+
 void co_delete(cothread_t cothread) {
   if(cothread) {
     if(((cothread_struct*)cothread)->stack) {
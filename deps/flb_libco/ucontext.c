@@ -54,6 +54,15 @@ cothread_t co_create(unsigned int heapsize, void (*coentry)(void),
   return (cothread_t)thread;
 }
 
+cothread_t co_derive(void *memory, unsigned int size,
+                     void (*entrypoint)(void)) {
+  /* not supported by this backend, callers fall back to co_create() */
+  (void)memory;
+  (void)size;
+  (void)entrypoint;
+  return 0;
+}
+
 void co_delete(cothread_t cothread) {
   if(cothread) {
     if(((ucontext_t*)cothread)->uc_stack.ss_sp) { free(((ucontext_t*)cothread)->uc_stack.ss_sp); }
@@ -37,10 +37,18 @@
 /* General Headers */
 #include <errno.h>
 
-/* global vars */
+/*
+ * Global vars: a plugin made of several source files defines
+ * MK_PLUGIN_API_EXTERN before the includes in all of them but one.
+ */
+#ifdef MK_PLUGIN_API_EXTERN
+extern struct plugin_api *mk_api;
+extern pthread_key_t MK_EXPORT _mkp_data;
+#else
 struct plugin_api *mk_api;
 
 pthread_key_t MK_EXPORT _mkp_data;
+#endif
 
 #define MONKEY_PLUGIN(a, b, c, d)                   \
     struct mk_plugin_info MK_EXPORT _plugin_info = {a, b, c, d}
@@ -90,10 +98,10 @@ pthread_key_t MK_EXPORT _mkp_data;
 #define mk_info(...) mk_info_ex(mk_api, __VA_ARGS__)
 
 #undef  mk_err
-#define mk_err(...) mk_error_ex(mk_api, __VA_ARGS__)
+#define mk_err(...) mk_err_ex(mk_api, __VA_ARGS__)
 
 #undef  mk_warn
-#define mk_warn(...) mk_error_ex(mk_api, __VA_ARGS__)
+#define mk_warn(...) mk_warn_ex(mk_api, __VA_ARGS__)
 
 #undef  mk_bug
 #define mk_bug(condition) mk_bug_ex(mk_api, condition)
@@ -45,6 +45,32 @@ typedef uint32_t gid_t;
 #define MK_DEFAULT_LISTEN_PORT              "2001"
 #define MK_WORKERS_DEFAULT                  1
 
+/* Maximum number of connections accepted per listener wakeup */
+#define MK_ACCEPT_BATCH_DEFAULT             16
+#define MK_ACCEPT_BATCH_MAX                 256
+
+/* Open file cache: entries per worker and revalidation interval (seconds) */
+#define MK_FILE_CACHE_SIZE_DEFAULT          256
+#define MK_FILE_CACHE_TTL_DEFAULT           5
+
+/* Files up to this size (bytes) are kept in memory, per worker budget (KB) */
+#define MK_FILE_CACHE_MAX_BODY_DEFAULT      16384
+#define MK_FILE_CACHE_MEMORY_DEFAULT        4096
+
+/* Largest file compressed on the fly (bytes), per worker budget (KB) */
+#define MK_GZIP_MAX_SIZE_DEFAULT            1048576
+#define MK_GZIP_MEMORY_DEFAULT              8192
+
+/* Coroutine contexts kept by each worker for library mode handlers */
+#define MK_COROUTINE_POOL_DEFAULT           64
+
+/* Write-stall timeout (seconds) and timeouts resolution (milliseconds) */
+#define MK_WRITE_TIMEOUT_DEFAULT            15
+#define MK_TIMEOUT_RESOLUTION_DEFAULT       100
+
+/* Path of the internal metrics endpoint */
+#define MK_METRICS_PATH_DEFAULT             "/metrics"
+
 /* Core capabilities, used as identifiers to match plugins */
 #define MK_CAP_HTTP        1
 
@@ -78,7 +104,7 @@ struct mk_server
     short int workers;            /* number of worker threads */
     short int manual_tcp_cork;    /* If enabled it will handle TCP_CORK */
 
-    int8_t fdt;                   /* is FDT enabled ? */
+    int8_t fdt;                   /* is the open file cache enabled ? */
     int8_t is_daemon;
     int8_t is_seteuid;
     int8_t scheduler_mode;        /* Scheduler balancing mode */
@@ -116,6 +142,12 @@ struct mk_server
     int max_keep_alive_request; /* max persistent connections to allow */
     int keep_alive_timeout;     /* persistent connection timeout */
 
+    /* timeouts in milliseconds and the timer resolution */
+    int timeout_ms;
+    int keep_alive_timeout_ms;
+    int write_timeout_ms;
+    int timeout_resolution;
+
     /* counter of threads working */
     int thread_counter;
 
@@ -125,6 +157,42 @@ struct mk_server
 
     int max_request_size;
 
+    /* accept(2) budget per listener wakeup */
+    int accept_batch;
+
+    /* register connections in edge-triggered mode */
+    int8_t edge_triggered;
+
+    /* connection contexts from a per worker slab, optional huge pages */
+    int8_t conn_slab;
+    int8_t conn_slab_huge_pages;
+
+    /* release the session of idle keep-alive connections */
+    int8_t keepalive_compact;
+
+    /* open file cache: entries per worker and revalidation interval */
+    int file_cache_size;
+    int file_cache_ttl;
+
+    /* in-memory responses: max file size and per worker budget */
+    size_t file_cache_max_body;
+    size_t file_cache_memory;
+
+    /* gzip content encoding */
+    int8_t gzip_static;           /* serve file.gz siblings      */
+    int8_t gzip_compress;         /* compress text on the fly    */
+    size_t gzip_max_size;
+    size_t gzip_memory;
+
+    /* library mode handlers: pooled coroutines and stack size (bytes) */
+    int coroutine_pool;
+    size_t coroutine_stack;
+
+    /* instrumentation and the path of the internal metrics endpoint */
+    int8_t metrics;
+    char *metrics_path;
+    int metrics_path_len;
+
     struct mk_list *index_files;
 
     /* configured host quantity */
@@ -184,9 +252,6 @@ struct mk_server
     pthread_cond_t  pth_cond;
     pthread_mutex_t pth_mutex;
 
-    /* Used for vhost initialization synchronization */
-    pthread_mutex_t vhost_fdt_mutex;
-
     /* worker_id as used by mk_sched_register_thread, it was moved here
      * because it has to be local to each mk_server instance.
      */
@@ -220,6 +285,7 @@ int mk_config_listen_check_busy(struct mk_server *server);
 void mk_config_listeners_free(struct mk_server *server);
 
 int mk_config_get_bool(char *value);
+int mk_config_timeout_ms(char *value);
 void mk_config_read_hosts(char *path);
 void mk_config_sanity_check(struct mk_server *server);
 void mk_config_free_all(struct mk_server *server);
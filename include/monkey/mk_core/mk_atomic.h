@@ -0,0 +1,53 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_ATOMIC_H
+#define MK_ATOMIC_H
+
+/*
+ * Minimal set of atomic helpers used by the lock-free structures shared
+ * between threads (e.g: balancer -> worker hand-off ring). Values are
+ * expected to be 32 bits wide.
+ */
+
+/* Size used to keep producer and consumer data on different cache lines */
+#define MK_CACHE_LINE_SIZE   64
+
+#ifdef _MSC_VER
+#include <intrin.h>
+
+#define mk_atomic_load(p)                               \
+    _InterlockedOr((volatile long *) (p), 0)
+#define mk_atomic_store(p, v)                           \
+    _InterlockedExchange((volatile long *) (p), (long) (v))
+#define mk_atomic_exchange(p, v)                        \
+    _InterlockedExchange((volatile long *) (p), (long) (v))
+#define mk_atomic_add(p, v)                             \
+    _InterlockedExchangeAdd((volatile long *) (p), (long) (v))
+
+#else
+
+#define mk_atomic_load(p)         __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define mk_atomic_store(p, v)     __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define mk_atomic_exchange(p, v)  __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#define mk_atomic_add(p, v)       __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+
+#endif
+
+#endif
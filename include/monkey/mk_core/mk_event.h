@@ -74,6 +74,8 @@
     #include "mk_event_libevent.h"
 #elif defined(MK_HAVE_EVENT_SELECT)
     #include "mk_event_select.h"
+#elif defined(MK_HAVE_EVENT_URING)
+    #include "mk_event_uring.h"
 #elif defined(__linux__) && !defined(LINUX_KQUEUE)
     #include "mk_event_epoll.h"
 #else
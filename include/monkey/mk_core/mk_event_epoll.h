@@ -22,6 +22,9 @@
 #ifndef MK_EVENT_EPOLL_H
 #define MK_EVENT_EPOLL_H
 
+/* Backend honors MK_EVENT_EDGE registrations */
+#define MK_EVENT_HAVE_EDGE
+
 struct mk_event_ctx {
     int efd;
     int queue_size;
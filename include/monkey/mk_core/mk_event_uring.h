@@ -0,0 +1,89 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <linux/io_uring.h>
+
+#ifndef MK_EVENT_URING_H
+#define MK_EVENT_URING_H
+
+/* Submission and completion queues size */
+#define MK_EVENT_URING_SQ_ENTRIES   256
+#define MK_EVENT_URING_CQ_ENTRIES   4096
+
+/*
+ * Every registered file descriptor owns a slot. The generation number is
+ * bumped each time a poll request is cancelled so completions that belong
+ * to a previous registration can be recognized and discarded.
+ */
+struct mk_event_uring_slot {
+    struct mk_event *event;    /* registered event, NULL if unused     */
+    uint32_t gen;              /* registration generation               */
+    uint32_t mask;             /* requested MK_EVENT_READ/WRITE mask    */
+    int armed;                 /* a poll request is in flight           */
+};
+
+struct mk_event_ctx {
+    int ring_fd;
+    int queue_size;
+
+    /* submission queue */
+    unsigned *sq_khead;
+    unsigned *sq_ktail;
+    unsigned *sq_kmask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_tail;
+    struct io_uring_sqe *sqes;
+
+    /* completion queue */
+    unsigned *cq_khead;
+    unsigned *cq_ktail;
+    unsigned *cq_kmask;
+    struct io_uring_cqe *cqes;
+
+    /* mmap(2) regions */
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    /* registered events indexed by file descriptor */
+    int slots_size;
+    struct mk_event_uring_slot *slots;
+
+    /* events reported by the last wait */
+    struct mk_event **fired;
+    int *fired_fd;
+};
+
+#define mk_event_foreach(event, evl)                                         \
+    int __i;                                                                 \
+    struct mk_event_ctx *__ctx = evl->data;                                  \
+                                                                             \
+    if (evl->n_events > 0) {                                                 \
+        event = __ctx->fired[0];                                             \
+    }                                                                        \
+                                                                             \
+    for (__i = 0;                                                            \
+         __i < evl->n_events;                                                \
+         __i++,                                                              \
+             event = ((__i < evl->n_events) ? __ctx->fired[__i] : NULL)      \
+         )
+#endif
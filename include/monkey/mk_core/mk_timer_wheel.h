@@ -0,0 +1,81 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#ifndef MK_TIMER_WHEEL_H
+#define MK_TIMER_WHEEL_H
+
+#include <stdint.h>
+#include "mk_list.h"
+
+/*
+ * Hierarchical timing wheel: every level has MK_TIMER_WHEEL_SLOTS buckets
+ * and each slot of a level spans a full turn of the level below. A timer
+ * is linked to the level that covers its distance to the current tick and
+ * is moved down (cascaded) when the lower level wraps around, so adding,
+ * removing and expiring a timer do not depend on the number of timers.
+ *
+ * With 4 levels of 64 slots the wheel spans 2^24 ticks, farther deadlines
+ * are clamped to the last slot.
+ */
+#define MK_TIMER_WHEEL_BITS      6
+#define MK_TIMER_WHEEL_SLOTS     (1 << MK_TIMER_WHEEL_BITS)
+#define MK_TIMER_WHEEL_MASK      (MK_TIMER_WHEEL_SLOTS - 1)
+#define MK_TIMER_WHEEL_LEVELS    4
+#define MK_TIMER_WHEEL_SPAN      (1ULL << (MK_TIMER_WHEEL_BITS * \
+                                           MK_TIMER_WHEEL_LEVELS))
+
+struct mk_timer_wheel_node {
+    uint64_t expire;              /* absolute tick                       */
+    int active;                   /* linked to a slot ?                  */
+    struct mk_list _head;         /* link to the wheel slot              */
+};
+
+struct mk_timer_wheel {
+    int tick_ms;                  /* resolution in milliseconds          */
+    uint64_t now;                 /* last processed tick                 */
+    unsigned long count;          /* number of active timers             */
+    struct mk_list slots[MK_TIMER_WHEEL_LEVELS][MK_TIMER_WHEEL_SLOTS];
+};
+
+typedef void (*mk_timer_wheel_cb)(struct mk_timer_wheel_node *, void *);
+
+static inline void mk_timer_wheel_node_init(struct mk_timer_wheel_node *node)
+{
+    node->expire = 0;
+    node->active = 0;
+}
+
+static inline int mk_timer_wheel_node_active(struct mk_timer_wheel_node *node)
+{
+    return node->active;
+}
+
+void mk_timer_wheel_init(struct mk_timer_wheel *wheel, int tick_ms,
+                         uint64_t now_ms);
+void mk_timer_wheel_add(struct mk_timer_wheel *wheel,
+                        struct mk_timer_wheel_node *node,
+                        uint64_t now_ms, uint64_t timeout_ms);
+void mk_timer_wheel_del(struct mk_timer_wheel *wheel,
+                        struct mk_timer_wheel_node *node);
+int mk_timer_wheel_expire(struct mk_timer_wheel *wheel, uint64_t now_ms,
+                          mk_timer_wheel_cb cb, void *data);
+uint64_t mk_timer_wheel_clock();
+
+#endif
@@ -0,0 +1,119 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_FILE_CACHE_H
+#define MK_FILE_CACHE_H
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_config.h>
+#include <monkey/mk_http_internal.h>
+#include <monkey/mk_mimetype.h>
+
+/* "Wed, 15 Nov 1995 04:58:08 GMT\r\n" plus the NULL byte */
+#define MK_FILE_CACHE_GMT_SIZE        32
+
+/* Files smaller than this are not worth to be compressed */
+#define MK_FILE_CACHE_GZIP_MIN_SIZE  256
+
+/* State of the precompressed sibling (file.gz) */
+#define MK_FILE_CACHE_GZ_UNKNOWN      -1
+#define MK_FILE_CACHE_GZ_MISSING       0
+#define MK_FILE_CACHE_GZ_FOUND         1
+
+/*
+ * A cached resource: the result of stat(2) over the full path, the shared
+ * file descriptor (opened on first use) and the response metadata derived
+ * from them, so a hit does not need to touch the file system.
+ */
+struct mk_file_cache_entry {
+    char *path;
+    int path_len;
+    unsigned int hash;
+
+    int fd;                       /* shared descriptor, -1 if not opened */
+    int readers;                  /* requests holding this entry         */
+    int stale;                    /* unlinked, free on last release      */
+    time_t validated;             /* last time metadata was checked      */
+
+    struct file_info file_info;
+    struct mk_mimetype *mime;
+
+    int  etag_len;
+    char etag[MK_HEADER_ETAG_SIZE];
+    int  last_modified_len;
+    char last_modified[MK_FILE_CACHE_GMT_SIZE];
+
+    /* Last-Modified, Content-Type and ETag rows as a single buffer */
+    mk_ptr_t headers;
+
+    /* file content for small files, NULL if it's served from the fd */
+    char *body;
+
+    /* gzip content encoding */
+    int gzip_static;              /* MK_FILE_CACHE_GZ_ state of file.gz   */
+    int gzip_skip;                /* not compressible or not worth it    */
+    char *gzip;                   /* compressed copy of the file         */
+    size_t gzip_len;
+    int  gzip_etag_len;
+    char gzip_etag[MK_HEADER_ETAG_SIZE];
+
+    struct mk_list _head;         /* link to hash bucket                 */
+    struct mk_list _head_lru;     /* link to LRU list, oldest first      */
+};
+
+struct mk_file_cache {
+    int size;                     /* current number of entries           */
+    int capacity;                 /* maximum number of entries           */
+    int ttl;                      /* revalidation interval in seconds    */
+    unsigned int mask;            /* buckets - 1                         */
+    struct mk_list *buckets;
+    struct mk_list lru;
+
+    /* in-memory responses */
+    size_t max_body;              /* largest file kept in memory         */
+    size_t memory_limit;          /* bytes available for file contents   */
+    size_t memory;                /* bytes used by file contents         */
+
+    /* compressed objects */
+    size_t gzip_max_size;         /* largest file compressed on the fly  */
+    size_t gzip_memory_limit;     /* bytes available for gzip objects   */
+    size_t gzip_memory;           /* bytes used by gzip objects          */
+
+    /* stats */
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long body_hits;
+    unsigned long body_misses;
+    unsigned long gzip_hits;
+    unsigned long gzip_misses;
+};
+
+int mk_file_cache_worker_init(struct mk_server *server);
+int mk_file_cache_worker_exit(struct mk_server *server);
+
+int mk_file_cache_stat(struct mk_http_request *sr, struct mk_server *server);
+int mk_file_cache_open(struct mk_http_request *sr, struct mk_server *server);
+int mk_file_cache_close(struct mk_http_request *sr, struct mk_server *server);
+int mk_file_cache_send(struct mk_http_request *sr);
+int mk_file_cache_sibling(struct mk_http_request *sr, char *path, int len,
+                          struct mk_server *server);
+int mk_file_cache_gzip(struct mk_http_request *sr, struct mk_server *server);
+
+#endif
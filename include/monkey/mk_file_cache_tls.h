@@ -20,19 +20,19 @@
 #include <monkey/mk_info.h>
 
 
-#ifndef MK_VHOST_TLS_H
-#define MK_VHOST_TLS_H
+#ifndef MK_FILE_CACHE_TLS_H
+#define MK_FILE_CACHE_TLS_H
 
 #include <monkey/mk_core.h>
 
 #ifdef MK_HAVE_C_TLS  /* Use Compiler Thread Local Storage (TLS) */
 
-__thread struct mk_list *mk_tls_vhost_fdt;
+__thread struct mk_file_cache *mk_tls_file_cache;
 
 #else
 
-pthread_key_t mk_tls_vhost_fdt;
+pthread_key_t mk_tls_file_cache;
 
 #endif /* MK_HAVE_C_TLS  */
 
-#endif /* MK_VHOST_TLS_H */
+#endif /* MK_FILE_CACHE_TLS_H */
@@ -99,6 +99,7 @@ extern const mk_ptr_t mk_header_conn_ka;
 extern const mk_ptr_t mk_header_conn_close;
 extern const mk_ptr_t mk_header_content_length;
 extern const mk_ptr_t mk_header_content_encoding;
+extern const mk_ptr_t mk_header_vary_encoding;
 extern const mk_ptr_t mk_header_accept_ranges;
 extern const mk_ptr_t mk_header_te_chunked;
 extern const mk_ptr_t mk_header_last_modified;
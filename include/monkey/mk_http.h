@@ -64,6 +64,7 @@
 #define MK_EXIT_OK           0
 #define MK_EXIT_ERROR       -1
 #define MK_EXIT_ABORT       -2
+#define MK_EXIT_REFUSED     -3   /* handler not available for the protocol */
 #define MK_EXIT_PCONNECTION 24
 
 /* Available methods */
@@ -77,10 +78,12 @@
 #define MK_HTTP_PROTOCOL_09 (9)
 #define MK_HTTP_PROTOCOL_10 (10)
 #define MK_HTTP_PROTOCOL_11 (11)
+#define MK_HTTP_PROTOCOL_20 (20)
 
 #define MK_HTTP_PROTOCOL_09_STR "HTTP/0.9"
 #define MK_HTTP_PROTOCOL_10_STR "HTTP/1.0"
 #define MK_HTTP_PROTOCOL_11_STR "HTTP/1.1"
+#define MK_HTTP_PROTOCOL_20_STR "HTTP/2.0"
 
 extern const mk_ptr_t mk_http_method_get_p;
 extern const mk_ptr_t mk_http_method_post_p;
@@ -93,6 +96,7 @@ extern const mk_ptr_t mk_http_method_null_p;
 extern const mk_ptr_t mk_http_protocol_09_p;
 extern const mk_ptr_t mk_http_protocol_10_p;
 extern const mk_ptr_t mk_http_protocol_11_p;
+extern const mk_ptr_t mk_http_protocol_20_p;
 extern const mk_ptr_t mk_http_protocol_null_p;
 
 /*
@@ -118,12 +122,17 @@ struct mk_http_session
     int counter_connections;    /* Count persistent connections */
     int status;                 /* Request status */
     int close_now;              /* Close the session ASAP */
+    int processing;             /* Core parsing/preparing requests */
 
     struct mk_channel *channel;
     struct mk_sched_conn *conn;
 
+    /* HTTP/2 stream this session belongs to, NULL for HTTP/1.x */
+    void *h2_stream;
+
     unsigned int body_size;
     unsigned int body_length;
+    unsigned int body_offset;   /* Start of the data not consumed yet */
 
     /* head for mk_http_request list nodes, each request is linked here */
     struct mk_list request_list;
@@ -134,28 +143,27 @@ struct mk_http_session
     /* request body buffer */
     char *body;
 
-    /* Initial fixed size buffer for small requests */
-    char body_fixed[MK_REQUEST_CHUNK];
-
     /*
-     * FIXME: in previous versions of Monkey we used to parse the complete request
-     * for pipelined requests and generate a linked lists of request. With the new
-     * parser we are taking the approach to parse one request and process it before
-     * parsing others, from that point of view we should not need a linked list
-     * of requests.
-     *
-     * Still testing...
+     * First request of the session. When the client pipelines requests, the
+     * complete ones found in the buffer are processed in a batch and linked
+     * after this one in the request_list, see mk_http_request_batch().
      */
     struct mk_http_request sr_fixed;
 
+    /* Server context */
+    struct mk_server *server;
+
     /*
+     * The fields below are initialized by mk_http_session_init(), a new
+     * connection context is only zeroed up to this point (sched_zero_size).
+     *
      * Parser context: we only held one parser per connection
      * which is re-used everytime we have a new request.
      */
     struct mk_http_parser parser;
 
-    /* Server context */
-    struct mk_server *server;
+    /* Initial fixed size buffer for small requests */
+    char body_fixed[MK_REQUEST_CHUNK];
 };
 
 static inline int mk_http_status_completed(struct mk_http_session *cs,
@@ -199,6 +207,9 @@ int mk_http_session_init(struct mk_http_session *cs,
                          struct mk_server *server);
 void mk_http_session_remove(struct mk_http_session *cs,
                             struct mk_server *server);
+void mk_http_session_idle(struct mk_http_session *cs,
+                          struct mk_sched_conn *conn,
+                          struct mk_sched_worker *sched);
 
 /* event handlers */
 int mk_http_handler_read(struct mk_sched_conn *conn, struct mk_http_session *cs,
@@ -217,9 +228,12 @@ struct mk_http_header *mk_http_header_get(int name, struct mk_http_request *req,
                                           const char *key, unsigned int len);
 
 int mk_http_request_end(struct mk_http_session *cs, struct mk_server *server);
+int mk_http_request_serve(struct mk_http_session *cs,
+                          struct mk_http_request *sr,
+                          int protocol, struct mk_server *server);
 
+/* NULL if the connection is idle and its session was released */
 #define mk_http_session_get(conn)               \
-    (struct mk_http_session *)                  \
-    (((uint8_t *) conn) + sizeof(struct mk_sched_conn))
+    ((struct mk_http_session *) (conn)->extra)
 
 #endif
@@ -22,27 +22,35 @@
 
 #include <stdint.h>
 #include <monkey/mk_stream.h>
+#include <monkey/mk_http.h>
 #include <monkey/mk_http2_settings.h>
+#include <monkey/mk_http2_hpack.h>
 
-/* Connection was just upgraded */
-#define MK_HTTP2_UPGRADED               1
+/* Session status */
+#define MK_HTTP2_PREFACE                1 /* waiting for the client preface */
 #define MK_HTTP2_OK                     2
-
-/*
- * The Client 'sent' the SETTINGS frame according to Section 6.5:
- *
- * https://httpwg.github.io/specs/rfc7540.html#ConnectionHeader
- * https://httpwg.github.io/specs/rfc7540.html#SETTINGS
- */
-#define MK_HTTP2_CLIENT_SETTINGS        2
-
-
+#define MK_HTTP2_CLOSING                3 /* GOAWAY sent, close once flushed */
+#define MK_HTTP2_CLOSED                 4 /* connection closed, releasing  */
 
 /* A buffer chunk size */
 #define MK_HTTP2_CHUNK               4096
 
 #define MK_HTTP2_HEADER_SIZE            9 /* Frame header size */
 
+/* Largest frame payload we accept: SETTINGS_MAX_FRAME_SIZE default */
+#define MK_HTTP2_FRAME_SIZE         16384
+
+/* Limits announced in MK_HTTP2_SETTINGS_DEFAULT_FRAME */
+#define MK_HTTP2_MAX_STREAMS          100
+#define MK_HTTP2_WINDOW_SIZE        65535
+#define MK_HTTP2_WINDOW_MAX    0x7fffffff
+
+/* Bytes of DATA frames queued on every round of the write handler */
+#define MK_HTTP2_DISPATCH_SIZE      65536
+
+/* Largest response header the HTTP/1.x pipeline may produce for a stream */
+#define MK_HTTP2_HEADERS_MAX        16384
+
 /*
  * 4.1 HTTP2 Frame format
  *
@@ -60,39 +68,62 @@
 
 /* Structure to represent an incoming frame (not to write) */
 struct mk_http2_frame {
-    uint32_t  len_type;  /* (24 length + 8 type) */
+    uint32_t  length;
+    uint8_t   type;
     uint8_t   flags;
     uint32_t  stream_id;
-    void      *payload;
+    uint8_t   *payload;
 };
 
-/* a=target variable, b=bit number to act upon 0-n */
-#define BIT_CLEAR(a,b) ((a) &= ~(1<<(b)))
-
 static inline uint32_t mk_http2_bitdec_32u(uint8_t *b)
 {
-    return (uint32_t) ((b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3]);
+    return ((uint32_t) b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
 }
 
 static inline uint32_t mk_http2_bitdec_stream_id(uint8_t *b)
 {
-    uint32_t sid = mk_http2_bitdec_32u(b);
-    return BIT_CLEAR(sid, 31);
+    return mk_http2_bitdec_32u(b) & 0x7fffffff;
 }
 
-static inline uint8_t mk_http2_frame_type(struct mk_http2_frame *f)
+static inline void mk_http2_bitenc_32u(uint8_t *b, uint32_t v)
 {
-    return (uint8_t) (0xFFFFFF & f->len_type);
+    b[0] = v >> 24;
+    b[1] = v >> 16;
+    b[2] = v >> 8;
+    b[3] = v;
 }
 
-static inline uint32_t mk_http2_frame_len(struct mk_http2_frame *f)
+/* Decode a frame header, no more... no less */
+static inline void mk_http2_frame_decode_header(uint8_t *buf,
+                                                struct mk_http2_frame *frame)
 {
-    return (uint32_t) (f->len_type >> 8);
+    frame->length    = (buf[0] << 16) | (buf[1] << 8) | buf[2];
+    frame->type      = buf[3];
+    frame->flags     = buf[4];
+    frame->stream_id = mk_http2_bitdec_stream_id(buf + 5);
+    frame->payload   = buf + MK_HTTP2_HEADER_SIZE;
+}
+
+static inline void mk_http2_frame_encode_header(uint8_t *buf, uint32_t length,
+                                                uint8_t type, uint8_t flags,
+                                                uint32_t stream_id)
+{
+    buf[0] = length >> 16;
+    buf[1] = length >> 8;
+    buf[2] = length;
+    buf[3] = type;
+    buf[4] = flags;
+    mk_http2_bitenc_32u(buf + 5, stream_id & 0x7fffffff);
 }
 
 /* HTTP/2 General flags */
 
 #define MK_HTTP2_SETTINGS_ACK        0x1
+#define MK_HTTP2_PING_ACK            0x1
+#define MK_HTTP2_END_STREAM          0x1
+#define MK_HTTP2_END_HEADERS         0x4
+#define MK_HTTP2_PADDED              0x8
+#define MK_HTTP2_PRIORITY_FLAG      0x20
 
 /*
  * HTTP/2 Frame types
@@ -107,11 +138,7 @@ static inline uint32_t mk_http2_frame_len(struct mk_http2_frame *f)
 #define MK_HTTP2_GOAWAY              0x7   /* Section 6.8  */
 #define MK_HTTP2_WINDOW_UPDATE       0x8   /* Section 6.9  */
 #define MK_HTTP2_CONTINUATION        0x9   /* Section 6.10 */
-
-/*
- * HTTP/2 Settings Parameters (Section 6.5.2)
- * ------------------------------------------
- */
+#define MK_HTTP2_PRIORITY_UPDATE    0x10   /* RFC 9218     */
 
 /*
  * HTTP/2 Error codes
@@ -160,9 +187,66 @@ static inline uint32_t mk_http2_frame_len(struct mk_http2_frame *f)
 #define MK_H2_TRACE(...) do {} while (0)
 #endif
 
-#define mk_http2_send_raw(conn, buf, length)            \
-    mk_stream_set(NULL, MK_STREAM_RAW, &conn->channel,  \
-                  buf, length, NULL, NULL, NULL, NULL)
+/* Stream flags */
+#define MK_HTTP2_STREAM_END_REMOTE    1  /* the request was received        */
+#define MK_HTTP2_STREAM_RESPONSE      2  /* response HEADERS queued         */
+#define MK_HTTP2_STREAM_END_LOCAL     4  /* END_STREAM or RST_STREAM queued */
+#define MK_HTTP2_STREAM_RESET         8  /* reset by any of the endpoints   */
+#define MK_HTTP2_STREAM_SERVED       16  /* went through the HTTP pipeline  */
+#define MK_HTTP2_STREAM_FIELDS       32  /* regular header fields received  */
+
+/* Extensible Prioritization Scheme for HTTP (RFC 9218) */
+#define MK_HTTP2_URGENCY_DEFAULT      3
+#define MK_HTTP2_URGENCY_MAX          7
+
+/* A pseudo-header value, offset within the stream 'pseudo' buffer */
+struct mk_http2_field {
+    unsigned int offset;
+    unsigned int length;
+};
+
+/*
+ * A stream is a request/response exchange. The request is rebuilt as
+ * HTTP/1.1 text in the buffer of its own HTTP session so it runs through
+ * the regular request pipeline. The response is queued on a private
+ * channel that is never written to the socket: its content is turned into
+ * HEADERS and DATA frames on the connection channel.
+ */
+struct mk_http2_stream {
+    uint32_t id;
+    int flags;
+    int error;                    /* malformed request: RST_STREAM code */
+
+    /* flow control */
+    int64_t window;               /* bytes we can send                   */
+    int32_t recv_window;          /* bytes the client can send           */
+    uint32_t recv_consumed;       /* received, not acknowledged yet      */
+
+    /* priority */
+    uint8_t urgency;
+    uint8_t incremental;
+
+    /* frames of this stream on the connection channel */
+    int out_pending;
+
+    /* request, pseudo-headers are kept apart until the request is built */
+    unsigned int headers_length;  /* header lines in the session buffer  */
+    int64_t content_length;       /* content-length header, -1 if unset  */
+    int has_host;
+    struct mk_http2_field method;
+    struct mk_http2_field scheme;
+    struct mk_http2_field path;
+    struct mk_http2_field authority;
+    struct mk_http2_field cookie; /* crumbs joined with '; '             */
+    char *pseudo;
+    size_t pseudo_length;
+    size_t pseudo_size;
+
+    struct mk_http2_session *h2s;
+    struct mk_http_session session;
+    struct mk_channel channel;
+    struct mk_list _head;
+};
 
 struct mk_http2_session {
     int status;
@@ -171,12 +255,45 @@ struct mk_http2_session {
     unsigned int buffer_size;
     unsigned int buffer_length;
     char *buffer;
-    char buffer_fixed[MK_HTTP2_CHUNK];
 
     /* Session Settings */
     struct mk_http2_settings settings;
+    int settings_received;
+
+    /* streams, by creation order (stream identifier) */
+    struct mk_list streams;
+    int streams_active;
+    uint32_t last_stream_id;
+    int goaway_received;
+
+    /* connection flow control */
+    int64_t window;
+    int32_t recv_window;
+    uint32_t recv_consumed;
+
+    /* header block split in HEADERS and CONTINUATION frames */
+    uint32_t continuation_id;
+    uint8_t continuation_flags;
+    char *block;
+    size_t block_length;
+    size_t block_size;
+
+    /* header compression contexts */
+    struct mk_http2_hpack decoder;
+    struct mk_http2_hpack encoder;
 
-    struct mk_stream stream_settings;
+    /* outgoing frames, linked to the connection channel */
+    struct mk_stream stream_out;
+
+    /* HTTP/1.1 session of an upgraded connection, released on next event */
+    struct mk_http_session *upgrade;
+    int allocated;
+
+    struct mk_sched_conn *conn;
+    struct mk_server *server;
+
+    /* The fields below are initialized when the session is created */
+    char buffer_fixed[MK_HTTP2_CHUNK];
 };
 
 #endif
@@ -0,0 +1,94 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_HTTP2_HPACK_H
+#define MK_HTTP2_HPACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * HPACK: Header Compression for HTTP/2 (RFC 7541)
+ * -----------------------------------------------
+ * Each HTTP/2 connection holds two contexts: the decoder for the header
+ * blocks sent by the client and the encoder for our responses. Both keep a
+ * dynamic table of recently used header fields that is referenced together
+ * with the static table by index.
+ */
+
+/* Default SETTINGS_HEADER_TABLE_SIZE */
+#define MK_HTTP2_HPACK_TABLE_SIZE      4096
+
+/* Entries of the static table (Appendix A) */
+#define MK_HTTP2_HPACK_STATIC_SIZE       61
+
+/* Size accounted for every entry on top of the name and value (Section 4.1) */
+#define MK_HTTP2_HPACK_ENTRY_OVERHEAD    32
+
+/* How a literal header field is encoded (Section 6.2) */
+#define MK_HTTP2_HPACK_INDEX              0   /* add to the dynamic table   */
+#define MK_HTTP2_HPACK_NO_INDEX           1   /* do not add it              */
+#define MK_HTTP2_HPACK_NEVER_INDEX        2   /* intermediaries must not    */
+
+struct mk_http2_hpack_entry {
+    uint32_t name_len;
+    uint32_t value_len;
+    char *value;                  /* stored right after the name */
+    char name[];
+};
+
+struct mk_http2_hpack {
+    uint32_t size;                /* current size of the dynamic table  */
+    uint32_t max_size;            /* maximum size currently in use      */
+    uint32_t limit;               /* maximum allowed by the settings    */
+    int size_update;              /* encoder: signal max_size change    */
+
+    /* ring of entries, the newest one has the lowest index */
+    unsigned int first;
+    unsigned int count;
+    unsigned int mask;
+    struct mk_http2_hpack_entry **entries;
+
+    /* decoder: room for Huffman decoded strings */
+    char *buf;
+    size_t buf_size;
+};
+
+/* Invoked for every header field of a decoded block */
+typedef void (*mk_http2_hpack_cb)(void *data,
+                                  char *name, size_t name_len,
+                                  char *value, size_t value_len);
+
+int mk_http2_hpack_init(struct mk_http2_hpack *ctx, uint32_t limit);
+void mk_http2_hpack_exit(struct mk_http2_hpack *ctx);
+
+int mk_http2_hpack_decode(struct mk_http2_hpack *ctx,
+                          uint8_t *buf, size_t len,
+                          mk_http2_hpack_cb cb, void *data);
+
+void mk_http2_hpack_set_limit(struct mk_http2_hpack *ctx, uint32_t limit);
+int mk_http2_hpack_encode_begin(struct mk_http2_hpack *ctx,
+                                uint8_t *out, size_t size);
+int mk_http2_hpack_encode(struct mk_http2_hpack *ctx,
+                          uint8_t *out, size_t size,
+                          const char *name, size_t name_len,
+                          const char *value, size_t value_len,
+                          int mode);
+
+#endif
@@ -20,6 +20,8 @@
 #ifndef MK_HTTP2_SETTINGS_H
 #define MK_HTTP2_SETTINGS_H
 
+#include <stdint.h>
+
 struct mk_http2_settings {
     uint32_t header_table_size;
     uint32_t enable_push;
@@ -29,12 +31,12 @@ struct mk_http2_settings {
     uint32_t max_header_list_size;
 };
 
-
-const struct mk_http2_settings MK_HTTP2_SETTINGS_DEFAULT =
+/* Initial values of the peer settings (Section 6.5.2) */
+static const struct mk_http2_settings MK_HTTP2_SETTINGS_DEFAULT =
     {
         .header_table_size      = 4096,
         .enable_push            = 1,
-        .max_concurrent_streams = 64,
+        .max_concurrent_streams = UINT32_MAX,
         .initial_window_size    = 65535,
         .max_frame_size         = 16384, /* 6.5.2 -> 2^14 */
         .max_header_list_size   = UINT32_MAX
@@ -42,21 +44,26 @@ const struct mk_http2_settings MK_HTTP2_SETTINGS_DEFAULT =
 
 /*
  * Default settings of Monkey, we send this upon a new connection arrives
- * to the HTTP/2 handler.
+ * to the HTTP/2 handler. The values must match MK_HTTP2_MAX_STREAMS and
+ * MK_HTTP2_WINDOW_SIZE.
  */
 #define MK_HTTP2_SETTINGS_DEFAULT_FRAME                 \
-    "\x00\x00\x0c"       /* frame length     */         \
+    "\x00\x00\x12"       /* frame length     */         \
     "\x04"               /* type=SETTINGS    */         \
     "\x00"               /* flags            */         \
     "\x00\x00\x00\x00"   /* stream ID        */         \
                                                         \
     /* SETTINGS_MAX_CONCURRENT_STREAMS  */              \
     "\x00\x03"                                          \
-    "\x00\x00\x00\x40"   /* value=64    */              \
+    "\x00\x00\x00\x64"   /* value=100   */              \
                                                         \
     /* SETTINGS_INITIAL_WINDOW_SIZE     */              \
     "\x00\x04"                                          \
-    "\x00\x00\xff\xff"   /* value=65535 */
+    "\x00\x00\xff\xff"   /* value=65535 */              \
+                                                        \
+    /* SETTINGS_NO_RFC7540_PRIORITIES   */              \
+    "\x00\x09"                                          \
+    "\x00\x00\x00\x01"   /* value=1     */
 
 #define MK_HTTP2_SETTINGS_ACK_FRAME             \
     "\x00\x00\x00\x04\x01\x00\x00\x00\x00"
@@ -67,5 +74,6 @@ const struct mk_http2_settings MK_HTTP2_SETTINGS_DEFAULT =
 #define MK_HTTP2_SETTINGS_INITIAL_WINDOW_SIZE     0x4
 #define MK_HTTP2_SETTINGS_MAX_FRAME_SIZE          0x5
 #define MK_HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE    0x6
+#define MK_HTTP2_SETTINGS_NO_RFC7540_PRIORITIES   0x9  /* RFC 9218 */
 
 #endif
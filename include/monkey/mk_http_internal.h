@@ -24,6 +24,8 @@
 
 #define MK_HEADER_IOV         32
 #define MK_HEADER_ETAG_SIZE   32
+#define MK_HEADER_LM_SIZE     32
+#define MK_HEADER_CL_SIZE     32
 
 struct response_headers
 {
@@ -52,17 +54,29 @@ struct response_headers
 
     int upgrade;
 
-    int ranges[2];
+    long ranges[2];
 
     time_t last_modified;
+    mk_ptr_t last_modified_str;   /* preformatted Last-Modified value */
     mk_ptr_t allow_methods;
     mk_ptr_t content_type;
     mk_ptr_t content_encoding;
+    int vary_encoding;            /* send Vary: Accept-Encoding */
     char *location;
 
     int  etag_len;
     char etag_buf[MK_HEADER_ETAG_SIZE];
 
+    /*
+     * Content-Length and Last-Modified values, a batch of pipelined
+     * responses is written at once so each request keeps its own.
+     */
+    char cl_buf[MK_HEADER_CL_SIZE];
+    char lm_buf[MK_HEADER_LM_SIZE];
+
+    /* Last-Modified, Content-Type and ETag prebuilt by the file cache */
+    mk_ptr_t file_headers;
+
     /*
      * This field allow plugins to add their own response
      * headers
@@ -93,6 +107,9 @@ struct mk_http_request
     /* Body Stream size */
     uint64_t stream_size;
 
+    /* Metrics: time the request was parsed (microseconds), zero if unset */
+    uint64_t metrics_start;
+
     /* Streams handling: headers and static file */
     struct mk_stream stream;
     struct mk_stream_input in_headers;
@@ -163,15 +180,25 @@ struct mk_http_request
      */
     void *stage30_handler;
 
+    /*
+     * Set while the stage30 handler keeps working on the response from its
+     * own events (MK_PLUGIN_RET_CONTINUE), the request is ended by the
+     * plugin through http_request_end().
+     */
+    int stage30_active;
+
     /* Static file information */
     int file_fd;
     struct file_info file_info;
 
-    /* Vhost */
-    int vhost_fdt_id;
-    unsigned int vhost_fdt_hash;
-    int vhost_fdt_enabled;
+    /* Open file cache entry (if any) */
+    struct mk_file_cache_entry *file_cache;
+    int file_cache_gzip;          /* serve the gzip copy of the entry */
 
+    /* multipart/byteranges response for multiple ranges */
+    struct mk_http_multirange *multirange;
+
+    /* Vhost */
     struct mk_vhost   *host_conf;      /* root vhost config */
     struct mk_vhost_alias *host_alias; /* specific vhost matched */
 
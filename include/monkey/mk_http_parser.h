@@ -197,8 +197,6 @@ struct mk_http_parser {
     int                        header_key;
     int                        header_sep;
     int                        header_val;
-    int                        header_min;
-    int                        header_max;
     int                        headers_extra_count;
 
     /* Known headers */
@@ -324,8 +322,6 @@ static inline void mk_http_parser_init(struct mk_http_parser *p)
     p->header_key = -1;
     p->header_sep = -1;
     p->header_val = -1;
-    p->header_min = -1;
-    p->header_max = -1;
     p->header_content_length = -1;
 
     /* init list header */
@@ -344,5 +340,6 @@ static inline int mk_http_parser_more(struct mk_http_parser *p, int len)
 
 int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                    char *buffer, int buf_len, struct mk_server *server);
+void mk_http_parser_setup(void);
 
 #endif /* MK_HTTP_H */
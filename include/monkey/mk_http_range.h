@@ -0,0 +1,88 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_HTTP_RANGE_H
+#define MK_HTTP_RANGE_H
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_stream.h>
+#include <monkey/mk_http_internal.h>
+
+/* Maximum number of ranges served in a multipart/byteranges response */
+#define MK_HTTP_RANGES_MAX          16
+
+/* "\r\n--" + 16 hex digits + "--\r\n" plus the NULL byte */
+#define MK_HTTP_RANGE_BOUNDARY_SIZE 32
+
+/* "Content-Range: bytes %ld-%ld/%ld\r\n\r\n" */
+#define MK_HTTP_RANGE_ROW_SIZE      96
+
+/* mk_http_range_set() return values */
+#define MK_HTTP_RANGE_OK             0   /* partial content configured  */
+#define MK_HTTP_RANGE_FULL           1   /* ignore Range, send it all   */
+#define MK_HTTP_RANGE_ERROR         -1   /* malformed header            */
+#define MK_HTTP_RANGE_UNSATISFIABLE -2   /* no range overlaps the file  */
+
+/*
+ * A byte range as found in the request: 'start' and 'end' are inclusive
+ * offsets, -1 marks an omitted value. For suffix ranges (-N) start is -1
+ * and 'end' holds the number of trailing bytes requested.
+ */
+struct mk_http_range {
+    long start;
+    long end;
+};
+
+/* One body part: boundary and part headers followed by the file segment */
+struct mk_http_range_part {
+    struct mk_stream_input in_head;  /* MK_STREAM_IOV  */
+    struct mk_stream_input in_body;  /* MK_STREAM_FILE */
+    struct mk_iov iov;
+    struct mk_iovec io[3];
+    long offset;
+    long length;
+    int  range_len;
+    char range[MK_HTTP_RANGE_ROW_SIZE];
+};
+
+/* multipart/byteranges response, one allocation per request */
+struct mk_http_multirange {
+    int count;
+
+    int  delim_len;                  /* "\r\n--boundary\r\n"           */
+    char delim[MK_HTTP_RANGE_BOUNDARY_SIZE];
+    int  close_len;                  /* "\r\n--boundary--\r\n"         */
+    char close[MK_HTTP_RANGE_BOUNDARY_SIZE];
+    int  content_type_len;
+    char content_type[64 + MK_HTTP_RANGE_BOUNDARY_SIZE];
+
+    struct mk_stream_input in_close;
+    struct mk_iov close_iov;
+    struct mk_iovec close_io[1];
+
+    struct mk_http_range_part parts[];
+};
+
+int mk_http_range_parse(mk_ptr_t *value, struct mk_http_range *ranges,
+                        int size);
+int mk_http_range_set(struct mk_http_request *sr, long file_size);
+int mk_http_range_stream(struct mk_http_request *sr);
+void mk_http_range_free(struct mk_http_request *sr);
+
+#endif
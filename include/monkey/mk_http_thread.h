@@ -32,9 +32,24 @@ struct mk_http_thread {
     struct mk_http_session *session;  /* HTTP session            */
     struct mk_http_request *request;  /* HTTP request            */
     struct mk_thread       *parent;   /* Parent thread           */
+    void                   *stack;    /* Pooled stack mapping    */
+    size_t                  stack_len;/* Mapping length          */
     struct mk_list _head;             /* Link to worker->threads */
 };
 
+/*
+ * Per worker pool of coroutine contexts: every entry keeps the thread
+ * header and a stack mapping with a guard page at its bottom, so creating
+ * a coroutine for a request does not need to allocate or map memory.
+ */
+struct mk_http_thread_pool {
+    int size;                         /* Contexts available      */
+    int capacity;                     /* Maximum contexts kept   */
+    size_t stack_size;                /* Usable stack size       */
+    size_t guard_size;                /* PROT_NONE bottom page   */
+    struct mk_list available;         /* Free contexts           */
+};
+
 extern MK_TLS_DEFINE(struct mk_http_libco_params, mk_http_thread_libco_params);
 extern MK_TLS_DEFINE(struct mk_thread,            mk_thread);
 
@@ -45,6 +60,9 @@ static MK_INLINE void mk_http_thread_resume(struct mk_http_thread *mth)
 
 void mk_http_thread_initialize_tls();
 
+int mk_http_thread_pool_init(struct mk_server *server);
+int mk_http_thread_pool_exit(struct mk_server *server);
+
 struct mk_http_thread *mk_http_thread_create(int type,
                                              struct mk_vhost_handler *handler,
                                              struct mk_http_session *session,
@@ -0,0 +1,148 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#ifndef MK_METRICS_H
+#define MK_METRICS_H
+
+#include <time.h>
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_http_internal.h>
+
+/*
+ * Latency histograms keep values in microseconds using log-linear buckets
+ * (HDR style): values below MK_METRICS_SUB are counted exactly and every
+ * power of two above is split in MK_METRICS_SUB buckets, so the relative
+ * error is bounded by 1 / MK_METRICS_SUB whatever the magnitude.
+ */
+#define MK_METRICS_SUB_BITS        3
+#define MK_METRICS_SUB             (1 << MK_METRICS_SUB_BITS)
+#define MK_METRICS_MAX_EXP         35          /* 2^36 us, ~19 hours */
+#define MK_METRICS_BUCKETS         (MK_METRICS_SUB *                        \
+                                    (MK_METRICS_MAX_EXP -                   \
+                                     MK_METRICS_SUB_BITS + 2))
+
+/* Response status codes counted per virtual host: 100 - 599 */
+#define MK_METRICS_STATUS_MIN      100
+#define MK_METRICS_STATUS_SLOTS    500
+
+/* Histograms recorded by every worker */
+#define MK_METRICS_PARSE           0   /* request parsing                  */
+#define MK_METRICS_TTFB            1   /* request start to response headers */
+#define MK_METRICS_RESPONSE        2   /* request start to response sent   */
+#define MK_METRICS_LOOP            3   /* event loop iteration             */
+#define MK_METRICS_HISTOGRAMS      4
+
+struct mk_metrics_histogram {
+    uint64_t count;
+    uint64_t sum;                 /* microseconds                        */
+    uint64_t buckets[MK_METRICS_BUCKETS];
+};
+
+/*
+ * Per worker metrics: only the owner thread writes them, the endpoint reads
+ * every worker without locking, values are stored and loaded atomically so
+ * readers never see a torn counter.
+ */
+struct mk_metrics {
+    uint64_t requests;
+    uint64_t bytes_sent;
+
+    int n_vhosts;
+    uint64_t *status;             /* n_vhosts * MK_METRICS_STATUS_SLOTS  */
+
+    struct mk_metrics_histogram hist[MK_METRICS_HISTOGRAMS];
+};
+
+#ifdef _MSC_VER
+#define mk_metrics_add(p, v)   (*(p) += (v))
+#define mk_metrics_read(p)     (*(volatile uint64_t *) (p))
+#else
+#define mk_metrics_add(p, v)   __atomic_store_n(p, *(p) + (v), __ATOMIC_RELAXED)
+#define mk_metrics_read(p)     __atomic_load_n(p, __ATOMIC_RELAXED)
+#endif
+
+/* Monotonic clock in microseconds */
+static inline uint64_t mk_metrics_now()
+{
+#ifdef _WIN32
+    return (uint64_t) GetTickCount64() * 1000;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+#endif
+}
+
+static inline int mk_metrics_bucket(uint64_t us)
+{
+    int exp;
+
+    if (us < MK_METRICS_SUB) {
+        return (int) us;
+    }
+
+#ifdef _MSC_VER
+    unsigned long msb;
+
+    _BitScanReverse64(&msb, us);
+    exp = (int) msb;
+#else
+    exp = 63 - __builtin_clzll(us);
+#endif
+    if (exp > MK_METRICS_MAX_EXP) {
+        return MK_METRICS_BUCKETS - 1;
+    }
+
+    return MK_METRICS_SUB + ((exp - MK_METRICS_SUB_BITS) * MK_METRICS_SUB) +
+        (int) ((us >> (exp - MK_METRICS_SUB_BITS)) & (MK_METRICS_SUB - 1));
+}
+
+static inline void mk_metrics_observe(struct mk_metrics_histogram *h,
+                                      uint64_t us)
+{
+    mk_metrics_add(&h->buckets[mk_metrics_bucket(us)], 1);
+    mk_metrics_add(&h->sum, us);
+    mk_metrics_add(&h->count, 1);
+}
+
+struct mk_sched_worker;
+struct mk_http_session;
+
+int mk_metrics_worker_init(struct mk_sched_worker *sched,
+                           struct mk_server *server);
+void mk_metrics_worker_exit(struct mk_sched_worker *sched);
+
+void mk_metrics_request_parsed(struct mk_http_request *sr, uint64_t start);
+void mk_metrics_response_headers(struct mk_http_request *sr);
+void mk_metrics_request_end(struct mk_http_request *sr);
+void mk_metrics_bytes_sent(struct mk_sched_worker *sched, size_t bytes);
+
+int mk_metrics_match(struct mk_http_request *sr, struct mk_server *server);
+int mk_metrics_http(struct mk_http_session *cs, struct mk_http_request *sr,
+                    struct mk_server *server);
+
+#endif
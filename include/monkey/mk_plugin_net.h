@@ -25,14 +25,23 @@
 /*
  * Network plugin: a plugin that provides a network layer, eg: plain
  * sockets or SSL.
+ *
+ * The optional conn_open callback is invoked with the channel of every
+ * accepted connection, the context it sets in channel->net_data is given
+ * back as the last argument of the I/O callbacks. The channel also refers
+ * to the connection event, so a layer can suspend and resume the event
+ * notifications of the connection. Sockets closed before they become a
+ * connection are given a NULL context.
  */
 struct mk_plugin;
+struct mk_channel;
 struct mk_plugin_network {
-    int (*read) (struct mk_plugin *, int, void *, int);
-    int (*write) (struct mk_plugin *, int, const void *, size_t);
-    int (*writev) (struct mk_plugin *, int, struct mk_iov *);
-    int (*close) (struct mk_plugin *, int);
-    int (*send_file) (struct mk_plugin *, int, int, off_t *, size_t);
+    int (*conn_open) (struct mk_plugin *, struct mk_channel *);
+    int (*read) (struct mk_plugin *, int, void *, int, void *);
+    int (*write) (struct mk_plugin *, int, const void *, size_t, void *);
+    int (*writev) (struct mk_plugin *, int, struct mk_iov *, void *);
+    int (*close) (struct mk_plugin *, int, void *);
+    int (*send_file) (struct mk_plugin *, int, int, off_t *, size_t, void *);
     int buffer_size;
     struct mk_plugin *plugin;
 };
@@ -26,6 +26,7 @@
 #include <monkey/mk_server.h>
 #include <monkey/mk_stream.h>
 #include <monkey/mk_net.h>
+#include <monkey/mk_slab.h>
 
 #ifndef MK_SCHEDULER_H
 #define MK_SCHEDULER_H
@@ -33,6 +34,12 @@
 #define MK_SCHED_CONN_TIMEOUT    -1
 #define MK_SCHED_CONN_CLOSED     -2
 
+/* Connection timeout kinds */
+#define MK_SCHED_TIMEOUT_READ       0   /* waiting for a complete request */
+#define MK_SCHED_TIMEOUT_KEEPALIVE  1   /* idle between requests          */
+#define MK_SCHED_TIMEOUT_WRITE      2   /* response stalled on the socket */
+#define MK_SCHED_TIMEOUT_TYPES      3
+
 #define MK_SCHED_SIGNAL_DEADBEEF         0xDEADBEEF
 #define MK_SCHED_SIGNAL_FREE_ALL         0xFFEE0000
 #define MK_SCHED_SIGNAL_EVENT_LOOP_BREAK 0xEEFFAACC
@@ -58,6 +65,41 @@
 #define MK_SCHEDULER_FAIR_BALANCING   0
 #define MK_SCHEDULER_REUSEPORT        1
 
+/*
+ * Accepted connections ring: when running in Fair Balancing mode, the
+ * balancer thread accept(2)s new connections and push the file descriptors
+ * into the target worker ring (single producer). The worker drains the ring
+ * from it own event loop (single consumer), so the connection context is
+ * only touched by its owner thread.
+ *
+ * The ring size must be a power of two.
+ */
+#define MK_SCHED_ACCEPT_RING_SIZE     1024
+
+struct mk_sched_accept_entry {
+    int fd;
+    struct mk_server_listen *listener;
+};
+
+struct mk_sched_accept_ring {
+    /* notification channel, it must be the first field */
+    struct mk_event event;
+    int channel_r;
+    int channel_w;
+
+    /* producer: balancer thread */
+    char _pad0[MK_CACHE_LINE_SIZE];
+    unsigned int tail;
+    unsigned int signaled;
+
+    /* consumer: worker thread */
+    char _pad1[MK_CACHE_LINE_SIZE];
+    unsigned int head;
+    char _pad2[MK_CACHE_LINE_SIZE];
+
+    struct mk_sched_accept_entry entries[MK_SCHED_ACCEPT_RING_SIZE];
+};
+
 /*
  * Thread-scope structure/variable that holds the Scheduler context for the
  * worker (or thread) in question.
@@ -72,12 +114,23 @@ struct mk_sched_worker
     unsigned long long over_capacity;
 
     /*
-     * The timeout queue represents client connections that
-     * have not initiated it requests or the request status
-     * is incomplete. This linear lists allows the scheduler
-     * to perform a fast check upon every timeout.
+     * Accept batching stats: number of wakeups that delivered new
+     * connections, connections taken on those wakeups and the largest
+     * batch seen. The average batch is accept_batch_total / accept_wakeups.
      */
-    struct mk_list timeout_queue;
+    unsigned long long accept_wakeups;
+    unsigned long long accept_batch_total;
+    unsigned int accept_batch_max;
+
+    /*
+     * Connection timeouts: client connections that have not completed
+     * their request, idle keep-alive connections and responses waiting
+     * for the socket to become writable. The wheel makes arming and
+     * expiring a timeout independent of the number of connections, the
+     * duration of each kind in milliseconds is indexed by its type.
+     */
+    struct mk_timer_wheel timeouts;
+    int timeout_ms[MK_SCHED_TIMEOUT_TYPES];
 
     short int idx;
     unsigned char initialized;
@@ -94,6 +147,13 @@ struct mk_sched_worker
 
     struct mk_list event_free_queue;
 
+    /*
+     * Edge-triggered connections that must be processed without waiting
+     * for a new notification: output ready to be written or input that
+     * was left in the socket while a response was in progress.
+     */
+    struct mk_list pending_queue;
+
     /*
      * This variable is used to signal the active workers,
      * just available because of ULONG_MAX bug described
@@ -105,6 +165,9 @@ struct mk_sched_worker
     /* If using REUSEPORT, this points to the list of listeners */
     struct mk_list *listeners;
 
+    /* If using FAIR_BALANCING, accepted connections pending to register */
+    struct mk_sched_accept_ring *accept_ring;
+
     /*
      * List head for finished requests that need to be cleared after each
      * event loop round.
@@ -115,6 +178,16 @@ struct mk_sched_worker
     struct mk_list threads;
     struct mk_list threads_purge;
 
+    /*
+     * Connection contexts allocator: closed connections are queued and
+     * returned to the slab after the event loop round.
+     */
+    struct mk_slab *conn_slab;
+    struct mk_slab *extra_slab;
+    struct mk_list conn_free_queue;
+
+    /* Instrumentation, NULL if metrics are disabled */
+    struct mk_metrics *metrics;
 };
 
 
@@ -124,14 +197,26 @@ struct mk_sched_conn
     struct mk_event event;             /* event loop context           */
     int status;                        /* connection status            */
     uint32_t properties;
-    char is_timeout_on;                /* registered to timeout queue? */
+    char timeout_type;                 /* MK_SCHED_TIMEOUT_ kind armed */
+    char wants_write;                  /* edge mode: output in progress */
+    char is_pending;                   /* linked to the pending queue? */
     time_t arrive_time;                /* arrive time                  */
     struct mk_sched_handler *protocol; /* protocol handler             */
     struct mk_server_listen *server_listen;
     struct mk_plugin_network *net;     /* I/O network layer            */
     struct mk_channel channel;         /* stream channel               */
-    struct mk_list timeout_head;       /* link to the timeout queue    */
+    struct mk_timer_wheel_node timeout; /* link to the timeout wheel   */
+    struct mk_list pending_head;       /* link to the pending queue    */
     void *data;                        /* optional ref for protocols   */
+
+    /*
+     * Protocol handler memory (sched_extra_size bytes). It's placed right
+     * after this structure, unless idle connections are compacted: then
+     * it's attached when data arrives and released while the connection
+     * waits in keep-alive, only 'requests' is preserved for the protocol.
+     */
+    void *extra;
+    unsigned int requests;             /* requests served              */
 };
 
 /* Protocol capabilities */
@@ -193,6 +278,13 @@ struct mk_sched_handler
      *  conn = malloc(t_size);
      */
     int sched_extra_size;
+
+    /*
+     * Number of bytes of the extra memory that must be zeroed for a new
+     * connection, the rest is initialized by the protocol handler. A zero
+     * value clears the whole extra memory.
+     */
+    int sched_zero_size;
     char capabilities;
 };
 
@@ -258,6 +350,14 @@ int mk_sched_drop_connection(struct mk_sched_conn *conn,
 int mk_sched_check_timeouts(struct mk_sched_worker *sched,
                             struct mk_server *server);
 
+int mk_sched_accept_ring_create(struct mk_sched_worker *sched);
+void mk_sched_accept_ring_destroy(struct mk_sched_worker *sched);
+int mk_sched_accept_push(struct mk_sched_worker *sched, int fd,
+                         struct mk_server_listen *listener);
+int mk_sched_accept_pop(struct mk_sched_worker *sched, int *fd,
+                        struct mk_server_listen **listener);
+void mk_sched_accept_rearm(struct mk_sched_worker *sched);
+
 
 struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
                                               struct mk_server_listen *listener,
@@ -286,6 +386,11 @@ int mk_sched_event_write(struct mk_sched_conn *conn,
                          struct mk_sched_worker *sched,
                          struct mk_server *server);
 
+int mk_sched_conn_write_interest(struct mk_sched_conn *conn,
+                                 struct mk_sched_worker *sched,
+                                 int enable);
+int mk_sched_pending_run(struct mk_sched_worker *sched,
+                         struct mk_server *server);
 
 int mk_sched_event_close(struct mk_sched_conn *conn,
                          struct mk_sched_worker *sched,
@@ -293,6 +398,13 @@ int mk_sched_event_close(struct mk_sched_conn *conn,
 
 void mk_sched_event_free(struct mk_event *event);
 
+void *mk_sched_conn_extra_attach(struct mk_sched_conn *conn,
+                                 struct mk_sched_worker *sched);
+void mk_sched_conn_extra_detach(struct mk_sched_conn *conn,
+                                struct mk_sched_worker *sched);
+void mk_sched_conn_free(struct mk_sched_worker *sched,
+                        struct mk_sched_conn *conn);
+
 
 static inline void mk_sched_event_free_all(struct mk_sched_worker *sched)
 {
@@ -305,34 +417,82 @@ static inline void mk_sched_event_free_all(struct mk_sched_worker *sched)
         mk_list_del(&event->_head);
         mk_mem_free(event);
     }
+
+    /* The event is the first member of the connection context */
+    mk_list_foreach_safe(head, tmp, &sched->conn_free_queue) {
+        event = mk_list_entry(head, struct mk_event, _head);
+        mk_list_del(&event->_head);
+        mk_sched_conn_free(sched, (struct mk_sched_conn *) event);
+    }
 }
 
+/*
+ * Arm a timeout of the given type. If the same kind is already armed the
+ * original deadline is kept, so a client cannot extend it by trickling
+ * bytes; a different kind replaces it.
+ */
 static inline void mk_sched_conn_timeout_add(struct mk_sched_conn *conn,
+                                             struct mk_sched_worker *sched,
+                                             int type)
+{
+    if (mk_timer_wheel_node_active(&conn->timeout) &&
+        conn->timeout_type == type) {
+        return;
+    }
+
+    conn->timeout_type = type;
+    mk_timer_wheel_add(&sched->timeouts, &conn->timeout,
+                       mk_timer_wheel_clock(), sched->timeout_ms[type]);
+}
+
+/* Arm a timeout of the given type starting from now */
+static inline void mk_sched_conn_timeout_reset(struct mk_sched_conn *conn,
+                                               struct mk_sched_worker *sched,
+                                               int type)
+{
+    conn->timeout_type = type;
+    mk_timer_wheel_add(&sched->timeouts, &conn->timeout,
+                       mk_timer_wheel_clock(), sched->timeout_ms[type]);
+}
+
+static inline void mk_sched_conn_timeout_del(struct mk_sched_conn *conn,
+                                             struct mk_sched_worker *sched)
+{
+    mk_timer_wheel_del(&sched->timeouts, &conn->timeout);
+}
+
+static inline void mk_sched_conn_pending_add(struct mk_sched_conn *conn,
                                              struct mk_sched_worker *sched)
 {
-    if (conn->is_timeout_on == MK_FALSE) {
-        mk_list_add(&conn->timeout_head, &sched->timeout_queue);
-        conn->is_timeout_on = MK_TRUE;
+    if (conn->is_pending == MK_FALSE) {
+        mk_list_add(&conn->pending_head, &sched->pending_queue);
+        conn->is_pending = MK_TRUE;
     }
 }
 
-static inline void mk_sched_conn_timeout_del(struct mk_sched_conn *conn)
+static inline void mk_sched_conn_pending_del(struct mk_sched_conn *conn)
 {
-    if (conn->is_timeout_on == MK_TRUE) {
-        mk_list_del(&conn->timeout_head);
-        conn->is_timeout_on = MK_FALSE;
+    if (conn->is_pending == MK_TRUE) {
+        mk_list_del(&conn->pending_head);
+        conn->is_pending = MK_FALSE;
     }
 }
 
+/* Check if the connection is registered in edge-triggered mode */
+#define mk_sched_conn_is_edge(conn)                     \
+    ((conn->event.mask & MK_EVENT_EDGE) != 0)
+
 
 #define mk_sched_conn_read(conn, buf, s)                \
-    conn->net->read(conn->net->plugin, conn->event.fd, buf, s)
+    conn->net->read(conn->net->plugin, conn->event.fd, buf, s,  \
+                    conn->channel.net_data)
 #define mk_sched_conn_write(ch, buf, s)         \
     mk_net_conn_write(ch, buf, s)
 #define mk_sched_conn_writev(ch, iov)           \
-    ch->io->writev(ch->io->plugin, ch->fd, iov)
+    ch->io->writev(ch->io->plugin, ch->fd, iov, ch->net_data)
 #define mk_sched_conn_sendfile(ch, f_fd, f_offs, f_count)   \
-    ch->io->send_file(ch->io->plugin, ch->fd, f_fd, f_offs, f_count)
+    ch->io->send_file(ch->io->plugin, ch->fd, f_fd, f_offs, f_count, \
+                      ch->net_data)
 
 #define mk_sched_switch_protocol(conn, cap)     \
     conn->protocol = mk_sched_handler_cap(cap)
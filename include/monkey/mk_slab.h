@@ -0,0 +1,62 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_SLAB_H
+#define MK_SLAB_H
+
+#include <monkey/mk_core.h>
+
+/* Size of the chunks when they are backed by huge pages */
+#define MK_SLAB_HUGE_CHUNK    (2 * 1024 * 1024)
+
+/* Minimum number of objects per chunk on regular pages */
+#define MK_SLAB_CHUNK_OBJECTS 32
+
+/*
+ * Fixed size object allocator used from a single thread: objects are carved
+ * from mmap(2) chunks and released objects are kept in a free list, so
+ * allocating one is just a pointer swap. Objects are not cleared, the caller
+ * initializes what it needs. Chunks are only returned to the system when the
+ * slab is destroyed.
+ */
+struct mk_slab_chunk {
+    size_t size;                  /* mapping length                  */
+    struct mk_list _head;         /* link to mk_slab->chunks         */
+};
+
+struct mk_slab {
+    size_t obj_size;              /* object size, cache line aligned */
+    int huge_pages;               /* try MAP_HUGETLB chunks          */
+    void *free_list;              /* singly linked released objects  */
+    struct mk_list chunks;
+
+    /* occupancy stats */
+    unsigned long capacity;       /* objects carved from chunks      */
+    unsigned long in_use;         /* objects handed out              */
+    unsigned long peak;           /* highest in_use value            */
+    unsigned long n_chunks;
+    unsigned long n_huge_chunks;  /* chunks backed by huge pages     */
+};
+
+struct mk_slab *mk_slab_create(size_t obj_size, int huge_pages);
+void mk_slab_destroy(struct mk_slab *slab);
+void *mk_slab_alloc(struct mk_slab *slab);
+void mk_slab_free(struct mk_slab *slab, void *obj);
+
+#endif
@@ -42,6 +42,9 @@
 #define MK_CHANNEL_BUSY    16  /* cannot write, busy (EAGAIN)  */
 #define MK_CHANNEL_UNKNOWN 32  /* unhandled                    */
 
+/* Maximum number of buffers flushed by a single channel write */
+#define MK_CHANNEL_IOV_MAX  64
+
 /* Channel status */
 #define MK_CHANNEL_DISABLED 0 /* channel is sleeping */
 #define MK_CHANNEL_ENABLED  1 /* channel enabled, have some data */
@@ -65,6 +68,7 @@ struct mk_channel {
 
     struct mk_event *event;
     struct mk_plugin_network *io;
+    void *net_data;             /* network layer connection context */
     struct mk_list streams;
     void *thread;
 };
@@ -395,4 +399,7 @@ int mk_channel_release(struct mk_channel *channel);
 int mk_channel_flush(struct mk_channel *channel);
 int mk_channel_write(struct mk_channel *channel, size_t *count);
 int mk_channel_clean(struct mk_channel *channel);
+size_t mk_channel_copy(struct mk_channel *channel, char *buf, size_t size);
+void mk_channel_consume(struct mk_channel *channel, size_t bytes);
+int mk_channel_pending(struct mk_channel *channel);
 #endif
@@ -32,13 +32,11 @@
 
 /* mk_cache.c */
 extern __thread struct mk_iov *mk_tls_cache_iov_header;
-extern __thread mk_ptr_t *mk_tls_cache_header_cl;
-extern __thread mk_ptr_t *mk_tls_cache_header_lm;
 extern __thread struct tm *mk_tls_cache_gmtime;
 extern __thread struct mk_gmt_cache *mk_tls_cache_gmtext;
 
-/* mk_vhost.c */
-extern __thread struct mk_list *mk_tls_vhost_fdt;
+/* mk_file_cache.c */
+extern __thread struct mk_file_cache *mk_tls_file_cache;
 
 /* mk_scheduler.c */
 extern __thread struct rb_root *mk_tls_sched_cs;
@@ -62,13 +60,11 @@ extern __thread struct mk_server_timeout *mk_tls_server_timeout;
 
 /* mk_cache.c */
 extern pthread_key_t mk_tls_cache_iov_header;
-extern pthread_key_t mk_tls_cache_header_cl;
-extern pthread_key_t mk_tls_cache_header_lm;
 extern pthread_key_t mk_tls_cache_gmtime;
 extern pthread_key_t mk_tls_cache_gmtext;
 
-/* mk_vhost.c */
-extern pthread_key_t mk_tls_vhost_fdt;
+/* mk_file_cache.c */
+extern pthread_key_t mk_tls_file_cache;
 
 /* mk_scheduler.c */
 extern pthread_key_t mk_tls_sched_cs;
@@ -88,13 +84,11 @@ extern pthread_key_t mk_tls_server_timeout;
 #define MK_INIT_INITIALIZE_TLS()                                \
     /* mk_cache.c */                                            \
     pthread_key_create(&mk_tls_cache_iov_header, NULL);         \
-    pthread_key_create(&mk_tls_cache_header_cl, NULL);          \
-    pthread_key_create(&mk_tls_cache_header_lm, NULL);          \
     pthread_key_create(&mk_tls_cache_gmtime, NULL);             \
     pthread_key_create(&mk_tls_cache_gmtext, NULL);             \
                                                                 \
-    /* mk_vhost.c */                                            \
-    pthread_key_create(&mk_tls_vhost_fdt, NULL);                \
+    /* mk_file_cache.c */                                       \
+    pthread_key_create(&mk_tls_file_cache, NULL);               \
                                                                 \
     /* mk_scheduler.c */                                        \
     pthread_key_create(&mk_tls_sched_cs, NULL);                 \
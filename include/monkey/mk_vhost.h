@@ -82,26 +82,6 @@ struct mk_vhost_alias
 };
 
 
-#define VHOST_FDT_HASHTABLE_SIZE   64
-#define VHOST_FDT_HASHTABLE_CHAINS  8
-
-struct vhost_fdt_hash_chain {
-    int fd;
-    int readers;
-    unsigned int hash;
-};
-
-struct vhost_fdt_hash_table {
-    int av_slots;
-    struct vhost_fdt_hash_chain chain[VHOST_FDT_HASHTABLE_CHAINS];
-};
-
-struct vhost_fdt_host {
-    struct mk_vhost *host;
-    struct vhost_fdt_hash_table hash_table[VHOST_FDT_HASHTABLE_SIZE];
-    struct mk_list _head;
-};
-
 struct mk_vhost *mk_vhost_read(char *path);
 int mk_vhost_get(mk_ptr_t host, struct mk_vhost **vhost, struct
                  mk_vhost_alias **alias,
@@ -109,10 +89,6 @@ int mk_vhost_get(mk_ptr_t host, struct mk_vhost **vhost, struct
 void mk_vhost_set_single(char *path, struct mk_server *server);
 void mk_vhost_init(char *path, struct mk_server *server);
 
-int mk_vhost_fdt_worker_init(struct mk_server *server);
-int mk_vhost_fdt_worker_exit(struct mk_server *server);
-int mk_vhost_open(struct mk_http_request *sr, struct mk_server *server);
-int mk_vhost_close(struct mk_http_request *sr, struct mk_server *server);
 void mk_vhost_free_all(struct mk_server *server);
 int mk_vhost_map_handlers(struct mk_server *server);
 struct mk_vhost_handler *mk_vhost_handler_match(char *match,
@@ -319,10 +319,16 @@ int main(int argc, char **argv)
     /* Server loop, let's listen for incomming clients */
     mk_server_loop(server);
 
-    /* Hang here, basically do nothing as threads are doing the job. */
+    /*
+     * Hang here, basically do nothing as threads are doing the job. Exit
+     * signals terminate the process from their handler, other handled
+     * signals (e.g: plugins reopening their logs) must not end it.
+     */
     sigset_t mask;
     sigprocmask(0, NULL, &mask);
-    sigsuspend(&mask);
+    while (1) {
+        sigsuspend(&mask);
+    }
 
     return 0;
 }
@@ -32,6 +32,8 @@
     #include "mk_event_libevent.c"
 #elif defined(MK_HAVE_EVENT_SELECT)
     #include "mk_event_select.c"
+#elif defined(MK_HAVE_EVENT_URING)
+    #include "mk_event_uring.c"
 #elif defined(__linux__) && !defined(LINUX_KQUEUE)
     #include "mk_event_epoll.c"
 #else
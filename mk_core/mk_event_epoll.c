@@ -134,6 +134,9 @@ static inline int _mk_event_add(struct mk_event_ctx *ctx, int fd,
     if (events & MK_EVENT_WRITE) {
         ep_event.events |= EPOLLOUT;
     }
+    if (events & MK_EVENT_EDGE) {
+        ep_event.events |= EPOLLET;
+    }
 
     ret = epoll_ctl(ctx->efd, op, fd, &ep_event);
     if (ret < 0) {
@@ -437,8 +440,11 @@ static inline int _mk_event_inject(struct mk_event_loop *loop,
 
 static inline int _mk_event_wait_2(struct mk_event_loop *loop, int timeout)
 {
-    struct mk_event_ctx *ctx = loop->data;
+    int i;
     int ret = 0;
+    uint32_t fired;
+    struct mk_event *event;
+    struct mk_event_ctx *ctx = loop->data;
 
     while(1) {
         ret = epoll_wait(ctx->efd, ctx->events, ctx->queue_size, timeout);
@@ -452,6 +458,29 @@ static inline int _mk_event_wait_2(struct mk_event_loop *loop, int timeout)
         /* retry when errno is EINTR */
     }
     loop->n_events = ret;
+
+    /*
+     * Edge-triggered events are registered once for both directions, the
+     * caller needs to know which one was reported: for those events the mask
+     * holds MK_EVENT_EDGE plus the triggered directions. A hang up or error
+     * is reported on both directions so the handlers find out on I/O.
+     */
+    for (i = 0; i < ret; i++) {
+        event = ctx->events[i].data.ptr;
+        if ((event->mask & MK_EVENT_EDGE) == 0) {
+            continue;
+        }
+
+        fired = ctx->events[i].events;
+        event->mask = MK_EVENT_EDGE;
+        if (fired & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            event->mask |= MK_EVENT_READ;
+        }
+        if (fired & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+            event->mask |= MK_EVENT_WRITE;
+        }
+    }
+
     return ret;
 }
 
@@ -0,0 +1,729 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * io_uring event loop backend
+ * ---------------------------
+ * Readiness is obtained through one-shot IORING_OP_POLL_ADD requests which
+ * are armed again once the caller had the chance to process the event, this
+ * keeps the level-triggered semantics that the rest of the server expects
+ * from epoll(7). Every registration change and re-arm is queued into the
+ * submission ring and flushed together with the wait, so a full event loop
+ * round costs a single io_uring_enter(2) call.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <endian.h>
+
+#include <time.h>
+
+#include <mk_core/mk_event.h>
+#include <mk_core/mk_memory.h>
+#include <mk_core/mk_utils.h>
+#include <mk_core/mk_atomic.h>
+
+#ifndef POLLRDHUP
+#define POLLRDHUP  0x2000
+#endif
+
+/* user_data used by requests whose completion must be ignored */
+#define MK_EVENT_URING_UD_IGNORE   UINT64_MAX
+
+/* Attempts to flush a full submission queue before giving up */
+#define MK_EVENT_URING_SUBMIT_RETRIES  8
+
+#define uring_ud(fd, gen)   (((uint64_t) (gen) << 32) | (uint32_t) (fd))
+#define uring_ud_fd(ud)     ((int) ((ud) & 0xffffffff))
+#define uring_ud_gen(ud)    ((uint32_t) ((ud) >> 32))
+
+static inline int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags,
+                              void *arg, size_t size)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                   flags, arg, size);
+}
+
+/* Number of queued entries the kernel did not consume yet */
+static inline unsigned uring_sq_pending(struct mk_event_ctx *ctx)
+{
+    return ctx->sq_tail - mk_atomic_load(ctx->sq_khead);
+}
+
+/* Publish queued submissions and optionally wait for completions */
+static inline int uring_submit(struct mk_event_ctx *ctx,
+                               unsigned min_complete, int timeout)
+{
+    int ret;
+    unsigned flags = 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+
+    mk_atomic_store(ctx->sq_ktail, ctx->sq_tail);
+
+    if (min_complete == 0) {
+        if (uring_sq_pending(ctx) == 0) {
+            return 0;
+        }
+        ret = uring_enter(ctx->ring_fd, uring_sq_pending(ctx), 0, 0, NULL, 0);
+        return ret;
+    }
+
+    memset(&arg, '\0', sizeof(arg));
+    flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    if (timeout >= 0) {
+        ts.tv_sec  = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+    }
+    arg.sigmask_sz = _NSIG / 8;
+
+    return uring_enter(ctx->ring_fd, uring_sq_pending(ctx), min_complete,
+                       flags, &arg, sizeof(arg));
+}
+
+/*
+ * Get a free submission entry, flush the queue if it's full. EBUSY means
+ * the completion queue overflowed: it only drains when the event loop
+ * reaps it, so retrying here would never succeed.
+ */
+static inline struct io_uring_sqe *uring_get_sqe(struct mk_event_ctx *ctx)
+{
+    int ret;
+    int retries = 0;
+    unsigned idx;
+    struct io_uring_sqe *sqe;
+
+    while (uring_sq_pending(ctx) >= ctx->sq_entries) {
+        ret = uring_submit(ctx, 0, 0);
+        if (ret > 0 || (ret == -1 && errno == EINTR)) {
+            continue;
+        }
+
+        /* nothing consumed or no kernel resources: retry a few times */
+        if ((ret == 0 || errno == EAGAIN) &&
+            ++retries <= MK_EVENT_URING_SUBMIT_RETRIES) {
+            continue;
+        }
+
+        mk_err("io_uring: cannot flush the submission queue");
+        return NULL;
+    }
+
+    idx = ctx->sq_tail & *ctx->sq_kmask;
+    ctx->sq_array[idx] = idx;
+    ctx->sq_tail++;
+
+    sqe = &ctx->sqes[idx];
+    memset(sqe, '\0', sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+static inline int uring_poll_add(struct mk_event_ctx *ctx, int fd)
+{
+    uint32_t events;
+    struct io_uring_sqe *sqe;
+    struct mk_event_uring_slot *slot = &ctx->slots[fd];
+
+    sqe = uring_get_sqe(ctx);
+    if (!sqe) {
+        return -1;
+    }
+
+    events = POLLERR | POLLHUP | POLLRDHUP;
+    if (slot->mask & MK_EVENT_READ) {
+        events |= POLLIN;
+    }
+    if (slot->mask & MK_EVENT_WRITE) {
+        events |= POLLOUT;
+    }
+#if __BYTE_ORDER == __BIG_ENDIAN
+    events = (events << 16) | (events >> 16);
+#endif
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = uring_ud(fd, slot->gen);
+    slot->armed = MK_TRUE;
+
+    return 0;
+}
+
+/* Cancel the in-flight poll request of a slot, if any */
+static inline int uring_poll_remove(struct mk_event_ctx *ctx, int fd)
+{
+    struct io_uring_sqe *sqe;
+    struct mk_event_uring_slot *slot = &ctx->slots[fd];
+
+    if (slot->armed == MK_TRUE) {
+        sqe = uring_get_sqe(ctx);
+        if (!sqe) {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = uring_ud(fd, slot->gen);
+        sqe->user_data = MK_EVENT_URING_UD_IGNORE;
+        slot->armed = MK_FALSE;
+    }
+
+    /* any completion still queued for the old request becomes stale */
+    slot->gen++;
+    return 0;
+}
+
+/* Make sure the slots table can hold the given file descriptor */
+static inline int uring_slots_grow(struct mk_event_ctx *ctx, int fd)
+{
+    int size;
+    struct mk_event_uring_slot *tmp;
+
+    if (fd < ctx->slots_size) {
+        return 0;
+    }
+
+    size = ctx->slots_size;
+    while (size <= fd) {
+        size *= 2;
+    }
+
+    tmp = mk_mem_realloc(ctx->slots, sizeof(struct mk_event_uring_slot) * size);
+    if (!tmp) {
+        return -1;
+    }
+    memset(tmp + ctx->slots_size, '\0',
+           sizeof(struct mk_event_uring_slot) * (size - ctx->slots_size));
+
+    ctx->slots = tmp;
+    ctx->slots_size = size;
+    return 0;
+}
+
+static inline int _mk_event_init()
+{
+    return 0;
+}
+
+static inline void *_mk_event_loop_create(int size)
+{
+    int fd;
+    struct io_uring_params p;
+    struct mk_event_ctx *ctx;
+
+    /* Main event context */
+    ctx = mk_mem_alloc_z(sizeof(struct mk_event_ctx));
+    if (!ctx) {
+        return NULL;
+    }
+
+    memset(&p, '\0', sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    p.cq_entries = MK_EVENT_URING_CQ_ENTRIES;
+
+    fd = uring_setup(MK_EVENT_URING_SQ_ENTRIES, &p);
+    if (fd == -1) {
+        mk_libc_error("io_uring_setup");
+        mk_mem_free(ctx);
+        return NULL;
+    }
+    ctx->ring_fd = fd;
+
+    if (!(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        mk_err("io_uring: kernel lacks EXT_ARG or NODROP support");
+        goto error;
+    }
+
+    /* Map the rings */
+    ctx->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ctx->cq_ring_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ctx->cq_ring_size > ctx->sq_ring_size) {
+            ctx->sq_ring_size = ctx->cq_ring_size;
+        }
+        ctx->cq_ring_size = ctx->sq_ring_size;
+    }
+
+    ctx->sq_ring = mmap(NULL, ctx->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ctx->sq_ring == MAP_FAILED) {
+        mk_libc_error("mmap");
+        ctx->sq_ring = NULL;
+        goto error;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ctx->cq_ring = ctx->sq_ring;
+    }
+    else {
+        ctx->cq_ring = mmap(NULL, ctx->cq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ctx->cq_ring == MAP_FAILED) {
+            mk_libc_error("mmap");
+            ctx->cq_ring = NULL;
+            goto error;
+        }
+    }
+
+    ctx->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ctx->sqes = mmap(NULL, ctx->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ctx->sqes == MAP_FAILED) {
+        mk_libc_error("mmap");
+        ctx->sqes = NULL;
+        goto error;
+    }
+
+    ctx->sq_khead   = (unsigned *) ((char *) ctx->sq_ring + p.sq_off.head);
+    ctx->sq_ktail   = (unsigned *) ((char *) ctx->sq_ring + p.sq_off.tail);
+    ctx->sq_kmask   = (unsigned *) ((char *) ctx->sq_ring + p.sq_off.ring_mask);
+    ctx->sq_array   = (unsigned *) ((char *) ctx->sq_ring + p.sq_off.array);
+    ctx->sq_entries = p.sq_entries;
+    ctx->sq_tail    = *ctx->sq_ktail;
+
+    ctx->cq_khead = (unsigned *) ((char *) ctx->cq_ring + p.cq_off.head);
+    ctx->cq_ktail = (unsigned *) ((char *) ctx->cq_ring + p.cq_off.tail);
+    ctx->cq_kmask = (unsigned *) ((char *) ctx->cq_ring + p.cq_off.ring_mask);
+    ctx->cqes     = (struct io_uring_cqe *) ((char *) ctx->cq_ring +
+                                             p.cq_off.cqes);
+
+    /* Registered events table, it grows on demand */
+    ctx->slots_size = 64;
+    ctx->slots = mk_mem_alloc_z(sizeof(struct mk_event_uring_slot) *
+                                ctx->slots_size);
+    if (!ctx->slots) {
+        goto error;
+    }
+
+    /* Allocate space for events queue */
+    ctx->fired = mk_mem_alloc_z(sizeof(struct mk_event *) * size);
+    ctx->fired_fd = mk_mem_alloc_z(sizeof(int) * size);
+    if (!ctx->fired || !ctx->fired_fd) {
+        goto error;
+    }
+    ctx->queue_size = size;
+
+    return ctx;
+
+ error:
+    if (ctx->sqes) {
+        munmap(ctx->sqes, ctx->sqes_size);
+    }
+    if (ctx->cq_ring && ctx->cq_ring != ctx->sq_ring) {
+        munmap(ctx->cq_ring, ctx->cq_ring_size);
+    }
+    if (ctx->sq_ring) {
+        munmap(ctx->sq_ring, ctx->sq_ring_size);
+    }
+    close(ctx->ring_fd);
+    mk_mem_free(ctx->slots);
+    mk_mem_free(ctx->fired);
+    mk_mem_free(ctx->fired_fd);
+    mk_mem_free(ctx);
+    return NULL;
+}
+
+/* Close handlers and memory */
+static inline void _mk_event_loop_destroy(struct mk_event_ctx *ctx)
+{
+    munmap(ctx->sqes, ctx->sqes_size);
+    if (ctx->cq_ring != ctx->sq_ring) {
+        munmap(ctx->cq_ring, ctx->cq_ring_size);
+    }
+    munmap(ctx->sq_ring, ctx->sq_ring_size);
+    close(ctx->ring_fd);
+
+    mk_mem_free(ctx->slots);
+    mk_mem_free(ctx->fired);
+    mk_mem_free(ctx->fired_fd);
+    mk_mem_free(ctx);
+}
+
+/*
+ * It register certain events for the file descriptor in question, if
+ * the file descriptor have not been registered, create a new entry.
+ */
+static inline int _mk_event_add(struct mk_event_ctx *ctx, int fd,
+                                int type, uint32_t events, void *data)
+{
+    int ret;
+    struct mk_event *event;
+    struct mk_event_uring_slot *slot;
+
+    mk_bug(ctx == NULL);
+    mk_bug(data == NULL);
+
+    ret = uring_slots_grow(ctx, fd);
+    if (ret != 0) {
+        return -1;
+    }
+    slot = &ctx->slots[fd];
+
+    /* Verify the FD status and desired operation */
+    event = (struct mk_event *) data;
+    if (event->mask == MK_EVENT_EMPTY) {
+        event->fd   = fd;
+        event->status = MK_EVENT_REGISTERED;
+        event->type = type;
+    }
+    else {
+        if (type != MK_EVENT_UNMODIFIED) {
+            event->type = type;
+        }
+    }
+
+    /* Drop the in-flight request (if any) and queue the new one */
+    if (uring_poll_remove(ctx, fd) != 0) {
+        return -1;
+    }
+
+    slot->event = event;
+    slot->mask  = events;
+    if (uring_poll_add(ctx, fd) != 0) {
+        slot->event = NULL;
+        return -1;
+    }
+
+    event->mask = events;
+    event->priority = MK_EVENT_PRIORITY_DEFAULT;
+
+    /* Remove from priority queue */
+    if (!mk_list_entry_is_orphan(&event->_priority_head)) {
+        mk_list_del(&event->_priority_head);
+    }
+
+    return 0;
+}
+
+/* Delete an event */
+static inline int _mk_event_del(struct mk_event_ctx *ctx, struct mk_event *event)
+{
+    int ret = 0;
+    struct mk_event_uring_slot *slot;
+
+    mk_bug(ctx == NULL);
+    mk_bug(event == NULL);
+
+    if (!MK_EVENT_IS_REGISTERED(event)) {
+        return 0;
+    }
+
+    if (event->fd >= 0 && event->fd < ctx->slots_size &&
+        ctx->slots[event->fd].event == event) {
+        slot = &ctx->slots[event->fd];
+        ret = uring_poll_remove(ctx, event->fd);
+        slot->event = NULL;
+        slot->mask = 0;
+
+        /*
+         * The poll request holds a reference to the file, submit the
+         * cancellation right away so a close(2) after this call releases
+         * the socket without waiting for the next loop round.
+         */
+        if (ret == 0 && uring_submit(ctx, 0, 0) < 0) {
+#ifdef MK_HAVE_TRACE
+            mk_libc_warn("io_uring_enter");
+#endif
+        }
+    }
+
+    MK_TRACE("[FD %i] io_uring, remove from QUEUE_FD=%i, ret=%i",
+             event->fd, ctx->ring_fd, ret);
+
+    /* Remove from priority queue */
+    if (!mk_list_entry_is_orphan(&event->_priority_head)) {
+        mk_list_del(&event->_priority_head);
+    }
+
+    MK_EVENT_NEW(event);
+
+    return ret;
+}
+
+/* Register a timeout file descriptor */
+static inline int _mk_event_timeout_create(struct mk_event_ctx *ctx,
+                                           time_t sec, long nsec, void *data)
+{
+    int ret;
+    int timer_fd;
+    struct itimerspec its;
+    struct timespec now;
+    struct mk_event *event;
+
+    mk_bug(data == NULL);
+
+    memset(&its, '\0', sizeof(struct itimerspec));
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+        mk_libc_error("clock_gettime");
+        return -1;
+    }
+
+    /* expiration interval */
+    its.it_interval.tv_sec  = sec;
+    its.it_interval.tv_nsec = nsec;
+
+    /* initial expiration */
+    its.it_value.tv_sec  = now.tv_sec + sec;
+    its.it_value.tv_nsec = 0;
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (timer_fd == -1) {
+        mk_libc_error("timerfd");
+        return -1;
+    }
+
+    ret = timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    if (ret < 0) {
+        mk_libc_error("timerfd_settime");
+        close(timer_fd);
+        return -1;
+    }
+
+    event = data;
+    event->fd   = timer_fd;
+    event->type = MK_EVENT_NOTIFICATION;
+    event->mask = MK_EVENT_EMPTY;
+
+    /* register the timer into the ring */
+    ret = _mk_event_add(ctx, timer_fd,
+                        MK_EVENT_NOTIFICATION, MK_EVENT_READ, data);
+    if (ret != 0) {
+        close(timer_fd);
+        return ret;
+    }
+
+    return timer_fd;
+}
+
+static inline int _mk_event_timeout_destroy(struct mk_event_ctx *ctx, void *data)
+{
+    struct mk_event *event;
+
+    if (data == NULL) {
+        return 0;
+    }
+
+    event = (struct mk_event *) data;
+    _mk_event_del(ctx, event);
+    close(event->fd);
+    return 0;
+}
+
+static inline int _mk_event_channel_create(struct mk_event_ctx *ctx,
+                                           int *r_fd, int *w_fd, void *data)
+{
+    int ret;
+    int fd[2];
+    struct mk_event *event;
+
+    mk_bug(data == NULL);
+
+    ret = pipe(fd);
+    if (ret < 0) {
+        mk_libc_error("pipe");
+        return ret;
+    }
+
+    event = data;
+    event->fd = fd[0];
+    event->type = MK_EVENT_NOTIFICATION;
+    event->mask = MK_EVENT_EMPTY;
+
+    ret = _mk_event_add(ctx, fd[0],
+                        MK_EVENT_NOTIFICATION, MK_EVENT_READ, event);
+    if (ret != 0) {
+        close(fd[0]);
+        close(fd[1]);
+        return ret;
+    }
+
+    *r_fd = fd[0];
+    *w_fd = fd[1];
+
+    return 0;
+}
+
+static inline int _mk_event_channel_destroy(struct mk_event_ctx *ctx,
+                                            int r_fd, int w_fd, void *data)
+{
+    struct mk_event *event;
+    int ret;
+
+    event = (struct mk_event *)data;
+    if (event->fd != r_fd) {
+        return -1;
+    }
+
+    ret = _mk_event_del(ctx, event);
+    if (ret != 0) {
+        return ret;
+    }
+
+    close(r_fd);
+    close(w_fd);
+
+    return 0;
+}
+
+static inline int _mk_event_inject(struct mk_event_loop *loop,
+                                   struct mk_event *event,
+                                   int mask,
+                                   int prevent_duplication)
+{
+    int                  index;
+    struct mk_event_ctx *ctx;
+
+    ctx = loop->data;
+
+    if (prevent_duplication) {
+        for (index = 0 ; index < loop->n_events ; index++) {
+            if (ctx->fired[index] == event) {
+                return 0;
+            }
+        }
+    }
+
+    event->mask = mask;
+
+    ctx->fired[loop->n_events] = event;
+    ctx->fired_fd[loop->n_events] = event->fd;
+
+    loop->n_events++;
+
+    return 0;
+}
+
+/*
+ * Arm again the poll requests consumed on the previous round. Events that
+ * were deleted or modified meanwhile are skipped: either they don't own a
+ * slot anymore or _mk_event_add() already queued a new request.
+ */
+static inline void uring_rearm(struct mk_event_loop *loop)
+{
+    int i;
+    int fd;
+    struct mk_event_ctx *ctx = loop->data;
+    struct mk_event_uring_slot *slot;
+
+    for (i = 0; i < loop->n_events; i++) {
+        fd = ctx->fired_fd[i];
+        if (fd < 0 || fd >= ctx->slots_size) {
+            continue;
+        }
+
+        slot = &ctx->slots[fd];
+        if (slot->event && slot->armed == MK_FALSE) {
+            uring_poll_add(ctx, fd);
+        }
+    }
+    loop->n_events = 0;
+}
+
+static inline int _mk_event_wait_2(struct mk_event_loop *loop, int timeout)
+{
+    int n = 0;
+    int fd;
+    int ret;
+    unsigned head;
+    unsigned tail;
+    unsigned min_complete;
+    struct io_uring_cqe *cqe;
+    struct mk_event_uring_slot *slot;
+    struct mk_event_ctx *ctx = loop->data;
+
+    uring_rearm(loop);
+
+    /* Don't block if there are completions not reaped yet */
+    head = *ctx->cq_khead;
+    tail = mk_atomic_load(ctx->cq_ktail);
+    min_complete = (head == tail && timeout != 0) ? 1 : 0;
+
+    while (1) {
+        ret = uring_submit(ctx, min_complete, timeout);
+        if (ret >= 0) {
+            break;
+        }
+        else if (errno == ETIME) {
+            break;
+        }
+        else if (errno != EINTR) {
+            mk_libc_error("io_uring_enter");
+            loop->n_events = -1;
+            return -1;
+        }
+        /* retry when errno is EINTR */
+    }
+
+    head = *ctx->cq_khead;
+    tail = mk_atomic_load(ctx->cq_ktail);
+
+    while (head != tail && n < ctx->queue_size) {
+        cqe = &ctx->cqes[head & *ctx->cq_kmask];
+        head++;
+
+        if (cqe->user_data == MK_EVENT_URING_UD_IGNORE) {
+            continue;
+        }
+
+        /* discard completions from a previous registration */
+        fd = uring_ud_fd(cqe->user_data);
+        if (fd < 0 || fd >= ctx->slots_size) {
+            continue;
+        }
+        slot = &ctx->slots[fd];
+        if (!slot->event || slot->gen != uring_ud_gen(cqe->user_data)) {
+            continue;
+        }
+
+        slot->armed = MK_FALSE;
+        if (cqe->res == -ECANCELED) {
+            continue;
+        }
+
+        ctx->fired[n] = slot->event;
+        ctx->fired_fd[n] = fd;
+        n++;
+    }
+    mk_atomic_store(ctx->cq_khead, head);
+
+    loop->n_events = n;
+    return n;
+}
+
+static inline char *_mk_event_backend()
+{
+    return "io_uring";
+}
@@ -0,0 +1,210 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include <mk_core/mk_timer_wheel.h>
+
+/* Link the node in the slot that covers its distance to the current tick */
+static void wheel_link(struct mk_timer_wheel *wheel,
+                       struct mk_timer_wheel_node *node)
+{
+    int level;
+    int idx;
+    uint64_t delta;
+
+    if (node->expire < wheel->now) {
+        node->expire = wheel->now;
+    }
+
+    delta = node->expire - wheel->now;
+    if (delta >= MK_TIMER_WHEEL_SPAN) {
+        node->expire = wheel->now + MK_TIMER_WHEEL_SPAN - 1;
+        delta = MK_TIMER_WHEEL_SPAN - 1;
+    }
+
+    level = 0;
+    while (delta >= (1ULL << (MK_TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    idx = (node->expire >> (MK_TIMER_WHEEL_BITS * level)) &
+        MK_TIMER_WHEEL_MASK;
+    mk_list_add(&node->_head, &wheel->slots[level][idx]);
+}
+
+/* Move the timers of an upper level slot to the levels below */
+static void wheel_cascade(struct mk_timer_wheel *wheel, int level, int idx)
+{
+    struct mk_list list;
+    struct mk_list *head;
+    struct mk_list *tmp;
+    struct mk_timer_wheel_node *node;
+
+    if (mk_list_is_empty(&wheel->slots[level][idx]) == 0) {
+        return;
+    }
+
+    /* detach the slot content so nodes can be linked back to it */
+    list.next = wheel->slots[level][idx].next;
+    list.prev = wheel->slots[level][idx].prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    mk_list_init(&wheel->slots[level][idx]);
+
+    mk_list_foreach_safe(head, tmp, &list) {
+        node = mk_list_entry(head, struct mk_timer_wheel_node, _head);
+        mk_list_del(&node->_head);
+        wheel_link(wheel, node);
+    }
+}
+
+void mk_timer_wheel_init(struct mk_timer_wheel *wheel, int tick_ms,
+                         uint64_t now_ms)
+{
+    int i;
+    int j;
+
+    if (tick_ms <= 0) {
+        tick_ms = 1;
+    }
+
+    wheel->tick_ms = tick_ms;
+    wheel->now = now_ms / tick_ms;
+    wheel->count = 0;
+
+    for (i = 0; i < MK_TIMER_WHEEL_LEVELS; i++) {
+        for (j = 0; j < MK_TIMER_WHEEL_SLOTS; j++) {
+            mk_list_init(&wheel->slots[i][j]);
+        }
+    }
+}
+
+/*
+ * Arm the timer to expire 'timeout_ms' after 'now_ms', if it was already
+ * armed the previous deadline is discarded. The deadline is rounded up to
+ * the next tick so a timer never fires early.
+ */
+void mk_timer_wheel_add(struct mk_timer_wheel *wheel,
+                        struct mk_timer_wheel_node *node,
+                        uint64_t now_ms, uint64_t timeout_ms)
+{
+    uint64_t expire;
+
+    if (node->active) {
+        mk_list_del(&node->_head);
+        wheel->count--;
+    }
+
+    expire = (now_ms + timeout_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+    if (expire <= wheel->now) {
+        expire = wheel->now + 1;
+    }
+
+    node->expire = expire;
+    node->active = 1;
+    wheel_link(wheel, node);
+    wheel->count++;
+}
+
+void mk_timer_wheel_del(struct mk_timer_wheel *wheel,
+                        struct mk_timer_wheel_node *node)
+{
+    if (!node->active) {
+        return;
+    }
+
+    mk_list_del(&node->_head);
+    node->active = 0;
+    wheel->count--;
+}
+
+/*
+ * Advance the wheel up to 'now_ms' invoking the callback for every expired
+ * timer. The node is disarmed before the callback runs, so it can be armed
+ * again or release the memory that contains it. Returns the number of
+ * expired timers.
+ */
+int mk_timer_wheel_expire(struct mk_timer_wheel *wheel, uint64_t now_ms,
+                          mk_timer_wheel_cb cb, void *data)
+{
+    int n = 0;
+    int idx;
+    int level;
+    uint64_t target;
+    struct mk_list *slot;
+    struct mk_timer_wheel_node *node;
+
+    target = now_ms / wheel->tick_ms;
+
+    while (wheel->now < target) {
+        /* nothing to expire, jump straight to the current tick */
+        if (wheel->count == 0) {
+            wheel->now = target;
+            break;
+        }
+
+        wheel->now++;
+        idx = wheel->now & MK_TIMER_WHEEL_MASK;
+
+        /* the lower level wrapped around, pull the timers from above */
+        if (idx == 0) {
+            for (level = 1; level < MK_TIMER_WHEEL_LEVELS; level++) {
+                idx = (wheel->now >> (MK_TIMER_WHEEL_BITS * level)) &
+                    MK_TIMER_WHEEL_MASK;
+                wheel_cascade(wheel, level, idx);
+                if (idx != 0) {
+                    break;
+                }
+            }
+            idx = 0;
+        }
+
+        slot = &wheel->slots[0][idx];
+        while (mk_list_is_empty(slot) != 0) {
+            node = mk_list_entry(slot->next, struct mk_timer_wheel_node,
+                                 _head);
+            mk_list_del(&node->_head);
+            node->active = 0;
+            wheel->count--;
+            n++;
+            cb(node, data);
+        }
+    }
+
+    return n;
+}
+
+/* Monotonic clock in milliseconds */
+uint64_t mk_timer_wheel_clock()
+{
+#ifdef _WIN32
+    return (uint64_t) GetTickCount64();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+#endif
+}
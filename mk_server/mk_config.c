@@ -87,6 +87,10 @@ void mk_config_free_all(struct mk_server *server)
         mk_mem_free(server->conf_user_pub);
     }
 
+    if (server->metrics_path) {
+        mk_mem_free(server->metrics_path);
+    }
+
     /* free config->index_files */
     if (server->index_files) {
         mk_string_split_free(server->index_files);
@@ -271,10 +275,76 @@ static int mk_config_listen_read(struct mk_rconf_section *section,
     return 0;
 }
 
+/*
+ * Parse a timeout value: seconds by default, fractions of a second ("0.5")
+ * or an explicit milliseconds suffix ("500ms") give sub-second timeouts.
+ * Returns the timeout in milliseconds or -1 if the value is not valid.
+ */
+int mk_config_timeout_ms(char *value)
+{
+    char *end;
+    double num;
+
+    if (!value) {
+        return -1;
+    }
+
+    num = strtod(value, &end);
+    if (end == value || num <= 0) {
+        return -1;
+    }
+
+    while (*end == ' ' || *end == '\t') {
+        end++;
+    }
+
+    if (strcasecmp(end, "ms") != 0) {
+        if (*end != '\0' && strcasecmp(end, "s") != 0) {
+            return -1;
+        }
+        num *= 1000;
+    }
+
+    if (num < 1 || num > INT_MAX) {
+        return -1;
+    }
+
+    return (int) num;
+}
+
+/*
+ * Timeouts are kept in milliseconds, the seconds value is informative.
+ * Returns 1 if the key is not set and -1 if the value is not valid.
+ */
+static int mk_config_read_timeout(struct mk_rconf_section *section,
+                                  char *key, int *ms, int *sec)
+{
+    int ret;
+    char *val;
+
+    val = mk_rconf_section_get_key(section, key, MK_RCONF_STR);
+    if (!val) {
+        return 1;
+    }
+
+    ret = mk_config_timeout_ms(val);
+    mk_mem_free(val);
+    if (ret <= 0) {
+        return -1;
+    }
+
+    *ms = ret;
+    if (sec) {
+        *sec = (ret + 999) / 1000;
+    }
+    return 0;
+}
+
 /* Read configuration files */
 static int mk_config_read_files(char *path_conf, char *file_conf,
                                 struct mk_server *server)
 {
+    int ret;
     unsigned long len;
     char *tmp = NULL;
     struct stat checkdir;
@@ -344,9 +414,8 @@ static int mk_config_read_files(char *path_conf, char *file_conf,
     }
 
     /* Timeout */
-    server->timeout = (size_t) mk_rconf_section_get_key(section,
-                                                           "Timeout", MK_RCONF_NUM);
-    if (server->timeout < 1) {
+    if (mk_config_read_timeout(section, "Timeout",
+                               &server->timeout_ms, &server->timeout) != 0) {
         mk_config_print_error_msg("Timeout", tmp);
     }
 
@@ -369,13 +438,28 @@ static int mk_config_read_files(char *path_conf, char *file_conf,
     }
 
     /* KeepAliveTimeout */
-    server->keep_alive_timeout = (size_t) mk_rconf_section_get_key(section,
-                                                                      "KeepAliveTimeout",
-                                                                      MK_RCONF_NUM);
-    if (server->keep_alive_timeout == 0) {
+    if (mk_config_read_timeout(section, "KeepAliveTimeout",
+                               &server->keep_alive_timeout_ms,
+                               &server->keep_alive_timeout) != 0) {
         mk_config_print_error_msg("KeepAliveTimeout", tmp);
     }
 
+    /* WriteTimeout, optional */
+    if (mk_config_read_timeout(section, "WriteTimeout",
+                               &server->write_timeout_ms, NULL) == -1) {
+        mk_config_print_error_msg("WriteTimeout", tmp);
+    }
+
+    /* TimeoutResolution (milliseconds), optional */
+    ret = (size_t) mk_rconf_section_get_key(section, "TimeoutResolution",
+                                            MK_RCONF_NUM);
+    if (ret != 0) {
+        if (ret < 1 || ret > 1000) {
+            mk_config_print_error_msg("TimeoutResolution", tmp);
+        }
+        server->timeout_resolution = ret;
+    }
+
     /* Pid File */
     if (!server->path_conf_pidfile) {
         server->path_conf_pidfile = mk_rconf_section_get_key(section,
@@ -421,6 +505,59 @@ static int mk_config_read_files(char *path_conf, char *file_conf,
         server->max_request_size *= 1024;
     }
 
+    /* Accept Batch */
+    server->accept_batch = (size_t) mk_rconf_section_get_key(section,
+                                                           "AcceptBatch",
+                                                           MK_RCONF_NUM);
+    if (server->accept_batch <= 0) {
+        server->accept_batch = MK_ACCEPT_BATCH_DEFAULT;
+    }
+    else if (server->accept_batch > MK_ACCEPT_BATCH_MAX) {
+        server->accept_batch = MK_ACCEPT_BATCH_MAX;
+    }
+
+    /* Edge Triggered */
+    server->edge_triggered = (size_t) mk_rconf_section_get_key(section,
+                                                             "EdgeTriggered",
+                                                             MK_RCONF_BOOL);
+    if (server->edge_triggered == MK_ERROR) {
+        mk_config_print_error_msg("EdgeTriggered", tmp);
+    }
+#ifndef MK_EVENT_HAVE_EDGE
+    if (server->edge_triggered == MK_TRUE) {
+        mk_warn("EdgeTriggered is not supported by the %s backend",
+                mk_event_backend());
+        server->edge_triggered = MK_FALSE;
+
+    /* Connection contexts from the worker slab, regular pages */
+    server->conn_slab = MK_TRUE;
+    server->conn_slab_huge_pages = MK_FALSE;
+    server->keepalive_compact = MK_FALSE;
+    }
+#endif
+
+    /* Connection contexts allocator */
+    server->conn_slab = (size_t) mk_rconf_section_get_key(section,
+                                                        "ConnectionSlab",
+                                                        MK_RCONF_BOOL);
+    if (server->conn_slab == MK_ERROR) {
+        mk_config_print_error_msg("ConnectionSlab", tmp);
+    }
+
+    server->conn_slab_huge_pages = (size_t) mk_rconf_section_get_key(section,
+                                                                   "ConnectionSlabHugePages",
+                                                                   MK_RCONF_BOOL);
+    if (server->conn_slab_huge_pages == MK_ERROR) {
+        mk_config_print_error_msg("ConnectionSlabHugePages", tmp);
+    }
+
+    server->keepalive_compact = (size_t) mk_rconf_section_get_key(section,
+                                                                "KeepAliveCompact",
+                                                                MK_RCONF_BOOL);
+    if (server->keepalive_compact == MK_ERROR) {
+        mk_config_print_error_msg("KeepAliveCompact", tmp);
+    }
+
     /* Symbolic Links */
     server->symlink = (size_t) mk_rconf_section_get_key(section,
                                                      "SymLink", MK_RCONF_BOOL);
@@ -442,11 +579,109 @@ static int mk_config_read_files(char *path_conf, char *file_conf,
         mk_string_build(&server->mimetype_default_str, &len, "%s\r\n", tmp);
     }
 
-    /* File Descriptor Table (FDT) */
+    /* Open file cache, still enabled through the FDT key */
     server->fdt = (size_t) mk_rconf_section_get_key(section,
                                                     "FDT",
                                                     MK_RCONF_BOOL);
 
+    server->file_cache_size = (size_t) mk_rconf_section_get_key(section,
+                                                                "FileCacheSize",
+                                                                MK_RCONF_NUM);
+    if (server->file_cache_size <= 0) {
+        server->file_cache_size = MK_FILE_CACHE_SIZE_DEFAULT;
+    }
+
+    mk_mem_free(tmp);
+    tmp = mk_rconf_section_get_key(section, "FileCacheTTL", MK_RCONF_STR);
+    if (tmp) {
+        server->file_cache_ttl = atoi(tmp);
+        if (server->file_cache_ttl < 0) {
+            mk_config_print_error_msg("FileCacheTTL", tmp);
+        }
+    }
+
+    /* In-memory responses for small files, zero disables them */
+    mk_mem_free(tmp);
+    tmp = mk_rconf_section_get_key(section, "FileCacheMaxBody", MK_RCONF_STR);
+    if (tmp) {
+        server->file_cache_max_body = strtoul(tmp, NULL, 10);
+    }
+
+    mk_mem_free(tmp);
+    tmp = mk_rconf_section_get_key(section, "FileCacheMemory", MK_RCONF_STR);
+    if (tmp) {
+        server->file_cache_memory = strtoul(tmp, NULL, 10) * 1024;
+    }
+
+    /* Content encoding */
+    server->gzip_static = (size_t) mk_rconf_section_get_key(section,
+                                                          "GzipStatic",
+                                                          MK_RCONF_BOOL);
+    if (server->gzip_static == MK_ERROR) {
+        mk_config_print_error_msg("GzipStatic", tmp);
+    }
+
+    server->gzip_compress = (size_t) mk_rconf_section_get_key(section,
+                                                            "GzipCompress",
+                                                            MK_RCONF_BOOL);
+    if (server->gzip_compress == MK_ERROR) {
+        mk_config_print_error_msg("GzipCompress", tmp);
+    }
+#ifndef MK_HAVE_GZIP
+    if (server->gzip_compress == MK_TRUE) {
+        mk_warn("GzipCompress requires Monkey to be built with zlib");
+        server->gzip_compress = MK_FALSE;
+    }
+#endif
+
+    mk_mem_free(tmp);
+    tmp = mk_rconf_section_get_key(section, "GzipMaxSize", MK_RCONF_STR);
+    if (tmp) {
+        server->gzip_max_size = strtoul(tmp, NULL, 10);
+    }
+
+    mk_mem_free(tmp);
+    tmp = mk_rconf_section_get_key(section, "GzipMemory", MK_RCONF_STR);
+    if (tmp) {
+        server->gzip_memory = strtoul(tmp, NULL, 10) * 1024;
+    }
+
+    /* Library mode handlers: coroutine contexts pool */
+    mk_mem_free(tmp);
+    tmp = mk_rconf_section_get_key(section, "CoroutinePoolSize", MK_RCONF_STR);
+    if (tmp) {
+        server->coroutine_pool = atoi(tmp);
+        if (server->coroutine_pool < 0) {
+            mk_config_print_error_msg("CoroutinePoolSize", tmp);
+        }
+    }
+
+    mk_mem_free(tmp);
+    tmp = mk_rconf_section_get_key(section, "CoroutineStackSize", MK_RCONF_STR);
+    if (tmp) {
+        server->coroutine_stack = strtoul(tmp, NULL, 10) * 1024;
+    }
+
+    /* Metrics */
+    server->metrics = (size_t) mk_rconf_section_get_key(section,
+                                                        "Metrics",
+                                                        MK_RCONF_BOOL);
+    if (server->metrics == MK_ERROR) {
+        mk_config_print_error_msg("Metrics", tmp);
+    }
+
+    mk_mem_free(tmp);
+    tmp = mk_rconf_section_get_key(section, "MetricsPath", MK_RCONF_STR);
+    if (tmp) {
+        if (tmp[0] != '/') {
+            mk_config_print_error_msg("MetricsPath", tmp);
+        }
+        mk_mem_free(server->metrics_path);
+        server->metrics_path = tmp;
+        server->metrics_path_len = strlen(tmp);
+        tmp = NULL;
+    }
+
     /* FIXME: Overcapacity not ready */
     server->fd_limit = (size_t) mk_rconf_section_get_key(section,
                                                            "FDLimit",
@@ -575,6 +810,10 @@ void mk_config_set_init_values(struct mk_server *server)
     server->hideversion = MK_FALSE;
     server->keep_alive = MK_TRUE;
     server->keep_alive_timeout = 15;
+    server->timeout_ms = server->timeout * 1000;
+    server->keep_alive_timeout_ms = server->keep_alive_timeout * 1000;
+    server->write_timeout_ms = MK_WRITE_TIMEOUT_DEFAULT * 1000;
+    server->timeout_resolution = MK_TIMEOUT_RESOLUTION_DEFAULT;
     server->max_keep_alive_request = 50;
     server->resume = MK_TRUE;
     server->standard_port = 80;
@@ -603,6 +842,33 @@ void mk_config_set_init_values(struct mk_server *server)
      * so we are setting a maximum request size to 32 KB */
     server->max_request_size = MK_REQUEST_CHUNK * 8;
 
+    /* Connections accepted on every listener wakeup */
+    server->accept_batch = MK_ACCEPT_BATCH_DEFAULT;
+
+    /* Level-triggered connection events */
+    server->edge_triggered = MK_FALSE;
+
+    /* Open file cache */
+    server->file_cache_size = MK_FILE_CACHE_SIZE_DEFAULT;
+    server->file_cache_ttl = MK_FILE_CACHE_TTL_DEFAULT;
+    server->file_cache_max_body = MK_FILE_CACHE_MAX_BODY_DEFAULT;
+    server->file_cache_memory = MK_FILE_CACHE_MEMORY_DEFAULT * 1024;
+
+    /* Content encoding */
+    server->gzip_static = MK_FALSE;
+    server->gzip_compress = MK_FALSE;
+    server->gzip_max_size = MK_GZIP_MAX_SIZE_DEFAULT;
+    server->gzip_memory = MK_GZIP_MEMORY_DEFAULT * 1024;
+
+    /* Coroutines, a zero stack size means MK_THREAD_STACK_SIZE */
+    server->coroutine_pool = MK_COROUTINE_POOL_DEFAULT;
+    server->coroutine_stack = 0;
+
+    /* Metrics */
+    server->metrics = MK_FALSE;
+    server->metrics_path = mk_string_dup(MK_METRICS_PATH_DEFAULT);
+    server->metrics_path_len = sizeof(MK_METRICS_PATH_DEFAULT) - 1;
+
     /* Internals */
     server->safe_event_write = MK_FALSE;
 
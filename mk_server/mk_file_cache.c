@@ -0,0 +1,737 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_info.h>
+#include <monkey/mk_core.h>
+#include <monkey/mk_file_cache.h>
+#include <monkey/mk_file_cache_tls.h>
+#include <monkey/mk_clock.h>
+#include <monkey/mk_header.h>
+#include <monkey/mk_utils.h>
+#include <monkey/mk_tls.h>
+
+#include <fcntl.h>
+
+#ifdef MK_HAVE_GZIP
+#include <zlib.h>
+#endif
+
+/*
+ * Open file cache
+ * ---------------
+ * Every worker owns a table of recently served resources keyed by their
+ * full path. An entry keeps the stat(2) result, a shared file descriptor
+ * and the ETag, Last-Modified and mime type of the resource, so serving
+ * the same file again costs a hash lookup instead of stat(2) + open(2) +
+ * close(2) and the header formatting.
+ *
+ * Entries are revalidated with stat(2) once their TTL expires; if the size
+ * or modification time changed the entry is dropped and rebuilt. When the
+ * table is full the least recently used entry is evicted. An entry that is
+ * still referenced by an in-flight request is only unlinked, the last
+ * request releasing it closes the descriptor.
+ *
+ * Small files are also kept in memory: their content is appended to the
+ * response headers IOV so the whole response goes out in one writev(2).
+ * The same applies to the gzip copies of text files compressed on the fly,
+ * which are accounted in their own memory budget.
+ */
+
+static inline void file_cache_entry_free(struct mk_file_cache_entry *entry)
+{
+    if (entry->fd != -1) {
+        close(entry->fd);
+    }
+    if (entry->body) {
+        mk_mem_free(entry->body);
+    }
+    if (entry->headers.data) {
+        mk_mem_free(entry->headers.data);
+    }
+    if (entry->gzip) {
+        mk_mem_free(entry->gzip);
+    }
+    mk_mem_free(entry->path);
+    mk_mem_free(entry);
+}
+
+static inline void file_cache_entry_unlink(struct mk_file_cache *cache,
+                                           struct mk_file_cache_entry *entry)
+{
+    mk_list_del(&entry->_head);
+    mk_list_del(&entry->_head_lru);
+    cache->size--;
+
+    if (entry->body) {
+        cache->memory -= entry->file_info.size;
+    }
+    if (entry->gzip) {
+        cache->gzip_memory -= entry->gzip_len;
+    }
+
+    if (entry->readers > 0) {
+        entry->stale = MK_TRUE;
+        return;
+    }
+    file_cache_entry_free(entry);
+}
+
+static inline void file_cache_entry_release(struct mk_file_cache_entry *entry)
+{
+    entry->readers--;
+    if (entry->stale == MK_TRUE && entry->readers == 0) {
+        file_cache_entry_free(entry);
+    }
+}
+
+static struct mk_file_cache_entry *file_cache_lookup(struct mk_file_cache *cache,
+                                                     unsigned int hash,
+                                                     char *path, int len)
+{
+    struct mk_list *head;
+    struct mk_list *bucket;
+    struct mk_file_cache_entry *entry;
+
+    bucket = &cache->buckets[hash & cache->mask];
+    mk_list_foreach(head, bucket) {
+        entry = mk_list_entry(head, struct mk_file_cache_entry, _head);
+        if (entry->hash == hash && entry->path_len == len &&
+            memcmp(entry->path, path, len) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Compose the Last-Modified, Content-Type and ETag rows */
+static void file_cache_headers(struct mk_file_cache_entry *entry)
+{
+    char *p;
+    size_t size;
+
+    if (entry->last_modified_len <= 0) {
+        return;
+    }
+
+    size = mk_header_last_modified.len + entry->last_modified_len +
+        entry->mime->header_type.len + entry->etag_len;
+
+    p = mk_mem_alloc(size);
+    if (!p) {
+        return;
+    }
+    entry->headers.data = p;
+    entry->headers.len  = size;
+
+    memcpy(p, mk_header_last_modified.data, mk_header_last_modified.len);
+    p += mk_header_last_modified.len;
+    memcpy(p, entry->last_modified, entry->last_modified_len);
+    p += entry->last_modified_len;
+    memcpy(p, entry->mime->header_type.data, entry->mime->header_type.len);
+    p += entry->mime->header_type.len;
+    memcpy(p, entry->etag, entry->etag_len);
+}
+
+/*
+ * Read the file content into memory if it's small enough, evicting the
+ * oldest in-memory files when the worker budget is exhausted.
+ */
+static void file_cache_body_load(struct mk_file_cache *cache,
+                                 struct mk_file_cache_entry *entry)
+{
+    char *body;
+    size_t size = entry->file_info.size;
+    size_t total = 0;
+    ssize_t bytes;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_file_cache_entry *old;
+
+    if (size == 0 || size > cache->max_body || size > cache->memory_limit) {
+        return;
+    }
+
+    mk_list_foreach_safe(head, tmp, &cache->lru) {
+        if (cache->memory + size <= cache->memory_limit) {
+            break;
+        }
+
+        old = mk_list_entry(head, struct mk_file_cache_entry, _head_lru);
+        if (old == entry) {
+            return;
+        }
+        if (old->body) {
+            file_cache_entry_unlink(cache, old);
+            cache->evictions++;
+        }
+    }
+
+    if (cache->memory + size > cache->memory_limit) {
+        return;
+    }
+
+    body = mk_mem_alloc(size);
+    if (!body) {
+        return;
+    }
+
+    while (total < size) {
+        bytes = pread(entry->fd, body + total, size - total, total);
+        if (bytes <= 0) {
+            mk_mem_free(body);
+            return;
+        }
+        total += bytes;
+    }
+
+    entry->body = body;
+    cache->memory += size;
+}
+
+/* Text based content is worth to be compressed */
+static int file_cache_compressible(struct mk_mimetype *mime)
+{
+    char *type = mime->type.data;
+
+    if (strncmp(type, "text/", 5) == 0 ||
+        strstr(type, "javascript") ||
+        strstr(type, "json") ||
+        strstr(type, "xml")) {
+        return MK_TRUE;
+    }
+    return MK_FALSE;
+}
+
+static struct mk_file_cache_entry *file_cache_add(struct mk_file_cache *cache,
+                                                  mk_ptr_t *path,
+                                                  struct file_info *finfo,
+                                                  unsigned int hash,
+                                                  time_t now,
+                                                  struct mk_server *server)
+{
+    char *p;
+    struct mk_file_cache_entry *entry;
+
+    /* Make room for the new entry */
+    while (cache->size >= cache->capacity) {
+        entry = mk_list_entry_first(&cache->lru,
+                                    struct mk_file_cache_entry, _head_lru);
+        file_cache_entry_unlink(cache, entry);
+        cache->evictions++;
+    }
+
+    entry = mk_mem_alloc(sizeof(struct mk_file_cache_entry));
+    if (!entry) {
+        return NULL;
+    }
+
+    entry->path = mk_mem_alloc(path->len + 1);
+    if (!entry->path) {
+        mk_mem_free(entry);
+        return NULL;
+    }
+    memcpy(entry->path, path->data, path->len);
+    entry->path[path->len] = '\0';
+    entry->path_len  = path->len;
+    entry->hash      = hash;
+    entry->fd        = -1;
+    entry->readers   = 0;
+    entry->stale     = MK_FALSE;
+    entry->validated = now;
+    entry->file_info = *finfo;
+    entry->body      = NULL;
+    entry->gzip      = NULL;
+    entry->gzip_len  = 0;
+    entry->gzip_static = MK_FILE_CACHE_GZ_UNKNOWN;
+    mk_ptr_reset(&entry->headers);
+
+    /* Response metadata */
+    entry->mime = mk_mimetype_find(server, path);
+    if (!entry->mime) {
+        entry->mime = server->mimetype_default;
+    }
+    entry->gzip_skip = !file_cache_compressible(entry->mime);
+
+    entry->etag_len = snprintf(entry->etag, MK_HEADER_ETAG_SIZE,
+                               "ETag: \"%x-%zx\"\r\n",
+                               (unsigned int) finfo->last_modification,
+                               finfo->size);
+
+    p = entry->last_modified;
+    entry->last_modified_len = mk_utils_utime2gmt(&p,
+                                                  finfo->last_modification);
+    file_cache_headers(entry);
+
+    mk_list_add(&entry->_head, &cache->buckets[hash & cache->mask]);
+    mk_list_add(&entry->_head_lru, &cache->lru);
+    cache->size++;
+
+    return entry;
+}
+
+/*
+ * Lookup or create the entry for 'path'. Returns -1 if the resource cannot
+ * be stat'ed, otherwise 0 and a referenced entry (or NULL if it could not
+ * be cached) on 'out'. In both cases 'finfo' gets the resource metadata.
+ */
+static int file_cache_get(struct mk_file_cache *cache, mk_ptr_t *path,
+                          struct file_info *finfo,
+                          struct mk_file_cache_entry **out,
+                          struct mk_server *server)
+{
+    int ret;
+    int checked = MK_FALSE;
+    time_t now;
+    unsigned int hash;
+    struct mk_file_cache_entry *entry;
+
+    *out = NULL;
+    now  = server->clock_context->log_current_utime;
+    hash = mk_utils_gen_hash(path->data, path->len);
+
+    entry = file_cache_lookup(cache, hash, path->data, path->len);
+    if (entry && now - entry->validated >= cache->ttl) {
+        ret = mk_file_get_info(path->data, finfo, MK_FILE_READ);
+        checked = MK_TRUE;
+
+        if (ret == -1) {
+            file_cache_entry_unlink(cache, entry);
+            return -1;
+        }
+
+        if (finfo->size != entry->file_info.size ||
+            finfo->last_modification != entry->file_info.last_modification ||
+            finfo->is_directory != entry->file_info.is_directory) {
+            file_cache_entry_unlink(cache, entry);
+            entry = NULL;
+        }
+        else {
+            entry->file_info = *finfo;
+            entry->validated = now;
+            entry->gzip_static = MK_FILE_CACHE_GZ_UNKNOWN;
+        }
+    }
+
+    if (entry) {
+        /* Most recently used goes to the tail */
+        mk_list_del(&entry->_head_lru);
+        mk_list_add(&entry->_head_lru, &cache->lru);
+        cache->hits++;
+    }
+    else {
+        cache->misses++;
+        if (checked == MK_FALSE) {
+            ret = mk_file_get_info(path->data, finfo, MK_FILE_READ);
+            if (ret == -1) {
+                /* Missing resources are not cached */
+                return -1;
+            }
+        }
+
+        entry = file_cache_add(cache, path, finfo, hash, now, server);
+        if (!entry) {
+            return 0;
+        }
+    }
+
+    entry->readers++;
+    *finfo = entry->file_info;
+    *out = entry;
+
+    return 0;
+}
+
+/* Retrieve the metadata for the resource pointed by sr->real_path */
+int mk_file_cache_stat(struct mk_http_request *sr, struct mk_server *server)
+{
+    struct mk_file_cache *cache;
+
+    /* A previous lookup on this request (e.g: directory index) */
+    if (sr->file_cache) {
+        file_cache_entry_release(sr->file_cache);
+        sr->file_cache = NULL;
+    }
+
+    cache = MK_TLS_GET(mk_tls_file_cache);
+    if (!cache) {
+        return mk_file_get_info(sr->real_path.data, &sr->file_info,
+                                MK_FILE_READ);
+    }
+
+    return file_cache_get(cache, &sr->real_path, &sr->file_info,
+                          &sr->file_cache, server);
+}
+
+/*
+ * Replace the request resource with a variant of it, e.g: the precompressed
+ * file.gz. The request is untouched if the variant is not a readable file.
+ */
+int mk_file_cache_sibling(struct mk_http_request *sr, char *path, int len,
+                          struct mk_server *server)
+{
+    int ret;
+    mk_ptr_t p = {.data = path, .len = len};
+    struct file_info finfo;
+    struct mk_file_cache *cache;
+    struct mk_file_cache_entry *entry;
+    struct mk_file_cache_entry *orig = sr->file_cache;
+
+    cache = MK_TLS_GET(mk_tls_file_cache);
+    if (!cache) {
+        ret = mk_file_get_info(path, &finfo, MK_FILE_READ);
+        if (ret == -1 || finfo.is_file == MK_FALSE ||
+            finfo.read_access == MK_FALSE) {
+            return -1;
+        }
+        sr->file_info = finfo;
+        return 0;
+    }
+
+    ret = file_cache_get(cache, &p, &finfo, &entry, server);
+    if (ret == -1 || finfo.is_file == MK_FALSE ||
+        finfo.read_access == MK_FALSE) {
+        if (entry) {
+            file_cache_entry_release(entry);
+        }
+        if (orig) {
+            orig->gzip_static = MK_FILE_CACHE_GZ_MISSING;
+        }
+        return -1;
+    }
+
+    if (orig) {
+        orig->gzip_static = MK_FILE_CACHE_GZ_FOUND;
+        file_cache_entry_release(orig);
+    }
+    sr->file_cache = entry;
+    sr->file_info = finfo;
+
+    return 0;
+}
+
+/* Get a file descriptor for the resource, shared if it's cached */
+int mk_file_cache_open(struct mk_http_request *sr, struct mk_server *server)
+{
+    struct mk_file_cache_entry *entry = sr->file_cache;
+    (void) server;
+
+    if (!entry) {
+        return open(sr->real_path.data, sr->file_info.flags_read_only);
+    }
+
+    if (entry->fd == -1) {
+        entry->fd = open(entry->path, entry->file_info.flags_read_only);
+        if (entry->fd != -1) {
+            file_cache_body_load(MK_TLS_GET(mk_tls_file_cache), entry);
+        }
+    }
+    return entry->fd;
+}
+
+/*
+ * If the file content is in memory, append the requested bytes to the
+ * response headers IOV. Returns -1 if the content must be streamed from
+ * the file descriptor.
+ */
+int mk_file_cache_send(struct mk_http_request *sr)
+{
+    struct mk_iov *iov = &sr->headers.headers_iov;
+    struct mk_file_cache *cache;
+    struct mk_file_cache_entry *entry = sr->file_cache;
+
+    if (!entry) {
+        return -1;
+    }
+
+    cache = MK_TLS_GET(mk_tls_file_cache);
+    if (sr->file_cache_gzip == MK_TRUE) {
+        if (sr->headers._extra_rows || iov->iov_idx >= iov->size) {
+            /* stream the compressed copy as a separate input */
+            mk_stream_input(&sr->stream, NULL, MK_STREAM_RAW, -1,
+                            entry->gzip, entry->gzip_len, 0, NULL, NULL);
+            return 0;
+        }
+        mk_iov_add(iov, entry->gzip, entry->gzip_len, MK_FALSE);
+        sr->in_headers.bytes_total = iov->total_len;
+        return 0;
+    }
+
+    if (!entry->body || sr->headers._extra_rows ||
+        iov->iov_idx >= iov->size) {
+        cache->body_misses++;
+        return -1;
+    }
+
+    mk_iov_add(iov, entry->body + sr->in_file.bytes_offset,
+               sr->in_file.bytes_total, MK_FALSE);
+    sr->in_headers.bytes_total = iov->total_len;
+    cache->body_hits++;
+
+    return 0;
+}
+
+#ifdef MK_HAVE_GZIP
+/* Compress 'size' bytes of the entry into a new gzip buffer */
+static char *file_cache_deflate(struct mk_file_cache_entry *entry,
+                                size_t *out_len)
+{
+    int ret;
+    char *in;
+    char *out;
+    size_t size = entry->file_info.size;
+    size_t total = 0;
+    size_t bound;
+    ssize_t bytes;
+    z_stream strm;
+
+    /* Input: the in-memory copy or the file content */
+    if (entry->body) {
+        in = entry->body;
+    }
+    else {
+        in = mk_mem_alloc(size);
+        if (!in) {
+            return NULL;
+        }
+        while (total < size) {
+            bytes = pread(entry->fd, in + total, size - total, total);
+            if (bytes <= 0) {
+                mk_mem_free(in);
+                return NULL;
+            }
+            total += bytes;
+        }
+    }
+
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                       MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        if (in != entry->body) {
+            mk_mem_free(in);
+        }
+        return NULL;
+    }
+
+    bound = deflateBound(&strm, size);
+    out = mk_mem_alloc(bound);
+    if (out) {
+        strm.next_in   = (unsigned char *) in;
+        strm.avail_in  = size;
+        strm.next_out  = (unsigned char *) out;
+        strm.avail_out = bound;
+
+        ret = deflate(&strm, Z_FINISH);
+        if (ret != Z_STREAM_END) {
+            mk_mem_free(out);
+            out = NULL;
+        }
+        else {
+            *out_len = strm.total_out;
+        }
+    }
+    deflateEnd(&strm);
+
+    if (in != entry->body) {
+        mk_mem_free(in);
+    }
+    return out;
+}
+#endif
+
+/*
+ * Make sure the request resource has a gzip copy: it's compressed the first
+ * time and kept while the entry lives. Returns -1 if the identity content
+ * must be served.
+ */
+int mk_file_cache_gzip(struct mk_http_request *sr, struct mk_server *server)
+{
+#ifdef MK_HAVE_GZIP
+    char *gzip;
+    size_t len = 0;
+    size_t size;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_file_cache *cache;
+    struct mk_file_cache_entry *old;
+    struct mk_file_cache_entry *entry = sr->file_cache;
+
+    if (!entry) {
+        return -1;
+    }
+
+    cache = MK_TLS_GET(mk_tls_file_cache);
+    if (entry->gzip) {
+        cache->gzip_hits++;
+        return 0;
+    }
+
+    size = entry->file_info.size;
+    if (entry->gzip_skip == MK_TRUE ||
+        size < MK_FILE_CACHE_GZIP_MIN_SIZE || size > cache->gzip_max_size) {
+        return -1;
+    }
+
+    if (mk_file_cache_open(sr, server) == -1) {
+        return -1;
+    }
+
+    gzip = file_cache_deflate(entry, &len);
+    if (!gzip || len >= size) {
+        /* Not compressible, do not try again */
+        if (gzip) {
+            mk_mem_free(gzip);
+        }
+        entry->gzip_skip = MK_TRUE;
+        return -1;
+    }
+
+    /* Drop the oldest compressed objects until the new one fits */
+    mk_list_foreach_safe(head, tmp, &cache->lru) {
+        if (cache->gzip_memory + len <= cache->gzip_memory_limit) {
+            break;
+        }
+
+        old = mk_list_entry(head, struct mk_file_cache_entry, _head_lru);
+        if (old == entry) {
+            break;
+        }
+        if (old->gzip) {
+            file_cache_entry_unlink(cache, old);
+            cache->evictions++;
+        }
+    }
+
+    if (cache->gzip_memory + len > cache->gzip_memory_limit) {
+        mk_mem_free(gzip);
+        cache->gzip_misses++;
+        return -1;
+    }
+
+    entry->gzip = gzip;
+    entry->gzip_len = len;
+    entry->gzip_etag_len = snprintf(entry->gzip_etag, MK_HEADER_ETAG_SIZE,
+                                    "ETag: \"%x-%zx-gz\"\r\n",
+                                    (unsigned int) entry->file_info.last_modification,
+                                    size);
+    cache->gzip_memory += len;
+    cache->gzip_misses++;
+
+    return 0;
+#else
+    (void) sr;
+    (void) server;
+    return -1;
+#endif
+}
+
+int mk_file_cache_close(struct mk_http_request *sr, struct mk_server *server)
+{
+    struct mk_file_cache_entry *entry = sr->file_cache;
+    (void) server;
+
+    if (!entry) {
+        if (sr->in_file.fd > 0) {
+            return close(sr->in_file.fd);
+        }
+        return -1;
+    }
+
+    sr->file_cache = NULL;
+    file_cache_entry_release(entry);
+
+    return 0;
+}
+
+/*
+ * This function is triggered upon thread creation (inside the thread
+ * context), here we allocate the worker cache.
+ */
+int mk_file_cache_worker_init(struct mk_server *server)
+{
+    unsigned int i;
+    unsigned int buckets = 16;
+    struct mk_file_cache *cache;
+
+    if (server->fdt == MK_FALSE) {
+        MK_TLS_SET(mk_tls_file_cache, NULL);
+        return 0;
+    }
+
+    cache = mk_mem_alloc_z(sizeof(struct mk_file_cache));
+    if (!cache) {
+        return -1;
+    }
+
+    /* Power of two buckets, at least one per entry */
+    while (buckets < (unsigned int) server->file_cache_size) {
+        buckets <<= 1;
+    }
+
+    cache->buckets = mk_mem_alloc(sizeof(struct mk_list) * buckets);
+    if (!cache->buckets) {
+        mk_mem_free(cache);
+        return -1;
+    }
+
+    for (i = 0; i < buckets; i++) {
+        mk_list_init(&cache->buckets[i]);
+    }
+    mk_list_init(&cache->lru);
+
+    cache->mask     = buckets - 1;
+    cache->capacity = server->file_cache_size;
+    cache->ttl      = server->file_cache_ttl;
+
+    cache->max_body     = server->file_cache_max_body;
+    cache->memory_limit = server->file_cache_memory;
+
+    cache->gzip_max_size     = server->gzip_max_size;
+    cache->gzip_memory_limit = server->gzip_memory;
+
+    MK_TLS_SET(mk_tls_file_cache, cache);
+    return 0;
+}
+
+int mk_file_cache_worker_exit(struct mk_server *server)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_file_cache *cache;
+    struct mk_file_cache_entry *entry;
+    (void) server;
+
+    cache = MK_TLS_GET(mk_tls_file_cache);
+    if (!cache) {
+        return 0;
+    }
+
+    mk_list_foreach_safe(head, tmp, &cache->lru) {
+        entry = mk_list_entry(head, struct mk_file_cache_entry, _head_lru);
+        mk_list_del(&entry->_head_lru);
+        file_cache_entry_free(entry);
+    }
+
+    mk_mem_free(cache->buckets);
+    mk_mem_free(cache);
+    MK_TLS_SET(mk_tls_file_cache, NULL);
+
+    return 0;
+}
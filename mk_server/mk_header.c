@@ -30,6 +30,7 @@
 #include <monkey/mk_http.h>
 #include <monkey/mk_vhost.h>
 #include <monkey/mk_tls.h>
+#include <monkey/mk_metrics.h>
 
 #define MK_HEADER_SHORT_DATE       "Date: "
 #define MK_HEADER_SHORT_LOCATION   "Location: "
@@ -44,6 +45,7 @@
 #define MK_HEADER_TE_CHUNKED       "Transfer-Encoding: chunked" MK_CRLF
 #define MK_HEADER_LAST_MODIFIED    "Last-Modified: "
 #define MK_HEADER_UPGRADE_H2C      "Upgrade: h2c" MK_CRLF
+#define MK_HEADER_VARY_ENCODING    "Vary: Accept-Encoding" MK_CRLF
 
 const mk_ptr_t mk_header_short_date = mk_ptr_init(MK_HEADER_SHORT_DATE);
 const mk_ptr_t mk_header_short_location = mk_ptr_init(MK_HEADER_SHORT_LOCATION);
@@ -59,6 +61,7 @@ const mk_ptr_t mk_header_accept_ranges = mk_ptr_init(MK_HEADER_ACCEPT_RANGES);
 const mk_ptr_t mk_header_te_chunked = mk_ptr_init(MK_HEADER_TE_CHUNKED);
 const mk_ptr_t mk_header_last_modified = mk_ptr_init(MK_HEADER_LAST_MODIFIED);
 const mk_ptr_t mk_header_upgrade_h2c = mk_ptr_init(MK_HEADER_UPGRADE_H2C);
+const mk_ptr_t mk_header_vary_encoding = mk_ptr_init(MK_HEADER_VARY_ENCODING);
 
 #define status_entry(num, str) {num, sizeof(str) - 1, str}
 
@@ -176,6 +179,10 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
     sh = &sr->headers;
     iov = &sh->headers_iov;
 
+    if (server->metrics == MK_TRUE) {
+        mk_metrics_response_headers(sr);
+    }
+
     /* HTTP Status Code */
     if (sh->status == MK_CUSTOM_STATUS) {
         response.data = sh->custom_status.data;
@@ -207,10 +214,23 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
                server->clock_context->headers_preset.len,
                MK_FALSE);
 
+    /* Last-Modified, Content-Type and ETag in one row set */
+    if (sh->file_headers.data) {
+        mk_iov_add(iov,
+                   sh->file_headers.data,
+                   sh->file_headers.len,
+                   MK_FALSE);
+    }
+
     /* Last-Modified */
-    if (sh->last_modified > 0) {
-        mk_ptr_t *lm = MK_TLS_GET(mk_tls_cache_header_lm);
-        lm->len = mk_utils_utime2gmt(&lm->data, sh->last_modified);
+    if (sh->last_modified > 0 && !sh->file_headers.data) {
+        mk_ptr_t *lm = &sh->last_modified_str;
+
+        /* Format the date unless the open file cache already did it */
+        if (!lm->data) {
+            lm->data = sh->lm_buf;
+            lm->len = mk_utils_utime2gmt(&lm->data, sh->last_modified);
+        }
 
         mk_iov_add(iov,
                    mk_header_last_modified.data,
@@ -274,7 +294,7 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
     }
 
     /* Content type */
-    if (sh->content_type.len > 0) {
+    if (sh->content_type.len > 0 && !sh->file_headers.data) {
         mk_iov_add(iov,
                    sh->content_type.data,
                    sh->content_type.len,
@@ -295,7 +315,7 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
     }
 
     /* E-Tag */
-    if (sh->etag_len > 0) {
+    if (sh->etag_len > 0 && !sh->file_headers.data) {
         mk_iov_add(iov, sh->etag_buf, sh->etag_len, MK_FALSE);
     }
 
@@ -309,11 +329,20 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
                    MK_FALSE);
     }
 
+    /* Vary: the resource has more than one content encoding */
+    if (sh->vary_encoding == MK_TRUE) {
+        mk_iov_add(iov, mk_header_vary_encoding.data,
+                   mk_header_vary_encoding.len,
+                   MK_FALSE);
+    }
+
     /* Content-Length */
     if (sh->content_length >= 0 && sh->transfer_encoding != 0) {
         /* Map content length to MK_POINTER */
-        mk_ptr_t *cl = MK_TLS_GET(mk_tls_cache_header_cl);
-        mk_string_itop(sh->content_length, cl);
+        mk_ptr_t cl;
+
+        cl.data = sh->cl_buf;
+        mk_string_itop(sh->content_length, &cl);
 
         /* Set headers */
         mk_iov_add(iov,
@@ -321,8 +350,8 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
                    mk_header_content_length.len,
                    MK_FALSE);
         mk_iov_add(iov,
-                   cl->data,
-                   cl->len,
+                   cl.data,
+                   cl.len,
                    MK_FALSE);
     }
 
@@ -334,7 +363,7 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
         if (sh->ranges[0] >= 0 && sh->ranges[1] == -1) {
             mk_string_build(&buffer,
                             &len,
-                            "%s bytes %d-%ld/%ld\r\n",
+                            "%s bytes %ld-%ld/%ld\r\n",
                             RH_CONTENT_RANGE,
                             sh->ranges[0],
                             (sh->real_length - 1), sh->real_length);
@@ -345,7 +374,7 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
         if (sh->ranges[0] >= 0 && sh->ranges[1] >= 0) {
             mk_string_build(&buffer,
                             &len,
-                            "%s bytes %d-%d/%ld\r\n",
+                            "%s bytes %ld-%ld/%ld\r\n",
                             RH_CONTENT_RANGE,
                             sh->ranges[0], sh->ranges[1], sh->real_length);
 
@@ -435,10 +464,13 @@ void mk_header_response_reset(struct response_headers *header)
     header->connection = 0;
     header->transfer_encoding = -1;
     header->last_modified = -1;
+    mk_ptr_reset(&header->last_modified_str);
+    mk_ptr_reset(&header->file_headers);
     header->upgrade = -1;
     header->cgi = SH_NOCGI;
     mk_ptr_reset(&header->content_type);
     mk_ptr_reset(&header->content_encoding);
+    header->vary_encoding = MK_FALSE;
     header->location = NULL;
     header->_extra_rows = NULL;
     header->allow_methods.len = 0;
@@ -20,6 +20,7 @@
 #define _GNU_SOURCE
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -39,11 +40,14 @@
 #include <monkey/mk_config.h>
 #include <monkey/mk_socket.h>
 #include <monkey/mk_mimetype.h>
+#include <monkey/mk_file_cache.h>
+#include <monkey/mk_http_range.h>
 #include <monkey/mk_header.h>
 #include <monkey/mk_plugin.h>
 #include <monkey/mk_vhost.h>
 #include <monkey/mk_server.h>
 #include <monkey/mk_plugin_stage.h>
+#include <monkey/mk_metrics.h>
 
 const mk_ptr_t mk_http_method_get_p = mk_ptr_init(MK_METHOD_GET_STR);
 const mk_ptr_t mk_http_method_post_p = mk_ptr_init(MK_METHOD_POST_STR);
@@ -56,6 +60,7 @@ const mk_ptr_t mk_http_method_null_p = { NULL, 0 };
 const mk_ptr_t mk_http_protocol_09_p = mk_ptr_init(MK_HTTP_PROTOCOL_09_STR);
 const mk_ptr_t mk_http_protocol_10_p = mk_ptr_init(MK_HTTP_PROTOCOL_10_STR);
 const mk_ptr_t mk_http_protocol_11_p = mk_ptr_init(MK_HTTP_PROTOCOL_11_STR);
+const mk_ptr_t mk_http_protocol_20_p = mk_ptr_init(MK_HTTP_PROTOCOL_20_STR);
 const mk_ptr_t mk_http_protocol_null_p = { NULL, 0 };
 
 /* Create a memory allocation in order to handle the request data */
@@ -73,11 +78,13 @@ void mk_http_request_init(struct mk_http_session *session,
     request->connection.len = -1;
     request->file_fd        = -1;
     request->file_info.size = -1;
-    request->vhost_fdt_id = 0;
-    request->vhost_fdt_hash = 0;
-    request->vhost_fdt_enabled = MK_FALSE;
+    request->file_cache = NULL;
+    request->file_cache_gzip = MK_FALSE;
+    request->multirange = NULL;
     request->host.data = NULL;
     request->stage30_blocked = MK_FALSE;
+    request->stage30_handler = NULL;
+    request->stage30_active = MK_FALSE;
     request->session = session;
     request->host_conf = mk_list_entry_first(host_list, struct mk_vhost, _head);
     request->uri_processed.data = NULL;
@@ -390,109 +397,6 @@ static int mk_http_error_page(char *title, mk_ptr_t *message, char *signature,
     return 0;
 }
 
-static int mk_http_range_set(struct mk_http_request *sr, size_t file_size,
-                             struct mk_server *server)
-{
-    struct response_headers *sh = &sr->headers;
-    struct mk_stream_input *in;
-
-    in = &sr->in_file;
-    in->bytes_total  = file_size;
-    in->bytes_offset = 0;
-
-    if (server->resume == MK_TRUE && sr->range.data) {
-        /* yyy- */
-        if (sh->ranges[0] >= 0 && sh->ranges[1] == -1) {
-            in->bytes_offset = sh->ranges[0];
-            in->bytes_total = file_size - in->bytes_offset;
-        }
-
-        /* yyy-xxx */
-        if (sh->ranges[0] >= 0 && sh->ranges[1] >= 0) {
-            in->bytes_offset = sh->ranges[0];
-            in->bytes_total  = labs(sh->ranges[1] - sh->ranges[0]) + 1;
-        }
-
-        /* -xxx */
-        if (sh->ranges[0] == -1 && sh->ranges[1] > 0) {
-            in->bytes_total = sh->ranges[1];
-            in->bytes_offset = file_size - sh->ranges[1];
-        }
-
-        if ((size_t) in->bytes_offset >= file_size ||
-            in->bytes_total > file_size) {
-            return -1;
-        }
-
-        lseek(in->fd, in->bytes_offset, SEEK_SET);
-    }
-    return 0;
-}
-
-static int mk_http_range_parse(struct mk_http_request *sr)
-{
-    int eq_pos, sep_pos, len;
-    char *buffer = 0;
-    struct response_headers *sh;
-
-    if (!sr->range.data)
-        return -1;
-
-    if ((eq_pos = mk_string_char_search(sr->range.data, '=', sr->range.len)) < 0)
-        return -1;
-
-    if (strncasecmp(sr->range.data, "Bytes", eq_pos) != 0)
-        return -1;
-
-    if ((sep_pos = mk_string_char_search(sr->range.data, '-', sr->range.len)) < 0)
-        return -1;
-
-    len = sr->range.len;
-    sh = &sr->headers;
-
-    /* =-xxx */
-    if (eq_pos + 1 == sep_pos) {
-        sh->ranges[0] = -1;
-        sh->ranges[1] = (unsigned long) atol(sr->range.data + sep_pos + 1);
-
-        if (sh->ranges[1] <= 0) {
-            return -1;
-        }
-
-        sh->content_length = sh->ranges[1];
-        return 0;
-    }
-
-    /* =yyy-xxx */
-    if ((eq_pos + 1 != sep_pos) && (len > sep_pos + 1)) {
-        buffer = mk_string_copy_substr(sr->range.data, eq_pos + 1, sep_pos);
-        sh->ranges[0] = (unsigned long) atol(buffer);
-        mk_mem_free(buffer);
-
-        buffer = mk_string_copy_substr(sr->range.data, sep_pos + 1, len);
-        sh->ranges[1] = (unsigned long) atol(buffer);
-        mk_mem_free(buffer);
-
-        if (sh->ranges[1] < 0 || (sh->ranges[0] > sh->ranges[1])) {
-            return -1;
-        }
-
-        sh->content_length = abs(sh->ranges[1] - sh->ranges[0]) + 1;
-        return 0;
-    }
-    /* =yyy- */
-    if ((eq_pos + 1 != sep_pos) && (len == sep_pos + 1)) {
-        buffer = mk_string_copy_substr(sr->range.data, eq_pos + 1, len);
-        sr->headers.ranges[0] = (unsigned long) atol(buffer);
-        mk_mem_free(buffer);
-
-        sh->content_length = (sh->content_length - sh->ranges[0]);
-        return 0;
-    }
-
-    return -1;
-}
-
 static int mk_http_directory_redirect_check(struct mk_http_session *cs,
                                             struct mk_http_request *sr,
                                             struct mk_server *server)
@@ -625,6 +529,155 @@ static inline void mk_http_cb_file_on_consume(struct mk_stream_input *in,
 }
 #endif
 
+/* Check if the Accept-Encoding value allows gzip (not listed as q=0) */
+static int mk_http_accept_gzip(mk_ptr_t *value)
+{
+    int len;
+    char *p;
+    char *end;
+    char *token;
+
+    p = value->data;
+    end = value->data + value->len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        token = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ') {
+            p++;
+        }
+        len = p - token;
+
+        if ((len == 4 && strncasecmp(token, "gzip", 4) == 0) ||
+            (len == 6 && strncasecmp(token, "x-gzip", 6) == 0)) {
+            /* Parameters: 'q=0', 'q=0.0' and so on disable the coding */
+            while (p < end && *p != ',') {
+                if (*p == '=' && p > token && (p[-1] == 'q' || p[-1] == 'Q')) {
+                    p++;
+                    if (p < end && *p == '0') {
+                        p++;
+                        while (p < end && (*p == '.' || *p == '0')) {
+                            p++;
+                        }
+                        if (p == end || *p == ',' || *p == ' ' || *p == ';') {
+                            return MK_FALSE;
+                        }
+                    }
+                    continue;
+                }
+                p++;
+            }
+            return MK_TRUE;
+        }
+
+        while (p < end && *p != ',') {
+            p++;
+        }
+    }
+
+    return MK_FALSE;
+}
+
+/* Switch the request to the precompressed 'file.gz' sibling if it exists */
+static int mk_http_gzip_static(struct mk_http_request *sr,
+                               struct mk_server *server)
+{
+    int len;
+    char path[MK_MAX_PATH];
+
+    if (sr->file_cache &&
+        sr->file_cache->gzip_static == MK_FILE_CACHE_GZ_MISSING) {
+        return -1;
+    }
+
+    len = sr->real_path.len + 3;
+    if (len >= MK_MAX_PATH) {
+        return -1;
+    }
+    memcpy(path, sr->real_path.data, sr->real_path.len);
+    memcpy(path + sr->real_path.len, ".gz", 4);
+
+    if (mk_file_cache_sibling(sr, path, len, server) != 0) {
+        return -1;
+    }
+
+    if (sr->real_path.data == sr->real_path_static && len < MK_PATH_BASE) {
+        memcpy(sr->real_path_static, path, len + 1);
+    }
+    else {
+        if (sr->real_path.data != sr->real_path_static) {
+            mk_ptr_free(&sr->real_path);
+        }
+        sr->real_path.data = mk_string_dup(path);
+    }
+    sr->real_path.len = len;
+
+    return 0;
+}
+
+/*
+ * Content negotiation on Accept-Encoding: serve file.gz if present or a gzip
+ * copy of text resources compressed on the fly.
+ */
+static void mk_http_encoding(struct mk_http_session *cs,
+                             struct mk_http_request *sr,
+                             struct mk_server *server)
+{
+    struct mk_http_header *header;
+    struct mk_file_cache_entry *entry = sr->file_cache;
+
+    if (server->gzip_static == MK_FALSE && server->gzip_compress == MK_FALSE) {
+        return;
+    }
+
+    if (sr->method != MK_METHOD_GET && sr->method != MK_METHOD_HEAD) {
+        return;
+    }
+
+    header = &cs->parser.headers[MK_HEADER_ACCEPT_ENCODING];
+    if (!header->val.data || sr->range.data ||
+        mk_http_accept_gzip(&header->val) == MK_FALSE) {
+        /* Identity, but let caches know a gzip version exists */
+        if (entry && (entry->gzip_static == MK_FILE_CACHE_GZ_FOUND ||
+                      entry->gzip)) {
+            sr->headers.vary_encoding = MK_TRUE;
+        }
+        return;
+    }
+
+    if (server->gzip_static == MK_TRUE && mk_http_gzip_static(sr, server) == 0) {
+        mk_ptr_set(&sr->headers.content_encoding, "gzip\r\n");
+        sr->headers.vary_encoding = MK_TRUE;
+        return;
+    }
+
+    if (server->gzip_compress == MK_TRUE && mk_file_cache_gzip(sr, server) == 0) {
+        mk_ptr_set(&sr->headers.content_encoding, "gzip\r\n");
+        sr->headers.vary_encoding = MK_TRUE;
+        sr->file_cache_gzip = MK_TRUE;
+    }
+}
+
+#ifdef MK_HAVE_HTTP2
+/* Library callbacks write to the socket by their own, they cannot run on HTTP/2 */
+static int mk_http_lib_handlers(struct mk_vhost *host)
+{
+    struct mk_list *head;
+    struct mk_vhost_handler *h_handler;
+
+    mk_list_foreach(head, &host->handlers) {
+        h_handler = mk_list_entry(head, struct mk_vhost_handler, _head);
+        if (h_handler->cb) {
+            return MK_TRUE;
+        }
+    }
+
+    return MK_FALSE;
+}
+#endif
+
 int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
                  struct mk_server *server)
 {
@@ -680,7 +733,14 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
 
     /* Check if this is related to a protocol upgrade */
 #ifdef MK_HAVE_HTTP2
-    if (cs->parser.header_connection & MK_HTTP_PARSER_CONN_UPGRADE) {
+    /*
+     * Requests with a body are not upgraded: the request would need to be
+     * completed before the switch. Library handlers are not served over
+     * HTTP/2, virtual hosts having them stay on HTTP/1.1.
+     */
+    if ((cs->parser.header_connection & MK_HTTP_PARSER_CONN_UPGRADE) &&
+        !cs->h2_stream && !sr->_content_length.data &&
+        mk_http_lib_handlers(sr->host_conf) == MK_FALSE) {
         /* HTTP/2.0 upgrade ? */
         if (cs->parser.header_connection & MK_HTTP_PARSER_CONN_HTTP2_SE) {
             MK_TRACE("Connection Upgrade request: HTTP/2.0");
@@ -720,7 +780,7 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
         sr->_content_length.len = 0;
     }
 
-    ret_file = mk_file_get_info(sr->real_path.data, &sr->file_info, MK_FILE_READ);
+    ret_file = mk_file_cache_stat(sr, server);
 
     /* Manually set the headers input streams */
     sr->in_headers.type        = MK_STREAM_IOV;
@@ -730,6 +790,11 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
     sr->in_headers.stream      = &sr->stream;
     mk_list_add(&sr->in_headers._head, &sr->stream.inputs);
 
+    /* Internal metrics endpoint */
+    if (server->metrics == MK_TRUE && mk_metrics_match(sr, server)) {
+        return mk_metrics_http(cs, sr, server);
+    }
+
     /* Plugin Stage 30: look for handlers for this request */
     if (sr->stage30_blocked == MK_FALSE) {
         sr->uri_processed.data[sr->uri_processed.len] = '\0';
@@ -743,6 +808,11 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
             }
 
             if (h_handler->cb) {
+                /* the handler writes to the socket by its own */
+                if (cs->h2_stream) {
+                    return MK_EXIT_REFUSED;
+                }
+
                 /* Create coroutine/thread context */
                 sr->headers.content_length = 0;
                 mth = mk_http_thread_create(MK_HTTP_THREAD_LIB,
@@ -766,12 +836,20 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
                 ret = plugin->stage->stage30(plugin, cs, sr,
                                              h_handler->n_params,
                                              &h_handler->params);
-                mk_header_prepare(cs, sr, server);
+
+                /*
+                 * A handler that did not set a status yet will prepare the
+                 * response headers by itself once it knows them.
+                 */
+                if (ret == MK_PLUGIN_RET_CONTINUE && sr->headers.status > 0) {
+                    mk_header_prepare(cs, sr, server);
+                }
             }
 
             MK_TRACE("[FD %i] STAGE_30 returned %i", cs->socket, ret);
             switch (ret) {
             case MK_PLUGIN_RET_CONTINUE:
+                sr->stage30_active = MK_TRUE;
                 /* FIXME: PLUGINS DISABLED
                 if ((plugin->flags & MK_PLUGIN_THREAD) &&
                     plugin->stage->stage30_thread) {
@@ -834,8 +912,7 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
             }
             sr->real_path.len  = index_length;
 
-            ret = mk_file_get_info(sr->real_path.data,
-                                   &sr->file_info, MK_FILE_READ);
+            ret = mk_file_cache_stat(sr, server);
             if (ret != 0) {
                 return mk_http_error(MK_CLIENT_FORBIDDEN, cs, sr, server);
             }
@@ -888,6 +965,7 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
             MK_TRACE("[FD %i] STAGE_30 returned %i", cs->socket, ret);
             switch (ret) {
             case MK_PLUGIN_RET_CONTINUE:
+                sr->stage30_active = MK_TRUE;
                 return MK_PLUGIN_RET_CONTINUE;
             case MK_PLUGIN_RET_CLOSE_CONX:
                 if (sr->headers.status > 0) {
@@ -946,9 +1024,14 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
     }
 
     /* Matching MimeType  */
-    mime = mk_mimetype_find(server, &sr->real_path);
-    if (!mime) {
-        mime = server->mimetype_default;
+    if (sr->file_cache) {
+        mime = sr->file_cache->mime;
+    }
+    else {
+        mime = mk_mimetype_find(server, &sr->real_path);
+        if (!mime) {
+            mime = server->mimetype_default;
+        }
     }
 
     if (sr->file_info.is_directory == MK_TRUE) {
@@ -960,13 +1043,35 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
         return mk_http_error(MK_CLIENT_NOT_FOUND, cs, sr, server);
     }
 
+    /* Content-Encoding */
+    mk_http_encoding(cs, sr, server);
+
     /* Configure some headers */
     sr->headers.last_modified = sr->file_info.last_modification;
-    sr->headers.etag_len = snprintf(sr->headers.etag_buf,
-                                    MK_HEADER_ETAG_SIZE,
-                                    "ETag: \"%x-%zx\"\r\n",
-                                    (unsigned int) sr->file_info.last_modification,
-                                    sr->file_info.size);
+    if (sr->file_cache) {
+        if (sr->file_cache_gzip == MK_TRUE) {
+            memcpy(sr->headers.etag_buf, sr->file_cache->gzip_etag,
+                   sr->file_cache->gzip_etag_len);
+            sr->headers.etag_len = sr->file_cache->gzip_etag_len;
+        }
+        else {
+            memcpy(sr->headers.etag_buf, sr->file_cache->etag,
+                   sr->file_cache->etag_len);
+            sr->headers.etag_len = sr->file_cache->etag_len;
+        }
+
+        if (sr->file_cache->last_modified_len > 0) {
+            sr->headers.last_modified_str.data = sr->file_cache->last_modified;
+            sr->headers.last_modified_str.len = sr->file_cache->last_modified_len;
+        }
+    }
+    else {
+        sr->headers.etag_len = snprintf(sr->headers.etag_buf,
+                                        MK_HEADER_ETAG_SIZE,
+                                        "ETag: \"%x-%zx\"\r\n",
+                                        (unsigned int) sr->file_info.last_modification,
+                                        sr->file_info.size);
+    }
 
     if (sr->if_modified_since.data && sr->method == MK_METHOD_GET) {
         time_t date_client;       /* Date sent by client */
@@ -986,10 +1091,13 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
     /* Object size for log and response headers */
     sr->headers.content_length = sr->file_info.size;
     sr->headers.real_length = sr->file_info.size;
+    if (sr->file_cache_gzip == MK_TRUE) {
+        sr->headers.content_length = sr->file_cache->gzip_len;
+    }
 
     /* Open file */
     if (mk_likely(sr->file_info.size > 0)) {
-        sr->file_fd = mk_vhost_open(sr, server);
+        sr->file_fd = mk_file_cache_open(sr, server);
         if (sr->file_fd == -1) {
             MK_TRACE("open() failed");
             return mk_http_error(MK_CLIENT_FORBIDDEN, cs, sr, server);
@@ -1005,23 +1113,18 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
         if (mime) {
             sr->headers.content_type = mime->header_type;
         }
+        if (sr->file_cache && sr->headers.content_encoding.len == 0) {
+            sr->headers.file_headers = sr->file_cache->headers;
+        }
 
         /* HTTP Ranges */
         if (sr->range.data != NULL && server->resume == MK_TRUE) {
-            if (mk_http_range_parse(sr) < 0) {
-                sr->headers.ranges[0] = -1;
-                sr->headers.ranges[1] = -1;
+            ret = mk_http_range_set(sr, sr->file_info.size);
+            if (ret == MK_HTTP_RANGE_ERROR) {
                 return mk_http_error(MK_CLIENT_BAD_REQUEST, cs, sr, server);
             }
-            if (sr->headers.ranges[0] >= 0 || sr->headers.ranges[1] >= 0) {
-                mk_header_set_http_status(sr, MK_HTTP_PARTIAL);
-            }
-
-            /* Calc bytes to send & offset */
-            if (mk_http_range_set(sr, sr->file_info.size, server) != 0) {
+            else if (ret == MK_HTTP_RANGE_UNSATISFIABLE) {
                 sr->headers.content_length = -1;
-                sr->headers.ranges[0] = -1;
-                sr->headers.ranges[1] = -1;
                 return mk_http_error(MK_CLIENT_REQUESTED_RANGE_NOT_SATISF,
                                      cs, sr, server);
             }
@@ -1039,6 +1142,17 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
     }
     /* Send file content */
     if (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_POST) {
+        /* Multiple ranges: multipart/byteranges body */
+        if (sr->multirange) {
+            mk_http_range_stream(sr);
+            return MK_EXIT_OK;
+        }
+
+        /* Small cached files go out in the same writev(2) as the headers */
+        if (mk_file_cache_send(sr) == 0) {
+            return MK_EXIT_OK;
+        }
+
         /* Note: bytes and offsets are set after the Range check */
         sr->in_file.type = MK_STREAM_FILE;
         mk_stream_append(&sr->in_file, &sr->stream);
@@ -1107,9 +1221,135 @@ int mk_http_keepalive_check(struct mk_http_session *cs,
     return 0;
 }
 
+/*
+ * Parse a request starting at the session buffer offset, on success the
+ * offset moves after it. Requests are parsed in place so the pointers of
+ * the ones already processed remain valid.
+ */
+static inline int mk_http_request_parse(struct mk_http_session *cs,
+                                        struct mk_http_request *sr,
+                                        struct mk_server *server)
+{
+    int status;
+    unsigned int end;
+    uint64_t start = 0;
+
+    if (server->metrics == MK_TRUE) {
+        start = mk_metrics_now();
+    }
+
+    cs->processing = MK_TRUE;
+    status = mk_http_parser(sr, &cs->parser, cs->body + cs->body_offset,
+                            cs->body_length - cs->body_offset, server);
+    cs->processing = MK_FALSE;
+
+    if (status == MK_HTTP_PARSER_OK) {
+        end = cs->body_offset + cs->parser.i + 1;
+        cs->body_offset = (end < cs->body_length) ? end : cs->body_length;
+
+        if (start > 0) {
+            mk_metrics_request_parsed(sr, start);
+        }
+    }
+
+    return status;
+}
+
+/*
+ * Process a parsed request and, for pipelined clients, the complete requests
+ * that follow it in the buffer. Their responses are queued on the channel
+ * behind the previous ones so they can be flushed together.
+ *
+ * Batching stops when a request is handled by a plugin or a thread (its
+ * response is produced later), when the connection must be closed or when
+ * the next request is still incomplete.
+ */
+static int mk_http_request_batch(struct mk_http_session *cs,
+                                 struct mk_http_request *sr,
+                                 struct mk_server *server)
+{
+    int ret;
+    int status;
+    struct mk_http_request *next;
+
+    while (1) {
+        cs->processing = MK_TRUE;
+        ret = mk_http_request_prepare(cs, sr, server);
+        cs->processing = MK_FALSE;
+
+        if (ret == MK_EXIT_ABORT) {
+            return ret;
+        }
+
+        if (cs->close_now == MK_TRUE || sr->stage30_handler || sr->thread ||
+            cs->body_offset >= cs->body_length ||
+            cs->counter_connections + 1 >= server->max_keep_alive_request) {
+            break;
+        }
+
+        next = mk_mem_alloc_z(sizeof(struct mk_http_request));
+        if (!next) {
+            break;
+        }
+        mk_http_request_init(cs, next, server);
+        mk_http_parser_init(&cs->parser);
+
+        status = mk_http_request_parse(cs, next, server);
+        if (status == MK_HTTP_PARSER_PENDING) {
+            /* It will be parsed again once the batch is done */
+            mk_http_request_free(next, server);
+            mk_mem_free(next);
+            break;
+        }
+
+        mk_list_add(&next->_head, &cs->request_list);
+        cs->counter_connections++;
+
+        if (status == MK_HTTP_PARSER_ERROR) {
+            /* The parser may have queued an error response */
+            cs->close_now = MK_TRUE;
+            break;
+        }
+        sr = next;
+    }
+
+    return ret;
+}
+
+/*
+ * Serve a request whose text was placed in the session buffer by another
+ * protocol handler, as HTTP/2 streams do: it's parsed and processed like
+ * any other request but it's reported with the given protocol version. The
+ * response is queued on the session channel.
+ */
+int mk_http_request_serve(struct mk_http_session *cs,
+                          struct mk_http_request *sr,
+                          int protocol, struct mk_server *server)
+{
+    int ret;
+    int status;
+
+    status = mk_http_request_parse(cs, sr, server);
+    if (status != MK_HTTP_PARSER_OK) {
+        return MK_EXIT_ERROR;
+    }
+
+    sr->protocol = protocol;
+    if (protocol == MK_HTTP_PROTOCOL_20) {
+        sr->protocol_p = mk_http_protocol_20_p;
+    }
+
+    cs->processing = MK_TRUE;
+    ret = mk_http_request_prepare(cs, sr, server);
+    cs->processing = MK_FALSE;
+
+    return ret;
+}
+
 static inline void mk_http_request_ka_next(struct mk_http_session *cs)
 {
     cs->body_length = 0;
+    cs->body_offset = 0;
     cs->counter_connections++;
 
     /* Update data for scheduler */
@@ -1124,7 +1364,7 @@ int mk_http_request_end(struct mk_http_session *cs, struct mk_server *server)
 {
     int ret;
     int status;
-    int len;
+    unsigned int len;
     struct mk_http_request *sr = NULL;
 
     if (server->max_keep_alive_request <= cs->counter_connections) {
@@ -1132,26 +1372,25 @@ int mk_http_request_end(struct mk_http_session *cs, struct mk_server *server)
         goto shutdown;
     }
 
+    if (cs->close_now == MK_TRUE) {
+        goto shutdown;
+    }
+
     /* Check if we have some enqueued pipeline requests */
-    ret = mk_http_parser_more(&cs->parser, cs->body_length);
-    if (ret == MK_TRUE) {
+    if (cs->body_offset < cs->body_length) {
         /* Our pipeline request limit is the same that our keepalive limit */
         cs->counter_connections++;
-        len = (cs->body_length - cs->parser.i) -1;
-        memmove(cs->body,
-                cs->body + cs->parser.i + 1,
-                len);
-        cs->body_length = len;
 
         /* Prepare for next one */
-        sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
-        mk_http_request_free(sr, server);
+        mk_http_request_free_list(cs, server);
+        sr = &cs->sr_fixed;
+        mk_list_add(&sr->_head, &cs->request_list);
         mk_http_request_init(cs, sr, server);
         mk_http_parser_init(&cs->parser);
-        status = mk_http_parser(sr, &cs->parser, cs->body, cs->body_length,
-                                server);
+
+        status = mk_http_request_parse(cs, sr, server);
         if (status == MK_HTTP_PARSER_OK) {
-            ret = mk_http_request_prepare(cs, sr, server);
+            ret = mk_http_request_batch(cs, sr, server);
             if (ret == MK_EXIT_ABORT) {
                 return -1;
             }
@@ -1163,6 +1402,17 @@ int mk_http_request_end(struct mk_http_session *cs, struct mk_server *server)
             return 1;
         }
         else if (status == MK_HTTP_PARSER_PENDING) {
+            /*
+             * Incomplete request: move it to the beginning of the buffer so
+             * the next read has room for the rest, it will be parsed again.
+             */
+            len = cs->body_length - cs->body_offset;
+            memmove(cs->body, cs->body + cs->body_offset, len);
+            mk_http_request_free_list(cs, server);
+            mk_http_request_ka_next(cs);
+            cs->body_length = len;
+            mk_sched_conn_timeout_add(cs->conn, mk_sched_get_thread_conf(),
+                                      MK_SCHED_TIMEOUT_READ);
             return 0;
         }
         else if (status == MK_HTTP_PARSER_ERROR) {
@@ -1184,7 +1434,8 @@ int mk_http_request_end(struct mk_http_session *cs, struct mk_server *server)
     else {
         mk_http_request_free_list(cs, server);
         mk_http_request_ka_next(cs);
-        mk_sched_conn_timeout_add(cs->conn, mk_sched_get_thread_conf());
+        mk_sched_conn_timeout_add(cs->conn, mk_sched_get_thread_conf(),
+                                  MK_SCHED_TIMEOUT_KEEPALIVE);
         return 0;
     }
 
@@ -1322,6 +1573,9 @@ int mk_http_error(int http_status, struct mk_http_session *cs,
     sr->headers.cgi = SH_NOCGI;
     sr->headers.pconnections_left = 0;
     sr->headers.last_modified = -1;
+    mk_ptr_reset(&sr->headers.file_headers);
+    mk_ptr_reset(&sr->headers.content_encoding);
+    sr->headers.vary_encoding = MK_FALSE;
 
     if (!page.data) {
         mk_ptr_reset(&sr->headers.content_type);
@@ -1348,8 +1602,16 @@ int mk_http_error(int http_status, struct mk_http_session *cs,
         }
     }
 
-    mk_channel_write(cs->channel, &count);
-    mk_http_request_end(cs, server);
+    /*
+     * While the core is parsing or preparing requests the response is just
+     * queued, it's flushed with the others by the scheduler. Plugins calling
+     * from their own events get it written right away, unless a stage30
+     * handler owns the request: it ends it through http_request_end().
+     */
+    if (cs->processing == MK_FALSE && sr->stage30_active == MK_FALSE) {
+        mk_channel_write(cs->channel, &count);
+        mk_http_request_end(cs, server);
+    }
 
     return MK_EXIT_OK;
 }
@@ -1358,6 +1620,22 @@ int mk_http_error(int http_status, struct mk_http_session *cs,
  * From thread mk_sched_worker "list", remove the http_session
  * struct information
  */
+/*
+ * The connection is waiting in keep-alive with no data: release the session
+ * memory, only the number of requests served is kept in the connection.
+ */
+void mk_http_session_idle(struct mk_http_session *cs,
+                          struct mk_sched_conn *conn,
+                          struct mk_sched_worker *sched)
+{
+    if (cs->body != cs->body_fixed) {
+        mk_mem_free(cs->body);
+    }
+
+    conn->requests = cs->counter_connections;
+    mk_sched_conn_extra_detach(conn, sched);
+}
+
 void mk_http_session_remove(struct mk_http_session *cs,
                             struct mk_server *server)
 {
@@ -1409,8 +1687,9 @@ int mk_http_session_init(struct mk_http_session *cs, struct mk_sched_conn *conn,
     /* Alloc memory for node */
     cs->_sched_init = MK_TRUE;
     cs->pipelined = MK_FALSE;
-    cs->counter_connections = 0;
+    cs->counter_connections = conn->requests;
     cs->close_now = MK_FALSE;
+    cs->processing = MK_FALSE;
     cs->socket = conn->event.fd;
     cs->status = MK_REQUEST_STATUS_INCOMPLETE;
     cs->server = server;
@@ -1437,6 +1716,7 @@ int mk_http_session_init(struct mk_http_session *cs, struct mk_sched_conn *conn,
 
     /* Current data length */
     cs->body_length = 0;
+    cs->body_offset = 0;
 
     /* Init session request list */
     mk_list_init(&cs->request_list);
@@ -1450,8 +1730,8 @@ int mk_http_session_init(struct mk_http_session *cs, struct mk_sched_conn *conn,
 
 void mk_http_request_free(struct mk_http_request *sr, struct mk_server *server)
 {
-    /* Let the vhost interface to handle the session close */
-    mk_vhost_close(sr, server);
+    /* Release the file descriptor or the open file cache entry */
+    mk_file_cache_close(sr, server);
 
     if (sr->headers.location) {
         mk_mem_free(sr->headers.location);
@@ -1468,6 +1748,9 @@ void mk_http_request_free(struct mk_http_request *sr, struct mk_server *server)
     if (sr->stream.channel) {
         mk_stream_release(&sr->stream);
     }
+
+    /* multipart/byteranges inputs are gone with the stream */
+    mk_http_range_free(sr);
 }
 
 void mk_http_request_free_list(struct mk_http_session *cs,
@@ -1533,8 +1816,8 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
 {
     int ret;
     int status;
+    int attached = MK_FALSE;
     size_t count;
-    (void) worker;
     struct mk_http_session *cs;
     struct mk_http_request *sr;
 
@@ -1543,6 +1826,15 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
 #endif
 
     cs = mk_http_session_get(conn);
+    if (!cs) {
+        /* Idle connection: attach a new session */
+        cs = mk_sched_conn_extra_attach(conn, worker);
+        if (!cs) {
+            return -1;
+        }
+        attached = MK_TRUE;
+    }
+
     if (cs->_sched_init == MK_FALSE) {
         /* Create session for the client */
         MK_TRACE("[FD %i] Create HTTP session", socket);
@@ -1554,6 +1846,11 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
 
     /* Invoke the read handler, on this case we only support HTTP (for now :) */
     ret = mk_http_handler_read(conn, cs, server);
+    if (ret == -1 && errno == EAGAIN && attached == MK_TRUE) {
+        /* Nothing arrived, the connection is still idle */
+        mk_http_session_idle(cs, conn, worker);
+        return ret;
+    }
     if (ret > 0) {
         if (mk_list_is_empty(&cs->request_list) == 0) {
             /* Add the first entry */
@@ -1564,16 +1861,20 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
         else {
             sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
         }
-        status = mk_http_parser(sr, &cs->parser, cs->body,
-                                cs->body_length, server);
+        status = mk_http_request_parse(cs, sr, server);
         if (status == MK_HTTP_PARSER_OK) {
             MK_TRACE("[FD %i] HTTP_PARSER_OK", socket);
             if (mk_http_status_completed(cs, conn) == -1) {
                 mk_http_session_remove(cs, server);
                 return -1;
             }
-            mk_sched_conn_timeout_del(conn);
-            ret = mk_http_request_prepare(cs, sr, server);
+            mk_sched_conn_timeout_del(conn, worker);
+            ret = mk_http_request_batch(cs, sr, server);
+
+            /* The response is dispatched by the scheduler write handler */
+            if (ret != MK_EXIT_ABORT && mk_channel_is_empty(cs->channel) != 0) {
+                mk_sched_conn_write_interest(conn, worker, MK_TRUE);
+            }
         }
         else if (status == MK_HTTP_PARSER_ERROR) {
             /* The HTTP parser may enqueued some response error */
@@ -1586,6 +1887,9 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
         }
         else {
             MK_TRACE("[FD %i] HTTP_PARSER_PENDING", socket);
+
+            /* A new request started, the keep-alive wait is over */
+            mk_sched_conn_timeout_add(conn, worker, MK_SCHED_TIMEOUT_READ);
         }
     }
 
@@ -1608,7 +1912,9 @@ int mk_http_sched_close(struct mk_sched_conn *conn,
 
     /* Release resources of the requests and session */
     session = mk_http_session_get(conn);
-    mk_http_session_remove(session, server);
+    if (session) {
+        mk_http_session_remove(session, server);
+    }
     return 0;
 }
 
@@ -1616,16 +1922,49 @@ int mk_http_sched_done(struct mk_sched_conn *conn,
                        struct mk_sched_worker *worker,
                        struct mk_server *server)
 {
-    (void) worker;
+    int ret;
+    int threads = MK_FALSE;
+    struct mk_list *head;
     struct mk_http_session *session;
     struct mk_http_request *sr;
 
     session = mk_http_session_get(conn);
-    sr = mk_list_entry_first(&session->request_list,
-                             struct mk_http_request, _head);
-    mk_plugin_stage_run_40(session, sr, server);
+    if (!session) {
+        return 0;
+    }
 
-    return mk_http_request_end(session, server);
+    /*
+     * The channel can run dry while a stage30 handler still waits for more
+     * response data, the plugin ends the request once it's complete.
+     */
+    mk_list_foreach(head, &session->request_list) {
+        sr = mk_list_entry(head, struct mk_http_request, _head);
+        if (sr->stage30_active == MK_TRUE) {
+            return 0;
+        }
+    }
+
+    /* STAGE_40, every request of the (pipelined) batch has ended */
+    mk_list_foreach(head, &session->request_list) {
+        sr = mk_list_entry(head, struct mk_http_request, _head);
+        mk_plugin_stage_run_40(session, sr, server);
+        if (server->metrics == MK_TRUE) {
+            mk_metrics_request_end(sr);
+        }
+        if (sr->thread) {
+            threads = MK_TRUE;
+        }
+    }
+
+    ret = mk_http_request_end(session, server);
+
+    /* Keep-alive with no data pending: compact the connection */
+    if (ret == 0 && server->keepalive_compact == MK_TRUE &&
+        threads == MK_FALSE && session->body_length == 0) {
+        mk_http_session_idle(session, conn, worker);
+    }
+
+    return ret;
 }
 
 struct mk_sched_handler mk_http_handler = {
@@ -1634,5 +1973,6 @@ struct mk_sched_handler mk_http_handler = {
     .cb_close         = mk_http_sched_close,
     .cb_done          = mk_http_sched_done,
     .sched_extra_size = sizeof(struct mk_http_session),
+    .sched_zero_size  = offsetof(struct mk_http_session, parser),
     .capabilities     = MK_CAP_HTTP
 };
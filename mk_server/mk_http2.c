@@ -19,366 +19,2240 @@
 
 #define _GNU_SOURCE
 
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
 #include <inttypes.h>
+#include <sys/socket.h>
 
+#include <monkey/mk_core.h>
 #include <monkey/mk_http2.h>
 #include <monkey/mk_http2_settings.h>
+#include <monkey/mk_http2_hpack.h>
+#include <monkey/mk_http.h>
 #include <monkey/mk_header.h>
 #include <monkey/mk_scheduler.h>
+#include <monkey/mk_plugin.h>
+#include <monkey/mk_plugin_stage.h>
+#include <monkey/mk_metrics.h>
+#include <monkey/mk_server.h>
 
 /* HTTP/2 Connection Preface */
-#define MK_HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define MK_HTTP2_PREFACE_STR "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
 static mk_ptr_t http2_preface = {
-    .data = MK_HTTP2_PREFACE,
-    .len  = sizeof(MK_HTTP2_PREFACE) - 1
+    .data = MK_HTTP2_PREFACE_STR,
+    .len  = sizeof(MK_HTTP2_PREFACE_STR) - 1
 };
 
-static inline void buffer_consume(struct mk_http2_session *h2s, int bytes)
+/* Response to a HTTP/1.1 request upgraded to h2c (Section 3.2) */
+#define MK_HTTP2_SWITCHING                      \
+    "HTTP/1.1 101 Switching Protocols\r\n"      \
+    "Connection: Upgrade\r\n"                   \
+    "Upgrade: h2c\r\n\r\n"
+
+/* The read buffer never grows beyond a complete frame of the largest size */
+#define MK_HTTP2_BUFFER_MAX  (MK_HTTP2_HEADER_SIZE + MK_HTTP2_FRAME_SIZE)
+
+/* Receive windows are extended once half of them was consumed */
+#define MK_HTTP2_WINDOW_THRESHOLD  (MK_HTTP2_WINDOW_SIZE / 2)
+
+/*
+ * A frame queued on the connection channel. The frame bytes follow the
+ * structure, for file DATA frames only the header is stored here and the
+ * payload is the file input queued right after it.
+ */
+struct h2_frame {
+    struct mk_http2_stream *stream;   /* NULL for connection frames */
+    int file;
+    uint8_t data[];
+};
+
+static void h2_stream_release(struct mk_http2_session *h2s,
+                              struct mk_http2_stream *st);
+
+/*
+ * Output
+ * ======
+ */
+
+/* A stream is released once its last frame left the connection channel */
+static inline void h2_stream_check(struct mk_http2_session *h2s,
+                                   struct mk_http2_stream *st)
+{
+    if (h2s->status == MK_HTTP2_CLOSED) {
+        return;
+    }
+
+    if ((st->flags & MK_HTTP2_STREAM_END_LOCAL) && st->out_pending == 0) {
+        h2_stream_release(h2s, st);
+    }
+}
+
+static void cb_frame_finished(struct mk_stream_input *in)
+{
+    struct h2_frame *frame = in->context;
+    struct mk_http2_stream *st = frame->stream;
+
+    mk_mem_free(frame);
+
+    if (st) {
+        st->out_pending--;
+        h2_stream_check(st->h2s, st);
+    }
+}
+
+static void cb_file_finished(struct mk_stream_input *in)
+{
+    struct mk_http2_stream *st = in->context;
+
+    st->out_pending--;
+    h2_stream_check(st->h2s, st);
+}
+
+/* The stream that owns a frame of the connection channel, if any */
+static inline struct mk_http2_stream *h2_input_stream(struct mk_stream_input *in)
+{
+    struct h2_frame *frame;
+
+    if (in->cb_finished == cb_frame_finished) {
+        frame = in->context;
+        return frame->stream;
+    }
+    else if (in->cb_finished == cb_file_finished) {
+        return in->context;
+    }
+
+    return NULL;
+}
+
+static inline struct h2_frame *h2_frame_new(size_t length)
+{
+    struct h2_frame *frame;
+
+    frame = mk_mem_alloc(sizeof(struct h2_frame) +
+                         MK_HTTP2_HEADER_SIZE + length);
+    if (!frame) {
+        return NULL;
+    }
+    frame->stream = NULL;
+    frame->file = MK_FALSE;
+
+    return frame;
+}
+
+/* Queue a frame on the connection channel, it's released once written */
+static int h2_frame_queue(struct mk_http2_session *h2s,
+                          struct mk_http2_stream *st,
+                          struct h2_frame *frame, size_t size)
+{
+    int ret;
+    struct mk_stream_input *in;
+
+    ret = mk_stream_in_raw(&h2s->stream_out, NULL, (char *) frame->data, size,
+                           NULL, cb_frame_finished);
+    if (ret != 0) {
+        mk_mem_free(frame);
+        return -1;
+    }
+
+    in = mk_list_entry_last(&h2s->stream_out.inputs,
+                            struct mk_stream_input, _head);
+    in->context = frame;
+    frame->stream = st;
+    if (st) {
+        st->out_pending++;
+    }
+
+    return 0;
+}
+
+/* Queue a frame, the payload is copied */
+static int h2_send(struct mk_http2_session *h2s, struct mk_http2_stream *st,
+                   uint8_t type, uint8_t flags, uint32_t stream_id,
+                   const void *payload, size_t length)
+{
+    struct h2_frame *frame;
+
+    frame = h2_frame_new(length);
+    if (!frame) {
+        return -1;
+    }
+
+    mk_http2_frame_encode_header(frame->data, length, type, flags, stream_id);
+    if (length > 0) {
+        memcpy(frame->data + MK_HTTP2_HEADER_SIZE, payload, length);
+    }
+
+    return h2_frame_queue(h2s, st, frame, MK_HTTP2_HEADER_SIZE + length);
+}
+
+/* Queue constant data, no release required */
+static inline int h2_send_static(struct mk_http2_session *h2s,
+                                 const char *buf, size_t length)
+{
+    return mk_stream_in_raw(&h2s->stream_out, NULL, (char *) buf, length,
+                            NULL, NULL);
+}
+
+static int h2_send_rst(struct mk_http2_session *h2s, uint32_t stream_id,
+                       uint32_t error)
+{
+    uint8_t payload[4];
+
+    mk_http2_bitenc_32u(payload, error);
+    return h2_send(h2s, NULL, MK_HTTP2_RST_STREAM, 0, stream_id, payload, 4);
+}
+
+static int h2_send_window_update(struct mk_http2_session *h2s,
+                                 uint32_t stream_id, uint32_t increment)
+{
+    uint8_t payload[4];
+
+    mk_http2_bitenc_32u(payload, increment);
+    return h2_send(h2s, NULL, MK_HTTP2_WINDOW_UPDATE, 0, stream_id,
+                   payload, 4);
+}
+
+/*
+ * Connection error (Section 5.4.1): let the client know the last stream we
+ * processed and close the connection once the GOAWAY frame is written.
+ */
+static void h2_goaway(struct mk_http2_session *h2s, uint32_t error)
+{
+    uint8_t payload[8];
+
+    if (h2s->status == MK_HTTP2_CLOSING) {
+        return;
+    }
+
+    MK_H2_TRACE(h2s->conn, "GOAWAY error=%" PRIu32, error);
+
+    mk_http2_bitenc_32u(payload, h2s->last_stream_id);
+    mk_http2_bitenc_32u(payload + 4, error);
+    h2_send(h2s, NULL, MK_HTTP2_GOAWAY, 0, 0, payload, 8);
+    h2s->status = MK_HTTP2_CLOSING;
+}
+
+/*
+ * Drop the frames of a stream that were not written yet. The first input of
+ * the channel may be partially written so it's kept, together with the file
+ * payload that follows it when it's a DATA frame header.
+ */
+static void h2_stream_purge(struct mk_http2_session *h2s,
+                            struct mk_http2_stream *st)
+{
+    int n = 0;
+    int keep = 1;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct h2_frame *frame;
+    struct mk_stream_input *in;
+
+    mk_list_foreach_safe(head, tmp, &h2s->stream_out.inputs) {
+        in = mk_list_entry(head, struct mk_stream_input, _head);
+        if (n++ < keep) {
+            if (in->cb_finished == cb_frame_finished) {
+                frame = in->context;
+                if (frame->file == MK_TRUE) {
+                    keep = 2;
+                }
+            }
+            continue;
+        }
+
+        if (h2_input_stream(in) == st) {
+            mk_stream_in_release(in);
+        }
+    }
+}
+
+/* Stream error (Section 5.4.2) */
+static void h2_stream_reset(struct mk_http2_session *h2s,
+                            struct mk_http2_stream *st, uint32_t error)
+{
+    if (!(st->flags & MK_HTTP2_STREAM_RESET)) {
+        MK_H2_TRACE(h2s->conn, "RST_STREAM id=%" PRIu32 " error=%" PRIu32,
+                    st->id, error);
+        h2_send_rst(h2s, st->id, error);
+    }
+    st->flags |= (MK_HTTP2_STREAM_RESET | MK_HTTP2_STREAM_END_LOCAL);
+
+    /* hold the stream while its frames are released */
+    st->out_pending++;
+    h2_stream_purge(h2s, st);
+    st->out_pending--;
+
+    h2_stream_check(h2s, st);
+}
+
+/*
+ * Streams
+ * =======
+ */
+
+static struct mk_http2_stream *h2_stream_get(struct mk_http2_session *h2s,
+                                             uint32_t id)
+{
+    struct mk_list *head;
+    struct mk_http2_stream *st;
+
+    mk_list_foreach(head, &h2s->streams) {
+        st = mk_list_entry(head, struct mk_http2_stream, _head);
+        if (st->id == id) {
+            return st;
+        }
+    }
+
+    return NULL;
+}
+
+static struct mk_http2_stream *h2_stream_create(struct mk_http2_session *h2s,
+                                                uint32_t id)
+{
+    struct mk_channel *channel;
+    struct mk_http_session *cs;
+    struct mk_http2_stream *st;
+
+    st = mk_mem_alloc_z(sizeof(struct mk_http2_stream));
+    if (!st) {
+        return NULL;
+    }
+
+    st->id = id;
+    st->h2s = h2s;
+    st->window = h2s->settings.initial_window_size;
+    st->recv_window = MK_HTTP2_WINDOW_SIZE;
+    st->urgency = MK_HTTP2_URGENCY_DEFAULT;
+    st->content_length = -1;
+
+    /* The response is collected here, it never reach the socket directly */
+    channel = &st->channel;
+    channel->type = MK_CHANNEL_SOCKET;
+    channel->fd = h2s->conn->event.fd;
+    channel->status = MK_CHANNEL_OK;
+    channel->event = &h2s->conn->event;
+    channel->io = h2s->conn->net;
+    channel->net_data = h2s->conn->channel.net_data;
+    mk_list_init(&channel->streams);
+
+    cs = &st->session;
+    mk_http_session_init(cs, h2s->conn, h2s->server);
+    cs->channel = channel;
+    cs->h2_stream = st;
+
+    mk_list_add(&st->_head, &h2s->streams);
+    h2s->streams_active++;
+
+    return st;
+}
+
+static void h2_stream_release(struct mk_http2_session *h2s,
+                              struct mk_http2_stream *st)
+{
+    struct mk_list *head;
+    struct mk_http_request *sr;
+    struct mk_http_session *cs = &st->session;
+    struct mk_server *server = h2s->server;
+
+    MK_H2_TRACE(h2s->conn, "release stream id=%" PRIu32, st->id);
+
+    /* Unsent inputs may belong to the request or to a handler context */
+    mk_channel_clean(&st->channel);
+
+    /*
+     * A complete response ends the request as a keep-alive one does, an
+     * aborted one lets the handlers hang up as a closed connection does.
+     */
+    if ((st->flags & MK_HTTP2_STREAM_SERVED) &&
+        !(st->flags & MK_HTTP2_STREAM_RESET)) {
+        mk_list_foreach(head, &cs->request_list) {
+            sr = mk_list_entry(head, struct mk_http_request, _head);
+            mk_plugin_stage_run_40(cs, sr, server);
+            if (server->metrics == MK_TRUE) {
+                mk_metrics_request_end(sr);
+            }
+        }
+        mk_http_request_free_list(cs, server);
+    }
+
+    mk_http_session_remove(cs, server);
+
+    mk_list_del(&st->_head);
+    h2s->streams_active--;
+
+    if (st->pseudo) {
+        mk_mem_free(st->pseudo);
+    }
+    mk_mem_free(st);
+}
+
+/* Make room for 'size' bytes of request data in the stream session buffer */
+static int h2_stream_reserve(struct mk_http2_stream *st, size_t size)
+{
+    char *tmp;
+    size_t new_size;
+    struct mk_http_session *cs = &st->session;
+
+    if (size <= cs->body_size) {
+        return 0;
+    }
+
+    if (size > (size_t) st->h2s->server->max_request_size) {
+        return -1;
+    }
+
+    new_size = ((size / MK_REQUEST_CHUNK) + 1) * MK_REQUEST_CHUNK;
+    if (cs->body == cs->body_fixed) {
+        tmp = mk_mem_alloc(new_size + 1);
+        if (tmp) {
+            memcpy(tmp, cs->body, cs->body_length);
+        }
+    }
+    else {
+        tmp = mk_mem_realloc(cs->body, new_size + 1);
+    }
+
+    if (!tmp) {
+        return -1;
+    }
+
+    cs->body = tmp;
+    cs->body_size = new_size;
+    return 0;
+}
+
+static int h2_stream_write(struct mk_http2_stream *st,
+                           const char *data, size_t length)
+{
+    struct mk_http_session *cs = &st->session;
+
+    if (h2_stream_reserve(st, cs->body_length + length) != 0) {
+        return -1;
+    }
+
+    memcpy(cs->body + cs->body_length, data, length);
+    cs->body_length += length;
+
+    return 0;
+}
+
+/* Store a pseudo-header value or a cookie crumb */
+static int h2_stream_pseudo(struct mk_http2_stream *st,
+                            struct mk_http2_field *field,
+                            const char *value, size_t length)
+{
+    char *tmp;
+    size_t size;
+    size_t need;
+
+    need = st->pseudo_length + length + 2;
+    if (need > st->pseudo_size) {
+        if (need > (size_t) st->h2s->server->max_request_size) {
+            return -1;
+        }
+
+        size = need + 256;
+        tmp = mk_mem_realloc(st->pseudo, size);
+        if (!tmp) {
+            return -1;
+        }
+        st->pseudo = tmp;
+        st->pseudo_size = size;
+    }
+
+    if (field->length > 0) {
+        /* cookie crumbs are joined, they are always the last values */
+        memcpy(st->pseudo + st->pseudo_length, "; ", 2);
+        st->pseudo_length += 2;
+        field->length += 2;
+    }
+    else {
+        field->offset = st->pseudo_length;
+    }
+
+    memcpy(st->pseudo + st->pseudo_length, value, length);
+    st->pseudo_length += length;
+    field->length += length;
+
+    return 0;
+}
+
+/*
+ * Priority
+ * ========
+ *
+ * The Extensible Prioritization Scheme (RFC 9218) replaces the dependency
+ * tree of RFC 7540, which we announce not to use: a stream has an urgency
+ * from 0 (highest) to 7 and can be served incrementally, together with the
+ * other incremental streams of the same urgency.
+ */
+static void h2_priority_parse(const char *value, size_t length,
+                              uint8_t *urgency, uint8_t *incremental)
+{
+    size_t len;
+    const char *s;
+    const char *p = value;
+    const char *end = value + length;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+
+        s = p;
+        while (p < end && *p != ',') {
+            p++;
+        }
+
+        len = p - s;
+        while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == '\t')) {
+            len--;
+        }
+
+        if (len == 3 && s[0] == 'u' && s[1] == '=' &&
+            s[2] >= '0' && s[2] <= '0' + MK_HTTP2_URGENCY_MAX) {
+            *urgency = s[2] - '0';
+        }
+        else if ((len == 1 && s[0] == 'i') ||
+                 (len == 4 && memcmp(s, "i=?1", 4) == 0)) {
+            *incremental = MK_TRUE;
+        }
+        else if (len == 4 && memcmp(s, "i=?0", 4) == 0) {
+            *incremental = MK_FALSE;
+        }
+    }
+}
+
+/*
+ * Request headers
+ * ===============
+ */
+
+static inline int h2_name_is(const char *name, size_t len, const char *str)
+{
+    return (len == strlen(str) && memcmp(name, str, len) == 0);
+}
+
+/*
+ * Validate a field of a request header block (Section 8.2) and store it in
+ * the stream: pseudo-headers and cookies apart, any other field as a
+ * HTTP/1.1 header line in the session buffer. A malformed request is reset
+ * once the block is decoded, the HPACK state must be kept in sync.
+ */
+static void h2_header_cb(void *data, char *name, size_t name_len,
+                         char *value, size_t value_len)
+{
+    size_t i;
+    size_t size;
+    int64_t length;
+    char *p;
+    struct mk_http2_field *field;
+    struct mk_http2_stream *st = data;
+    struct mk_http_session *cs = &st->session;
+
+    if (st->error) {
+        return;
+    }
+
+    if (name_len == 0) {
+        st->error = MK_HTTP2_PROTOCOL_ERROR;
+        return;
+    }
+
+    /* characters that would alter the HTTP/1.1 request text */
+    for (i = 0; i < value_len; i++) {
+        if (value[i] == '\r' || value[i] == '\n' || value[i] == '\0') {
+            st->error = MK_HTTP2_PROTOCOL_ERROR;
+            return;
+        }
+    }
+
+    if (name[0] == ':') {
+        if (st->flags & MK_HTTP2_STREAM_FIELDS) {
+            st->error = MK_HTTP2_PROTOCOL_ERROR;
+            return;
+        }
+
+        if (h2_name_is(name, name_len, ":method")) {
+            field = &st->method;
+        }
+        else if (h2_name_is(name, name_len, ":path")) {
+            field = &st->path;
+        }
+        else if (h2_name_is(name, name_len, ":scheme")) {
+            field = &st->scheme;
+        }
+        else if (h2_name_is(name, name_len, ":authority")) {
+            field = &st->authority;
+        }
+        else {
+            st->error = MK_HTTP2_PROTOCOL_ERROR;
+            return;
+        }
+
+        /* duplicated, empty or breaking the request line */
+        if (field->length > 0 || value_len == 0 ||
+            memchr(value, ' ', value_len)) {
+            st->error = MK_HTTP2_PROTOCOL_ERROR;
+            return;
+        }
+
+        if (field == &st->path && value[0] != '/' &&
+            !(value_len == 1 && value[0] == '*')) {
+            st->error = MK_HTTP2_PROTOCOL_ERROR;
+            return;
+        }
+
+        if (h2_stream_pseudo(st, field, value, value_len) != 0) {
+            st->error = MK_HTTP2_CANCEL;
+        }
+        return;
+    }
+
+    st->flags |= MK_HTTP2_STREAM_FIELDS;
+
+    for (i = 0; i < name_len; i++) {
+        if ((name[i] >= 'A' && name[i] <= 'Z') || name[i] <= 0x20 ||
+            name[i] == ':' || (unsigned char) name[i] >= 0x7f) {
+            st->error = MK_HTTP2_PROTOCOL_ERROR;
+            return;
+        }
+    }
+
+    /* Connection-specific header fields are not allowed (Section 8.2.2) */
+    if (h2_name_is(name, name_len, "connection") ||
+        h2_name_is(name, name_len, "keep-alive") ||
+        h2_name_is(name, name_len, "proxy-connection") ||
+        h2_name_is(name, name_len, "transfer-encoding") ||
+        h2_name_is(name, name_len, "upgrade")) {
+        st->error = MK_HTTP2_PROTOCOL_ERROR;
+        return;
+    }
+
+    if (h2_name_is(name, name_len, "te")) {
+        if (!(value_len == 8 && memcmp(value, "trailers", 8) == 0)) {
+            st->error = MK_HTTP2_PROTOCOL_ERROR;
+        }
+        return;
+    }
+
+    if (h2_name_is(name, name_len, "cookie")) {
+        if (h2_stream_pseudo(st, &st->cookie, value, value_len) != 0) {
+            st->error = MK_HTTP2_CANCEL;
+        }
+        return;
+    }
+
+    if (h2_name_is(name, name_len, "host")) {
+        st->has_host = MK_TRUE;
+    }
+    else if (h2_name_is(name, name_len, "content-length")) {
+        length = 0;
+        for (i = 0; i < value_len; i++) {
+            if (value[i] < '0' || value[i] > '9' ||
+                length > (INT64_MAX - 9) / 10) {
+                st->error = MK_HTTP2_PROTOCOL_ERROR;
+                return;
+            }
+            length = (length * 10) + (value[i] - '0');
+        }
+        if (st->content_length >= 0 && st->content_length != length) {
+            st->error = MK_HTTP2_PROTOCOL_ERROR;
+            return;
+        }
+        st->content_length = length;
+    }
+    else if (h2_name_is(name, name_len, "priority")) {
+        h2_priority_parse(value, value_len, &st->urgency, &st->incremental);
+    }
+
+    /* name: value\r\n */
+    size = name_len + value_len + 4;
+    if (h2_stream_reserve(st, cs->body_length + size) != 0) {
+        st->error = MK_HTTP2_CANCEL;
+        return;
+    }
+
+    p = cs->body + cs->body_length;
+    memcpy(p, name, name_len);
+    p += name_len;
+    *p++ = ':';
+    *p++ = ' ';
+    memcpy(p, value, value_len);
+    p += value_len;
+    *p++ = '\r';
+    *p++ = '\n';
+    cs->body_length += size;
+}
+
+/* Fields of blocks we do not process, decoded to keep the HPACK state */
+static void h2_header_discard(void *data, char *name, size_t name_len,
+                              char *value, size_t value_len)
+{
+    (void) data;
+    (void) name;
+    (void) name_len;
+    (void) value;
+    (void) value_len;
+}
+
+static inline char *h2_put(char *p, const char *data, size_t length)
+{
+    memcpy(p, data, length);
+    return p + length;
+}
+
+/*
+ * Turn the received request into HTTP/1.1 text at the beginning of the
+ * session buffer: request line, Host and Cookie headers built from the
+ * pseudo-headers, the header lines, Content-Length if the client did not
+ * send it and finally the body. Returns zero or a stream error code.
+ */
+static int h2_stream_build(struct mk_http2_stream *st)
+{
+    int cl_len = 0;
+    size_t total;
+    size_t prefix;
+    size_t body_length;
+    char *p;
+    char cl[48];
+    struct mk_http_session *cs = &st->session;
+
+    if (st->method.length == 0 || st->path.length == 0 ||
+        st->scheme.length == 0) {
+        return MK_HTTP2_PROTOCOL_ERROR;
+    }
+
+    body_length = cs->body_length - st->headers_length;
+    if (st->content_length >= 0 &&
+        (uint64_t) st->content_length != body_length) {
+        return MK_HTTP2_PROTOCOL_ERROR;
+    }
+
+    /* METHOD path HTTP/1.1\r\n */
+    prefix = st->method.length + st->path.length + 12;
+    if (st->authority.length > 0 && st->has_host == MK_FALSE) {
+        prefix += st->authority.length + 8;
+    }
+    if (st->cookie.length > 0) {
+        prefix += st->cookie.length + 10;
+    }
+
+    if (body_length > 0 && st->content_length < 0) {
+        cl_len = snprintf(cl, sizeof(cl), "Content-Length: %zu\r\n",
+                          body_length);
+    }
+
+    total = prefix + st->headers_length + cl_len + 2 + body_length;
+    if (h2_stream_reserve(st, total) != 0) {
+        return MK_HTTP2_CANCEL;
+    }
+
+    /* body and header lines are moved to their final place */
+    memmove(cs->body + total - body_length,
+            cs->body + st->headers_length, body_length);
+    memmove(cs->body + prefix, cs->body, st->headers_length);
+
+    p = cs->body;
+    p = h2_put(p, st->pseudo + st->method.offset, st->method.length);
+    *p++ = ' ';
+    p = h2_put(p, st->pseudo + st->path.offset, st->path.length);
+    p = h2_put(p, " HTTP/1.1\r\n", 11);
+
+    if (st->authority.length > 0 && st->has_host == MK_FALSE) {
+        p = h2_put(p, "Host: ", 6);
+        p = h2_put(p, st->pseudo + st->authority.offset, st->authority.length);
+        p = h2_put(p, "\r\n", 2);
+    }
+    if (st->cookie.length > 0) {
+        p = h2_put(p, "Cookie: ", 8);
+        p = h2_put(p, st->pseudo + st->cookie.offset, st->cookie.length);
+        p = h2_put(p, "\r\n", 2);
+    }
+
+    p = cs->body + prefix + st->headers_length;
+    p = h2_put(p, cl, cl_len);
+    p = h2_put(p, "\r\n", 2);
+
+    cs->body_length = total;
+    cs->body[cs->body_length] = '\0';
+
+    return 0;
+}
+
+/* Headers that are not worth to be added to the HPACK dynamic table */
+static inline int h2_header_volatile(const char *name, size_t len)
+{
+    return (h2_name_is(name, len, "content-length") ||
+            h2_name_is(name, len, "content-range") ||
+            h2_name_is(name, len, "etag") ||
+            h2_name_is(name, len, "last-modified") ||
+            h2_name_is(name, len, "location") ||
+            h2_name_is(name, len, "set-cookie"));
+}
+
+/* Queue a header block as a HEADERS frame plus CONTINUATION frames */
+static int h2_send_headers(struct mk_http2_session *h2s,
+                           struct mk_http2_stream *st,
+                           uint8_t *block, size_t length, int end_stream)
+{
+    int ret;
+    uint8_t type = MK_HTTP2_HEADERS;
+    uint8_t flags;
+    size_t n;
+    size_t max = h2s->settings.max_frame_size;
+
+    do {
+        n = (length > max) ? max : length;
+        flags = 0;
+        if (type == MK_HTTP2_HEADERS && end_stream) {
+            flags |= MK_HTTP2_END_STREAM;
+        }
+        if (n == length) {
+            flags |= MK_HTTP2_END_HEADERS;
+        }
+
+        ret = h2_send(h2s, st, type, flags, st->id, block, n);
+        if (ret != 0) {
+            return -1;
+        }
+
+        block += n;
+        length -= n;
+        type = MK_HTTP2_CONTINUATION;
+    } while (length > 0);
+
+    return 0;
+}
+
+/*
+ * The HTTP/1.x pipeline queued the response on the stream channel: take the
+ * status line and headers and send them as a HEADERS frame, the body that
+ * follows is sent with DATA frames as the flow control windows allow it.
+ */
+static int h2_stream_respond(struct mk_http2_session *h2s,
+                             struct mk_http2_stream *st)
+{
+    int ret;
+    int end_stream;
+    size_t n;
+    size_t size;
+    size_t name_len;
+    size_t value_len;
+    size_t length;
+    char *p;
+    char *end;
+    char *eol;
+    char *name;
+    char *value;
+    char *colon;
+    uint8_t *block;
+    char buf[MK_HTTP2_HEADERS_MAX];
+
+    size = mk_channel_copy(&st->channel, buf, sizeof(buf));
+    end = memmem(buf, size, "\r\n\r\n", 4);
+    if (!end || end - buf < 12 || memcmp(buf, "HTTP/1.", 7) != 0) {
+        return -1;
+    }
+    length = (end - buf) + 4;
+
+    /* encoded fields are never larger than twice their text */
+    size = (length * 2) + 64;
+    block = mk_mem_alloc(size);
+    if (!block) {
+        return -1;
+    }
+
+    n = mk_http2_hpack_encode_begin(&h2s->encoder, block, size);
+    ret = mk_http2_hpack_encode(&h2s->encoder, block + n, size - n,
+                                ":status", 7, buf + 9, 3,
+                                MK_HTTP2_HPACK_INDEX);
+    if (ret < 0) {
+        mk_mem_free(block);
+        return -1;
+    }
+    n += ret;
+
+    p = memchr(buf, '\n', length) + 1;
+    while (p < end) {
+        eol = memmem(p, (end + 2) - p, "\r\n", 2);
+        colon = memchr(p, ':', eol - p);
+        if (!colon) {
+            p = eol + 2;
+            continue;
+        }
+
+        name = p;
+        name_len = colon - p;
+        for (p = name; p < colon; p++) {
+            *p = tolower((unsigned char) *p);
+        }
+
+        value = colon + 1;
+        while (value < eol && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        value_len = eol - value;
+        p = eol + 2;
+
+        if (h2_name_is(name, name_len, "connection") ||
+            h2_name_is(name, name_len, "keep-alive") ||
+            h2_name_is(name, name_len, "proxy-connection") ||
+            h2_name_is(name, name_len, "transfer-encoding") ||
+            h2_name_is(name, name_len, "upgrade")) {
+            continue;
+        }
+
+        ret = mk_http2_hpack_encode(&h2s->encoder, block + n, size - n,
+                                    name, name_len, value, value_len,
+                                    h2_header_volatile(name, name_len) ?
+                                    MK_HTTP2_HPACK_NO_INDEX :
+                                    MK_HTTP2_HPACK_INDEX);
+        if (ret < 0) {
+            mk_mem_free(block);
+            return -1;
+        }
+        n += ret;
+    }
+
+    mk_channel_consume(&st->channel, length);
+
+    end_stream = !mk_channel_pending(&st->channel);
+    ret = h2_send_headers(h2s, st, block, n, end_stream);
+    mk_mem_free(block);
+    if (ret != 0) {
+        return -1;
+    }
+
+    st->flags |= MK_HTTP2_STREAM_RESPONSE;
+    if (end_stream) {
+        st->flags |= MK_HTTP2_STREAM_END_LOCAL;
+    }
+
+    return 0;
+}
+
+/* The request is complete: run it through the HTTP/1.x pipeline */
+static void h2_stream_serve(struct mk_http2_session *h2s,
+                            struct mk_http2_stream *st)
+{
+    int ret;
+    int error;
+    struct mk_http_session *cs = &st->session;
+    struct mk_http_request *sr = &cs->sr_fixed;
+
+    if (st->error) {
+        h2_stream_reset(h2s, st, st->error);
+        return;
+    }
+
+    error = h2_stream_build(st);
+    if (error) {
+        h2_stream_reset(h2s, st, error);
+        return;
+    }
+
+    mk_list_add(&sr->_head, &cs->request_list);
+    mk_http_request_init(cs, sr, h2s->server);
+    st->flags |= MK_HTTP2_STREAM_SERVED;
+
+    ret = mk_http_request_serve(cs, sr, MK_HTTP_PROTOCOL_20, h2s->server);
+
+    /*
+     * Handlers that write to the socket by their own, like library mode
+     * callbacks or plugins that complete the response out of the pipeline,
+     * are only served over HTTP/1.1.
+     */
+    if (ret == MK_EXIT_REFUSED || ret == MK_PLUGIN_RET_CONTINUE) {
+        h2_stream_reset(h2s, st, MK_HTTP2_HTTP_1_1_REQUIRED);
+        return;
+    }
+
+    if (h2_stream_respond(h2s, st) != 0) {
+        h2_stream_reset(h2s, st, (ret == MK_EXIT_ERROR) ?
+                        MK_HTTP2_PROTOCOL_ERROR : MK_HTTP2_INTERNAL_ERROR);
+        return;
+    }
+
+    h2_stream_check(h2s, st);
+}
+
+/*
+ * DATA frames
+ * ===========
+ */
+
+/* Pick the stream to send: lowest urgency, incremental ones share it */
+static struct mk_http2_stream *h2_stream_next(struct mk_http2_session *h2s)
+{
+    struct mk_list *head;
+    struct mk_http2_stream *st;
+    struct mk_http2_stream *best = NULL;
+
+    mk_list_foreach(head, &h2s->streams) {
+        st = mk_list_entry(head, struct mk_http2_stream, _head);
+        if (!(st->flags & MK_HTTP2_STREAM_RESPONSE) ||
+            (st->flags & MK_HTTP2_STREAM_END_LOCAL) || st->window <= 0) {
+            continue;
+        }
+
+        if (!best || st->urgency < best->urgency ||
+            (st->urgency == best->urgency &&
+             !st->incremental && best->incremental)) {
+            best = st;
+        }
+    }
+
+    return best;
+}
+
+/* Frame up to 'size' bytes of the stream response */
+static ssize_t h2_stream_data(struct mk_http2_session *h2s,
+                              struct mk_http2_stream *st, size_t size)
+{
+    int fd;
+    int ret;
+    off_t offset;
+    size_t n;
+    struct h2_frame *frame;
+    struct mk_list *head;
+    struct mk_stream *stream = NULL;
+    struct mk_stream_input *in;
+
+    mk_list_foreach(head, &st->channel.streams) {
+        stream = mk_list_entry(head, struct mk_stream, _head);
+        if (mk_list_is_empty(&stream->inputs) != 0) {
+            break;
+        }
+        stream = NULL;
+    }
+
+    if (!stream) {
+        /* nothing left, just close our side */
+        n = 0;
+        frame = h2_frame_new(0);
+        if (!frame) {
+            return -1;
+        }
+    }
+    else {
+        in = mk_list_entry_first(&stream->inputs, struct mk_stream_input,
+                                 _head);
+        if (in->type == MK_STREAM_FILE) {
+            /* the frame header goes first, the payload is sent from the file */
+            n = (in->bytes_total < size) ? in->bytes_total : size;
+            fd = in->fd;
+            offset = in->bytes_offset;
+
+            frame = h2_frame_new(0);
+            if (!frame) {
+                return -1;
+            }
+            frame->file = MK_TRUE;
+            mk_http2_frame_encode_header(frame->data, n, MK_HTTP2_DATA, 0,
+                                         st->id);
+            if (h2_frame_queue(h2s, st, frame, MK_HTTP2_HEADER_SIZE) != 0) {
+                return -1;
+            }
+
+            ret = mk_stream_in_file(&h2s->stream_out, NULL, fd, n, offset,
+                                    NULL, cb_file_finished);
+            if (ret != 0) {
+                return -1;
+            }
+            in = mk_list_entry_last(&h2s->stream_out.inputs,
+                                    struct mk_stream_input, _head);
+            in->context = st;
+            st->out_pending++;
+
+            mk_channel_consume(&st->channel, n);
+            st->window -= n;
+            h2s->window -= n;
+
+            if (!mk_channel_pending(&st->channel)) {
+                frame->data[4] |= MK_HTTP2_END_STREAM;
+                st->flags |= MK_HTTP2_STREAM_END_LOCAL;
+            }
+            return n;
+        }
+
+        frame = h2_frame_new(size);
+        if (!frame) {
+            return -1;
+        }
+
+        n = mk_channel_copy(&st->channel, (char *) frame->data +
+                            MK_HTTP2_HEADER_SIZE, size);
+        if (n == 0) {
+            mk_mem_free(frame);
+            return -1;
+        }
+        mk_channel_consume(&st->channel, n);
+    }
+
+    mk_http2_frame_encode_header(frame->data, n, MK_HTTP2_DATA, 0, st->id);
+    if (!mk_channel_pending(&st->channel)) {
+        frame->data[4] |= MK_HTTP2_END_STREAM;
+        st->flags |= MK_HTTP2_STREAM_END_LOCAL;
+    }
+
+    if (h2_frame_queue(h2s, st, frame, MK_HTTP2_HEADER_SIZE + n) != 0) {
+        return -1;
+    }
+
+    st->window -= n;
+    h2s->window -= n;
+
+    return n;
+}
+
+/*
+ * Queue DATA frames of the pending responses, bounded by the flow control
+ * windows and a budget per round so the connection channel stays small.
+ * After an upgrade nothing is sent until the client preface is received,
+ * some clients can only buffer a few frames following the 101 response.
+ */
+static void h2_dispatch(struct mk_http2_session *h2s)
+{
+    size_t size;
+    ssize_t n;
+    size_t budget = MK_HTTP2_DISPATCH_SIZE;
+    struct mk_http2_stream *st;
+
+    while (budget > 0 && h2s->window > 0 && h2s->status == MK_HTTP2_OK) {
+        st = h2_stream_next(h2s);
+        if (!st) {
+            break;
+        }
+
+        size = budget;
+        if ((int64_t) size > st->window) {
+            size = st->window;
+        }
+        if ((int64_t) size > h2s->window) {
+            size = h2s->window;
+        }
+        if (size > h2s->settings.max_frame_size) {
+            size = h2s->settings.max_frame_size;
+        }
+
+        n = h2_stream_data(h2s, st, size);
+        if (n < 0) {
+            h2_stream_reset(h2s, st, MK_HTTP2_INTERNAL_ERROR);
+            continue;
+        }
+        budget -= (n > 0) ? (size_t) n : 1;
+
+        if (st->flags & MK_HTTP2_STREAM_END_LOCAL) {
+            h2_stream_check(h2s, st);
+        }
+        else if (st->incremental) {
+            /* round-robin between the incremental streams */
+            mk_list_del(&st->_head);
+            mk_list_add(&st->_head, &h2s->streams);
+        }
+    }
+}
+
+/*
+ * Frames
+ * ======
+ */
+
+/* Extend the receive windows once half of them was consumed */
+static void h2_window_update(struct mk_http2_session *h2s,
+                             struct mk_http2_stream *st)
+{
+    if (h2s->recv_consumed >= MK_HTTP2_WINDOW_THRESHOLD) {
+        h2_send_window_update(h2s, 0, h2s->recv_consumed);
+        h2s->recv_window += h2s->recv_consumed;
+        h2s->recv_consumed = 0;
+    }
+
+    if (st && !(st->flags & (MK_HTTP2_STREAM_END_REMOTE |
+                             MK_HTTP2_STREAM_RESET)) &&
+        st->recv_consumed >= MK_HTTP2_WINDOW_THRESHOLD) {
+        h2_send_window_update(h2s, st->id, st->recv_consumed);
+        st->recv_window += st->recv_consumed;
+        st->recv_consumed = 0;
+    }
+}
+
+/* Apply a SETTINGS payload, returns zero or a connection error code */
+static int h2_settings_apply(struct mk_http2_session *h2s,
+                             uint8_t *payload, size_t length)
+{
+    size_t i;
+    int64_t delta;
+    uint16_t id;
+    uint32_t value;
+    struct mk_list *head;
+    struct mk_http2_stream *st;
+
+    for (i = 0; i + 6 <= length; i += 6) {
+        id = (payload[i] << 8) | payload[i + 1];
+        value = mk_http2_bitdec_32u(payload + i + 2);
+
+        MK_H2_TRACE(h2s->conn, "[Setting] ID=%" PRIu16 " VAL=%" PRIu32,
+                    id, value);
+
+        switch (id) {
+        case MK_HTTP2_SETTINGS_HEADER_TABLE_SIZE:
+            h2s->settings.header_table_size = value;
+            mk_http2_hpack_set_limit(&h2s->encoder, value);
+            break;
+        case MK_HTTP2_SETTINGS_ENABLE_PUSH:
+            if (value > 1) {
+                return MK_HTTP2_PROTOCOL_ERROR;
+            }
+            h2s->settings.enable_push = value;
+            break;
+        case MK_HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS:
+            h2s->settings.max_concurrent_streams = value;
+            break;
+        case MK_HTTP2_SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > MK_HTTP2_WINDOW_MAX) {
+                return MK_HTTP2_FLOW_CONTROL_ERROR;
+            }
+
+            /* the change applies to the windows of open streams */
+            delta = (int64_t) value - h2s->settings.initial_window_size;
+            mk_list_foreach(head, &h2s->streams) {
+                st = mk_list_entry(head, struct mk_http2_stream, _head);
+                st->window += delta;
+                if (st->window > MK_HTTP2_WINDOW_MAX) {
+                    return MK_HTTP2_FLOW_CONTROL_ERROR;
+                }
+            }
+            h2s->settings.initial_window_size = value;
+            break;
+        case MK_HTTP2_SETTINGS_MAX_FRAME_SIZE:
+            if (value < MK_HTTP2_FRAME_SIZE || value > 0xffffff) {
+                return MK_HTTP2_PROTOCOL_ERROR;
+            }
+            h2s->settings.max_frame_size = value;
+            break;
+        case MK_HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE:
+            h2s->settings.max_header_list_size = value;
+            break;
+        default:
+            /* unknown settings must be ignored */
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int h2_frame_settings(struct mk_http2_session *h2s,
+                             struct mk_http2_frame *frame)
+{
+    int ret;
+
+    if (frame->stream_id != 0) {
+        return MK_HTTP2_PROTOCOL_ERROR;
+    }
+
+    if (frame->flags & MK_HTTP2_SETTINGS_ACK) {
+        if (frame->length != 0) {
+            return MK_HTTP2_FRAME_SIZE_ERROR;
+        }
+        return 0;
+    }
+
+    if (frame->length % 6 != 0) {
+        return MK_HTTP2_FRAME_SIZE_ERROR;
+    }
+
+    ret = h2_settings_apply(h2s, frame->payload, frame->length);
+    if (ret != 0) {
+        return ret;
+    }
+    h2s->settings_received = MK_TRUE;
+
+    h2_send_static(h2s, MK_HTTP2_SETTINGS_ACK_FRAME,
+                   sizeof(MK_HTTP2_SETTINGS_ACK_FRAME) - 1);
+    return 0;
+}
+
+static int h2_frame_ping(struct mk_http2_session *h2s,
+                         struct mk_http2_frame *frame)
+{
+    if (frame->stream_id != 0) {
+        return MK_HTTP2_PROTOCOL_ERROR;
+    }
+    if (frame->length != 8) {
+        return MK_HTTP2_FRAME_SIZE_ERROR;
+    }
+
+    if (!(frame->flags & MK_HTTP2_PING_ACK)) {
+        h2_send(h2s, NULL, MK_HTTP2_PING, MK_HTTP2_PING_ACK, 0,
+                frame->payload, 8);
+    }
+    return 0;
+}
+
+static int h2_frame_goaway(struct mk_http2_session *h2s,
+                           struct mk_http2_frame *frame)
+{
+    if (frame->stream_id != 0) {
+        return MK_HTTP2_PROTOCOL_ERROR;
+    }
+    if (frame->length < 8) {
+        return MK_HTTP2_FRAME_SIZE_ERROR;
+    }
+
+    MK_H2_TRACE(h2s->conn, "GOAWAY received, error=%" PRIu32,
+                mk_http2_bitdec_32u(frame->payload + 4));
+    h2s->goaway_received = MK_TRUE;
+    return 0;
+}
+
+static int h2_frame_window_update(struct mk_http2_session *h2s,
+                                  struct mk_http2_frame *frame)
+{
+    uint32_t increment;
+    struct mk_http2_stream *st;
+
+    if (frame->length != 4) {
+        return MK_HTTP2_FRAME_SIZE_ERROR;
+    }
+    increment = mk_http2_bitdec_32u(frame->payload) & 0x7fffffff;
+
+    if (frame->stream_id == 0) {
+        if (increment == 0) {
+            return MK_HTTP2_PROTOCOL_ERROR;
+        }
+        h2s->window += increment;
+        if (h2s->window > MK_HTTP2_WINDOW_MAX) {
+            return MK_HTTP2_FLOW_CONTROL_ERROR;
+        }
+        return 0;
+    }
+
+    if (frame->stream_id > h2s->last_stream_id) {
+        return MK_HTTP2_PROTOCOL_ERROR;
+    }
+
+    st = h2_stream_get(h2s, frame->stream_id);
+    if (!st || (st->flags & MK_HTTP2_STREAM_RESET)) {
+        return 0;
+    }
+
+    if (increment == 0) {
+        h2_stream_reset(h2s, st, MK_HTTP2_PROTOCOL_ERROR);
+        return 0;
+    }
+
+    st->window += increment;
+    if (st->window > MK_HTTP2_WINDOW_MAX) {
+        h2_stream_reset(h2s, st, MK_HTTP2_FLOW_CONTROL_ERROR);
+    }
+    return 0;
+}
+
+static int h2_frame_rst_stream(struct mk_http2_session *h2s,
+                               struct mk_http2_frame *frame)
+{
+    struct mk_http2_stream *st;
+
+    if (frame->length != 4) {
+        return MK_HTTP2_FRAME_SIZE_ERROR;
+    }
+    if (frame->stream_id == 0 || frame->stream_id > h2s->last_stream_id) {
+        return MK_HTTP2_PROTOCOL_ERROR;
+    }
+
+    st = h2_stream_get(h2s, frame->stream_id);
+    if (!st) {
+        return 0;
+    }
+
+    /* the client does not want it anymore, nothing else is sent */
+    st->flags |= (MK_HTTP2_STREAM_RESET | MK_HTTP2_STREAM_END_REMOTE);
+    h2_stream_reset(h2s, st, MK_HTTP2_NO_ERROR);
+    return 0;
+}
+
+static int h2_frame_priority(struct mk_http2_session *h2s,
+                             struct mk_http2_frame *frame)
+{
+    if (frame->stream_id == 0) {
+        return MK_HTTP2_PROTOCOL_ERROR;
+    }
+    if (frame->length != 5) {
+        h2_send_rst(h2s, frame->stream_id, MK_HTTP2_FRAME_SIZE_ERROR);
+        return 0;
+    }
+    if (mk_http2_bitdec_stream_id(frame->payload) == frame->stream_id) {
+        h2_send_rst(h2s, frame->stream_id, MK_HTTP2_PROTOCOL_ERROR);
+    }
+
+    /* RFC 7540 priorities are not used */
+    return 0;
+}
+
+static int h2_frame_priority_update(struct mk_http2_session *h2s,
+                                    struct mk_http2_frame *frame)
+{
+    uint32_t id;
+    struct mk_http2_stream *st;
+
+    if (frame->stream_id != 0) {
+        return MK_HTTP2_PROTOCOL_ERROR;
+    }
+    if (frame->length < 4) {
+        return MK_HTTP2_FRAME_SIZE_ERROR;
+    }
+
+    id = mk_http2_bitdec_stream_id(frame->payload);
+    if (id == 0) {
+        return MK_HTTP2_PROTOCOL_ERROR;
+    }
+
+    st = h2_stream_get(h2s, id);
+    if (st) {
+        h2_priority_parse((char *) frame->payload + 4, frame->length - 4,
+                          &st->urgency, &st->incremental);
+    }
+    return 0;
+}
+
+static int h2_frame_data(struct mk_http2_session *h2s,
+                         struct mk_http2_frame *frame)
+{
+    uint8_t pad = 0;
+    uint8_t *data = frame->payload;
+    uint32_t length = frame->length;
+    struct mk_http2_stream *st;
+
+    if (frame->stream_id == 0 || frame->stream_id > h2s->last_stream_id) {
+        return MK_HTTP2_PROTOCOL_ERROR;
+    }
+
+    if (frame->flags & MK_HTTP2_PADDED) {
+        if (length < 1) {
+            return MK_HTTP2_FRAME_SIZE_ERROR;
+        }
+        pad = data[0];
+        if (pad >= length) {
+            return MK_HTTP2_PROTOCOL_ERROR;
+        }
+        data++;
+        length -= (pad + 1);
+    }
+
+    /* the whole frame payload counts for flow control */
+    if ((int64_t) frame->length > h2s->recv_window) {
+        return MK_HTTP2_FLOW_CONTROL_ERROR;
+    }
+    h2s->recv_window -= frame->length;
+    h2s->recv_consumed += frame->length;
+
+    st = h2_stream_get(h2s, frame->stream_id);
+    if (!st || (st->flags & MK_HTTP2_STREAM_RESET)) {
+        h2_window_update(h2s, NULL);
+        return 0;
+    }
+
+    if (st->flags & MK_HTTP2_STREAM_END_REMOTE) {
+        h2_stream_reset(h2s, st, MK_HTTP2_STREAM_CLOSED);
+        h2_window_update(h2s, NULL);
+        return 0;
+    }
+
+    if ((int64_t) frame->length > st->recv_window) {
+        h2_stream_reset(h2s, st, MK_HTTP2_FLOW_CONTROL_ERROR);
+        h2_window_update(h2s, NULL);
+        return 0;
+    }
+    st->recv_window -= frame->length;
+    st->recv_consumed += frame->length;
+
+    if (length > 0 && !st->error &&
+        h2_stream_write(st, (char *) data, length) != 0) {
+        h2_stream_reset(h2s, st, MK_HTTP2_CANCEL);
+        h2_window_update(h2s, NULL);
+        return 0;
+    }
+
+    if (frame->flags & MK_HTTP2_END_STREAM) {
+        st->flags |= MK_HTTP2_STREAM_END_REMOTE;
+        h2_window_update(h2s, NULL);
+        h2_stream_serve(h2s, st);
+        return 0;
+    }
+
+    h2_window_update(h2s, st);
+    return 0;
+}
+
+/* A complete header block arrived for a stream */
+static int h2_headers_end(struct mk_http2_session *h2s, uint32_t id,
+                          uint8_t flags, uint8_t *block, size_t length)
+{
+    int ret;
+    struct mk_http2_stream *st;
+
+    st = h2_stream_get(h2s, id);
+    if (st) {
+        ret = mk_http2_hpack_decode(&h2s->decoder, block, length,
+                                    h2_header_discard, NULL);
+        if (ret != 0) {
+            return MK_HTTP2_COMPRESSION_ERROR;
+        }
+
+        if (st->flags & (MK_HTTP2_STREAM_END_REMOTE | MK_HTTP2_STREAM_RESET)) {
+            h2_stream_reset(h2s, st, MK_HTTP2_STREAM_CLOSED);
+        }
+        else if (!(flags & MK_HTTP2_END_STREAM)) {
+            /* trailers must end the stream */
+            h2_stream_reset(h2s, st, MK_HTTP2_PROTOCOL_ERROR);
+        }
+        else {
+            /* trailers are not passed to the handlers */
+            st->flags |= MK_HTTP2_STREAM_END_REMOTE;
+            h2_stream_serve(h2s, st);
+        }
+        return 0;
+    }
+
+    if (id <= h2s->last_stream_id) {
+        /* a closed stream */
+        ret = mk_http2_hpack_decode(&h2s->decoder, block, length,
+                                    h2_header_discard, NULL);
+        if (ret != 0) {
+            return MK_HTTP2_COMPRESSION_ERROR;
+        }
+        h2_send_rst(h2s, id, MK_HTTP2_STREAM_CLOSED);
+        return 0;
+    }
+
+    h2s->last_stream_id = id;
+
+    if (h2s->streams_active >= MK_HTTP2_MAX_STREAMS ||
+        !(st = h2_stream_create(h2s, id))) {
+        ret = mk_http2_hpack_decode(&h2s->decoder, block, length,
+                                    h2_header_discard, NULL);
+        if (ret != 0) {
+            return MK_HTTP2_COMPRESSION_ERROR;
+        }
+        h2_send_rst(h2s, id, MK_HTTP2_REFUSED_STREAM);
+        return 0;
+    }
+
+    ret = mk_http2_hpack_decode(&h2s->decoder, block, length,
+                                h2_header_cb, st);
+    if (ret != 0) {
+        return MK_HTTP2_COMPRESSION_ERROR;
+    }
+    st->headers_length = st->session.body_length;
+
+    if (flags & MK_HTTP2_END_STREAM) {
+        st->flags |= MK_HTTP2_STREAM_END_REMOTE;
+        h2_stream_serve(h2s, st);
+    }
+    else if (st->error) {
+        h2_stream_reset(h2s, st, st->error);
+    }
+
+    return 0;
+}
+
+/* Keep a header block fragment until the block is complete */
+static int h2_block_add(struct mk_http2_session *h2s,
+                        uint8_t *data, size_t length)
+{
+    char *tmp;
+    size_t size;
+
+    if (h2s->block_length + length > h2s->block_size) {
+        size = h2s->block_length + length;
+        if (size > (size_t) h2s->server->max_request_size) {
+            return -1;
+        }
+
+        tmp = mk_mem_realloc(h2s->block, size);
+        if (!tmp) {
+            return -1;
+        }
+        h2s->block = tmp;
+        h2s->block_size = size;
+    }
+
+    memcpy(h2s->block + h2s->block_length, data, length);
+    h2s->block_length += length;
+    return 0;
+}
+
+static int h2_frame_headers(struct mk_http2_session *h2s,
+                            struct mk_http2_frame *frame)
 {
-    memmove(h2s->buffer,
-            h2s->buffer + bytes,
-            h2s->buffer_length - bytes);
+    uint8_t pad = 0;
+    uint8_t *data = frame->payload;
+    uint32_t length = frame->length;
 
-    MK_TRACE("[h2] consume buffer length from %i to %i",
-             h2s->buffer_length, h2s->buffer_length - bytes);
-    h2s->buffer_length -= bytes;
+    /* streams initiated by the client use odd identifiers */
+    if (frame->stream_id == 0 || (frame->stream_id & 1) == 0) {
+        return MK_HTTP2_PROTOCOL_ERROR;
+    }
+
+    if (frame->flags & MK_HTTP2_PADDED) {
+        if (length < 1) {
+            return MK_HTTP2_FRAME_SIZE_ERROR;
+        }
+        pad = data[0];
+        data++;
+        length--;
+    }
+
+    if (frame->flags & MK_HTTP2_PRIORITY_FLAG) {
+        if (length < 5) {
+            return MK_HTTP2_FRAME_SIZE_ERROR;
+        }
+        if (mk_http2_bitdec_stream_id(data) == frame->stream_id) {
+            return MK_HTTP2_PROTOCOL_ERROR;
+        }
+        data += 5;
+        length -= 5;
+    }
+
+    if (pad > length) {
+        return MK_HTTP2_PROTOCOL_ERROR;
+    }
+    length -= pad;
+
+    if (frame->flags & MK_HTTP2_END_HEADERS) {
+        return h2_headers_end(h2s, frame->stream_id, frame->flags,
+                              data, length);
+    }
+
+    h2s->block_length = 0;
+    if (h2_block_add(h2s, data, length) != 0) {
+        return MK_HTTP2_ENHANCE_YOUR_CALM;
+    }
+    h2s->continuation_id = frame->stream_id;
+    h2s->continuation_flags = frame->flags;
+
+    return 0;
 }
 
-static struct mk_http2_session *mk_http2_session_create()
+static int h2_frame_continuation(struct mk_http2_session *h2s,
+                                 struct mk_http2_frame *frame)
 {
-    struct mk_http2_session *h2s;
+    int ret;
 
-    h2s = mk_mem_alloc(sizeof(struct mk_http2_session));
-    if (!h2s) {
-        return NULL;
+    if (h2s->continuation_id == 0 ||
+        frame->stream_id != h2s->continuation_id) {
+        return MK_HTTP2_PROTOCOL_ERROR;
     }
-    h2s->buffer = NULL;
-    h2s->buffer_length = 0;
-    h2s->buffer_size = sizeof(h2s->buffer_fixed);
-    h2s->buffer = h2s->buffer_fixed;
-    h2s->settings = MK_HTTP2_SETTINGS_DEFAULT;
 
-    return h2s;
+    if (h2_block_add(h2s, frame->payload, frame->length) != 0) {
+        return MK_HTTP2_ENHANCE_YOUR_CALM;
+    }
+
+    if (!(frame->flags & MK_HTTP2_END_HEADERS)) {
+        return 0;
+    }
+
+    h2s->continuation_id = 0;
+    ret = h2_headers_end(h2s, frame->stream_id, h2s->continuation_flags,
+                         (uint8_t *) h2s->block, h2s->block_length);
+    h2s->block_length = 0;
+
+    return ret;
 }
 
-/* FIXME
-static int mk_http2_session_destroy(struct mk_http2_session *h2s)
+/* Process a frame, returns zero or a connection error code */
+static int h2_frame_process(struct mk_http2_session *h2s,
+                            struct mk_http2_frame *frame)
 {
-    if (h2s->buffer != h2s->buffer_fixed) {
-        mk_mem_free(h2s->buffer);
+    MK_H2_TRACE(h2s->conn, "frame type=%i flags=0x%x stream=%" PRIu32
+                " length=%" PRIu32, frame->type, frame->flags,
+                frame->stream_id, frame->length);
+
+    /* The client preface ends with a SETTINGS frame */
+    if (h2s->settings_received == MK_FALSE &&
+        frame->type != MK_HTTP2_SETTINGS) {
+        return MK_HTTP2_PROTOCOL_ERROR;
+    }
+
+    /* A header block can not be interleaved with other frames */
+    if (h2s->continuation_id && frame->type != MK_HTTP2_CONTINUATION) {
+        return MK_HTTP2_PROTOCOL_ERROR;
     }
-    mk_mem_free(h2s);
+
+    switch (frame->type) {
+    case MK_HTTP2_DATA:
+        return h2_frame_data(h2s, frame);
+    case MK_HTTP2_HEADERS:
+        return h2_frame_headers(h2s, frame);
+    case MK_HTTP2_PRIORITY:
+        return h2_frame_priority(h2s, frame);
+    case MK_HTTP2_RST_STREAM:
+        return h2_frame_rst_stream(h2s, frame);
+    case MK_HTTP2_SETTINGS:
+        return h2_frame_settings(h2s, frame);
+    case MK_HTTP2_PUSH_PROMISE:
+        /* clients can not push */
+        return MK_HTTP2_PROTOCOL_ERROR;
+    case MK_HTTP2_PING:
+        return h2_frame_ping(h2s, frame);
+    case MK_HTTP2_GOAWAY:
+        return h2_frame_goaway(h2s, frame);
+    case MK_HTTP2_WINDOW_UPDATE:
+        return h2_frame_window_update(h2s, frame);
+    case MK_HTTP2_CONTINUATION:
+        return h2_frame_continuation(h2s, frame);
+    case MK_HTTP2_PRIORITY_UPDATE:
+        return h2_frame_priority_update(h2s, frame);
+    }
+
+    /* Unknown frame types are ignored */
     return 0;
 }
 
-static int mk_http2_frame_header(char *buf, uint32_t length, uint8_t type,
-                                 uint32_t flags, void *data)
+/* Process the complete frames of the read buffer */
+static void h2_process(struct mk_http2_session *h2s)
 {
-    struct mk_http2_frame *f = (struct mk_http2_frame *) buf;
+    int ret;
+    size_t n;
+    size_t offset = 0;
+    struct mk_http2_frame frame;
+
+    if (h2s->status == MK_HTTP2_PREFACE) {
+        n = (h2s->buffer_length < http2_preface.len) ?
+            h2s->buffer_length : http2_preface.len;
+        if (memcmp(h2s->buffer, http2_preface.data, n) != 0) {
+            MK_H2_TRACE(h2s->conn, "invalid connection preface");
+            h2_goaway(h2s, MK_HTTP2_PROTOCOL_ERROR);
+            h2s->buffer_length = 0;
+            return;
+        }
+        if (n < http2_preface.len) {
+            return;
+        }
+        offset = http2_preface.len;
+        h2s->status = MK_HTTP2_OK;
+    }
+
+    while (h2s->status == MK_HTTP2_OK &&
+           h2s->buffer_length - offset >= MK_HTTP2_HEADER_SIZE) {
+        mk_http2_frame_decode_header((uint8_t *) h2s->buffer + offset, &frame);
+
+        /* We announced the default SETTINGS_MAX_FRAME_SIZE */
+        if (frame.length > MK_HTTP2_FRAME_SIZE) {
+            h2_goaway(h2s, MK_HTTP2_FRAME_SIZE_ERROR);
+            break;
+        }
+
+        if (h2s->buffer_length - offset < MK_HTTP2_HEADER_SIZE + frame.length) {
+            break;
+        }
 
-    f->len_type = (length << 8 | type);
-    f->flags    = flags;
-    f->payload  = data;
+        ret = h2_frame_process(h2s, &frame);
+        offset += MK_HTTP2_HEADER_SIZE + frame.length;
+        if (ret != 0) {
+            h2_goaway(h2s, ret);
+        }
+    }
 
-    return sizeof(struct mk_http2_frame);
+    if (h2s->status == MK_HTTP2_CLOSING) {
+        h2s->buffer_length = 0;
+    }
+    else if (offset > 0) {
+        memmove(h2s->buffer, h2s->buffer + offset,
+                h2s->buffer_length - offset);
+        h2s->buffer_length -= offset;
+    }
 }
 
-*/
+/*
+ * Session
+ * =======
+ */
 
-/* Handle an upgraded session */
-static int mk_http2_upgrade(void *cs, void *sr, struct mk_server *server)
+static int h2_session_init(struct mk_http2_session *h2s,
+                           struct mk_sched_conn *conn,
+                           struct mk_server *server)
 {
-    struct mk_http_session *s = cs;
-    struct mk_http_request *r = sr;
-    struct mk_http2_session *h2s;
+    if (mk_http2_hpack_init(&h2s->decoder, MK_HTTP2_HPACK_TABLE_SIZE) != 0) {
+        return -1;
+    }
+    if (mk_http2_hpack_init(&h2s->encoder, MK_HTTP2_HPACK_TABLE_SIZE) != 0) {
+        mk_http2_hpack_exit(&h2s->decoder);
+        return -1;
+    }
+
+    h2s->status = MK_HTTP2_PREFACE;
+    h2s->buffer = h2s->buffer_fixed;
+    h2s->buffer_size = sizeof(h2s->buffer_fixed);
+    h2s->buffer_length = 0;
+    h2s->settings = MK_HTTP2_SETTINGS_DEFAULT;
+    h2s->window = MK_HTTP2_WINDOW_SIZE;
+    h2s->recv_window = MK_HTTP2_WINDOW_SIZE;
+    mk_list_init(&h2s->streams);
+    h2s->conn = conn;
+    h2s->server = server;
+
+    mk_stream_set(&h2s->stream_out, &conn->channel, h2s, NULL, NULL, NULL);
+
+    return 0;
+}
+
+/* Get the session of the connection, it's created on the first event */
+static struct mk_http2_session *h2_session_get(struct mk_sched_conn *conn,
+                                               struct mk_sched_worker *worker,
+                                               struct mk_server *server)
+{
+    struct mk_http2_session *h2s = conn->data;
 
-    mk_header_set_http_status(r, MK_INFO_SWITCH_PROTOCOL);
-    r->headers.connection = MK_HEADER_CONN_UPGRADED;
-    r->headers.upgrade = MK_HEADER_UPGRADED_H2C;
-    mk_header_prepare(s, r, server);
+    if (h2s) {
+        /* the request that asked for the upgrade is done */
+        if (h2s->upgrade) {
+            mk_http_session_remove(h2s->upgrade, server);
+            h2s->upgrade = NULL;
+        }
+        return h2s;
+    }
 
-    h2s = mk_http2_session_create();
+    h2s = mk_sched_conn_extra_attach(conn, worker);
     if (!h2s) {
-        return -1;
+        return NULL;
     }
 
-    h2s->status = MK_HTTP2_UPGRADED;
-    s->conn->data = h2s;
+    if (h2_session_init(h2s, conn, server) != 0) {
+        return NULL;
+    }
+    conn->data = h2s;
 
-    return MK_HTTP_OK;
+    /* the server connection preface */
+    h2_send_static(h2s, MK_HTTP2_SETTINGS_DEFAULT_FRAME,
+                   sizeof(MK_HTTP2_SETTINGS_DEFAULT_FRAME) - 1);
+
+    return h2s;
 }
 
-/* FIXME Decode a frame header, no more... no less
-static inline void mk_http2_frame_decode_header(uint8_t *buf,
-                                                struct mk_http2_frame *frame)
+static int h2_buffer_grow(struct mk_http2_session *h2s, unsigned int size)
 {
-    struct mk_http2_session *h2s;
-    (void) h2s;
-
-    frame->len_type  = mk_http2_bitdec_32u(buf);
-    frame->flags     = buf[4];
-    frame->stream_id = mk_http2_bitdec_stream_id(buf + 5);
-    frame->payload   = buf + 9;
-
-#ifdef MK_HAVE_TRACE
-    MK_TRACE("Frame Header");
-    printf(" length=%i, type=%i, stream_id=%i\n",
-           mk_http2_frame_len(frame),
-           mk_http2_frame_type(frame),
-           frame->stream_id);
-#endif
-}
-*/
-
-static inline int mk_http2_handle_settings(struct mk_sched_conn *conn,
-                                           struct mk_http2_frame *frame)
-{
-    int i;
-    int frame_len;
-    int settings;
-    int setting_size = 6; /* 16 bits identifier + 32 bits value = 6 bytes */
-    uint16_t setting_id;
-    uint32_t setting_value;
-    uint8_t *p;
-    struct mk_http2_session *h2s;
+    char *tmp;
 
-    h2s = conn->data;
-    frame_len = mk_http2_frame_len(frame);
-    if (frame->flags == MK_HTTP2_SETTINGS_ACK) {
-        /*
-         * Nothing to do, the peer just received our SETTINGS and it's
-         * sending an acknowledge.
-         *
-         * note: validate that frame length is zero.
-         */
-        if (frame_len > 0) {
-            /*
-             * This must he handled as a connection error, we must reply
-             * with a FRAME_SIZE_ERROR. ref:
-             *
-             *  https://httpwg.github.io/specs/rfc7540.html#SETTINGS
-             */
-
-            /* FIXME: send a GOAWAY error frame */
-            MK_TRACE("FRAME SIZE ERR: %i\n", frame_len);
-            return -1;
+    if (h2s->buffer == h2s->buffer_fixed) {
+        tmp = mk_mem_alloc(size);
+        if (tmp) {
+            memcpy(tmp, h2s->buffer, h2s->buffer_length);
+        }
+    }
+    else {
+        tmp = mk_mem_realloc(h2s->buffer, size);
+    }
+
+    if (!tmp) {
+        return -1;
+    }
+    h2s->buffer = tmp;
+    h2s->buffer_size = size;
+
+    return 0;
+}
+
+/* Read from the socket into the session buffer */
+static int h2_read(struct mk_http2_session *h2s)
+{
+    int bytes;
+    unsigned int size;
 
+    /* a full buffer always holds complete frames once processed */
+    if (h2s->buffer_length == h2s->buffer_size) {
+        size = h2s->buffer_size * 2;
+        if (size > MK_HTTP2_BUFFER_MAX) {
+            size = MK_HTTP2_BUFFER_MAX;
+        }
+        if (size <= h2s->buffer_size || h2_buffer_grow(h2s, size) != 0) {
+            errno = 0;
+            return -1;
         }
-        return 0;
     }
 
-    /*
-     * Iterate our SETTINGS payload, it may contain many entries in the
-     * following format:
-     *
-     * +-------------------------------+
-     * |       Identifier (16)         |
-     * +-------------------------------+-------------------------------+
-     * |                        Value (32)                             |
-     * +---------------------------------------------------------------+
-     *
-     * 48 bits = 6 bytes
-     */
-    settings = (frame_len / setting_size);
-    for (i = 0; i < settings; i++ ) {
-        /* Seek payload per SETTINGS entry */
-        p = frame->payload + (setting_size * i);
+    bytes = mk_sched_conn_read(h2s->conn, h2s->buffer + h2s->buffer_length,
+                               h2s->buffer_size - h2s->buffer_length);
+    if (bytes == 0) {
+        errno = 0;
+        return -1;
+    }
+    else if (bytes < 0) {
+        return -1;
+    }
 
-        setting_id = p[0] << 8 | p[1];
-        setting_value = p[2] << 24 | p[3] << 16 | p[4] << 8  | p[5];
-        MK_H2_TRACE(conn, "[Setting] ID=%" PRIu16 " VAL=%" PRIu32,
-                    setting_id, setting_value);
+    /* after a GOAWAY the input is just discarded */
+    if (h2s->status != MK_HTTP2_CLOSING) {
+        h2s->buffer_length += bytes;
+    }
 
-        switch (setting_id) {
-        case MK_HTTP2_SETTINGS_HEADER_TABLE_SIZE:
-            /* unhandled */
-            break;
-        case MK_HTTP2_SETTINGS_ENABLE_PUSH:
-            if (setting_value != 0 && setting_value != 1) {
-                /* FIXME: PROTOCOL_ERROR */
-                MK_H2_TRACE(conn, "Invalid SETTINGS_ENABLE_PUSH");
-                return -1;
-            }
-            h2s->settings.enable_push = setting_value;
-            break;
-        case MK_HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS:
-            if (setting_value < 64) {
-                h2s->settings.max_concurrent_streams = setting_value;
-            }
-            else {
-                h2s->settings.max_concurrent_streams = 64;
-            }
-            MK_H2_TRACE(conn, "SETTINGS MAX_CONCURRENT_STREAMS=%i",
-                        setting_value);
-            break;
-        case MK_HTTP2_SETTINGS_INITIAL_WINDOW_SIZE:
-            if (setting_value < 65535 || setting_value > 2147483647) {
-                /* FIXME: send FLOW_CONTROL_ERROR */
-                MK_H2_TRACE(conn, "Invalid INITIAL_WINDOW_SIZE");
-                return -1;
-            }
-            h2s->settings.initial_window_size = setting_value;
-            break;
-        case MK_HTTP2_SETTINGS_MAX_FRAME_SIZE:
-            if (setting_value < 16384 || setting_value > 2147483647) {
-                /* FIXME: send PROTOCOL_ERROR */
-                return -1;
+    return bytes;
+}
+
+/* Arm the timeout that applies to the connection state */
+static void h2_timeout_update(struct mk_http2_session *h2s,
+                              struct mk_sched_worker *worker)
+{
+    int type;
+    struct mk_list *head;
+    struct mk_http2_stream *st;
+    struct mk_sched_conn *conn = h2s->conn;
+
+    /* the scheduler takes care of stalled writes */
+    if (mk_channel_pending(&conn->channel)) {
+        mk_sched_conn_timeout_del(conn, worker);
+        return;
+    }
+
+    if (h2s->buffer_length > 0 || h2s->continuation_id) {
+        type = MK_SCHED_TIMEOUT_READ;
+    }
+    else if (h2s->streams_active > 0) {
+        /* waiting for request data or for a window update */
+        type = MK_SCHED_TIMEOUT_WRITE;
+        mk_list_foreach(head, &h2s->streams) {
+            st = mk_list_entry(head, struct mk_http2_stream, _head);
+            if (!(st->flags & MK_HTTP2_STREAM_END_REMOTE)) {
+                type = MK_SCHED_TIMEOUT_READ;
+                break;
             }
-            h2s->settings.max_frame_size = setting_value;
-            break;
-        case MK_HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE:
-            /* Unhandled */
-            break;
-        default:
-            /*
-             * 5.5 Extending HTTP/2: ...Implementations MUST ignore unknown
-             * or unsupported values in all extensible protocol elements...
-             */
-            break;
         }
     }
+    else {
+        type = MK_SCHED_TIMEOUT_KEEPALIVE;
+    }
 
-    /* FIXME // No errors, send the ACK
-    mk_http2_send_raw(conn, MK_HTTP2_SETTINGS_ACK_FRAME,
-                      sizeof(MK_HTTP2_SETTINGS_ACK_FRAME) - 1);
-    */
-    return 0;
+    mk_sched_conn_timeout_add(conn, worker, type);
 }
 
+/*
+ * Scheduler callbacks
+ * ===================
+ */
 
-static inline int mk_http2_frame_run(struct mk_sched_conn *conn,
-                                     struct mk_sched_worker *worker)
+/*
+ * Clients of a h2c listener that do not start with the connection preface
+ * are served as HTTP/1.x, they can still ask for an upgrade. TLS listeners
+ * always fall back since the protocol is not negotiated with ALPN.
+ */
+static int h2_preface_check(struct mk_sched_conn *conn)
 {
-    int ret;
-    struct mk_http2_frame frame;
-    struct mk_http2_session *h2s;
-    (void) worker;
-
-    h2s = conn->data;
+    int bytes;
+    char buf[sizeof(MK_HTTP2_PREFACE_STR) - 1];
 
-    /* Decode the frame header */
-    //FIXME mk_http2_frame_decode_header(h2s->buffer, &frame);
+    if (MK_SCHED_CONN_PROP(conn) & MK_CAP_SOCK_TLS) {
+        return 1;
+    }
 
-    /* Do some validations */
-    if (h2s->buffer_length < (MK_HTTP2_HEADER_SIZE + (frame.len_type >> 8))) {
-        /* FIXME: need more data */
-        return 0;
+    bytes = recv(conn->event.fd, buf, sizeof(buf), MSG_PEEK);
+    if (bytes == 0) {
+        errno = 0;
+        return -1;
+    }
+    else if (bytes < 0) {
+        return -1;
     }
 
-    /* Do some work based on the frame type */
-    if (mk_http2_frame_type(&frame) == MK_HTTP2_SETTINGS) {
-        ret = mk_http2_handle_settings(conn, &frame);
-        /* FIXME: send our MK_HTTP2_SETTINGS_ACK_FRAME */
-        return ret;
+    if (memcmp(buf, http2_preface.data, bytes) != 0) {
+        return 1;
     }
 
     return 0;
 }
 
+static int h2_fallback(struct mk_sched_conn *conn,
+                       struct mk_sched_worker *worker,
+                       struct mk_server *server)
+{
+    MK_H2_TRACE(conn, "no connection preface, switch to HTTP/1.x");
+
+    mk_sched_switch_protocol(conn, MK_CAP_HTTP);
+    if (conn->extra) {
+        memset(conn->extra, '\0', conn->protocol->sched_zero_size);
+    }
+
+    return conn->protocol->cb_read(conn, worker, server);
+}
+
 static int mk_http2_sched_read(struct mk_sched_conn *conn,
                                struct mk_sched_worker *worker,
                                struct mk_server *server)
 {
+    int ret;
     int bytes;
-    int new_size;
-    int available;
-    char *tmp;
     struct mk_http2_session *h2s;
-    (void) worker;
-    (void) server;
-
-    h2s = conn->data;
-    available = h2s->buffer_size - h2s->buffer_length;
-    if (available == 0) {
-        new_size = h2s->buffer_size + MK_HTTP2_CHUNK;
-        if (h2s->buffer == h2s->buffer_fixed) {
-            h2s->buffer = mk_mem_alloc(new_size);
-            if (!h2s->buffer) {
-                /* FIXME: send internal server error ? */
-                return -1;
-            }
-            memcpy(h2s->buffer, h2s->buffer_fixed, h2s->buffer_length);
-            MK_TRACE("[FD %i] Buffer new size: %i, length: %i",
-                     conn->event.fd, new_size, h2s->buffer_length);
-        }
-        else {
-            MK_TRACE("[FD %i] Buffer realloc from %i to %i",
-                     conn->event.fd, h2s->buffer_size, new_size);
-            tmp = mk_mem_realloc(h2s->buffer, new_size);
-            if (tmp) {
-                h2s->buffer = tmp;
-                h2s->buffer_size = new_size;
-            }
-            else {
-                /* FIXME: send internal server error ? */
-                return -1;
-            }
 
+    if (!conn->data) {
+        ret = h2_preface_check(conn);
+        if (ret == -1) {
+            return -1;
+        }
+        else if (ret == 1) {
+            return h2_fallback(conn, worker, server);
         }
     }
 
-    /* Read the incoming data */
-    bytes = mk_sched_conn_read(conn,
-                               h2s->buffer,
-                               h2s->buffer_size - h2s->buffer_length);
-    if (bytes == 0) {
+    h2s = h2_session_get(conn, worker, server);
+    if (!h2s) {
         errno = 0;
         return -1;
     }
-    else if (bytes == -1) {
+
+    bytes = h2_read(h2s);
+    if (bytes <= 0) {
+        return -1;
+    }
+
+    h2_process(h2s);
+    h2_dispatch(h2s);
+
+    if (mk_channel_pending(&conn->channel)) {
+        mk_sched_conn_write_interest(conn, worker, MK_TRUE);
+    }
+    h2_timeout_update(h2s, worker);
+
+    return bytes;
+}
+
+/*
+ * The connection channel was flushed: frames received meanwhile are
+ * processed and the next DATA frames are queued.
+ */
+static int mk_http2_sched_done(struct mk_sched_conn *conn,
+                               struct mk_sched_worker *worker,
+                               struct mk_server *server)
+{
+    int bytes;
+    struct mk_http2_session *h2s;
+
+    h2s = h2_session_get(conn, worker, server);
+    if (!h2s || h2s->status == MK_HTTP2_CLOSING) {
+        return -1;
+    }
+
+    bytes = h2_read(h2s);
+    if (bytes < 0 && errno != EAGAIN) {
+        return -1;
+    }
+
+    h2_process(h2s);
+    h2_dispatch(h2s);
+
+    if (mk_channel_pending(&conn->channel)) {
+        return 1;
+    }
+
+    if (h2s->goaway_received && h2s->streams_active == 0) {
         return -1;
     }
 
-    h2s->buffer_length += bytes;
+    h2_timeout_update(h2s, worker);
+    return 0;
+}
+
+static int mk_http2_sched_close(struct mk_sched_conn *conn,
+                                struct mk_sched_worker *worker,
+                                int type, struct mk_server *server)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_http2_stream *st;
+    struct mk_http2_session *h2s = conn->data;
+
+    (void) worker;
+    (void) type;
+
+    if (!h2s) {
+        return 0;
+    }
+
+    /* pending frames are dropped before the streams they refer to */
+    h2s->status = MK_HTTP2_CLOSED;
+    mk_channel_clean(&conn->channel);
+
+    if (h2s->upgrade) {
+        mk_http_session_remove(h2s->upgrade, server);
+        h2s->upgrade = NULL;
+    }
+
+    mk_list_foreach_safe(head, tmp, &h2s->streams) {
+        st = mk_list_entry(head, struct mk_http2_stream, _head);
+        st->flags |= MK_HTTP2_STREAM_RESET;
+        h2_stream_release(h2s, st);
+    }
+
+    mk_http2_hpack_exit(&h2s->decoder);
+    mk_http2_hpack_exit(&h2s->encoder);
+
+    if (h2s->block) {
+        mk_mem_free(h2s->block);
+    }
+    if (h2s->buffer != h2s->buffer_fixed) {
+        mk_mem_free(h2s->buffer);
+    }
+
+    if (h2s->allocated) {
+        mk_mem_free(h2s);
+    }
+    conn->data = NULL;
+
+    return 0;
+}
+
+/* base64url without padding, as used by the HTTP2-Settings header */
+static int h2_base64url_decode(const char *in, size_t length,
+                               uint8_t *out, size_t size)
+{
+    int v;
+    int bits = 0;
+    size_t i;
+    size_t n = 0;
+    uint32_t acc = 0;
+    char c;
+
+    for (i = 0; i < length; i++) {
+        c = in[i];
+        if (c >= 'A' && c <= 'Z') {
+            v = c - 'A';
+        }
+        else if (c >= 'a' && c <= 'z') {
+            v = c - 'a' + 26;
+        }
+        else if (c >= '0' && c <= '9') {
+            v = c - '0' + 52;
+        }
+        else if (c == '-' || c == '+') {
+            v = 62;
+        }
+        else if (c == '_' || c == '/') {
+            v = 63;
+        }
+        else if (c == '=') {
+            break;
+        }
+        else {
+            return -1;
+        }
 
-    /* Upgraded connections from HTTP/1.x requires the preface */
-    if (h2s->status == MK_HTTP2_UPGRADED) {
-        if (h2s->buffer_length >= http2_preface.len) {
-            if (memcmp(h2s->buffer,
-                       http2_preface.data, http2_preface.len) != 0) {
-                MK_H2_TRACE(conn, "Invalid HTTP/2 preface");
-                return 0;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n == size) {
+                return -1;
             }
+            out[n++] = (acc >> bits) & 0xff;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * A HTTP/1.1 request asked to upgrade to h2c (Section 3.2 of RFC 7540): the
+ * request becomes the stream 1, half-closed for the client, and its
+ * response is the first one sent over the new connection.
+ */
+static int mk_http2_upgrade(void *cs, void *sr, struct mk_server *server)
+{
+    int n;
+    size_t length;
+    char *start;
+    uint8_t settings[MK_HTTP2_CHUNK];
+    struct mk_http_session *s = cs;
+    struct mk_http_request *r = sr;
+    struct mk_sched_conn *conn = s->conn;
+    struct mk_http_header *header;
+    struct mk_http2_stream *st;
+    struct mk_http2_session *h2s;
+
+    header = &s->parser.headers[MK_HEADER_HTTP2_SETTINGS];
+    n = h2_base64url_decode(header->val.data, header->val.len,
+                            settings, sizeof(settings));
+
+    h2s = mk_mem_alloc_z(sizeof(struct mk_http2_session));
+    if (!h2s || n < 0 || n % 6 != 0 ||
+        h2_session_init(h2s, conn, server) != 0) {
+        goto error;
+    }
+    h2s->allocated = MK_TRUE;
+
+    if (h2_settings_apply(h2s, settings, n) != 0) {
+        mk_http2_hpack_exit(&h2s->decoder);
+        mk_http2_hpack_exit(&h2s->encoder);
+        mk_stream_release(&h2s->stream_out);
+        goto error;
+    }
 
-            MK_H2_TRACE(conn, "HTTP/2 preface OK");
+    conn->data = h2s;
+    h2s->upgrade = s;
 
-            buffer_consume(h2s, http2_preface.len);
-            h2s->status = MK_HTTP2_OK;
+    h2_send_static(h2s, MK_HTTP2_SWITCHING, sizeof(MK_HTTP2_SWITCHING) - 1);
+    h2_send_static(h2s, MK_HTTP2_SETTINGS_DEFAULT_FRAME,
+                   sizeof(MK_HTTP2_SETTINGS_DEFAULT_FRAME) - 1);
 
-            /* Send out our default settings
-            mk_stream_set(&h2s->stream_settings,
-                          MK_STREAM_RAW,
-                          &conn->channel,
-                          MK_HTTP2_SETTINGS_DEFAULT_FRAME,
-                          sizeof(MK_HTTP2_SETTINGS_DEFAULT_FRAME) - 1,
-                          NULL,
-                          NULL, NULL, NULL);
-            */
+    /* The request, without a body, is served again as HTTP/2 stream */
+    h2s->last_stream_id = 1;
+    st = h2_stream_create(h2s, 1);
+    if (st) {
+        start = r->method_p.data;
+        length = (s->body + s->body_offset) - start;
+        if (h2_stream_write(st, start, length) != 0) {
+            h2_stream_reset(h2s, st, MK_HTTP2_CANCEL);
         }
         else {
-            /* We need more data */
-            return 0;
+            st->flags |= (MK_HTTP2_STREAM_END_REMOTE |
+                          MK_HTTP2_STREAM_SERVED);
+            mk_list_add(&st->session.sr_fixed._head,
+                        &st->session.request_list);
+            mk_http_request_init(&st->session, &st->session.sr_fixed, server);
+            n = mk_http_request_serve(&st->session, &st->session.sr_fixed,
+                                      MK_HTTP_PROTOCOL_20, server);
+            if (n == MK_EXIT_REFUSED || n == MK_PLUGIN_RET_CONTINUE ||
+                h2_stream_respond(h2s, st) != 0) {
+                h2_stream_reset(h2s, st, MK_HTTP2_INTERNAL_ERROR);
+            }
+            else {
+                h2_stream_check(h2s, st);
+            }
         }
     }
 
-    /* Check that we have a minimum header size */
-    if (h2s->buffer_length < MK_HTTP2_HEADER_SIZE) {
-        MK_TRACE("HEADER FRAME incomplete %i/%i bytes",
-                 h2s->buffer_length, MK_HTTP2_HEADER_SIZE);
-        return 0;
+    /* The client preface may have arrived with the request */
+    length = s->body_length - s->body_offset;
+    if (length > 0) {
+        if (length > h2s->buffer_size &&
+            h2_buffer_grow(h2s, length) != 0) {
+            length = 0;
+        }
+        memcpy(h2s->buffer, s->body + s->body_offset, length);
+        h2s->buffer_length = length;
+        s->body_offset = s->body_length;
+        h2_process(h2s);
     }
 
-    /* We have at least one frame */
-    return mk_http2_frame_run(conn, worker);
-}
+    h2_dispatch(h2s);
+
+    return MK_EXIT_OK;
 
+ error:
+    if (h2s) {
+        mk_mem_free(h2s);
+    }
+    mk_sched_switch_protocol(conn, MK_CAP_HTTP);
+    return mk_http_error(MK_CLIENT_BAD_REQUEST, s, r, server);
+}
 
 struct mk_sched_handler mk_http2_handler = {
     .name             = "http2",
     .cb_read          = mk_http2_sched_read,
-    .cb_close         = NULL,
-    .cb_done          = NULL,
+    .cb_close         = mk_http2_sched_close,
+    .cb_done          = mk_http2_sched_done,
     .cb_upgrade       = mk_http2_upgrade,
     .sched_extra_size = sizeof(struct mk_http2_session),
+    .sched_zero_size  = offsetof(struct mk_http2_session, buffer_fixed),
     .capabilities     = MK_CAP_HTTP2
 };
@@ -0,0 +1,805 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_http2_hpack.h>
+
+/*
+ * HPACK decoder and encoder (RFC 7541). The code is self contained and
+ * does not depend on the HTTP/2 session, the session owns two contexts
+ * and feeds them with header blocks.
+ */
+
+struct hpack_static_entry {
+    const char *name;
+    const char *value;
+    uint8_t name_len;
+    uint8_t value_len;
+};
+
+#define HS(n, v)  {n, v, sizeof(n) - 1, sizeof(v) - 1}
+
+/* Static table, Appendix A. Index 0 is not used */
+static const struct hpack_static_entry hpack_static[] = {
+    HS("", ""),
+    HS(":authority", ""),
+    HS(":method", "GET"),
+    HS(":method", "POST"),
+    HS(":path", "/"),
+    HS(":path", "/index.html"),
+    HS(":scheme", "http"),
+    HS(":scheme", "https"),
+    HS(":status", "200"),
+    HS(":status", "204"),
+    HS(":status", "206"),
+    HS(":status", "304"),
+    HS(":status", "400"),
+    HS(":status", "404"),
+    HS(":status", "500"),
+    HS("accept-charset", ""),
+    HS("accept-encoding", "gzip, deflate"),
+    HS("accept-language", ""),
+    HS("accept-ranges", ""),
+    HS("accept", ""),
+    HS("access-control-allow-origin", ""),
+    HS("age", ""),
+    HS("allow", ""),
+    HS("authorization", ""),
+    HS("cache-control", ""),
+    HS("content-disposition", ""),
+    HS("content-encoding", ""),
+    HS("content-language", ""),
+    HS("content-length", ""),
+    HS("content-location", ""),
+    HS("content-range", ""),
+    HS("content-type", ""),
+    HS("cookie", ""),
+    HS("date", ""),
+    HS("etag", ""),
+    HS("expect", ""),
+    HS("expires", ""),
+    HS("from", ""),
+    HS("host", ""),
+    HS("if-match", ""),
+    HS("if-modified-since", ""),
+    HS("if-none-match", ""),
+    HS("if-range", ""),
+    HS("if-unmodified-since", ""),
+    HS("last-modified", ""),
+    HS("link", ""),
+    HS("location", ""),
+    HS("max-forwards", ""),
+    HS("proxy-authenticate", ""),
+    HS("proxy-authorization", ""),
+    HS("range", ""),
+    HS("referer", ""),
+    HS("refresh", ""),
+    HS("retry-after", ""),
+    HS("server", ""),
+    HS("set-cookie", ""),
+    HS("strict-transport-security", ""),
+    HS("transfer-encoding", ""),
+    HS("user-agent", ""),
+    HS("vary", ""),
+    HS("via", ""),
+    HS("www-authenticate", "")
+};
+
+#undef HS
+
+/* Huffman code of each symbol, RFC 7541 Appendix B */
+static const uint32_t hpack_huff_code[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff
+};
+
+static const uint8_t hpack_huff_bits[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+/*
+ * The code is canonical: the symbols of each length have consecutive codes.
+ * For every code length, the first code, the number of codes and where the
+ * symbols start in hpack_huff_sym[].
+ */
+static const uint32_t hpack_huff_first[31] = {
+    0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+    0x14, 0x5c, 0xf8, 0x0, 0x3f8, 0x7fa,
+    0xffa, 0x1ff8, 0x3ffc, 0x7ffc, 0x0, 0x0,
+    0x0, 0x7fff0, 0xfffe6, 0x1fffdc, 0x3fffd2, 0x7fffd8,
+    0xffffea, 0x1ffffec, 0x3ffffe0, 0x7ffffde, 0xfffffe2, 0x0,
+    0x3ffffffc
+};
+
+static const uint16_t hpack_huff_count[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+static const uint16_t hpack_huff_index[31] = {
+    0, 0, 0, 0, 0, 0, 10, 36, 68, 0, 74, 79, 82, 84, 90, 92,
+    0, 0, 0, 95, 98, 106, 119, 145, 174, 186, 190, 205, 224, 0, 253
+};
+
+static const uint16_t hpack_huff_sym[257] = {
+     48,  49,  50,  97,  99, 101, 105, 111, 115, 116,  32,  37,
+     45,  46,  47,  51,  52,  53,  54,  55,  56,  57,  61,  65,
+     95,  98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+     58,  66,  67,  68,  69,  70,  71,  72,  73,  74,  75,  76,
+     77,  78,  79,  80,  81,  82,  83,  84,  85,  86,  87,  89,
+    106, 107, 113, 118, 119, 120, 121, 122,  38,  42,  44,  59,
+     88,  90,  33,  34,  40,  41,  63,  39,  43, 124,  35,  62,
+      0,  36,  64,  91,  93, 126,  94, 125,  60,  96, 123,  92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233,   1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239,   9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254,   2,   3,   4,   5,
+      6,   7,   8,  11,  12,  14,  15,  16,  17,  18,  19,  20,
+     21,  23,  24,  25,  26,  27,  28,  29,  30,  31, 127, 220,
+    249,  10,  13,  22, 256
+};
+
+#define HPACK_HUFF_EOS  256
+
+/* Dynamic table */
+
+static inline struct mk_http2_hpack_entry *table_get(struct mk_http2_hpack *ctx,
+                                                     unsigned int i)
+{
+    return ctx->entries[(ctx->first + i) & ctx->mask];
+}
+
+static inline uint32_t entry_size(struct mk_http2_hpack_entry *e)
+{
+    return e->name_len + e->value_len + MK_HTTP2_HPACK_ENTRY_OVERHEAD;
+}
+
+static void table_evict(struct mk_http2_hpack *ctx, uint32_t max_size)
+{
+    struct mk_http2_hpack_entry *e;
+
+    while (ctx->count > 0 && ctx->size > max_size) {
+        e = table_get(ctx, ctx->count - 1);
+        ctx->size -= entry_size(e);
+        ctx->count--;
+        mk_mem_free(e);
+    }
+}
+
+/*
+ * Add a field to the table. The name or the value may point to an entry
+ * that is about to be evicted, so the copy is made before evicting.
+ */
+static int table_add(struct mk_http2_hpack *ctx,
+                     const char *name, size_t name_len,
+                     const char *value, size_t value_len)
+{
+    size_t size;
+    struct mk_http2_hpack_entry *e;
+
+    size = name_len + value_len + MK_HTTP2_HPACK_ENTRY_OVERHEAD;
+    if (size > ctx->max_size) {
+        /* not an error: the table ends empty (Section 4.4) */
+        table_evict(ctx, 0);
+        return 0;
+    }
+
+    e = mk_mem_alloc(sizeof(struct mk_http2_hpack_entry) +
+                     name_len + value_len);
+    if (!e) {
+        return -1;
+    }
+    e->name_len = name_len;
+    e->value_len = value_len;
+    e->value = e->name + name_len;
+    memcpy(e->name, name, name_len);
+    memcpy(e->value, value, value_len);
+
+    table_evict(ctx, ctx->max_size - size);
+
+    ctx->first = (ctx->first - 1) & ctx->mask;
+    ctx->entries[ctx->first] = e;
+    ctx->count++;
+    ctx->size += size;
+
+    return 0;
+}
+
+/* Resolve an index of the static or dynamic table */
+static int table_lookup(struct mk_http2_hpack *ctx, uint32_t index,
+                        char **name, size_t *name_len,
+                        char **value, size_t *value_len)
+{
+    struct mk_http2_hpack_entry *e;
+
+    if (index == 0) {
+        return -1;
+    }
+
+    if (index <= MK_HTTP2_HPACK_STATIC_SIZE) {
+        *name = (char *) hpack_static[index].name;
+        *name_len = hpack_static[index].name_len;
+        *value = (char *) hpack_static[index].value;
+        *value_len = hpack_static[index].value_len;
+        return 0;
+    }
+
+    index -= MK_HTTP2_HPACK_STATIC_SIZE + 1;
+    if (index >= ctx->count) {
+        return -1;
+    }
+
+    e = table_get(ctx, index);
+    *name = e->name;
+    *name_len = e->name_len;
+    *value = e->value;
+    *value_len = e->value_len;
+    return 0;
+}
+
+int mk_http2_hpack_init(struct mk_http2_hpack *ctx, uint32_t limit)
+{
+    unsigned int slots = 1;
+
+    /* the smallest entry takes 32 bytes, that bounds the number of slots */
+    while (slots <= limit / MK_HTTP2_HPACK_ENTRY_OVERHEAD) {
+        slots <<= 1;
+    }
+
+    ctx->entries = mk_mem_alloc(sizeof(struct mk_http2_hpack_entry *) * slots);
+    if (!ctx->entries) {
+        return -1;
+    }
+
+    ctx->size = 0;
+    ctx->max_size = limit;
+    ctx->limit = limit;
+    ctx->size_update = MK_FALSE;
+    ctx->first = 0;
+    ctx->count = 0;
+    ctx->mask = slots - 1;
+    ctx->buf = NULL;
+    ctx->buf_size = 0;
+
+    return 0;
+}
+
+void mk_http2_hpack_exit(struct mk_http2_hpack *ctx)
+{
+    table_evict(ctx, 0);
+    mk_mem_free(ctx->entries);
+    ctx->entries = NULL;
+
+    if (ctx->buf) {
+        mk_mem_free(ctx->buf);
+        ctx->buf = NULL;
+    }
+}
+
+/*
+ * The peer changed SETTINGS_HEADER_TABLE_SIZE. The encoder never grows
+ * beyond the size it was created with, if the table must shrink the next
+ * header block starts with a Dynamic Table Size Update.
+ */
+void mk_http2_hpack_set_limit(struct mk_http2_hpack *ctx, uint32_t limit)
+{
+    uint32_t size;
+
+    size = (limit < ctx->limit) ? limit : ctx->limit;
+    if (size == ctx->max_size) {
+        return;
+    }
+
+    ctx->max_size = size;
+    table_evict(ctx, size);
+    ctx->size_update = MK_TRUE;
+}
+
+/* Integers (Section 5.1) */
+
+static int int_decode(uint8_t **p, uint8_t *end, int prefix, uint32_t *out)
+{
+    int shift = 0;
+    uint8_t b;
+    uint32_t mask = (1 << prefix) - 1;
+    uint64_t value;
+
+    value = **p & mask;
+    (*p)++;
+
+    if (value < mask) {
+        *out = value;
+        return 0;
+    }
+
+    do {
+        if (*p >= end || shift > 28) {
+            return -1;
+        }
+        b = **p;
+        (*p)++;
+        value += (uint64_t) (b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+
+    if (value > UINT32_MAX) {
+        return -1;
+    }
+
+    *out = value;
+    return 0;
+}
+
+static int int_encode(uint8_t *out, size_t size, int prefix, uint8_t flags,
+                      uint32_t value)
+{
+    size_t n = 0;
+    uint32_t mask = (1 << prefix) - 1;
+
+    if (size == 0) {
+        return -1;
+    }
+
+    if (value < mask) {
+        out[n++] = flags | value;
+        return n;
+    }
+
+    out[n++] = flags | mask;
+    value -= mask;
+    while (value >= 0x80) {
+        if (n == size) {
+            return -1;
+        }
+        out[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if (n == size) {
+        return -1;
+    }
+    out[n++] = value;
+
+    return n;
+}
+
+/* Huffman (Section 5.2) */
+
+static int huff_decode(uint8_t *src, size_t len, char *dst)
+{
+    int bits = 0;
+    int i;
+    size_t n = 0;
+    uint32_t code = 0;
+    uint32_t offset;
+    uint8_t byte;
+    uint8_t *end = src + len;
+
+    while (src < end) {
+        byte = *src++;
+        for (i = 7; i >= 0; i--) {
+            code = (code << 1) | ((byte >> i) & 1);
+            bits++;
+
+            if (bits > 30) {
+                return -1;
+            }
+
+            offset = code - hpack_huff_first[bits];
+            if (code < hpack_huff_first[bits] ||
+                offset >= hpack_huff_count[bits]) {
+                continue;
+            }
+
+            offset = hpack_huff_sym[hpack_huff_index[bits] + offset];
+            if (offset == HPACK_HUFF_EOS) {
+                return -1;
+            }
+            dst[n++] = offset;
+            code = 0;
+            bits = 0;
+        }
+    }
+
+    /* padding: up to 7 bits, all of them set */
+    if (bits > 7 || code != (uint32_t) ((1 << bits) - 1)) {
+        return -1;
+    }
+
+    return n;
+}
+
+static size_t huff_length(const char *src, size_t len)
+{
+    size_t i;
+    size_t bits = 0;
+
+    for (i = 0; i < len; i++) {
+        bits += hpack_huff_bits[(uint8_t) src[i]];
+    }
+    return (bits + 7) / 8;
+}
+
+static void huff_encode(const char *src, size_t len, uint8_t *dst)
+{
+    int bits = 0;
+    size_t i;
+    uint64_t acc = 0;
+    uint8_t sym;
+
+    for (i = 0; i < len; i++) {
+        sym = src[i];
+        acc = (acc << hpack_huff_bits[sym]) | hpack_huff_code[sym];
+        bits += hpack_huff_bits[sym];
+        while (bits >= 8) {
+            bits -= 8;
+            *dst++ = acc >> bits;
+        }
+    }
+
+    /* pad with the most significant bits of EOS */
+    if (bits > 0) {
+        *dst = (acc << (8 - bits)) | (0xff >> bits);
+    }
+}
+
+/* Strings (Section 5.2) */
+
+static int string_decode(struct mk_http2_hpack *ctx, uint8_t **p, uint8_t *end,
+                         size_t *used, char **out, size_t *out_len)
+{
+    int ret;
+    int huffman;
+    uint32_t len;
+
+    if (*p >= end) {
+        return -1;
+    }
+
+    huffman = **p & 0x80;
+    if (int_decode(p, end, 7, &len) != 0 || len > (size_t) (end - *p)) {
+        return -1;
+    }
+
+    if (!huffman) {
+        *out = (char *) *p;
+        *out_len = len;
+        *p += len;
+        return 0;
+    }
+
+    /* the shortest code is 5 bits */
+    if (*used + ((len * 8) / 5) + 1 > ctx->buf_size) {
+        return -1;
+    }
+
+    ret = huff_decode(*p, len, ctx->buf + *used);
+    if (ret < 0) {
+        return -1;
+    }
+
+    *out = ctx->buf + *used;
+    *out_len = ret;
+    *used += ret;
+    *p += len;
+
+    return 0;
+}
+
+/*
+ * Decode a complete header block, invoking the callback for each field. On
+ * error the connection must be closed with COMPRESSION_ERROR, since the
+ * state of the dynamic table is no longer in sync with the peer.
+ */
+int mk_http2_hpack_decode(struct mk_http2_hpack *ctx,
+                          uint8_t *buf, size_t len,
+                          mk_http2_hpack_cb cb, void *data)
+{
+    int fields = 0;
+    int index_field;
+    size_t used;
+    size_t need;
+    uint8_t b;
+    uint32_t index;
+    uint8_t *p = buf;
+    uint8_t *end = buf + len;
+    char *name;
+    char *value;
+    size_t name_len;
+    size_t value_len;
+
+    /* room for the Huffman decoded strings of a single field */
+    need = ((len * 8) / 5) + 16;
+    if (need > ctx->buf_size) {
+        if (ctx->buf) {
+            mk_mem_free(ctx->buf);
+        }
+        ctx->buf = mk_mem_alloc(need);
+        if (!ctx->buf) {
+            ctx->buf_size = 0;
+            return -1;
+        }
+        ctx->buf_size = need;
+    }
+
+    while (p < end) {
+        b = *p;
+        used = 0;
+
+        /* Indexed Header Field */
+        if (b & 0x80) {
+            if (int_decode(&p, end, 7, &index) != 0 ||
+                table_lookup(ctx, index, &name, &name_len,
+                             &value, &value_len) != 0) {
+                return -1;
+            }
+            cb(data, name, name_len, value, value_len);
+            fields++;
+            continue;
+        }
+
+        /* Dynamic Table Size Update, only at the beginning of the block */
+        if ((b & 0xe0) == 0x20) {
+            if (fields > 0 || int_decode(&p, end, 5, &index) != 0 ||
+                index > ctx->limit) {
+                return -1;
+            }
+            ctx->max_size = index;
+            table_evict(ctx, index);
+            continue;
+        }
+
+        /* Literal Header Field: with, without or never indexed */
+        if (b & 0x40) {
+            index_field = MK_TRUE;
+            if (int_decode(&p, end, 6, &index) != 0) {
+                return -1;
+            }
+        }
+        else {
+            index_field = MK_FALSE;
+            if (int_decode(&p, end, 4, &index) != 0) {
+                return -1;
+            }
+        }
+
+        if (index > 0) {
+            if (table_lookup(ctx, index, &name, &name_len,
+                             &value, &value_len) != 0) {
+                return -1;
+            }
+        }
+        else if (string_decode(ctx, &p, end, &used, &name, &name_len) != 0) {
+            return -1;
+        }
+
+        if (string_decode(ctx, &p, end, &used, &value, &value_len) != 0) {
+            return -1;
+        }
+
+        cb(data, name, name_len, value, value_len);
+        fields++;
+
+        if (index_field == MK_TRUE &&
+            table_add(ctx, name, name_len, value, value_len) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Emit a pending Dynamic Table Size Update, must start each header block */
+int mk_http2_hpack_encode_begin(struct mk_http2_hpack *ctx,
+                                uint8_t *out, size_t size)
+{
+    int ret;
+
+    if (ctx->size_update == MK_FALSE) {
+        return 0;
+    }
+
+    ret = int_encode(out, size, 5, 0x20, ctx->max_size);
+    if (ret > 0) {
+        ctx->size_update = MK_FALSE;
+    }
+    return ret;
+}
+
+static int string_encode(uint8_t *out, size_t size,
+                         const char *str, size_t len)
+{
+    int n;
+    size_t hlen;
+
+    hlen = huff_length(str, len);
+    if (hlen < len) {
+        n = int_encode(out, size, 7, 0x80, hlen);
+        if (n < 0 || hlen > size - n) {
+            return -1;
+        }
+        huff_encode(str, len, out + n);
+        return n + hlen;
+    }
+
+    n = int_encode(out, size, 7, 0x00, len);
+    if (n < 0 || len > size - n) {
+        return -1;
+    }
+    memcpy(out + n, str, len);
+    return n + len;
+}
+
+/*
+ * Encode a header field into 'out', the name must be in lowercase. Returns
+ * the number of bytes written or -1 if there is not enough room.
+ */
+int mk_http2_hpack_encode(struct mk_http2_hpack *ctx,
+                          uint8_t *out, size_t size,
+                          const char *name, size_t name_len,
+                          const char *value, size_t value_len,
+                          int mode)
+{
+    int i;
+    int n;
+    int ret;
+    uint8_t flags;
+    uint8_t prefix;
+    uint32_t name_index = 0;
+    unsigned int j;
+    const struct hpack_static_entry *s;
+    struct mk_http2_hpack_entry *e;
+
+    for (i = 1; i <= MK_HTTP2_HPACK_STATIC_SIZE; i++) {
+        s = &hpack_static[i];
+        if (s->name_len != name_len || memcmp(s->name, name, name_len) != 0) {
+            continue;
+        }
+        if (s->value_len == value_len &&
+            memcmp(s->value, value, value_len) == 0) {
+            return int_encode(out, size, 7, 0x80, i);
+        }
+        if (name_index == 0) {
+            name_index = i;
+        }
+    }
+
+    if (mode != MK_HTTP2_HPACK_NEVER_INDEX) {
+        for (j = 0; j < ctx->count; j++) {
+            e = table_get(ctx, j);
+            if (e->name_len != name_len ||
+                memcmp(e->name, name, name_len) != 0) {
+                continue;
+            }
+            if (e->value_len == value_len &&
+                memcmp(e->value, value, value_len) == 0) {
+                return int_encode(out, size, 7, 0x80,
+                                  MK_HTTP2_HPACK_STATIC_SIZE + 1 + j);
+            }
+            if (name_index == 0) {
+                name_index = MK_HTTP2_HPACK_STATIC_SIZE + 1 + j;
+            }
+        }
+    }
+
+    if (mode == MK_HTTP2_HPACK_INDEX) {
+        flags = 0x40;
+        prefix = 6;
+    }
+    else if (mode == MK_HTTP2_HPACK_NEVER_INDEX) {
+        flags = 0x10;
+        prefix = 4;
+    }
+    else {
+        flags = 0x00;
+        prefix = 4;
+    }
+
+    n = int_encode(out, size, prefix, flags, name_index);
+    if (n < 0) {
+        return -1;
+    }
+
+    if (name_index == 0) {
+        ret = string_encode(out + n, size - n, name, name_len);
+        if (ret < 0) {
+            return -1;
+        }
+        n += ret;
+    }
+
+    ret = string_encode(out + n, size - n, value, value_len);
+    if (ret < 0) {
+        return -1;
+    }
+    n += ret;
+
+    if (mode == MK_HTTP2_HPACK_INDEX &&
+        table_add(ctx, name, name_len, value, value_len) != 0) {
+        return -1;
+    }
+
+    return n;
+}
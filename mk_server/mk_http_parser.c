@@ -26,10 +26,17 @@
 #include <stdint.h>
 #include <limits.h>
 
+#include <pthread.h>
+
 #include <monkey/mk_http.h>
 #include <monkey/mk_http_parser.h>
 #include <monkey/mk_http_status.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MK_HTTP_PARSER_SIMD
+#include <immintrin.h>
+#endif
+
 #define mark_end()                              \
     p->end = p->i;                              \
     p->chars = -1;
@@ -39,7 +46,6 @@
     continue
 
 #define field_len()   (p->end - p->start)
-#define header_scope_eq(p, x) p->header_min = p->header_max = x
 
 struct row_entry {
     int len;
@@ -78,6 +84,176 @@ struct row_entry mk_headers_table[] = {
     { 10, "user-agent"          }
 };
 
+/*
+ * Perfect hash for the known headers table: the key length plus the first
+ * and last characters (lowercase) give a unique slot for every entry in
+ * mk_headers_table. If a header is added, the table must be regenerated.
+ */
+#define MK_HEADERS_HASH_SIZE 32
+#define header_hash(len, first, last)                   \
+    ((len + (first * 7) + last) & (MK_HEADERS_HASH_SIZE - 1))
+
+static const signed char mk_headers_hash[MK_HEADERS_HASH_SIZE] = {
+    MK_HEADER_COOKIE,              /*  0 */
+    MK_HEADER_ACCEPT,              /*  1 */
+    MK_HEADER_AUTHORIZATION,       /*  2 */
+    -1, -1,
+    MK_HEADER_LAST_MODIFIED,       /*  5 */
+    MK_HEADER_CONTENT_TYPE,        /*  6 */
+    MK_HEADER_CONTENT_RANGE,       /*  7 */
+    MK_HEADER_RANGE,               /*  8 */
+    MK_HEADER_ACCEPT_CHARSET,      /*  9 */
+    -1,
+    MK_HEADER_CONTENT_LENGTH,      /* 11 */
+    MK_HEADER_LAST_MODIFIED_SINCE, /* 12 */
+    MK_HEADER_CONNECTION,          /* 13 */
+    MK_HEADER_CACHE_CONTROL,       /* 14 */
+    -1,
+    MK_HEADER_HOST,                /* 16 */
+    MK_HEADER_USER_AGENT,          /* 17 */
+    -1, -1, -1,
+    MK_HEADER_IF_MODIFIED_SINCE,   /* 21 */
+    -1,
+    MK_HEADER_REFERER,             /* 23 */
+    -1,
+    MK_HEADER_HTTP2_SETTINGS,      /* 25 */
+    -1,
+    MK_HEADER_ACCEPT_LANGUAGE,     /* 27 */
+    -1,
+    MK_HEADER_ACCEPT_ENCODING,     /* 29 */
+    -1,
+    MK_HEADER_UPGRADE              /* 31 */
+};
+
+/*
+ * Delimiters scanner
+ * ------------------
+ * Find the first byte of buffer[i, len) that matches any of the 'n' (up to
+ * MK_HTTP_SCAN_SET) characters in 'set', returns its position or -1. The
+ * vectorized versions (SSE4.2 and AVX2) are selected at runtime by
+ * mk_http_parser_setup(), the scalar one handles the tail and the CPUs
+ * without support.
+ */
+#define MK_HTTP_SCAN_SET  4
+
+typedef int (*scan_func_t)(const char *, int, int, const char *, int);
+
+static int scan_scalar(const char *buf, int i, int len,
+                       const char *set, int n)
+{
+    int x;
+
+    for (; i < len; i++) {
+        for (x = 0; x < n; x++) {
+            if (buf[i] == set[x]) {
+                return i;
+            }
+        }
+    }
+
+    return -1;
+}
+
+#ifdef MK_HTTP_PARSER_SIMD
+__attribute__((target("sse4.2")))
+static int scan_sse42(const char *buf, int i, int len,
+                      const char *set, int n)
+{
+    int r;
+    char tmp[16] = {0};
+    __m128i chars;
+    __m128i data;
+
+    memcpy(tmp, set, n);
+    chars = _mm_loadu_si128((const __m128i *) tmp);
+
+    while (len - i >= 16) {
+        data = _mm_loadu_si128((const __m128i *) (buf + i));
+        r = _mm_cmpestri(chars, n, data, 16,
+                         _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+                         _SIDD_LEAST_SIGNIFICANT);
+        if (r != 16) {
+            return i + r;
+        }
+        i += 16;
+    }
+
+    return scan_scalar(buf, i, len, set, n);
+}
+
+__attribute__((target("avx2")))
+static int scan_avx2(const char *buf, int i, int len,
+                     const char *set, int n)
+{
+    int x;
+    unsigned int mask;
+    __m256i chars[MK_HTTP_SCAN_SET];
+    __m256i data;
+    __m256i match;
+
+    for (x = 0; x < n; x++) {
+        chars[x] = _mm256_set1_epi8(set[x]);
+    }
+
+    while (len - i >= 32) {
+        data = _mm256_loadu_si256((const __m256i *) (buf + i));
+        match = _mm256_cmpeq_epi8(data, chars[0]);
+        for (x = 1; x < n; x++) {
+            match = _mm256_or_si256(match, _mm256_cmpeq_epi8(data, chars[x]));
+        }
+
+        mask = (unsigned int) _mm256_movemask_epi8(match);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 32;
+    }
+
+    return scan_scalar(buf, i, len, set, n);
+}
+#endif
+
+static scan_func_t mk_http_scan = scan_scalar;
+static pthread_once_t mk_http_scan_once = PTHREAD_ONCE_INIT;
+
+static void mk_http_scan_select(void)
+{
+#ifdef MK_HTTP_PARSER_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        mk_http_scan = scan_avx2;
+    }
+    else if (__builtin_cpu_supports("sse4.2")) {
+        mk_http_scan = scan_sse42;
+    }
+#endif
+}
+
+/* Select the delimiters scanner for the running CPU */
+void mk_http_parser_setup(void)
+{
+    pthread_once(&mk_http_scan_once, mk_http_scan_select);
+}
+
+/*
+ * Move the parser to the first delimiter of 'set' or to the last byte
+ * available if there is none, so the main loop resumes from the next
+ * byte once more data arrives.
+ */
+static inline void scan_lookup(char *buf, const char *set, int n, int len,
+                               struct mk_http_parser *p)
+{
+    int pos;
+
+    pos = mk_http_scan(buf, p->i, len, set, n);
+    if (pos == -1) {
+        p->i = len - 1;
+    }
+    else {
+        p->i = pos;
+    }
+}
+
 static inline void reverse_char_lookup(char *buf, char c, int len, struct mk_http_parser *p)
 {
     int x = 0;
@@ -208,14 +384,11 @@ static inline int header_lookup(struct mk_http_parser *p, char *buffer)
     struct row_entry *h;
 
     len = (p->header_sep - p->header_key);
-    for (i = p->header_min; i <= p->header_max && i >= 0; i++) {
+    tmp = buffer + p->header_key;
+    i = mk_headers_hash[header_hash(len, tolower(tmp[0]), tolower(tmp[len - 1]))];
+    if (i >= 0) {
         h = &mk_headers_table[i];
-        /* Check string length first */
-        if (h->len != len) {
-            continue;
-        }
-
-        if (header_cmp(h->name + 1, buffer + p->header_key + 1, len - 1) == 0) {
+        if (h->len == len && header_cmp(h->name, tmp, len) == 0) {
             /* We got a header match, register the header index */
             header = &p->headers[i];
             header->type = i;
@@ -388,7 +561,6 @@ static inline int mk_http_parser_ok(struct mk_http_request *req,
 int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                    char *buffer, int buf_len, struct mk_server *server)
 {
-    int s;
     int tmp;
     int ret;
     int len;
@@ -454,6 +626,7 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                 }
                 break;
             case MK_ST_REQ_URI:                         /* URI */
+                scan_lookup(buffer, " ?\r\n", 4, len, p);
                 if (buffer[p->i] == ' ') {
                     mark_end();
                     p->status = MK_ST_REQ_PROT_VERSION;
@@ -576,57 +749,21 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                     }
                 }
 
+                /* We reach the start of a Header row */
                 if (p->chars == 0) {
-                    /*
-                     * We reach the start of a Header row, lets catch the most
-                     * probable header.
-                     *
-                     * The goal of this 'first row character lookup', is to define a
-                     * small range set of probable headers comparison once we catch
-                     * a header end.
-                     */
-                    s = tolower(buffer[p->i]);
-                    switch (s) {
-                    case 'a':
-                        p->header_min = MK_HEADER_ACCEPT;
-                        p->header_max = MK_HEADER_AUTHORIZATION;
-                        break;
-                    case 'c':
-                        p->header_min = MK_HEADER_CACHE_CONTROL;
-                        p->header_max = MK_HEADER_CONTENT_TYPE;
-                        break;
-                    case 'h':
-                        p->header_min = MK_HEADER_HOST;
-                        p->header_max = MK_HEADER_HTTP2_SETTINGS;
-                        break;
-                    case 'i':
-                        header_scope_eq(p, MK_HEADER_IF_MODIFIED_SINCE);
-                        break;
-                    case 'l':
-                        p->header_min = MK_HEADER_LAST_MODIFIED;
-                        p->header_max = MK_HEADER_LAST_MODIFIED_SINCE;
-                        break;
-                    case 'r':
-                        p->header_min = MK_HEADER_RANGE;
-                        p->header_max = MK_HEADER_REFERER;
-                        break;
-                    case 'u':
-                        p->header_min = MK_HEADER_UPGRADE;
-                        p->header_max = MK_HEADER_USER_AGENT;
-                        break;
-                    default:
-                        p->header_key = -1;
-                        p->header_sep = -1;
-                        p->header_min = -1;
-                        p->header_max = -1;
-                    };
                     p->header_key = p->i;
                     continue;
                 }
 
                 /* Found key/value separator */
-                char_lookup(buffer, ':', len, p);
-                if (buffer[p->i] == ':') {
+                scan_lookup(buffer, ":\r\n", 3, len, p);
+                if (buffer[p->i] == '\r' || buffer[p->i] == '\n') {
+                    /* Header row without a key/value separator */
+                    mk_http_error(MK_CLIENT_BAD_REQUEST, req->session,
+                                  req, server);
+                    return MK_HTTP_PARSER_ERROR;
+                }
+                else if (buffer[p->i] == ':') {
                     /* Set the key/value middle point */
                     p->header_sep = p->i;
 
@@ -655,6 +792,8 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
             }
             /* New header row starts */
             else if (p->status == MK_ST_HEADER_VAL_STARTS) {
+                scan_lookup(buffer, "\r\n", 2, len, p);
+
                 /* Maybe there is no more headers and we reach the end ? */
                 if (buffer[p->i] == '\r') {
                     mark_end();
@@ -731,8 +870,12 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                     return MK_HTTP_PARSER_PENDING;
                 }
 
-                /* Cut off */
-                p->i += p->body_received;
+                /*
+                 * Cut off: the body ends at Content-Length, any byte after
+                 * it belongs to the next pipelined request.
+                 */
+                p->body_received = p->header_content_length;
+                p->i = p->start + p->body_received - 1;
                 req->data.len  = p->body_received;
                 req->data.data = (buffer + p->start);
             }
@@ -0,0 +1,335 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <limits.h>
+#include <strings.h>
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_http.h>
+#include <monkey/mk_http_status.h>
+#include <monkey/mk_http_range.h>
+#include <monkey/mk_header.h>
+#include <monkey/mk_clock.h>
+
+static inline char *range_skip_spaces(char *p, char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    return p;
+}
+
+/* Parse a non negative decimal number in place, no allocation involved */
+static inline int range_number(char **p, char *end, long *out)
+{
+    long n = 0;
+    char *s = *p;
+
+    while (s < end && *s >= '0' && *s <= '9') {
+        if (n > (LONG_MAX - 9) / 10) {
+            return -1;
+        }
+        n = (n * 10) + (*s - '0');
+        s++;
+    }
+
+    if (s == *p) {
+        return -1;
+    }
+
+    *p = s;
+    *out = n;
+    return 0;
+}
+
+/*
+ * Parse a 'bytes=' Range header value into the ranges array. Returns the
+ * number of ranges found, size + 1 if there are more than 'size' ranges
+ * or -1 if the value is malformed.
+ */
+int mk_http_range_parse(mk_ptr_t *value, struct mk_http_range *ranges,
+                        int size)
+{
+    int count = 0;
+    char *p;
+    char *end;
+    struct mk_http_range *r;
+
+    if (!value->data) {
+        return -1;
+    }
+
+    p = value->data;
+    end = value->data + value->len;
+
+    p = range_skip_spaces(p, end);
+    if (end - p < 6 || strncasecmp(p, "bytes", 5) != 0) {
+        return -1;
+    }
+    p = range_skip_spaces(p + 5, end);
+    if (p == end || *p != '=') {
+        return -1;
+    }
+    p++;
+
+    while (1) {
+        p = range_skip_spaces(p, end);
+        if (p == end) {
+            break;
+        }
+
+        /* empty list elements are allowed */
+        if (*p == ',') {
+            p++;
+            continue;
+        }
+
+        if (count == size) {
+            return size + 1;
+        }
+        r = &ranges[count];
+
+        if (*p == '-') {
+            /* -N: last N bytes */
+            p++;
+            r->start = -1;
+            if (range_number(&p, end, &r->end) != 0) {
+                return -1;
+            }
+        }
+        else {
+            /* N- or N-M */
+            if (range_number(&p, end, &r->start) != 0) {
+                return -1;
+            }
+            p = range_skip_spaces(p, end);
+            if (p == end || *p != '-') {
+                return -1;
+            }
+            p = range_skip_spaces(p + 1, end);
+
+            r->end = -1;
+            if (p < end && *p >= '0' && *p <= '9') {
+                range_number(&p, end, &r->end);
+                if (r->end < r->start) {
+                    return -1;
+                }
+            }
+        }
+
+        p = range_skip_spaces(p, end);
+        if (p < end && *p != ',') {
+            return -1;
+        }
+        count++;
+    }
+
+    if (count == 0) {
+        return -1;
+    }
+
+    return count;
+}
+
+/* Turn a requested range into absolute offsets within the file */
+static inline int range_resolve(struct mk_http_range *r, long file_size)
+{
+    if (r->start == -1) {
+        if (r->end == 0) {
+            return -1;
+        }
+        r->start = (r->end < file_size) ? file_size - r->end : 0;
+        r->end = file_size - 1;
+        return 0;
+    }
+
+    if (r->start >= file_size) {
+        return -1;
+    }
+    if (r->end == -1 || r->end >= file_size) {
+        r->end = file_size - 1;
+    }
+    return 0;
+}
+
+static int range_multipart(struct mk_http_request *sr,
+                           struct mk_http_range *ranges, int count,
+                           long file_size)
+{
+    int i;
+    long length = 0;
+    unsigned long id;
+    time_t now;
+    mk_ptr_t *type;
+    struct mk_http_multirange *mr;
+    struct mk_http_range_part *part;
+    struct response_headers *sh = &sr->headers;
+
+    mr = mk_mem_alloc(sizeof(struct mk_http_multirange) +
+                      (sizeof(struct mk_http_range_part) * count));
+    if (!mr) {
+        return -1;
+    }
+    mr->count = count;
+
+    /* The boundary only needs to be unlikely to appear in the content */
+    now = sr->session->server->clock_context->log_current_utime;
+    id = ((unsigned long) now << 24) ^ (unsigned long) (uintptr_t) sr ^
+        (unsigned long) file_size;
+
+    mr->delim_len = snprintf(mr->delim, sizeof(mr->delim),
+                             "\r\n--%016lx\r\n", id);
+    mr->close_len = snprintf(mr->close, sizeof(mr->close),
+                             "\r\n--%016lx--\r\n", id);
+    mr->content_type_len = snprintf(mr->content_type,
+                                    sizeof(mr->content_type),
+                                    "Content-Type: multipart/byteranges; "
+                                    "boundary=%016lx\r\n", id);
+
+    /* Each part repeats the Content-Type of the resource */
+    type = &sh->content_type;
+
+    for (i = 0; i < count; i++) {
+        part = &mr->parts[i];
+        part->offset = ranges[i].start;
+        part->length = (ranges[i].end - ranges[i].start) + 1;
+        part->range_len = snprintf(part->range, sizeof(part->range),
+                                   "%s bytes %ld-%ld/%ld\r\n\r\n",
+                                   RH_CONTENT_RANGE,
+                                   ranges[i].start, ranges[i].end,
+                                   file_size);
+
+        part->iov.io = part->io;
+        part->iov.buf_to_free = NULL;
+        mk_iov_init(&part->iov, 3, 0);
+        mk_iov_add(&part->iov, mr->delim, mr->delim_len, MK_FALSE);
+        if (type->len > 0) {
+            mk_iov_add(&part->iov, type->data, type->len, MK_FALSE);
+        }
+        mk_iov_add(&part->iov, part->range, part->range_len, MK_FALSE);
+
+        length += part->iov.total_len + part->length;
+    }
+
+    mr->close_iov.io = mr->close_io;
+    mr->close_iov.buf_to_free = NULL;
+    mk_iov_init(&mr->close_iov, 1, 0);
+    mk_iov_add(&mr->close_iov, mr->close, mr->close_len, MK_FALSE);
+    length += mr->close_len;
+
+    sr->multirange = mr;
+
+    /* The file Content-Type row is replaced by the multipart one */
+    mk_ptr_reset(&sh->file_headers);
+    sh->content_type.data = mr->content_type;
+    sh->content_type.len = mr->content_type_len;
+    sh->content_length = length;
+
+    return 0;
+}
+
+/*
+ * Validate the Range request against the file and configure the response:
+ * a single range is served from the file input with an offset, multiple
+ * ranges build a multipart/byteranges body.
+ */
+int mk_http_range_set(struct mk_http_request *sr, long file_size)
+{
+    int i;
+    int n = 0;
+    int count;
+    long total = 0;
+    struct mk_http_range ranges[MK_HTTP_RANGES_MAX];
+    struct response_headers *sh = &sr->headers;
+
+    count = mk_http_range_parse(&sr->range, ranges, MK_HTTP_RANGES_MAX);
+    if (count < 0) {
+        return MK_HTTP_RANGE_ERROR;
+    }
+    else if (count > MK_HTTP_RANGES_MAX) {
+        return MK_HTTP_RANGE_FULL;
+    }
+
+    /* Discard the ranges beyond the end of the file */
+    for (i = 0; i < count; i++) {
+        if (range_resolve(&ranges[i], file_size) == 0) {
+            total += (ranges[i].end - ranges[i].start) + 1;
+            ranges[n++] = ranges[i];
+        }
+    }
+
+    if (n == 0) {
+        return MK_HTTP_RANGE_UNSATISFIABLE;
+    }
+
+    if (n == 1) {
+        sh->ranges[0] = ranges[0].start;
+        sh->ranges[1] = ranges[0].end;
+        sh->content_length = total;
+        sr->in_file.bytes_offset = ranges[0].start;
+        sr->in_file.bytes_total = total;
+        mk_header_set_http_status(sr, MK_HTTP_PARTIAL);
+        return MK_HTTP_RANGE_OK;
+    }
+
+    /* Overlapping ranges asking for more than the file itself */
+    if (total > file_size) {
+        return MK_HTTP_RANGE_FULL;
+    }
+
+    if (range_multipart(sr, ranges, n, file_size) != 0) {
+        return MK_HTTP_RANGE_FULL;
+    }
+    mk_header_set_http_status(sr, MK_HTTP_PARTIAL);
+
+    return MK_HTTP_RANGE_OK;
+}
+
+/* Queue the body parts, every segment is sent from the same file descriptor */
+int mk_http_range_stream(struct mk_http_request *sr)
+{
+    int i;
+    struct mk_http_multirange *mr = sr->multirange;
+    struct mk_http_range_part *part;
+
+    if (!mr) {
+        return -1;
+    }
+
+    for (i = 0; i < mr->count; i++) {
+        part = &mr->parts[i];
+        mk_stream_in_iov(&sr->stream, &part->in_head, &part->iov,
+                         NULL, NULL);
+        mk_stream_in_file(&sr->stream, &part->in_body, sr->in_file.fd,
+                          part->length, part->offset,
+                          NULL, NULL);
+    }
+    mk_stream_in_iov(&sr->stream, &mr->in_close, &mr->close_iov, NULL, NULL);
+
+    return 0;
+}
+
+void mk_http_range_free(struct mk_http_request *sr)
+{
+    if (sr->multirange) {
+        mk_mem_free(sr->multirange);
+        sr->multirange = NULL;
+    }
+}
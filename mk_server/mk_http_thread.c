@@ -25,6 +25,8 @@
 #include <monkey/mk_http_thread.h>
 
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 /*
  * libco do not support parameters in the entrypoint function due to the
@@ -46,6 +48,7 @@ pthread_once_t mk_http_thread_initialize_tls_once_flag = PTHREAD_ONCE_INIT;
 
 MK_TLS_DEFINE(struct mk_http_libco_params, mk_http_thread_libco_params);
 MK_TLS_DEFINE(struct mk_thread,            mk_thread);
+MK_TLS_DEFINE(struct mk_http_thread_pool,  mk_http_thread_pool);
 
 /* This function could return NULL if the process runs out of memory, in that
  * case failure is imminent.
@@ -73,6 +76,7 @@ static void mk_http_thread_initialize_tls_once()
 {
     MK_TLS_INIT(mk_http_thread_libco_params);
     MK_TLS_INIT(mk_thread);
+    MK_TLS_INIT(mk_http_thread_pool);
 }
 
 void mk_http_thread_initialize_tls()
@@ -155,6 +159,161 @@ static inline void thread_cb_init_vars()
     }
 }
 
+/*
+ * Coroutine contexts pool
+ * -----------------------
+ * A pooled context is a thread header (struct mk_thread followed by the
+ * struct mk_http_thread data) plus a stack mapping. The lowest page of the
+ * mapping is a guard page, the coroutine is re-created on top of the rest
+ * every time the context is taken from the pool.
+ */
+static struct mk_thread *thread_pool_context_new(struct mk_http_thread_pool *pool)
+{
+    void *stack;
+    struct mk_thread *th;
+    struct mk_http_thread *mth;
+
+    th = mk_mem_alloc(sizeof(struct mk_thread) + sizeof(struct mk_http_thread));
+    if (!th) {
+        return NULL;
+    }
+
+    stack = mmap(NULL, pool->guard_size + pool->stack_size,
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                 -1, 0);
+    if (stack == MAP_FAILED) {
+        mk_libc_error("mmap");
+        mk_mem_free(th);
+        return NULL;
+    }
+
+    if (mprotect(stack, pool->guard_size, PROT_NONE) != 0) {
+        mk_libc_error("mprotect");
+        munmap(stack, pool->guard_size + pool->stack_size);
+        mk_mem_free(th);
+        return NULL;
+    }
+
+    th->cb_destroy = NULL;
+    mth = (struct mk_http_thread *) MK_THREAD_DATA(th);
+    mth->stack = stack;
+    mth->stack_len = pool->guard_size + pool->stack_size;
+
+    return th;
+}
+
+static void thread_pool_context_free(struct mk_thread *th)
+{
+    struct mk_http_thread *mth;
+
+    mth = (struct mk_http_thread *) MK_THREAD_DATA(th);
+    munmap(mth->stack, mth->stack_len);
+    mk_mem_free(th);
+}
+
+static struct mk_thread *thread_pool_get(struct mk_http_thread_pool *pool)
+{
+    struct mk_thread *th;
+    struct mk_http_thread *mth;
+
+    if (mk_list_is_empty(&pool->available) == 0) {
+        return thread_pool_context_new(pool);
+    }
+
+    mth = mk_list_entry_first(&pool->available, struct mk_http_thread, _head);
+    mk_list_del(&mth->_head);
+    pool->size--;
+
+    th = mth->parent;
+    return th;
+}
+
+static void thread_pool_put(struct mk_http_thread_pool *pool,
+                            struct mk_thread *th)
+{
+    struct mk_http_thread *mth;
+
+    mth = (struct mk_http_thread *) MK_THREAD_DATA(th);
+    if (pool->size >= pool->capacity) {
+        thread_pool_context_free(th);
+        return;
+    }
+
+    mth->parent = th;
+    mk_list_add(&mth->_head, &pool->available);
+    pool->size++;
+}
+
+/*
+ * This function is triggered upon worker creation (inside the thread
+ * context), only library mode serves requests through coroutines.
+ */
+int mk_http_thread_pool_init(struct mk_server *server)
+{
+    int i;
+    long pagesize;
+    struct mk_thread *th;
+    struct mk_http_thread_pool *pool;
+
+    MK_TLS_SET(mk_http_thread_pool, NULL);
+    if (server->lib_mode == MK_FALSE || server->coroutine_pool <= 0) {
+        return 0;
+    }
+
+    pool = mk_mem_alloc_z(sizeof(struct mk_http_thread_pool));
+    if (!pool) {
+        return -1;
+    }
+
+    pagesize = sysconf(_SC_PAGESIZE);
+    pool->guard_size = pagesize;
+    pool->stack_size = server->coroutine_stack;
+    if (pool->stack_size == 0) {
+        pool->stack_size = MK_THREAD_STACK_SIZE;
+    }
+    pool->stack_size = (pool->stack_size + pagesize - 1) & ~(pagesize - 1);
+    pool->capacity = server->coroutine_pool;
+    mk_list_init(&pool->available);
+    MK_TLS_SET(mk_http_thread_pool, pool);
+
+    /* Map the stacks upfront, the pages are faulted in on first use only */
+    for (i = 0; i < pool->capacity; i++) {
+        th = thread_pool_context_new(pool);
+        if (!th) {
+            break;
+        }
+        thread_pool_put(pool, th);
+    }
+
+    return 0;
+}
+
+int mk_http_thread_pool_exit(struct mk_server *server)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_http_thread *mth;
+    struct mk_http_thread_pool *pool;
+    (void) server;
+
+    pool = MK_TLS_GET(mk_http_thread_pool);
+    if (!pool) {
+        return 0;
+    }
+
+    mk_list_foreach_safe(head, tmp, &pool->available) {
+        mth = mk_list_entry(head, struct mk_http_thread, _head);
+        mk_list_del(&mth->_head);
+        thread_pool_context_free(mth->parent);
+    }
+
+    /* Contexts still in use are unmapped when released */
+    mk_mem_free(pool);
+    MK_TLS_SET(mk_http_thread_pool, NULL);
+
+    return 0;
+}
+
 static inline void thread_params_set(struct mk_thread *th,
                                      int type,
                                      struct mk_vhost_handler *handler,
@@ -190,20 +349,46 @@ struct mk_http_thread *mk_http_thread_create(int type,
     struct mk_thread *th = NULL;
     struct mk_http_thread *mth;
     struct mk_sched_worker *sched;
+    struct mk_http_thread_pool *pool;
 
     sched = mk_sched_get_thread_conf();
     if (!sched) {
         return NULL;
     }
 
-    th = mk_thread_new(sizeof(struct mk_http_thread), NULL);
-    if (!th) {
-        return NULL;
+    pool = MK_TLS_GET(mk_http_thread_pool);
+    if (pool) {
+        th = thread_pool_get(pool);
     }
 
-    mth = (struct mk_http_thread *) MK_THREAD_DATA(th);
-    if (!mth) {
-        return NULL;
+    if (th) {
+        /* Build the coroutine on top of the pooled stack */
+        mth = (struct mk_http_thread *) MK_THREAD_DATA(th);
+        stack_size = pool->stack_size;
+        th->callee = co_derive((char *) mth->stack + pool->guard_size,
+                               stack_size, thread_cb_init_vars);
+        if (!th->callee) {
+            /* The libco backend cannot use external stacks */
+            thread_pool_context_free(th);
+            mk_http_thread_pool_exit(NULL);
+            th = NULL;
+        }
+    }
+
+    if (!th) {
+        th = mk_thread_new(sizeof(struct mk_http_thread), NULL);
+        if (!th) {
+            return NULL;
+        }
+
+        mth = (struct mk_http_thread *) MK_THREAD_DATA(th);
+        mth->stack = NULL;
+        th->callee = co_create(MK_THREAD_STACK_SIZE,
+                               thread_cb_init_vars, &stack_size);
+        if (!th->callee) {
+            mk_mem_free(th);
+            return NULL;
+        }
     }
 
     mth->session = session;
@@ -214,8 +399,6 @@ struct mk_http_thread *mk_http_thread_create(int type,
     mk_list_add(&mth->_head, &sched->threads);
 
     th->caller = co_active();
-    th->callee = co_create(MK_THREAD_STACK_SIZE,
-                           thread_cb_init_vars, &stack_size);
 
 #ifdef MK_HAVE_VALGRIND
     th->valgrind_stack_id = VALGRIND_STACK_REGISTER(th->callee,
@@ -251,6 +434,7 @@ int mk_http_thread_purge(struct mk_http_thread *mth, int close)
 int mk_http_thread_destroy(struct mk_http_thread *mth)
 {
     struct mk_thread *th;
+    struct mk_http_thread_pool *pool;
 
     /* Unlink from scheduler thread list */
     mk_list_del(&mth->_head);
@@ -258,7 +442,24 @@ int mk_http_thread_destroy(struct mk_http_thread *mth)
     /* release original memory context */
     th = mth->parent;
     mth->session->channel->event->type = MK_EVENT_CONNECTION;
-    mk_thread_destroy(th);
+
+    if (!mth->stack) {
+        mk_thread_destroy(th);
+        return 0;
+    }
+
+    /* Pooled context: keep the header and the stack mapping */
+#ifdef MK_HAVE_VALGRIND
+    VALGRIND_STACK_DEREGISTER(th->valgrind_stack_id);
+#endif
+
+    pool = MK_TLS_GET(mk_http_thread_pool);
+    if (pool) {
+        thread_pool_put(pool, th);
+    }
+    else {
+        thread_pool_context_free(th);
+    }
 
     return 0;
 }
@@ -323,11 +323,12 @@ int mk_config_set_property(struct mk_server *server, char *k, char *v)
         }
     }
     else if (config_eq(k, "Timeout") == 0) {
-        num = atoi(v);
+        num = mk_config_timeout_ms(v);
         if (num <= 0) {
             return -1;
         }
-        server->timeout = num;
+        server->timeout_ms = num;
+        server->timeout = (num + 999) / 1000;
     }
     else if (config_eq(k, "KeepAlive") == 0) {
         b = bool_val(v);
@@ -344,11 +345,26 @@ int mk_config_set_property(struct mk_server *server, char *k, char *v)
         server->max_keep_alive_request = num;
     }
     else if (config_eq(k, "KeepAliveTimeout") == 0) {
-        num = atoi(v);
+        num = mk_config_timeout_ms(v);
+        if (num <= 0) {
+            return -1;
+        }
+        server->keep_alive_timeout_ms = num;
+        server->keep_alive_timeout = (num + 999) / 1000;
+    }
+    else if (config_eq(k, "WriteTimeout") == 0) {
+        num = mk_config_timeout_ms(v);
         if (num <= 0) {
             return -1;
         }
-        server->keep_alive_timeout = num;
+        server->write_timeout_ms = num;
+    }
+    else if (config_eq(k, "TimeoutResolution") == 0) {
+        num = atoi(v);
+        if (num < 1 || num > 1000) {
+            return -1;
+        }
+        server->timeout_resolution = num;
     }
     else if (config_eq(k, "UserDir") == 0) {
         server->conf_user_pub = mk_string_dup(v);
@@ -380,6 +396,46 @@ int mk_config_set_property(struct mk_server *server, char *k, char *v)
         }
         server->max_request_size = num;
     }
+    else if (config_eq(k, "AcceptBatch") == 0) {
+        num = atoi(v);
+        if (num <= 0 || num > MK_ACCEPT_BATCH_MAX) {
+            return -1;
+        }
+        server->accept_batch = num;
+    }
+    else if (config_eq(k, "EdgeTriggered") == 0) {
+        b = bool_val(v);
+        if (b == -1) {
+            return -1;
+        }
+#ifndef MK_EVENT_HAVE_EDGE
+        if (b == MK_TRUE) {
+            return -1;
+        }
+#endif
+        server->edge_triggered = b;
+    }
+    else if (config_eq(k, "ConnectionSlab") == 0) {
+        b = bool_val(v);
+        if (b == -1) {
+            return -1;
+        }
+        server->conn_slab = b;
+    }
+    else if (config_eq(k, "ConnectionSlabHugePages") == 0) {
+        b = bool_val(v);
+        if (b == -1) {
+            return -1;
+        }
+        server->conn_slab_huge_pages = b;
+    }
+    else if (config_eq(k, "KeepAliveCompact") == 0) {
+        b = bool_val(v);
+        if (b == -1) {
+            return -1;
+        }
+        server->keepalive_compact = b;
+    }
     else if (config_eq(k, "SymLink") == 0) {
         b = bool_val(v);
         if (b == -1) {
@@ -397,6 +453,96 @@ int mk_config_set_property(struct mk_server *server, char *k, char *v)
         }
         server->fdt = b;
     }
+    else if (config_eq(k, "FileCacheSize") == 0) {
+        num = atoi(v);
+        if (num <= 0) {
+            return -1;
+        }
+        server->file_cache_size = num;
+    }
+    else if (config_eq(k, "FileCacheTTL") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->file_cache_ttl = num;
+    }
+    else if (config_eq(k, "FileCacheMaxBody") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->file_cache_max_body = num;
+    }
+    else if (config_eq(k, "FileCacheMemory") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->file_cache_memory = (size_t) num * 1024;
+    }
+    else if (config_eq(k, "GzipStatic") == 0) {
+        b = bool_val(v);
+        if (b == -1) {
+            return -1;
+        }
+        server->gzip_static = b;
+    }
+    else if (config_eq(k, "GzipCompress") == 0) {
+        b = bool_val(v);
+        if (b == -1) {
+            return -1;
+        }
+#ifndef MK_HAVE_GZIP
+        if (b == MK_TRUE) {
+            return -1;
+        }
+#endif
+        server->gzip_compress = b;
+    }
+    else if (config_eq(k, "GzipMaxSize") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->gzip_max_size = num;
+    }
+    else if (config_eq(k, "GzipMemory") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->gzip_memory = (size_t) num * 1024;
+    }
+    else if (config_eq(k, "CoroutinePoolSize") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->coroutine_pool = num;
+    }
+    else if (config_eq(k, "CoroutineStackSize") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->coroutine_stack = (size_t) num * 1024;
+    }
+    else if (config_eq(k, "Metrics") == 0) {
+        b = bool_val(v);
+        if (b == -1) {
+            return -1;
+        }
+        server->metrics = b;
+    }
+    else if (config_eq(k, "MetricsPath") == 0) {
+        if (v[0] != '/') {
+            return -1;
+        }
+        mk_mem_free(server->metrics_path);
+        server->metrics_path = mk_string_dup(v);
+        server->metrics_path_len = strlen(v);
+    }
 
     return 0;
 }
@@ -0,0 +1,451 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#include <monkey/monkey.h>
+#include <monkey/mk_core.h>
+#include <monkey/mk_server.h>
+#include <monkey/mk_scheduler.h>
+#include <monkey/mk_http.h>
+#include <monkey/mk_http_status.h>
+#include <monkey/mk_header.h>
+#include <monkey/mk_vhost.h>
+#include <monkey/mk_metrics.h>
+
+#define METRICS_CONTENT_TYPE "Content-Type: text/plain; version=0.0.4\r\n"
+
+/* Text exposition buffer */
+struct metrics_buf {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+int mk_metrics_worker_init(struct mk_sched_worker *sched,
+                           struct mk_server *server)
+{
+    struct mk_metrics *metrics;
+
+    sched->metrics = NULL;
+    if (server->metrics == MK_FALSE) {
+        return 0;
+    }
+
+    metrics = mk_mem_alloc_z(sizeof(struct mk_metrics));
+    if (!metrics) {
+        mk_libc_error("malloc");
+        return -1;
+    }
+
+    metrics->n_vhosts = mk_list_size(&server->hosts);
+    metrics->status = mk_mem_alloc_z(sizeof(uint64_t) * metrics->n_vhosts *
+                                     MK_METRICS_STATUS_SLOTS);
+    if (!metrics->status) {
+        mk_libc_error("malloc");
+        mk_mem_free(metrics);
+        return -1;
+    }
+
+    sched->metrics = metrics;
+    return 0;
+}
+
+void mk_metrics_worker_exit(struct mk_sched_worker *sched)
+{
+    struct mk_metrics *metrics = sched->metrics;
+
+    if (!metrics) {
+        return;
+    }
+
+    sched->metrics = NULL;
+    mk_mem_free(metrics->status);
+    mk_mem_free(metrics);
+}
+
+static inline struct mk_metrics *metrics_get()
+{
+    struct mk_sched_worker *sched;
+
+    sched = mk_sched_get_thread_conf();
+    if (!sched) {
+        return NULL;
+    }
+    return sched->metrics;
+}
+
+/* A request was parsed, 'start' is the time the parser was invoked */
+void mk_metrics_request_parsed(struct mk_http_request *sr, uint64_t start)
+{
+    struct mk_metrics *metrics = metrics_get();
+
+    if (!metrics) {
+        return;
+    }
+
+    sr->metrics_start = start;
+    mk_metrics_observe(&metrics->hist[MK_METRICS_PARSE],
+                       mk_metrics_now() - start);
+}
+
+/* The response headers are ready to be sent */
+void mk_metrics_response_headers(struct mk_http_request *sr)
+{
+    struct mk_metrics *metrics;
+
+    if (sr->metrics_start == 0) {
+        return;
+    }
+
+    metrics = metrics_get();
+    if (!metrics) {
+        return;
+    }
+
+    mk_metrics_observe(&metrics->hist[MK_METRICS_TTFB],
+                       mk_metrics_now() - sr->metrics_start);
+}
+
+/* The response was sent: count it by virtual host and status code */
+void mk_metrics_request_end(struct mk_http_request *sr)
+{
+    int idx;
+    int status;
+    struct mk_metrics *metrics = metrics_get();
+
+    if (!metrics) {
+        return;
+    }
+
+    mk_metrics_add(&metrics->requests, 1);
+
+    if (sr->metrics_start > 0) {
+        mk_metrics_observe(&metrics->hist[MK_METRICS_RESPONSE],
+                           mk_metrics_now() - sr->metrics_start);
+        sr->metrics_start = 0;
+    }
+
+    status = sr->headers.status;
+    if (!sr->host_conf || sr->host_conf->id < 0 ||
+        sr->host_conf->id >= metrics->n_vhosts ||
+        status < MK_METRICS_STATUS_MIN ||
+        status >= MK_METRICS_STATUS_MIN + MK_METRICS_STATUS_SLOTS) {
+        return;
+    }
+
+    idx = (sr->host_conf->id * MK_METRICS_STATUS_SLOTS) +
+        (status - MK_METRICS_STATUS_MIN);
+    mk_metrics_add(&metrics->status[idx], 1);
+}
+
+void mk_metrics_bytes_sent(struct mk_sched_worker *sched, size_t bytes)
+{
+    if (sched && sched->metrics) {
+        mk_metrics_add(&sched->metrics->bytes_sent, bytes);
+    }
+}
+
+static int metrics_printf(struct metrics_buf *buf, const char *fmt, ...)
+{
+    int len;
+    size_t size;
+    char *tmp;
+    va_list ap;
+
+    while (1) {
+        va_start(ap, fmt);
+        len = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, ap);
+        va_end(ap);
+
+        if (len < 0) {
+            return -1;
+        }
+        if ((size_t) len < buf->size - buf->len) {
+            buf->len += len;
+            return 0;
+        }
+
+        size = buf->size * 2;
+        while (size - buf->len <= (size_t) len) {
+            size *= 2;
+        }
+        tmp = mk_mem_realloc(buf->data, size);
+        if (!tmp) {
+            return -1;
+        }
+        buf->data = tmp;
+        buf->size = size;
+    }
+}
+
+static void metrics_type(struct metrics_buf *buf, char *name, char *type,
+                         char *help)
+{
+    metrics_printf(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Per worker counter read from the scheduler or the metrics context */
+static void metrics_worker_counters(struct metrics_buf *buf,
+                                    struct mk_server *server)
+{
+    int i;
+    uint64_t accepted;
+    uint64_t closed;
+    struct mk_sched_worker *w;
+    struct mk_sched_ctx *ctx = server->sched_ctx;
+
+    metrics_type(buf, "monkey_connections_accepted_total", "counter",
+                 "Connections accepted.");
+    for (i = 0; i < server->workers; i++) {
+        w = &ctx->workers[i];
+        metrics_printf(buf, "monkey_connections_accepted_total{worker=\"%i\"} "
+                       "%llu\n", i,
+                       mk_metrics_read(&w->accepted_connections));
+    }
+
+    metrics_type(buf, "monkey_connections_closed_total", "counter",
+                 "Connections closed.");
+    for (i = 0; i < server->workers; i++) {
+        w = &ctx->workers[i];
+        metrics_printf(buf, "monkey_connections_closed_total{worker=\"%i\"} "
+                       "%llu\n", i,
+                       mk_metrics_read(&w->closed_connections));
+    }
+
+    metrics_type(buf, "monkey_connections_active", "gauge",
+                 "Connections currently open.");
+    for (i = 0; i < server->workers; i++) {
+        w = &ctx->workers[i];
+        accepted = mk_metrics_read(&w->accepted_connections);
+        closed = mk_metrics_read(&w->closed_connections);
+        metrics_printf(buf, "monkey_connections_active{worker=\"%i\"} %llu\n",
+                       i, accepted > closed ? accepted - closed : 0);
+    }
+
+    metrics_type(buf, "monkey_connections_over_capacity_total", "counter",
+                 "Connections rejected because the worker was full.");
+    for (i = 0; i < server->workers; i++) {
+        w = &ctx->workers[i];
+        metrics_printf(buf, "monkey_connections_over_capacity_total"
+                       "{worker=\"%i\"} %llu\n", i,
+                       mk_metrics_read(&w->over_capacity));
+    }
+
+    metrics_type(buf, "monkey_http_requests_total", "counter",
+                 "HTTP requests served.");
+    for (i = 0; i < server->workers; i++) {
+        w = &ctx->workers[i];
+        if (!w->metrics) {
+            continue;
+        }
+        metrics_printf(buf, "monkey_http_requests_total{worker=\"%i\"} %llu\n",
+                       i, (unsigned long long)
+                       mk_metrics_read(&w->metrics->requests));
+    }
+
+    metrics_type(buf, "monkey_sent_bytes_total", "counter",
+                 "Bytes written to the clients.");
+    for (i = 0; i < server->workers; i++) {
+        w = &ctx->workers[i];
+        if (!w->metrics) {
+            continue;
+        }
+        metrics_printf(buf, "monkey_sent_bytes_total{worker=\"%i\"} %llu\n",
+                       i, (unsigned long long)
+                       mk_metrics_read(&w->metrics->bytes_sent));
+    }
+}
+
+/* Responses by virtual host and status code, summed over the workers */
+static void metrics_status(struct metrics_buf *buf, struct mk_server *server)
+{
+    int i;
+    int s;
+    uint64_t total;
+    struct mk_list *head;
+    struct mk_vhost *host;
+    struct mk_vhost_alias *alias;
+    struct mk_metrics *m;
+    struct mk_sched_ctx *ctx = server->sched_ctx;
+
+    metrics_type(buf, "monkey_http_responses_total", "counter",
+                 "HTTP responses by virtual host and status code.");
+
+    mk_list_foreach(head, &server->hosts) {
+        host = mk_list_entry(head, struct mk_vhost, _head);
+        if (mk_list_is_empty(&host->server_names) == 0) {
+            continue;
+        }
+        alias = mk_list_entry_first(&host->server_names,
+                                    struct mk_vhost_alias, _head);
+
+        for (s = 0; s < MK_METRICS_STATUS_SLOTS; s++) {
+            total = 0;
+            for (i = 0; i < server->workers; i++) {
+                m = ctx->workers[i].metrics;
+                if (!m || host->id < 0 || host->id >= m->n_vhosts) {
+                    continue;
+                }
+                total += mk_metrics_read(&m->status[host->id *
+                                                    MK_METRICS_STATUS_SLOTS +
+                                                    s]);
+            }
+            if (total == 0) {
+                continue;
+            }
+            metrics_printf(buf, "monkey_http_responses_total"
+                           "{vhost=\"%s\",code=\"%i\"} %llu\n",
+                           alias->name, s + MK_METRICS_STATUS_MIN,
+                           (unsigned long long) total);
+        }
+    }
+}
+
+/*
+ * Histograms are merged over the workers. The bucket bounds exposed are the
+ * powers of two (in microseconds) that delimit the log-linear groups.
+ */
+static void metrics_histogram(struct metrics_buf *buf,
+                              struct mk_server *server, int type,
+                              char *name, char *help)
+{
+    int i;
+    int b;
+    int group;
+    uint64_t sum = 0;
+    uint64_t cumulative = 0;
+    struct mk_metrics *m;
+    struct mk_metrics_histogram *h;
+    struct mk_sched_ctx *ctx = server->sched_ctx;
+    uint64_t buckets[MK_METRICS_BUCKETS];
+
+    memset(buckets, 0, sizeof(buckets));
+    for (i = 0; i < server->workers; i++) {
+        m = ctx->workers[i].metrics;
+        if (!m) {
+            continue;
+        }
+        h = &m->hist[type];
+        for (b = 0; b < MK_METRICS_BUCKETS; b++) {
+            buckets[b] += mk_metrics_read(&h->buckets[b]);
+        }
+        sum += mk_metrics_read(&h->sum);
+    }
+
+    metrics_type(buf, name, "histogram", help);
+
+    for (b = 0; b < MK_METRICS_BUCKETS; b++) {
+        cumulative += buckets[b];
+        if ((b + 1) % MK_METRICS_SUB != 0) {
+            continue;
+        }
+
+        group = (b + 1) / MK_METRICS_SUB;
+        metrics_printf(buf, "%s_bucket{le=\"%.6f\"} %llu\n", name,
+                       (double) (1ULL << (MK_METRICS_SUB_BITS + group - 1)) /
+                       1000000.0,
+                       (unsigned long long) cumulative);
+    }
+
+    metrics_printf(buf, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+                   (unsigned long long) cumulative);
+    metrics_printf(buf, "%s_sum %.6f\n", name, (double) sum / 1000000.0);
+    metrics_printf(buf, "%s_count %llu\n", name,
+                   (unsigned long long) cumulative);
+}
+
+int mk_metrics_match(struct mk_http_request *sr, struct mk_server *server)
+{
+    if (sr->method != MK_METHOD_GET && sr->method != MK_METHOD_HEAD) {
+        return MK_FALSE;
+    }
+
+    if (sr->uri_processed.len != (size_t) server->metrics_path_len ||
+        memcmp(sr->uri_processed.data, server->metrics_path,
+               server->metrics_path_len) != 0) {
+        return MK_FALSE;
+    }
+
+    return MK_TRUE;
+}
+
+/* Serve the metrics in the Prometheus text exposition format */
+int mk_metrics_http(struct mk_http_session *cs, struct mk_http_request *sr,
+                    struct mk_server *server)
+{
+    struct mk_iov *iov;
+    struct metrics_buf buf;
+
+    buf.size = 8192;
+    buf.len = 0;
+    buf.data = mk_mem_alloc(buf.size);
+    if (!buf.data) {
+        return mk_http_error(MK_SERVER_INTERNAL_ERROR, cs, sr, server);
+    }
+
+    metrics_worker_counters(&buf, server);
+    metrics_status(&buf, server);
+    metrics_histogram(&buf, server, MK_METRICS_PARSE,
+                      "monkey_http_request_parse_seconds",
+                      "Time spent parsing a complete request.");
+    metrics_histogram(&buf, server, MK_METRICS_TTFB,
+                      "monkey_http_time_to_first_byte_seconds",
+                      "Time from the request start until its response "
+                      "headers are ready.");
+    metrics_histogram(&buf, server, MK_METRICS_RESPONSE,
+                      "monkey_http_response_seconds",
+                      "Time from the request start until its response "
+                      "was sent.");
+    metrics_histogram(&buf, server, MK_METRICS_LOOP,
+                      "monkey_event_loop_iteration_seconds",
+                      "Time spent processing the events of one event loop "
+                      "iteration.");
+
+    mk_header_set_http_status(sr, MK_HTTP_OK);
+    sr->headers.content_length = buf.len;
+    sr->headers.location = NULL;
+    sr->headers.cgi = SH_NOCGI;
+    sr->headers.last_modified = -1;
+    mk_ptr_reset(&sr->headers.file_headers);
+    mk_ptr_reset(&sr->headers.content_encoding);
+    sr->headers.vary_encoding = MK_FALSE;
+    mk_ptr_set(&sr->headers.content_type, METRICS_CONTENT_TYPE);
+
+    mk_header_prepare(cs, sr, server);
+
+    if (sr->method == MK_METHOD_HEAD) {
+        mk_mem_free(buf.data);
+        return MK_EXIT_OK;
+    }
+
+    if (sr->headers._extra_rows) {
+        iov = sr->headers._extra_rows;
+        sr->in_headers_extra.bytes_total += buf.len;
+    }
+    else {
+        iov = &sr->headers.headers_iov;
+        sr->in_headers.bytes_total += buf.len;
+    }
+    mk_iov_add(iov, buf.data, buf.len, MK_TRUE);
+
+    return MK_EXIT_OK;
+}
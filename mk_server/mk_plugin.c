@@ -671,12 +671,24 @@ int mk_plugin_http_request_end(struct mk_plugin *plugin,
     }
 
     sr = mk_list_entry_last(&cs->request_list, struct mk_http_request, _head);
-    mk_plugin_stage_run_40(cs, sr, server);
+    sr->stage30_active = MK_FALSE;
 
     if (close == MK_TRUE) {
         cs->close_now = MK_TRUE;
     }
 
+    /*
+     * Part of the response is still queued, the scheduler ends the request
+     * once the client took all of it.
+     */
+    if (mk_channel_pending(cs->channel)) {
+        mk_sched_conn_write_interest(cs->conn, mk_sched_get_thread_conf(),
+                                     MK_TRUE);
+        return 0;
+    }
+
+    mk_plugin_stage_run_40(cs, sr, server);
+
     /* Let's check if we should ask to finalize the connection or not */
     ret = mk_http_request_end(cs, server);
     MK_TRACE("[FD %i] HTTP session end = %i", cs->socket, ret);
@@ -690,6 +702,11 @@ int mk_plugin_http_request_end(struct mk_plugin *plugin,
             return -1;
         }
     }
+    else if (ret == 1) {
+        /* The next pipelined request queued its response, send it */
+        mk_sched_conn_write_interest(cs->conn, mk_sched_get_thread_conf(),
+                                     MK_TRUE);
+    }
 
     return ret;
 }
@@ -26,6 +26,7 @@
 #include <monkey/mk_server.h>
 #include <monkey/mk_thread.h>
 #include <monkey/mk_cache.h>
+#include <monkey/mk_file_cache.h>
 #include <monkey/mk_config.h>
 #include <monkey/mk_clock.h>
 #include <monkey/mk_plugin.h>
@@ -34,6 +35,7 @@
 #include <monkey/mk_server.h>
 #include <monkey/mk_plugin_stage.h>
 #include <monkey/mk_http_thread.h>
+#include <monkey/mk_metrics.h>
 
 #include <signal.h>
 
@@ -41,6 +43,10 @@
 #include <sys/syscall.h>
 #endif
 
+#ifdef MK_HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
 extern struct mk_sched_handler mk_http_handler;
 extern struct mk_sched_handler mk_http2_handler;
 
@@ -129,7 +135,8 @@ void mk_sched_worker_free(struct mk_server *server)
 
     /* External */
     mk_plugin_exit_worker();
-    mk_vhost_fdt_worker_exit(server);
+    mk_file_cache_worker_exit(server);
+    mk_http_thread_pool_exit(server);
     mk_cache_worker_exit();
 
     /* Scheduler stuff */
@@ -144,7 +151,13 @@ void mk_sched_worker_free(struct mk_server *server)
 
     mk_bug(!worker);
 
-    /* FIXME!: there is nothing done here with the worker context */
+    /* Connection contexts */
+    mk_slab_destroy(worker->conn_slab);
+    mk_slab_destroy(worker->extra_slab);
+    worker->conn_slab = NULL;
+    worker->extra_slab = NULL;
+
+    mk_metrics_worker_exit(worker);
 
     /* Free master array (av queue & busy queue) */
     mk_mem_free(MK_TLS_GET(mk_tls_sched_cs));
@@ -153,6 +166,19 @@ void mk_sched_worker_free(struct mk_server *server)
     pthread_mutex_unlock(&mutex_worker_exit);
 }
 
+static size_t sched_conn_size_max()
+{
+    size_t size = mk_http_handler.sched_extra_size;
+
+#ifdef MK_HAVE_HTTP2
+    if ((size_t) mk_http2_handler.sched_extra_size > size) {
+        size = mk_http2_handler.sched_extra_size;
+    }
+#endif
+
+    return sizeof(struct mk_sched_conn) + size;
+}
+
 struct mk_sched_handler *mk_sched_handler_cap(char cap)
 {
     if (cap == MK_CAP_HTTP) {
@@ -179,6 +205,7 @@ struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
 {
     int ret;
     int size;
+    int zero;
     struct mk_sched_handler *handler;
     struct mk_sched_conn *conn;
     struct mk_event *event;
@@ -188,20 +215,40 @@ struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
 
     /* Close connection, otherwise continue */
     if (ret == MK_PLUGIN_RET_CLOSE_CONX) {
-        listener->network->network->close(listener->network, remote_fd);
+        listener->network->network->close(listener->network, remote_fd, NULL);
         MK_LT_SCHED(remote_fd, "PLUGIN_CLOSE");
         return NULL;
     }
 
+    /* The connection may switch protocol, room for any handler is needed */
     handler = listener->protocol;
-    if (handler->sched_extra_size > 0) {
-        void *data;
-        size = (sizeof(struct mk_sched_conn) + handler->sched_extra_size);
-        data = mk_mem_alloc_z(size);
-        conn = (struct mk_sched_conn *) data;
+    size = sched_conn_size_max();
+
+    if (server->keepalive_compact == MK_TRUE) {
+        /* The protocol memory is attached once the client sends data */
+        if (sched->conn_slab) {
+            conn = mk_slab_alloc(sched->conn_slab);
+        }
+        else {
+            conn = mk_mem_alloc(sizeof(struct mk_sched_conn));
+        }
+        if (conn) {
+            memset(conn, '\0', sizeof(struct mk_sched_conn));
+        }
+    }
+    else if (sched->conn_slab) {
+        conn = mk_slab_alloc(sched->conn_slab);
+        if (conn) {
+            /* Only clear what the protocol handler does not initialize */
+            zero = handler->sched_extra_size;
+            if (handler->sched_zero_size > 0) {
+                zero = handler->sched_zero_size;
+            }
+            memset(conn, '\0', sizeof(struct mk_sched_conn) + zero);
+        }
     }
     else {
-        conn = mk_mem_alloc_z(sizeof(struct mk_sched_conn));
+        conn = mk_mem_alloc_z(size);
     }
 
     if (!conn) {
@@ -209,6 +256,11 @@ struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
         return NULL;
     }
 
+    if (server->keepalive_compact == MK_FALSE &&
+        handler->sched_extra_size > 0) {
+        conn->extra = conn + 1;
+    }
+
     event = &conn->event;
     event->fd           = remote_fd;
     event->type         = MK_EVENT_CONNECTION;
@@ -217,7 +269,7 @@ struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
     conn->arrive_time   = server->clock_context->log_current_utime;
     conn->protocol      = handler;
     conn->net           = listener->network->network;
-    conn->is_timeout_on = MK_FALSE;
+    mk_timer_wheel_node_init(&conn->timeout);
     conn->server_listen = listener;
 
     /* Stream channel */
@@ -225,20 +277,29 @@ struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
     conn->channel.fd    = remote_fd;            /* socket conn      */
     conn->channel.io    = conn->net;            /* network layer    */
     conn->channel.event = event;                /* parent event ref */
+    conn->channel.net_data = NULL;
     mk_list_init(&conn->channel.streams);
 
+    /* The network layer may attach its own context to the connection */
+    if (conn->net->conn_open) {
+        ret = conn->net->conn_open(conn->net->plugin, &conn->channel);
+        if (ret == -1) {
+            mk_sched_conn_free(sched, conn);
+            return NULL;
+        }
+    }
+
     /*
-     * Register the connections into the timeout_queue:
+     * Arm the request timeout:
      *
      * When a new connection arrives, we cannot assume it contains some data
      * to read, meaning the event loop may not get notifications and the protocol
-     * handler will never be called. So in order to avoid DDoS we always register
-     * this session in the timeout_queue for further lookup.
+     * handler will never be called. So in order to avoid DDoS we always arm
+     * the timeout for this session.
      *
-     * The protocol handler is in charge to remove the session from the
-     * timeout_queue.
+     * The protocol handler is in charge to disarm it.
      */
-    mk_sched_conn_timeout_add(conn, sched);
+    mk_sched_conn_timeout_add(conn, sched, MK_SCHED_TIMEOUT_READ);
 
     /* Linux trace message */
     MK_LT_SCHED(remote_fd, "REGISTERED");
@@ -294,8 +355,14 @@ static int mk_sched_register_thread(struct mk_server *server)
     worker->pid = 0xdeadbeef;
 #endif
 
-    /* Initialize lists */
-    mk_list_init(&worker->timeout_queue);
+    /* Connection timeouts */
+    worker->timeout_ms[MK_SCHED_TIMEOUT_READ] = server->timeout_ms;
+    worker->timeout_ms[MK_SCHED_TIMEOUT_KEEPALIVE] =
+        server->keep_alive_timeout_ms;
+    worker->timeout_ms[MK_SCHED_TIMEOUT_WRITE] = server->write_timeout_ms;
+    mk_timer_wheel_init(&worker->timeouts, server->timeout_resolution,
+                        mk_timer_wheel_clock());
+
     worker->request_handler = NULL;
 
     return worker->idx;
@@ -338,8 +405,11 @@ void *mk_sched_launch_worker_loop(void *data)
     mk_sched_thread_lists_init();
     mk_cache_worker_init();
 
-    /* Virtual hosts: initialize per thread-vhost data */
-    mk_vhost_fdt_worker_init(server);
+    /* Open file cache: initialize per thread data */
+    mk_file_cache_worker_init(server);
+
+    /* Library mode: coroutine contexts for the request handlers */
+    mk_http_thread_pool_init(server);
 
     /* Register working thread */
     wid = mk_sched_register_thread(server);
@@ -370,8 +440,31 @@ void *mk_sched_launch_worker_loop(void *data)
     }
 
     mk_list_init(&sched->event_free_queue);
+    mk_list_init(&sched->pending_queue);
     mk_list_init(&sched->threads);
     mk_list_init(&sched->threads_purge);
+    mk_list_init(&sched->conn_free_queue);
+
+    /*
+     * Connection contexts, sized for the largest protocol handler. If idle
+     * connections are compacted the protocol memory has its own slab.
+     */
+    sched->conn_slab = NULL;
+    sched->extra_slab = NULL;
+    if (server->conn_slab == MK_TRUE && server->keepalive_compact == MK_TRUE) {
+        sched->conn_slab = mk_slab_create(sizeof(struct mk_sched_conn),
+                                          server->conn_slab_huge_pages);
+        sched->extra_slab = mk_slab_create(sched_conn_size_max() -
+                                           sizeof(struct mk_sched_conn),
+                                           server->conn_slab_huge_pages);
+    }
+    else if (server->conn_slab == MK_TRUE) {
+        sched->conn_slab = mk_slab_create(sched_conn_size_max(),
+                                          server->conn_slab_huge_pages);
+    }
+
+    /* Counters and latency histograms */
+    mk_metrics_worker_init(sched, server);
 
     /*
      * ULONG_MAX BUG test only
@@ -398,6 +491,13 @@ void *mk_sched_launch_worker_loop(void *data)
             exit(EXIT_FAILURE);
         }
     }
+    else {
+        /* The balancer will hand-off new connections through this ring */
+        ret = mk_sched_accept_ring_create(sched);
+        if (ret != 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
 
     /* Unlock the conditional initializator */
     pthread_mutex_lock(&server->pth_mutex);
@@ -540,14 +640,19 @@ int mk_sched_remove_client(struct mk_sched_conn *conn,
 
     /* Unlink from the red-black tree */
     //rb_erase(&conn->_rb_head, &sched->rb_queue);
-    mk_sched_conn_timeout_del(conn);
+    mk_sched_conn_timeout_del(conn, sched);
+    mk_sched_conn_pending_del(conn);
 
     /* Close at network layer level */
-    conn->net->close(conn->net->plugin, event->fd);
+    conn->net->close(conn->net->plugin, event->fd, conn->channel.net_data);
+    conn->channel.net_data = NULL;
 
     /* Release and return */
     mk_channel_clean(&conn->channel);
-    mk_sched_event_free(&conn->event);
+    if ((event->type & MK_EVENT_IDLE) == 0) {
+        event->type |= MK_EVENT_IDLE;
+        mk_list_add(&event->_head, &sched->conn_free_queue);
+    }
     conn->status = MK_SCHED_CONN_CLOSED;
 
     MK_LT_SCHED(remote_fd, "DELETE_CLIENT");
@@ -576,37 +681,188 @@ int mk_sched_drop_connection(struct mk_sched_conn *conn,
     return mk_sched_remove_client(conn, sched, server);
 }
 
+struct mk_sched_timeout_ctx {
+    struct mk_sched_worker *sched;
+    struct mk_server *server;
+};
+
+static void mk_sched_timeout_expired(struct mk_timer_wheel_node *node,
+                                     void *data)
+{
+    struct mk_sched_conn *conn;
+    struct mk_sched_timeout_ctx *ctx = data;
+
+    conn = mk_list_entry(node, struct mk_sched_conn, timeout);
+
+    MK_TRACE("Scheduler, closing fd %i due TIMEOUT (type=%i)",
+             conn->event.fd, conn->timeout_type);
+    MK_LT_SCHED(conn->event.fd, "TIMEOUT_CONN_PENDING");
+    conn->protocol->cb_close(conn, ctx->sched, MK_SCHED_CONN_TIMEOUT,
+                             ctx->server);
+    mk_sched_drop_connection(conn, ctx->sched, ctx->server);
+}
+
 int mk_sched_check_timeouts(struct mk_sched_worker *sched,
                             struct mk_server *server)
 {
-    int client_timeout;
-    struct mk_sched_conn *conn;
-    struct mk_list *head;
-    struct mk_list *temp;
+    struct mk_sched_timeout_ctx ctx;
 
-    /* PENDING CONN TIMEOUT */
-    mk_list_foreach_safe(head, temp, &sched->timeout_queue) {
-        conn = mk_list_entry(head, struct mk_sched_conn, timeout_head);
-        if (conn->event.type & MK_EVENT_IDLE) {
-            continue;
-        }
+    ctx.sched = sched;
+    ctx.server = server;
 
-        client_timeout = conn->arrive_time + server->timeout;
+    return mk_timer_wheel_expire(&sched->timeouts, mk_timer_wheel_clock(),
+                                 mk_sched_timeout_expired, &ctx);
+}
 
-        /* Check timeout */
-        if (client_timeout <= server->clock_context->log_current_utime) {
-            MK_TRACE("Scheduler, closing fd %i due TIMEOUT",
-                     conn->event.fd);
-            MK_LT_SCHED(conn->event.fd, "TIMEOUT_CONN_PENDING");
-            conn->protocol->cb_close(conn, sched, MK_SCHED_CONN_TIMEOUT,
-                                     server);
-            mk_sched_drop_connection(conn, sched, server);
-        }
+/*
+ * Create the ring used by the balancer to hand-off accepted connections to
+ * the worker, this call takes place inside the worker context.
+ */
+int mk_sched_accept_ring_create(struct mk_sched_worker *sched)
+{
+    int ret;
+    struct mk_sched_accept_ring *ring;
+
+    ring = mk_mem_alloc_z(sizeof(struct mk_sched_accept_ring));
+    if (!ring) {
+        mk_libc_error("malloc");
+        return -1;
+    }
+
+#ifdef MK_HAVE_EVENTFD
+    /* One counter is enough: the worker just needs to know it must drain */
+    ring->channel_r = eventfd(0, EFD_CLOEXEC);
+    if (ring->channel_r == -1) {
+        mk_libc_error("eventfd");
+        mk_mem_free(ring);
+        return -1;
+    }
+    ring->channel_w = ring->channel_r;
+
+    ret = mk_event_add(sched->loop, ring->channel_r,
+                       MK_EVENT_NOTIFICATION, MK_EVENT_READ, &ring->event);
+    if (ret != 0) {
+        close(ring->channel_r);
+        mk_mem_free(ring);
+        return -1;
+    }
+#else
+    ret = mk_event_channel_create(sched->loop,
+                                  &ring->channel_r,
+                                  &ring->channel_w,
+                                  &ring->event);
+    if (ret != 0) {
+        mk_mem_free(ring);
+        return -1;
+    }
+#endif
+
+    sched->accept_ring = ring;
+    return 0;
+}
+
+/* Release the ring, any connection not yet registered is closed */
+void mk_sched_accept_ring_destroy(struct mk_sched_worker *sched)
+{
+    int fd;
+    struct mk_server_listen *listener;
+    struct mk_sched_accept_ring *ring = sched->accept_ring;
+
+    if (!ring) {
+        return;
+    }
+
+    while (mk_sched_accept_pop(sched, &fd, &listener) == 0) {
+        listener->network->network->close(listener->network, fd, NULL);
+    }
+
+#ifdef MK_HAVE_EVENTFD
+    mk_event_del(sched->loop, &ring->event);
+    close(ring->channel_r);
+#else
+    mk_event_channel_destroy(sched->loop,
+                             ring->channel_r, ring->channel_w,
+                             &ring->event);
+#endif
+
+    mk_mem_free(ring);
+    sched->accept_ring = NULL;
+}
+
+/*
+ * Enqueue a new accepted connection into the worker ring, this function is
+ * only invoked by the balancer thread (single producer). The worker is
+ * notified just once per batch: further pushes done before the worker
+ * starts draining the ring do not generate new notifications.
+ */
+int mk_sched_accept_push(struct mk_sched_worker *sched, int fd,
+                         struct mk_server_listen *listener)
+{
+    ssize_t n;
+    uint64_t val = 1;
+    unsigned int head;
+    unsigned int tail;
+    struct mk_sched_accept_entry *entry;
+    struct mk_sched_accept_ring *ring = sched->accept_ring;
+
+    tail = ring->tail;
+    head = mk_atomic_load(&ring->head);
+    if (mk_unlikely(tail - head >= MK_SCHED_ACCEPT_RING_SIZE)) {
+        /* the worker is not keeping up */
+        return -1;
+    }
+
+    entry = &ring->entries[tail & (MK_SCHED_ACCEPT_RING_SIZE - 1)];
+    entry->fd = fd;
+    entry->listener = listener;
+    mk_atomic_store(&ring->tail, tail + 1);
+
+    if (mk_atomic_exchange(&ring->signaled, 1) != 0) {
+        return 0;
+    }
+
+#ifdef _WIN32
+    n = send(ring->channel_w, (char *) &val, sizeof(uint64_t), 0);
+#else
+    n = write(ring->channel_w, &val, sizeof(uint64_t));
+#endif
+    if (n < 0) {
+        mk_libc_error("write");
     }
 
     return 0;
 }
 
+/* Dequeue an accepted connection, only invoked by the owner worker */
+int mk_sched_accept_pop(struct mk_sched_worker *sched, int *fd,
+                        struct mk_server_listen **listener)
+{
+    unsigned int head;
+    struct mk_sched_accept_entry *entry;
+    struct mk_sched_accept_ring *ring = sched->accept_ring;
+
+    head = ring->head;
+    if (head == mk_atomic_load(&ring->tail)) {
+        return -1;
+    }
+
+    entry = &ring->entries[head & (MK_SCHED_ACCEPT_RING_SIZE - 1)];
+    *fd = entry->fd;
+    *listener = entry->listener;
+    mk_atomic_store(&ring->head, head + 1);
+
+    return 0;
+}
+
+/*
+ * Let the producer know that a new notification is required, it must be
+ * called by the worker right before to drain the ring.
+ */
+void mk_sched_accept_rearm(struct mk_sched_worker *sched)
+{
+    mk_atomic_exchange(&sched->accept_ring->signaled, 0);
+}
+
 static int sched_thread_cleanup(struct mk_sched_worker *sched,
                                 struct mk_list *list)
 {
@@ -678,11 +934,21 @@ int mk_sched_event_read(struct mk_sched_conn *conn,
                         struct mk_server *server)
 {
     int ret = 0;
+    int edge;
 
 #ifdef MK_HAVE_TRACE
     MK_TRACE("[FD %i] Connection Handler / read", conn->event.fd);
 #endif
 
+    /*
+     * In edge-triggered mode the input is not consumed while a response is
+     * in progress, it will be read once the request is done.
+     */
+    edge = mk_sched_conn_is_edge(conn);
+    if (edge && conn->wants_write == MK_TRUE) {
+        return 0;
+    }
+
     /*
      * When the event loop notify that there is some readable information
      * from the socket, we need to invoke the protocol handler associated
@@ -691,8 +957,15 @@ int mk_sched_event_read(struct mk_sched_conn *conn,
      *
      *  - plain sockets through liana will use just read(2)
      *  - ssl though mbedtls should use mk_mbedtls_read(..)
+     *
+     * On edge-triggered mode we will not be notified again about data that
+     * is already in the socket, so keep reading until it's drained or until
+     * the protocol queued a response.
      */
-    ret = conn->protocol->cb_read(conn, sched, server);
+    do {
+        ret = conn->protocol->cb_read(conn, sched, server);
+    } while (edge && ret > 0 && conn->wants_write == MK_FALSE);
+
     if (ret == -1) {
         if (errno == EAGAIN) {
             MK_TRACE("[FD %i] EAGAIN: need to read more data", conn->event.fd);
@@ -709,16 +982,47 @@ int mk_sched_event_write(struct mk_sched_conn *conn,
                          struct mk_server *server)
 {
     int ret = -1;
+    int edge;
     size_t count;
-    struct mk_event *event;
 
     MK_TRACE("[FD %i] Connection Handler / write", conn->event.fd);
 
+    /* Edge mode: the notification may come from the read side */
+    edge = mk_sched_conn_is_edge(conn);
+    if (edge && conn->wants_write == MK_FALSE) {
+        return 0;
+    }
+
     ret = mk_channel_write(&conn->channel, &count);
+    if (sched->metrics && (ret == MK_CHANNEL_FLUSH || ret == MK_CHANNEL_DONE)) {
+        mk_metrics_bytes_sent(sched, count);
+    }
+
     if (ret == MK_CHANNEL_FLUSH || ret == MK_CHANNEL_BUSY) {
+        /*
+         * The response is waiting for the peer: the write-stall timeout
+         * restarts every time the socket takes some data.
+         */
+        if (ret == MK_CHANNEL_FLUSH) {
+            mk_sched_conn_timeout_reset(conn, sched, MK_SCHED_TIMEOUT_WRITE);
+        }
+        else {
+            mk_sched_conn_timeout_add(conn, sched, MK_SCHED_TIMEOUT_WRITE);
+        }
+
+        /*
+         * If the socket did not report EAGAIN there will not be a new
+         * edge notification, continue on the next loop round.
+         */
+        if (edge && ret == MK_CHANNEL_FLUSH) {
+            mk_sched_conn_pending_add(conn, sched);
+        }
         return 0;
     }
     else if (ret == MK_CHANNEL_DONE || ret == MK_CHANNEL_EMPTY) {
+        if (conn->timeout_type == MK_SCHED_TIMEOUT_WRITE) {
+            mk_sched_conn_timeout_del(conn, sched);
+        }
         if (conn->protocol->cb_done) {
             ret = conn->protocol->cb_done(conn, sched, server);
         }
@@ -726,11 +1030,11 @@ int mk_sched_event_write(struct mk_sched_conn *conn,
             return -1;
         }
         else if (ret == 0) {
-            event = &conn->event;
-            mk_event_add(sched->loop, event->fd,
-                         MK_EVENT_CONNECTION,
-                         MK_EVENT_READ,
-                         conn);
+            mk_sched_conn_write_interest(conn, sched, MK_FALSE);
+        }
+        else if (edge) {
+            /* a pipelined response was queued */
+            mk_sched_conn_pending_add(conn, sched);
         }
         return 0;
     }
@@ -742,6 +1046,80 @@ int mk_sched_event_write(struct mk_sched_conn *conn,
     return -1;
 }
 
+/*
+ * Enable or disable the write notifications for a connection. On level-
+ * triggered mode this modifies the event loop registration, on edge-triggered
+ * mode the connection is registered once for both directions so we just keep
+ * track of the interest and queue the connection to be processed at the end
+ * of the current loop round.
+ */
+int mk_sched_conn_write_interest(struct mk_sched_conn *conn,
+                                 struct mk_sched_worker *sched,
+                                 int enable)
+{
+    struct mk_event *event = &conn->event;
+
+    if (mk_sched_conn_is_edge(conn)) {
+        conn->wants_write = enable;
+        mk_sched_conn_pending_add(conn, sched);
+        return 0;
+    }
+
+    if (enable == MK_TRUE) {
+        if (event->mask & MK_EVENT_WRITE) {
+            return 0;
+        }
+        return mk_event_add(sched->loop, event->fd,
+                            MK_EVENT_CONNECTION, MK_EVENT_WRITE, conn);
+    }
+
+    return mk_event_add(sched->loop, event->fd,
+                        MK_EVENT_CONNECTION, MK_EVENT_READ, conn);
+}
+
+/*
+ * Process the edge-triggered connections that have work to do without a
+ * new notification. The queue is detached first, so connections queued again
+ * while running are processed on the next round. It returns the number of
+ * connections that remain queued.
+ */
+int mk_sched_pending_run(struct mk_sched_worker *sched,
+                         struct mk_server *server)
+{
+    int ret;
+    struct mk_list list;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_sched_conn *conn;
+
+    if (mk_list_is_empty(&sched->pending_queue) == 0) {
+        return 0;
+    }
+
+    mk_list_init(&list);
+    mk_list_cat(&sched->pending_queue, &list);
+    mk_list_init(&sched->pending_queue);
+
+    mk_list_foreach_safe(head, tmp, &list) {
+        conn = mk_list_entry(head, struct mk_sched_conn, pending_head);
+        mk_list_del(&conn->pending_head);
+        conn->is_pending = MK_FALSE;
+
+        if (conn->wants_write == MK_TRUE) {
+            ret = mk_sched_event_write(conn, sched, server);
+        }
+        else {
+            ret = mk_sched_event_read(conn, sched, server);
+        }
+
+        if (ret < 0 && conn->status != MK_SCHED_CONN_CLOSED) {
+            mk_sched_event_close(conn, sched, MK_EP_SOCKET_CLOSED, server);
+        }
+    }
+
+    return mk_list_size(&sched->pending_queue);
+}
+
 int mk_sched_event_close(struct mk_sched_conn *conn,
                          struct mk_sched_worker *sched,
                          int type, struct mk_server *server)
@@ -760,6 +1138,73 @@ int mk_sched_event_close(struct mk_sched_conn *conn,
     return 0;
 }
 
+/*
+ * Return the protocol handler memory of the connection, allocating it if
+ * it was released while the connection was idle. The first sched_zero_size
+ * bytes are cleared so the handler knows it must initialize it again.
+ */
+void *mk_sched_conn_extra_attach(struct mk_sched_conn *conn,
+                                 struct mk_sched_worker *sched)
+{
+    int zero;
+    void *extra;
+    struct mk_sched_handler *handler = conn->protocol;
+
+    if (conn->extra) {
+        return conn->extra;
+    }
+
+    if (sched->extra_slab) {
+        extra = mk_slab_alloc(sched->extra_slab);
+    }
+    else {
+        extra = mk_mem_alloc(handler->sched_extra_size);
+    }
+    if (!extra) {
+        return NULL;
+    }
+
+    zero = handler->sched_extra_size;
+    if (handler->sched_zero_size > 0) {
+        zero = handler->sched_zero_size;
+    }
+    memset(extra, '\0', zero);
+
+    conn->extra = extra;
+    return extra;
+}
+
+/* Release the protocol memory of an idle connection */
+void mk_sched_conn_extra_detach(struct mk_sched_conn *conn,
+                                struct mk_sched_worker *sched)
+{
+    /* It's part of the connection context */
+    if (!conn->extra || conn->extra == (void *) (conn + 1)) {
+        return;
+    }
+
+    if (sched->extra_slab) {
+        mk_slab_free(sched->extra_slab, conn->extra);
+    }
+    else {
+        mk_mem_free(conn->extra);
+    }
+    conn->extra = NULL;
+}
+
+void mk_sched_conn_free(struct mk_sched_worker *sched,
+                        struct mk_sched_conn *conn)
+{
+    mk_sched_conn_extra_detach(conn, sched);
+
+    if (sched->conn_slab) {
+        mk_slab_free(sched->conn_slab, conn);
+    }
+    else {
+        mk_mem_free(conn);
+    }
+}
+
 void mk_sched_event_free(struct mk_event *event)
 {
     struct mk_sched_worker *sched = mk_sched_get_thread_conf();
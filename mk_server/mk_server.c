@@ -29,6 +29,7 @@
 #include <monkey/mk_core.h>
 #include <monkey/mk_fifo.h>
 #include <monkey/mk_http_thread.h>
+#include <monkey/mk_metrics.h>
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -44,8 +45,6 @@
 
 pthread_key_t mk_server_fifo_key;
 
-static int mk_server_lib_notify_event_loop_break(struct mk_sched_worker *sched);
-
 /* Return the number of clients that can be attended  */
 unsigned int mk_server_capacity(struct mk_server *server)
 {
@@ -89,45 +88,174 @@ unsigned int mk_server_capacity(struct mk_server *server)
     return cur;
 }
 
+/*
+ * Register an accepted connection into the worker scheduler and its event
+ * loop, this function must be invoked from the worker thread context.
+ */
 static inline
-struct mk_sched_conn *mk_server_listen_handler(struct mk_sched_worker *sched,
-                                               void *data,
-                                               struct mk_server *server)
+struct mk_sched_conn *mk_server_conn_register(struct mk_sched_worker *sched,
+                                              int client_fd,
+                                              struct mk_server_listen *listener,
+                                              struct mk_server *server)
 {
     int ret;
-    int client_fd = -1;
+    uint32_t mask = MK_EVENT_READ;
     struct mk_sched_conn *conn;
-    struct mk_server_listen *listener = data;
-
-    client_fd = mk_socket_accept(listener->server_fd);
-    if (mk_unlikely(client_fd == -1)) {
-        MK_TRACE("[server] Accept connection failed: %s", strerror(errno));
-        goto error;
-    }
 
     conn = mk_sched_add_connection(client_fd, listener, sched, server);
     if (mk_unlikely(!conn)) {
         goto error;
     }
 
+    /* Edge mode: register once, write interest is tracked by the scheduler */
+    if (server->edge_triggered == MK_TRUE) {
+        mask = MK_EVENT_READ | MK_EVENT_WRITE | MK_EVENT_EDGE;
+    }
+
     ret = mk_event_add(sched->loop, client_fd,
-                       MK_EVENT_CONNECTION, MK_EVENT_READ, conn);
+                       MK_EVENT_CONNECTION, mask, conn);
     if (mk_unlikely(ret != 0)) {
         mk_err("[server] Error registering file descriptor: %s",
                strerror(errno));
         goto error;
     }
 
-    sched->accepted_connections++;
     MK_TRACE("[server] New connection arrived: FD %i", client_fd);
     return conn;
 
 error:
-    if (client_fd != -1) {
-        listener->network->network->close(listener->network, client_fd);
+    listener->network->network->close(listener->network, client_fd, NULL);
+    return NULL;
+}
+
+/* Account one wakeup that delivered 'count' new connections */
+static inline void mk_server_accept_stats(struct mk_sched_worker *sched,
+                                          unsigned int count)
+{
+    if (count == 0) {
+        return;
     }
 
-    return NULL;
+    sched->accept_wakeups++;
+    sched->accept_batch_total += count;
+    if (count > sched->accept_batch_max) {
+        sched->accept_batch_max = count;
+    }
+}
+
+/*
+ * Drain the listener backlog: accept up to 'accept_batch' connections or
+ * until the kernel reports there is nothing else pending, then register
+ * all of them together. Returns the number of registered connections.
+ */
+static inline int mk_server_listen_handler(struct mk_sched_worker *sched,
+                                           void *data,
+                                           struct mk_server *server)
+{
+    int i;
+    int n = 0;
+    int count = 0;
+    int client_fd;
+    int fds[MK_ACCEPT_BATCH_MAX];
+    struct mk_sched_conn *conn;
+    struct mk_server_listen *listener = data;
+
+    while (n < server->accept_batch) {
+        client_fd = mk_socket_accept(listener->server_fd);
+        if (client_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                MK_TRACE("[server] Accept connection failed: %s",
+                         strerror(errno));
+            }
+            break;
+        }
+        fds[n++] = client_fd;
+    }
+
+    for (i = 0; i < n; i++) {
+        conn = mk_server_conn_register(sched, fds[i], listener, server);
+        if (mk_unlikely(!conn)) {
+            continue;
+        }
+        sched->accepted_connections++;
+        count++;
+    }
+
+    mk_server_accept_stats(sched, n);
+    return count;
+}
+
+/*
+ * Balancer side: drain the listener backlog and hand off every accepted
+ * connection to the less loaded worker ring. Connections are accounted to
+ * the worker right away so the next balancing decision is aware of them.
+ * The worker is woken up once per batch, not once per connection. Returns
+ * -1 if there is no worker able to take new connections.
+ */
+static inline int mk_server_listen_balance(struct mk_server_listen *listener,
+                                           struct mk_server *server)
+{
+    int n;
+    int ret;
+    int client_fd;
+    struct mk_sched_worker *sched;
+
+    for (n = 0; n < server->accept_batch; n++) {
+        sched = mk_sched_next_target(server);
+        if (!sched) {
+            return (n == 0) ? -1 : n;
+        }
+
+        client_fd = mk_socket_accept(listener->server_fd);
+        if (client_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                MK_TRACE("[server] Accept connection failed: %s",
+                         strerror(errno));
+            }
+            break;
+        }
+
+        ret = mk_sched_accept_push(sched, client_fd, listener);
+        if (mk_unlikely(ret != 0)) {
+            MK_TRACE("[server] Worker %i ring is full, drop FD %i",
+                     sched->idx, client_fd);
+            listener->network->network->close(listener->network, client_fd,
+                                              NULL);
+            sched->over_capacity++;
+            continue;
+        }
+
+        sched->accepted_connections++;
+    }
+
+    return n;
+}
+
+/*
+ * Worker side: register every connection handed off by the balancer. The
+ * balancer already accounted them as accepted, so a failure here must be
+ * accounted as a closed connection.
+ */
+static int mk_server_accept_ring_drain(struct mk_sched_worker *sched,
+                                       struct mk_server *server)
+{
+    int fd;
+    int count = 0;
+    struct mk_sched_conn *conn;
+    struct mk_server_listen *listener;
+
+    mk_sched_accept_rearm(sched);
+
+    while (mk_sched_accept_pop(sched, &fd, &listener) == 0) {
+        conn = mk_server_conn_register(sched, fd, listener, server);
+        if (mk_unlikely(!conn)) {
+            sched->closed_connections++;
+        }
+        count++;
+    }
+
+    mk_server_accept_stats(sched, count);
+    return count;
 }
 
 void mk_server_listen_free()
@@ -202,6 +330,9 @@ struct mk_list *mk_server_listen_init(struct mk_server *server)
 #endif
             }
 
+            /* Listeners are drained in batches until accept(2) would block */
+            mk_socket_set_nonblocking(server_fd);
+
             listener = mk_mem_alloc_z(sizeof(struct mk_server_listen));
 
             /* configure the internal event_state */
@@ -318,13 +449,13 @@ void mk_server_loop_balancer(struct mk_server *server)
 {
     size_t bytes;
     uint64_t val;
+    int ret;
     int operation_flag;
     struct mk_list *head;
     struct mk_list *listeners;
     struct mk_server_listen *listener;
     struct mk_event *event;
     struct mk_event_loop *evl;
-    struct mk_sched_worker *sched;
     struct mk_event management_event;
 
     /* Init the listeners */
@@ -386,15 +517,12 @@ void mk_server_loop_balancer(struct mk_server *server)
                 }
 
                 /*
-                 * Accept connection: determinate which thread may work on this
-                 * new connection.
+                 * Accept connections: every new connection is dispatched to
+                 * the worker with the lowest load.
                  */
-                sched = mk_sched_next_target(server);
-                if (sched != NULL) {
-                    mk_server_listen_handler(sched, event, server);
-
-                    mk_server_lib_notify_event_loop_break(sched);
-
+                ret = mk_server_listen_balance((struct mk_server_listen *) event,
+                                               server);
+                if (ret >= 0) {
 #ifdef MK_HAVE_TRACE
                     int i;
                     struct mk_sched_ctx *ctx = server->sched_ctx;
@@ -432,7 +560,9 @@ void mk_server_loop_balancer(struct mk_server *server)
 void mk_server_worker_loop(struct mk_server *server)
 {
     int ret = -1;
+    int pending = 0;
     int timeout_fd;
+    uint64_t loop_start = 0;
     uint64_t val;
     struct mk_event *event;
     struct mk_event_loop *evl;
@@ -500,10 +630,25 @@ void mk_server_worker_loop(struct mk_server *server)
     /* create a new timeout file descriptor */
     server_timeout = mk_mem_alloc_z(sizeof(struct mk_server_timeout));
     MK_TLS_SET(mk_tls_server_timeout, server_timeout);
-    timeout_fd = mk_event_timeout_create(evl, server->timeout, 0, server_timeout);
+    timeout_fd = mk_event_timeout_create(evl,
+                                         server->timeout_resolution / 1000,
+                                         (server->timeout_resolution % 1000) *
+                                         1000000,
+                                         server_timeout);
 
     while (1) {
-        mk_event_wait(evl);
+        /* Don't block if some connections still have work to do */
+        if (pending > 0) {
+            mk_event_wait_2(evl, 0);
+        }
+        else {
+            mk_event_wait(evl);
+        }
+
+        if (sched->metrics) {
+            loop_start = mk_metrics_now();
+        }
+
         mk_event_foreach(event, evl) {
             ret = 0;
             if (event->type & MK_EVENT_IDLE) {
@@ -542,11 +687,7 @@ void mk_server_worker_loop(struct mk_server *server)
                  * the result, we let the loop continue processing the other
                  * events triggered.
                  */
-                conn = mk_server_listen_handler(sched, event, server);
-                if (conn) {
-                    //conn->event.mask = MK_EVENT_READ
-                    //goto speed;
-                }
+                mk_server_listen_handler(sched, event, server);
                 continue;
             }
             else if (event->type == MK_EVENT_CUSTOM) {
@@ -580,6 +721,7 @@ void mk_server_worker_loop(struct mk_server *server)
                         }
                         mk_mem_free(MK_TLS_GET(mk_tls_server_timeout));
                         mk_server_listen_exit(sched->listeners);
+                        mk_sched_accept_ring_destroy(sched);
                         mk_event_loop_destroy(evl);
                         mk_sched_worker_free(server);
                         return;
@@ -592,6 +734,10 @@ void mk_server_worker_loop(struct mk_server *server)
                         MK_TRACE("New client accepted, awesome!");
                     }
                 }
+                else if (sched->accept_ring &&
+                         event == &sched->accept_ring->event) {
+                    mk_server_accept_ring_drain(sched, server);
+                }
                 else if (event->fd == timeout_fd) {
                     mk_sched_check_timeouts(sched, server);
                 }
@@ -606,27 +752,15 @@ void mk_server_worker_loop(struct mk_server *server)
                 continue;
             }
         }
+        pending = mk_sched_pending_run(sched, server);
         mk_sched_threads_purge(sched);
         mk_sched_event_free_all(sched);
-    }
-}
 
-static int mk_server_lib_notify_event_loop_break(struct mk_sched_worker *sched)
-{
-    uint64_t val;
-
-    /* Check the channel is valid (enabled by library mode) */
-    if (sched->signal_channel_w <= 0) {
-        return -1;
+        if (sched->metrics) {
+            mk_metrics_observe(&sched->metrics->hist[MK_METRICS_LOOP],
+                               mk_metrics_now() - loop_start);
+        }
     }
-
-    val = MK_SCHED_SIGNAL_EVENT_LOOP_BREAK;
-
-#ifdef _WIN32
-    return send(sched->signal_channel_w, &val, sizeof(uint64_t), 0);
-#else
-    return write(sched->signal_channel_w, &val, sizeof(uint64_t));
-#endif
 }
 
 static int mk_server_lib_notify_started(struct mk_server *server)
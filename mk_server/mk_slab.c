@@ -0,0 +1,149 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_slab.h>
+
+#define SLAB_ALIGN(n, a)  (((n) + ((a) - 1)) & ~((a) - 1))
+
+struct mk_slab *mk_slab_create(size_t obj_size, int huge_pages)
+{
+    struct mk_slab *slab;
+
+    slab = mk_mem_alloc_z(sizeof(struct mk_slab));
+    if (!slab) {
+        return NULL;
+    }
+
+    /* Objects never share a cache line */
+    slab->obj_size = SLAB_ALIGN(obj_size, MK_CACHE_LINE_SIZE);
+    slab->huge_pages = huge_pages;
+    mk_list_init(&slab->chunks);
+
+    return slab;
+}
+
+void mk_slab_destroy(struct mk_slab *slab)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_slab_chunk *chunk;
+
+    if (!slab) {
+        return;
+    }
+
+    mk_list_foreach_safe(head, tmp, &slab->chunks) {
+        chunk = mk_list_entry(head, struct mk_slab_chunk, _head);
+        mk_list_del(&chunk->_head);
+        munmap(chunk, chunk->size);
+    }
+    mk_mem_free(slab);
+}
+
+/* Map a new chunk and push all its objects into the free list */
+static int slab_grow(struct mk_slab *slab)
+{
+    int huge = MK_FALSE;
+    char *obj;
+    char *end;
+    void *map = MAP_FAILED;
+    size_t size;
+    size_t offset;
+    long pagesize;
+    struct mk_slab_chunk *chunk;
+
+    offset = SLAB_ALIGN(sizeof(struct mk_slab_chunk), MK_CACHE_LINE_SIZE);
+
+#ifdef MAP_HUGETLB
+    if (slab->huge_pages == MK_TRUE &&
+        offset + slab->obj_size <= MK_SLAB_HUGE_CHUNK) {
+        size = MK_SLAB_HUGE_CHUNK;
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (map != MAP_FAILED) {
+            huge = MK_TRUE;
+        }
+    }
+#endif
+
+    if (map == MAP_FAILED) {
+        pagesize = sysconf(_SC_PAGESIZE);
+        size = offset + (slab->obj_size * MK_SLAB_CHUNK_OBJECTS);
+        size = SLAB_ALIGN(size, (size_t) pagesize);
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            mk_libc_error("mmap");
+            return -1;
+        }
+    }
+
+    chunk = map;
+    chunk->size = size;
+    mk_list_add(&chunk->_head, &slab->chunks);
+    slab->n_chunks++;
+    if (huge == MK_TRUE) {
+        slab->n_huge_chunks++;
+    }
+
+    /* Link the objects in address order */
+    end = (char *) map + size;
+    obj = (char *) map + offset;
+    while (obj + slab->obj_size <= end) {
+        obj += slab->obj_size;
+    }
+    while (obj > (char *) map + offset) {
+        obj -= slab->obj_size;
+        *(void **) obj = slab->free_list;
+        slab->free_list = obj;
+        slab->capacity++;
+    }
+
+    return 0;
+}
+
+void *mk_slab_alloc(struct mk_slab *slab)
+{
+    void *obj;
+
+    if (!slab->free_list && slab_grow(slab) != 0) {
+        return NULL;
+    }
+
+    obj = slab->free_list;
+    slab->free_list = *(void **) obj;
+
+    slab->in_use++;
+    if (slab->in_use > slab->peak) {
+        slab->peak = slab->in_use;
+    }
+
+    return obj;
+}
+
+void mk_slab_free(struct mk_slab *slab, void *obj)
+{
+    *(void **) obj = slab->free_list;
+    slab->free_list = obj;
+    slab->in_use--;
+}
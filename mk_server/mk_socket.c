@@ -218,10 +218,11 @@ int mk_socket_connect(char *host, int port, int async)
                 break;
             }
             else {
-                printf("%s", strerror(errno));
-                perror("connect");
-                exit(1);
+#ifdef MK_HAVE_TRACE
+                mk_libc_error("connect");
+#endif
                 close(socket_fd);
+                socket_fd = -1;
                 continue;
             }
         }
@@ -19,6 +19,7 @@
 
 #include <monkey/monkey.h>
 #include <monkey/mk_stream.h>
+#include <monkey/mk_metrics.h>
 #include <assert.h>
 
 /* Create a new channel */
@@ -33,6 +34,7 @@ struct mk_channel *mk_channel_new(int type, int fd)
     channel->type   = type;
     channel->fd     = fd;
     channel->status = MK_CHANNEL_OK;
+    channel->net_data = NULL;
     mk_list_init(&channel->streams);
 
     return channel;
@@ -76,6 +78,7 @@ size_t mk_stream_size(struct mk_stream *stream)
 int mk_channel_flush(struct mk_channel *channel)
 {
     int ret = 0;
+    struct mk_sched_conn *conn;
     size_t count = 0;
     size_t total = 0;
     uint32_t stop = (MK_CHANNEL_DONE | MK_CHANNEL_ERROR | MK_CHANNEL_EMPTY);
@@ -98,19 +101,19 @@ int mk_channel_flush(struct mk_channel *channel)
 #endif
     } while (total <= 4096 && ((ret & stop) == 0));
 
+    if (total > 0) {
+        mk_metrics_bytes_sent(mk_sched_get_thread_conf(), total);
+    }
+
     if (ret == MK_CHANNEL_DONE) {
         MK_TRACE("Channel done");
         return ret;
     }
     else if (ret & (MK_CHANNEL_FLUSH | MK_CHANNEL_BUSY)) {
         MK_TRACE("Channel FLUSH | BUSY");
-        if ((channel->event->mask & MK_EVENT_WRITE) == 0) {
-            mk_event_add(mk_sched_loop(),
-                         channel->fd,
-                         MK_EVENT_CONNECTION,
-                         MK_EVENT_WRITE,
-                         channel->event);
-        }
+        conn = mk_list_entry(channel, struct mk_sched_conn, channel);
+        mk_sched_conn_write_interest(conn, mk_sched_get_thread_conf(),
+                                     MK_TRUE);
     }
 
     return ret;
@@ -169,9 +172,14 @@ int mk_channel_stream_write(struct mk_stream *stream, size_t *count)
         }
         else if (input->type == MK_STREAM_RAW) {
             bytes = mk_sched_conn_write(channel,
-                                        input->buffer, input->bytes_total);
+                                        (char *) input->buffer +
+                                        input->bytes_offset,
+                                        input->bytes_total);
             MK_TRACE("[CH %i] STREAM_RAW, bytes=%lu/%lu\n",
                      channel->fd, bytes, input->bytes_total);
+            if (bytes > 0) {
+                input->bytes_offset += bytes;
+            }
         }
 
         if (bytes > 0) {
@@ -206,11 +214,217 @@ int mk_channel_stream_write(struct mk_stream *stream, size_t *count)
     return bytes;
 }
 
+/* Get the first stream of the channel that has some pending input */
+static inline struct mk_stream *channel_stream_pending(struct mk_channel *channel)
+{
+    struct mk_list *head;
+    struct mk_stream *stream;
+
+    mk_list_foreach(head, &channel->streams) {
+        stream = mk_list_entry(head, struct mk_stream, _head);
+        if (mk_list_is_empty(&stream->inputs) != 0) {
+            return stream;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Collect the buffers of the consecutive memory inputs (IOV and RAW) of the
+ * channel, crossing stream boundaries, so the responses of pipelined requests
+ * are flushed together. It stops on the first input of another type.
+ */
+static inline int channel_gather(struct mk_channel *channel,
+                                 struct mk_iovec *io, int size)
+{
+    int i;
+    int n = 0;
+    struct mk_iov *iov;
+    struct mk_list *head;
+    struct mk_list *head_in;
+    struct mk_stream *stream;
+    struct mk_stream_input *in;
+
+    mk_list_foreach(head, &channel->streams) {
+        stream = mk_list_entry(head, struct mk_stream, _head);
+        mk_list_foreach(head_in, &stream->inputs) {
+            in = mk_list_entry(head_in, struct mk_stream_input, _head);
+            if (in->type == MK_STREAM_IOV) {
+                iov = in->buffer;
+                if (!iov) {
+                    return n;
+                }
+                for (i = 0; i < iov->iov_idx; i++) {
+                    if (iov->io[i].iov_len == 0) {
+                        continue;
+                    }
+                    if (n == size) {
+                        return n;
+                    }
+                    io[n++] = iov->io[i];
+                }
+            }
+            else if (in->type == MK_STREAM_RAW) {
+                if (in->bytes_total == 0) {
+                    continue;
+                }
+                if (n == size) {
+                    return n;
+                }
+                io[n].iov_base = (char *) in->buffer + in->bytes_offset;
+                io[n].iov_len = in->bytes_total;
+                n++;
+            }
+            else {
+                return n;
+            }
+        }
+    }
+
+    return n;
+}
+
+/* Mark the bytes written by a gathered write as consumed, input by input */
+static inline void channel_gather_consume(struct mk_channel *channel,
+                                          size_t bytes)
+{
+    size_t len;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_list *tmp_in;
+    struct mk_list *head_in;
+    struct mk_stream *stream;
+    struct mk_stream_input *in;
+
+    mk_list_foreach_safe(head, tmp, &channel->streams) {
+        stream = mk_list_entry(head, struct mk_stream, _head);
+        if (mk_list_is_empty(&stream->inputs) == 0) {
+            continue;
+        }
+
+        mk_list_foreach_safe(head_in, tmp_in, &stream->inputs) {
+            if (bytes == 0) {
+                return;
+            }
+
+            in = mk_list_entry(head_in, struct mk_stream_input, _head);
+            len = in->bytes_total;
+            if (bytes < len) {
+                len = bytes;
+            }
+
+            if (in->type == MK_STREAM_IOV) {
+                mk_iov_consume(in->buffer, len);
+            }
+            else {
+                in->bytes_offset += len;
+            }
+            mk_stream_input_consume(in, len);
+            bytes -= len;
+
+            /* notification callbacks, optional */
+            if (stream->cb_bytes_consumed) {
+                stream->cb_bytes_consumed(stream, len);
+            }
+            if (in->cb_consumed) {
+                in->cb_consumed(in, len);
+            }
+
+            if (in->bytes_total == 0) {
+                MK_TRACE("Input done, unlinking (channel=%p)", channel);
+                mk_stream_in_release(in);
+            }
+        }
+
+        /* Everytime the stream is empty, we notify the trigger the cb */
+        if (mk_list_is_empty(&stream->inputs) == 0 && stream->cb_finished) {
+            stream->cb_finished(stream);
+        }
+    }
+}
+
+/*
+ * Copy up to 'size' bytes of the consecutive memory inputs of the channel
+ * without consuming them. Used by protocol handlers that do not write a
+ * channel to the socket but frame its content (HTTP/2 streams).
+ */
+size_t mk_channel_copy(struct mk_channel *channel, char *buf, size_t size)
+{
+    int i;
+    size_t len;
+    size_t n = 0;
+    size_t left;
+    struct mk_iov *iov;
+    struct mk_list *head;
+    struct mk_list *head_in;
+    struct mk_stream *stream;
+    struct mk_stream_input *in;
+
+    mk_list_foreach(head, &channel->streams) {
+        stream = mk_list_entry(head, struct mk_stream, _head);
+        mk_list_foreach(head_in, &stream->inputs) {
+            in = mk_list_entry(head_in, struct mk_stream_input, _head);
+            if (n == size) {
+                return n;
+            }
+
+            if (in->type == MK_STREAM_IOV) {
+                iov = in->buffer;
+                if (!iov) {
+                    return n;
+                }
+                left = in->bytes_total;
+                for (i = 0; i < iov->iov_idx && left > 0 && n < size; i++) {
+                    len = iov->io[i].iov_len;
+                    if (len > left) {
+                        len = left;
+                    }
+                    if (len > size - n) {
+                        len = size - n;
+                    }
+                    memcpy(buf + n, iov->io[i].iov_base, len);
+                    n += len;
+                    left -= len;
+                }
+            }
+            else if (in->type == MK_STREAM_RAW) {
+                len = in->bytes_total;
+                if (len > size - n) {
+                    len = size - n;
+                }
+                memcpy(buf + n, (char *) in->buffer + in->bytes_offset, len);
+                n += len;
+            }
+            else {
+                return n;
+            }
+        }
+    }
+
+    return n;
+}
+
+/* Check if any stream of the channel has some input pending */
+int mk_channel_pending(struct mk_channel *channel)
+{
+    return (channel_stream_pending(channel) != NULL);
+}
+
+/* Mark as consumed the bytes taken with mk_channel_copy() */
+void mk_channel_consume(struct mk_channel *channel, size_t bytes)
+{
+    channel_gather_consume(channel, bytes);
+}
+
 /* It perform a direct stream I/O write through the network layer */
 int mk_channel_write(struct mk_channel *channel, size_t *count)
 {
+    int i;
+    int n;
     ssize_t bytes = -1;
-    struct mk_iov *iov;
+    struct mk_iov iov;
+    struct mk_iovec io[MK_CHANNEL_IOV_MAX];
     struct mk_stream *stream = NULL;
     struct mk_stream_input *input;
 
@@ -221,46 +435,53 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
         return MK_CHANNEL_EMPTY;
     }
 
-    /* Get the input source */
-    stream = mk_list_entry_first(&channel->streams, struct mk_stream, _head);
-    if (mk_list_is_empty(&stream->inputs) == 0) {
+    /*
+     * Get the input source. Streams of the requests that were already served
+     * may remain linked to the channel until the requests are released.
+     */
+    stream = channel_stream_pending(channel);
+    if (!stream) {
         return MK_CHANNEL_EMPTY;
     }
     input = mk_list_entry_first(&stream->inputs, struct mk_stream_input, _head);
 
+    if (channel->type != MK_CHANNEL_SOCKET) {
+        return MK_CHANNEL_ERROR;
+    }
+
     /*
-     * Based on the Stream Input type we consume on that way, not all inputs
-     * requires to read from buffer, e.g: Static File, Pipes.
+     * Memory buffers: headers, pages and small responses of one or more
+     * streams go out in a single writev(2).
      */
-    if (channel->type == MK_CHANNEL_SOCKET) {
-        if (input->type == MK_STREAM_FILE) {
-            bytes = channel_write_in_file(channel, input);
+    if (input->type == MK_STREAM_IOV || input->type == MK_STREAM_RAW) {
+        n = channel_gather(channel, io, MK_CHANNEL_IOV_MAX);
+        if (n == 0) {
+            return MK_CHANNEL_EMPTY;
         }
-        else if (input->type == MK_STREAM_IOV) {
-            iov   = input->buffer;
-            if (!iov) {
-                return MK_CHANNEL_EMPTY;
-            }
 
-            bytes = mk_sched_conn_writev(channel, iov);
+        iov.io = io;
+        iov.buf_to_free = NULL;
+        iov.iov_idx = n;
+        iov.buf_idx = 0;
+        iov.size = n;
+        iov.total_len = 0;
 
-            MK_TRACE("[CH %i] STREAM_IOV, wrote %d bytes",
-                     channel->fd, bytes);
-            if (bytes > 0) {
-                /* Perform the adjustment on mk_iov */
-                mk_iov_consume(iov, bytes);
-            }
-        }
-        else if (input->type == MK_STREAM_RAW) {
-            bytes = mk_sched_conn_write(channel,
-                                        input->buffer, input->bytes_total);
-            MK_TRACE("[CH %i] STREAM_RAW, bytes=%lu/%lu",
-                     channel->fd, bytes, input->bytes_total);
-            if (bytes > 0) {
-                /* DEPRECATED: consume_raw(input, bytes); */
-            }
+        /* network layers other than liana rely on the total length */
+        for (i = 0; i < n; i++) {
+            iov.total_len += io[i].iov_len;
         }
 
+        bytes = mk_sched_conn_writev(channel, &iov);
+        MK_TRACE("[CH %i] STREAM_IOV, %i buffers, wrote %d bytes",
+                 channel->fd, n, bytes);
+
+        if (bytes > 0) {
+            *count = bytes;
+            channel_gather_consume(channel, bytes);
+        }
+    }
+    else if (input->type == MK_STREAM_FILE) {
+        bytes = channel_write_in_file(channel, input);
         if (bytes > 0) {
             *count = bytes;
             mk_stream_input_consume(input, bytes);
@@ -279,37 +500,34 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
                 mk_stream_in_release(input);
             }
 
-            if (mk_list_is_empty(&stream->inputs) == 0) {
-                /* Everytime the stream is empty, we notify the trigger the cb */
-                if (stream->cb_finished) {
-                    stream->cb_finished(stream);
-                }
-
-                if (mk_channel_is_empty(channel) == 0) {
-                    MK_TRACE("[CH %i] CHANNEL_DONE", channel->fd);
-                    return MK_CHANNEL_DONE;
-                }
-                else {
-                    MK_TRACE("[CH %i] CHANNEL_FLUSH", channel->fd);
-                    return MK_CHANNEL_FLUSH;
-                }
+            /* Everytime the stream is empty, we notify the trigger the cb */
+            if (mk_list_is_empty(&stream->inputs) == 0 &&
+                stream->cb_finished) {
+                stream->cb_finished(stream);
             }
-
-            MK_TRACE("[CH %i] CHANNEL_FLUSH", channel->fd);
-            return MK_CHANNEL_FLUSH;
         }
-        else if (bytes < 0) {
-            if (errno == EAGAIN) {
-                return MK_CHANNEL_BUSY;
-            }
+    }
 
-            mk_stream_in_release(input);
-            return MK_CHANNEL_ERROR;
+    if (bytes > 0) {
+        if (!channel_stream_pending(channel)) {
+            MK_TRACE("[CH %i] CHANNEL_DONE", channel->fd);
+            return MK_CHANNEL_DONE;
         }
-        else if (bytes == 0) {
-            mk_stream_in_release(input);
-            return MK_CHANNEL_ERROR;
+
+        MK_TRACE("[CH %i] CHANNEL_FLUSH", channel->fd);
+        return MK_CHANNEL_FLUSH;
+    }
+    else if (bytes < 0) {
+        if (errno == EAGAIN) {
+            return MK_CHANNEL_BUSY;
         }
+
+        mk_stream_in_release(input);
+        return MK_CHANNEL_ERROR;
+    }
+    else if (bytes == 0) {
+        mk_stream_in_release(input);
+        return MK_CHANNEL_ERROR;
     }
 
     return MK_CHANNEL_ERROR;
@@ -21,7 +21,6 @@
 #include <monkey/monkey.h>
 #include <monkey/mk_core.h>
 #include <monkey/mk_vhost.h>
-#include <monkey/mk_vhost_tls.h>
 #include <monkey/mk_utils.h>
 #include <monkey/mk_http_status.h>
 #include <monkey/mk_info.h>
@@ -30,7 +29,6 @@
 
 #include <re.h>
 #include <sys/stat.h>
-#include <fcntl.h>
 
 static int str_to_regex(char *str, regex_t *reg)
 {
@@ -49,262 +47,6 @@ static int str_to_regex(char *str, regex_t *reg)
     return 0;
 }
 
-/*
- * This function is triggered upon thread creation (inside the thread
- * context), here we configure per-thread data.
- */
-int mk_vhost_fdt_worker_init(struct mk_server *server)
-{
-    int i;
-    int j;
-    struct mk_vhost *h;
-    struct mk_list *list;
-    struct mk_list *head;
-    struct vhost_fdt_host *fdt;
-    struct vhost_fdt_hash_table *ht;
-    struct vhost_fdt_hash_chain *hc;
-
-    if (server->fdt == MK_FALSE) {
-        return -1;
-    }
-
-    /*
-     * We are under a thread context and the main configuration is
-     * already in place. Now for every existent virtual host we are
-     * going to create the File Descriptor Table (FDT) which aims to
-     * hold references of 'open and shared' file descriptors under
-     * the Virtual Host context.
-     */
-
-    /*
-     * Under an initialization context we need to protect this critical
-     * section
-     */
-    pthread_mutex_lock(&server->vhost_fdt_mutex);
-
-    /*
-     * Initialize the thread FDT/Hosts list and create an entry per
-     * existent virtual host
-     */
-    list = mk_mem_alloc_z(sizeof(struct mk_list));
-    mk_list_init(list);
-
-    mk_list_foreach(head, &server->hosts) {
-        h = mk_list_entry(head, struct mk_vhost, _head);
-
-        fdt = mk_mem_alloc(sizeof(struct vhost_fdt_host));
-        fdt->host = h;
-
-        /* Initialize hash table */
-        for (i = 0; i < VHOST_FDT_HASHTABLE_SIZE; i++) {
-            ht = &fdt->hash_table[i];
-            ht->av_slots = VHOST_FDT_HASHTABLE_CHAINS;
-
-            /* for each chain under the hash table, set the fd */
-            for (j = 0; j < VHOST_FDT_HASHTABLE_CHAINS; j++) {
-                hc = &ht->chain[j];
-                hc->fd      = -1;
-                hc->hash    =  0;
-                hc->readers =  0;
-            }
-        }
-        mk_list_add(&fdt->_head, list);
-    }
-
-    MK_TLS_SET(mk_tls_vhost_fdt, list);
-    pthread_mutex_unlock(&server->vhost_fdt_mutex);
-
-    return 0;
-}
-
-int mk_vhost_fdt_worker_exit(struct mk_server *server)
-{
-    struct mk_list *list;
-    struct mk_list *head;
-    struct mk_list *tmp;
-    struct vhost_fdt_host *fdt;
-
-    if (server->fdt == MK_FALSE) {
-        return -1;
-    }
-
-    list = MK_TLS_GET(mk_tls_vhost_fdt);
-    mk_list_foreach_safe(head, tmp, list) {
-        fdt = mk_list_entry(head, struct vhost_fdt_host, _head);
-        mk_list_del(&fdt->_head);
-        mk_mem_free(fdt);
-    }
-
-    mk_mem_free(list);
-    return 0;
-}
-
-
-static inline
-struct vhost_fdt_hash_table *mk_vhost_fdt_table_lookup(int id, struct mk_vhost *host)
-{
-    struct mk_list *head;
-    struct mk_list *list;
-    struct vhost_fdt_host *fdt_host;
-    struct vhost_fdt_hash_table *ht = NULL;
-
-    list = MK_TLS_GET(mk_tls_vhost_fdt);
-    mk_list_foreach(head, list) {
-        fdt_host = mk_list_entry(head, struct vhost_fdt_host, _head);
-        if (fdt_host->host == host) {
-            ht = &fdt_host->hash_table[id];
-            return ht;
-        }
-    }
-
-    return ht;
-}
-
-static inline
-struct vhost_fdt_hash_chain
-*mk_vhost_fdt_chain_lookup(unsigned int hash, struct vhost_fdt_hash_table *ht)
-{
-    int i;
-    struct vhost_fdt_hash_chain *hc = NULL;
-
-    for (i = 0; i < VHOST_FDT_HASHTABLE_CHAINS; i++) {
-        hc = &ht->chain[i];
-        if (hc->hash == hash) {
-            return hc;
-        }
-    }
-
-    return NULL;
-}
-
-
-static inline int mk_vhost_fdt_open(int id, unsigned int hash,
-                                    struct mk_http_request *sr,
-                                    struct mk_server *server)
-{
-    int i;
-    int fd = -1;
-    struct vhost_fdt_hash_table *ht = NULL;
-    struct vhost_fdt_hash_chain *hc;
-
-    if (server->fdt == MK_FALSE) {
-        return open(sr->real_path.data, sr->file_info.flags_read_only);
-    }
-
-    ht = mk_vhost_fdt_table_lookup(id, sr->host_conf);
-    if (mk_unlikely(!ht)) {
-        return open(sr->real_path.data, sr->file_info.flags_read_only);
-    }
-
-    /* We got the hash table, now look around the chains array */
-    hc = mk_vhost_fdt_chain_lookup(hash, ht);
-    if (hc) {
-        /* Increment the readers and return the shared FD */
-        hc->readers++;
-        sr->vhost_fdt_id      = id;
-        sr->vhost_fdt_hash    = hash;
-        sr->vhost_fdt_enabled = MK_TRUE;
-        return hc->fd;
-    }
-
-    /*
-     * Get here means that no entry exists in the hash table for the
-     * requested file descriptor and hash, we must try to open the file
-     * and register the entry in the table.
-     */
-    fd = open(sr->real_path.data, sr->file_info.flags_read_only);
-    if (fd == -1) {
-        return -1;
-    }
-
-    /* If chains are full, just return the new FD, bad luck... */
-    if (ht->av_slots <= 0) {
-        return fd;
-    }
-
-    /* Register the new entry in an available slot */
-    for (i = 0; i < VHOST_FDT_HASHTABLE_CHAINS; i++) {
-        hc = &ht->chain[i];
-        if (hc->fd == -1) {
-            hc->fd   = fd;
-            hc->hash = hash;
-            hc->readers++;
-            ht->av_slots--;
-
-            sr->vhost_fdt_id      = id;
-            sr->vhost_fdt_hash    = hash;
-            sr->vhost_fdt_enabled = MK_TRUE;
-
-            return fd;
-        }
-    }
-
-    return fd;
-}
-
-static inline int mk_vhost_fdt_close(struct mk_http_request *sr,
-                                     struct mk_server *server)
-{
-    int id;
-    unsigned int hash;
-    struct vhost_fdt_hash_table *ht = NULL;
-    struct vhost_fdt_hash_chain *hc;
-
-    if (server->fdt == MK_FALSE || sr->vhost_fdt_enabled == MK_FALSE) {
-        if (sr->in_file.fd > 0) {
-            return close(sr->in_file.fd);
-        }
-        return -1;
-    }
-
-    id   = sr->vhost_fdt_id;
-    hash = sr->vhost_fdt_hash;
-
-    ht = mk_vhost_fdt_table_lookup(id, sr->host_conf);
-    if (mk_unlikely(!ht)) {
-        return close(sr->in_file.fd);
-    }
-
-    /* We got the hash table, now look around the chains array */
-    hc = mk_vhost_fdt_chain_lookup(hash, ht);
-    if (hc) {
-        /* Increment the readers and check if we should close */
-        hc->readers--;
-        sr->vhost_fdt_enabled = MK_FALSE;
-
-        if (hc->readers == 0) {
-            hc->fd   = -1;
-            hc->hash = 0;
-            ht->av_slots++;
-            return close(sr->in_file.fd);
-        }
-        else {
-            return 0;
-        }
-    }
-    return close(sr->in_file.fd);
-}
-
-
-int mk_vhost_open(struct mk_http_request *sr, struct mk_server *server)
-{
-    int id;
-    int off;
-    unsigned int hash;
-
-    off = sr->host_conf->documentroot.len;
-    hash = mk_utils_gen_hash(sr->real_path.data + off,
-                             sr->real_path.len - off);
-    id   = (hash % VHOST_FDT_HASHTABLE_SIZE);
-
-    return mk_vhost_fdt_open(id, hash, sr, server);
-}
-
-int mk_vhost_close(struct mk_http_request *sr, struct mk_server *server)
-{
-    return mk_vhost_fdt_close(sr, server);
-}
-
 struct mk_vhost_handler *mk_vhost_handler_match(char *match,
                                                 void (*cb)(struct mk_http_request *,
                                                            void *),
@@ -660,6 +402,7 @@ void mk_vhost_init(char *path, struct mk_server *server)
     if (!p_host) {
         mk_err("Error parsing main configuration file 'default'");
     }
+    p_host->id = server->nhosts;
     mk_list_add(&p_host->_head, &server->hosts);
     server->nhosts++;
     mk_mem_free(buf);
@@ -696,6 +439,7 @@ void mk_vhost_init(char *path, struct mk_server *server)
             continue;
         }
         else {
+            p_host->id = server->nhosts;
             mk_list_add(&p_host->_head, &server->hosts);
             server->nhosts++;
         }
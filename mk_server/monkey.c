@@ -179,7 +179,8 @@ struct mk_server *mk_server_create()
 
     mk_mimetype_init(server);
 
-    pthread_mutex_init(&server->vhost_fdt_mutex, NULL);
+    /* Pick the HTTP parser delimiters scanner for this CPU */
+    mk_http_parser_setup();
 
     return server;
 }
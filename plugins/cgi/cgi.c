@@ -26,6 +26,13 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+
+struct cgi_request **requests_by_socket;
+struct mk_list cgi_global_matches;
+pthread_key_t cgi_request_list;
+
+static char *server_signature;
 
 void cgi_finish(struct cgi_request *r)
 {
@@ -35,7 +42,13 @@ void cgi_finish(struct cgi_request *r)
      */
     mk_api->ev_del(mk_api->sched_loop(), (struct mk_event *) r);
     close(r->fd);
-    if (r->chunked && r->active == MK_TRUE) {
+    if (r->active == MK_TRUE && !r->all_headers_done) {
+        /* The script ended without a complete response header block */
+        PLUGIN_TRACE("CGI sending error, no response headers");
+        mk_api->http_request_error(MK_SERVER_INTERNAL_ERROR, r->cs, r->sr,
+                                   r->plugin);
+    }
+    else if (r->chunked && r->active == MK_TRUE) {
         PLUGIN_TRACE("CGI sending Chunked EOF");
         channel_write(r, "0\r\n\r\n", 5);
     }
@@ -70,19 +83,43 @@ int swrite(const int fd, const void *buf, const size_t count)
     return count;
 }
 
+static void cb_channel_finished(struct mk_stream_input *in)
+{
+    mk_api->mem_free(in->context);
+}
+
 int channel_write(struct cgi_request *r, void *buf, size_t count)
 {
     int ret;
+    char *data;
+    struct mk_stream_input *in;
 
     if (r->active == MK_FALSE) {
         return -1;
     }
 
+    /*
+     * The stream references the buffer until it's sent, the caller
+     * reuses its own one for the next read.
+     */
+    data = mk_api->mem_alloc(count);
+    if (!data) {
+        return -1;
+    }
+    memcpy(data, buf, count);
+
     MK_TRACE("channel write: %d bytes", count);
-    mk_stream_in_raw(&r->sr->stream,
-                      NULL,
-                      buf, count,
-                      NULL, NULL);
+    ret = mk_stream_in_raw(&r->sr->stream,
+                           NULL,
+                           data, count,
+                           NULL, cb_channel_finished);
+    if (ret != 0) {
+        mk_api->mem_free(data);
+        return -1;
+    }
+    in = mk_list_entry_last(&r->sr->stream.inputs,
+                            struct mk_stream_input, _head);
+    in->context = data;
 
     ret = mk_api->channel_flush(r->sr->session->channel);
     if (ret & MK_CHANNEL_ERROR) {
@@ -94,10 +131,11 @@ int channel_write(struct cgi_request *r, void *buf, size_t count)
 
 static void cgi_write_post(void *p)
 {
-    const struct post_t * const in = p;
+    struct post_t *in = p;
 
     swrite(in->fd, in->buf, in->len);
     close(in->fd);
+    mk_api->mem_free(in);
 }
 
 static int do_cgi(const char *const __restrict__ file,
@@ -109,7 +147,7 @@ static int do_cgi(const char *const __restrict__ file,
                   char *mimetype)
 {
     int ret;
-    int devnull;
+    pid_t pid;
     const int socket = cs->socket;
     struct file_info finfo;
     struct cgi_request *r = NULL;
@@ -163,7 +201,7 @@ static int do_cgi(const char *const __restrict__ file,
     env[envpos++] = method;
 
     snprintf(server_software, SHORTLEN, "SERVER_SOFTWARE=%s",
-             mk_api->config->server_signature);
+             server_signature);
     env[envpos++] = server_software;
 
     snprintf(http_host, SHORTLEN, "HTTP_HOST=%.*s", (int) sr->host.len, sr->host.data);
@@ -222,89 +260,47 @@ static int do_cgi(const char *const __restrict__ file,
     env[envpos] = NULL;
 
     /* pipes, from monkey's POV */
-    if (pipe(writepipe) || pipe(readpipe)) {
+    if (pipe2(writepipe, O_CLOEXEC)) {
         mk_err("Failed to create pipe");
         return 403;
     }
-
-    pid_t pid = vfork();
-    if (pid < 0) {
-        mk_err("Failed to fork");
+    if (pipe2(readpipe, O_CLOEXEC)) {
+        mk_err("Failed to create pipe");
+        close(writepipe[0]);
+        close(writepipe[1]);
         return 403;
     }
 
-    /* Child */
-    if (pid == 0) {
-        close(writepipe[1]);
-        close(readpipe[0]);
+    pid = cgi_spawn(file, interpreter, env, writepipe[0], readpipe[1]);
 
-        /* Our stdin is the read end of monkey's writing */
-        if (dup2(writepipe[0], 0) < 0) {
-            mk_err("dup2 failed");
-            _exit(1);
-        }
-        close(writepipe[0]);
-
-        /* Our stdout is the write end of monkey's reading */
-        if (dup2(readpipe[1], 1) < 0) {
-            mk_err("dup2 failed");
-            _exit(1);
-        }
-        close(readpipe[1]);
-
-        /* Our stderr goes to /dev/null */
-        devnull = open("/dev/null", O_WRONLY);
-        if (devnull == -1) {
-            perror("open");
-            _exit(1);
-        }
-
-        if (dup2(devnull, 2) < 0) {
-            mk_err("dup2 failed");
-            _exit(1);
-        }
-        close(devnull);
-
-        char *argv[3] = { NULL };
-
-        char *tmp = mk_api->str_dup(file);
-        if (chdir(dirname(tmp)))
-            _exit(1);
-
-        char *tmp2 = mk_api->str_dup(file);
-        argv[0] = basename(tmp2);
-
-        /* Restore signals for the child */
-        signal(SIGPIPE, SIG_DFL);
-        signal(SIGCHLD, SIG_DFL);
-
-        if (!interpreter) {
-            execve(file, argv, env);
-        }
-        else {
-            argv[0] = basename(interpreter);
-            argv[1] = (char *) file;
-            execve(interpreter, argv, env);
-        }
-        /* Exec failed, return */
-        _exit(1);
-    }
-
-    /* Yay me */
     close(writepipe[0]);
     close(readpipe[1]);
 
+    if (pid < 0) {
+        mk_err("Failed to spawn CGI process");
+        close(writepipe[1]);
+        close(readpipe[0]);
+        return 403;
+    }
+
     /* If we have POST data to write, spawn a thread to do that */
     if (sr->data.len) {
-        struct post_t p;
+        struct post_t *p;
         pthread_t tid;
 
-        p.fd = writepipe[1];
-        p.buf = sr->data.data;
-        p.len = sr->data.len;
+        p = mk_api->mem_alloc(sizeof(struct post_t));
+        if (!p) {
+            close(writepipe[1]);
+            return 403;
+        }
+        p->fd = writepipe[1];
+        p->buf = sr->data.data;
+        p->len = sr->data.len;
 
-        ret = mk_api->worker_spawn(cgi_write_post, &p, &tid);
+        ret = mk_api->worker_spawn(cgi_write_post, p, &tid);
         if (ret != 0) {
+            close(writepipe[1]);
+            mk_api->mem_free(p);
             return 403;
         }
     }
@@ -325,18 +321,10 @@ static int do_cgi(const char *const __restrict__ file,
      * by specification, only on HTTP/1.1 where the Chunked Transfer encoding
      * exists.
      */
-    if (r->sr->protocol >= MK_HTTP_PROTOCOL_11) {
+    if (r->sr->protocol == MK_HTTP_PROTOCOL_11) {
         r->hangup = MK_FALSE;
     }
 
-    /* Set transfer encoding */
-    if (r->sr->protocol >= MK_HTTP_PROTOCOL_11 &&
-        (r->sr->headers.status < MK_REDIR_MULTIPLE ||
-         r->sr->headers.status > MK_REDIR_USE_PROXY)) {
-        r->sr->headers.transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
-        r->chunked = 1;
-    }
-
     /* Register the 'request' context */
     cgi_req_add(r);
 
@@ -362,12 +350,14 @@ static int do_cgi(const char *const __restrict__ file,
     return 200;
 }
 
-int mk_cgi_plugin_init(struct plugin_api **api, char *confdir)
+int mk_cgi_plugin_init(struct mk_plugin *plugin, char *confdir)
 {
     struct rlimit lim;
+    struct mk_server *server = plugin->server_ctx;
     (void) confdir;
 
-    mk_api = *api;
+    mk_api = plugin->api;
+    server_signature = server->server_signature;
     mk_list_init(&cgi_global_matches);
     pthread_key_create(&cgi_request_list, NULL);
 
@@ -386,9 +376,10 @@ int mk_cgi_plugin_init(struct plugin_api **api, char *confdir)
     return 0;
 }
 
-int mk_cgi_plugin_exit()
+int mk_cgi_plugin_exit(struct mk_plugin *plugin)
 {
-    regfree(&match_regex);
+    (void) plugin;
+
     mk_api->mem_free(requests_by_socket);
 
     return 0;
@@ -425,7 +416,7 @@ int mk_cgi_stage30(struct mk_plugin *plugin,
         }
 
         /* Mimetype */
-        param = mk_api->handler_param_get(0, params);
+        param = mk_api->handler_param_get(1, params);
         if (param) {
             mimetype = param->p.data;
         }
@@ -434,9 +425,12 @@ int mk_cgi_stage30(struct mk_plugin *plugin,
     int status = do_cgi(file, sr->uri_processed.data,
                         sr, cs, plugin, interpreter, mimetype);
 
-    /* These are just for the other plugins, such as logger; bogus data */
-    mk_api->header_set_http_status(sr, status);
+    /*
+     * On success the status is left unset: the response headers are
+     * prepared once the script sent its own ones.
+     */
     if (status != 200) {
+        mk_api->header_set_http_status(sr, status);
         return MK_PLUGIN_RET_CLOSE_CONX;
     }
 
@@ -467,9 +461,10 @@ int mk_cgi_stage30_hangup(struct mk_plugin *plugin,
     return 0;
 }
 
-void mk_cgi_worker_init()
+void mk_cgi_worker_init(struct mk_server *server)
 {
     struct mk_list *list = mk_api->mem_alloc_z(sizeof(struct mk_list));
+    (void) server;
 
     mk_list_init(list);
     pthread_setspecific(cgi_request_list, (void *) list);
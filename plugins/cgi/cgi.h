@@ -34,9 +34,7 @@ enum {
     SHORTLEN = 64
 };
 
-regex_t match_regex;
-
-struct cgi_request **requests_by_socket;
+extern struct cgi_request **requests_by_socket;
 
 struct post_t {
     int fd;
@@ -57,8 +55,7 @@ struct cgi_vhost_t {
     struct mk_list matches;
 };
 
-struct cgi_vhost_t *cgi_vhosts;
-struct mk_list cgi_global_matches;
+extern struct mk_list cgi_global_matches;
 
 
 struct cgi_request {
@@ -86,9 +83,7 @@ struct cgi_request {
 };
 
 /* Global list per worker */
-pthread_key_t cgi_request_list;
-
-extern struct cgi_request **requests_by_socket;
+extern pthread_key_t cgi_request_list;
 
 void cgi_finish(struct cgi_request *r);
 
@@ -130,4 +125,7 @@ static inline struct cgi_request *cgi_req_get_by_fd(int fd)
 
 int cb_cgi_read(void *data);
 
+pid_t cgi_spawn(const char *file, const char *interpreter, char **env,
+                int fd_in, int fd_out);
+
 #endif
@@ -18,6 +18,8 @@
  *  limitations under the License.
  */
 
+#define MK_PLUGIN_API_EXTERN
+
 #include "cgi.h"
 
 /*
@@ -57,6 +59,27 @@ static char *getearliestbreak(const char buf[], const unsigned bufsize,
     return crend;
 }
 
+/*
+ * The script sent its whole header block: prepare our own response
+ * headers with the status it asked for.
+ */
+static void cgi_headers_start(struct cgi_request *r)
+{
+    /* Set transfer encoding */
+    if (r->sr->protocol == MK_HTTP_PROTOCOL_11 &&
+        (r->sr->headers.status < MK_REDIR_MULTIPLE ||
+         r->sr->headers.status > MK_REDIR_USE_PROXY)) {
+        r->sr->headers.transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
+        r->chunked = 1;
+    }
+    else {
+        /* Without chunks the end of the content is the connection close */
+        r->hangup = MK_TRUE;
+    }
+
+    mk_api->header_prepare(r->plugin, r->cs, r->sr);
+}
+
 int process_cgi_data(struct cgi_request *r)
 {
     int ret;
@@ -69,8 +92,14 @@ int process_cgi_data(struct cgi_request *r)
     unsigned char advance;
 
     mk_api->socket_cork_flag(r->cs->socket, TCP_CORK_OFF);
-    if (!r->status_done && r->in_len >= 8) {
-        if (memcmp(buf, "Status: ", 8) == 0) {
+    if (!r->status_done) {
+        /* Wait for enough data to check the status line */
+        if (r->in_len < 8 && !memchr(buf, '\n', r->in_len)) {
+            return MK_PLUGIN_RET_EVENT_OWNED;
+        }
+
+        mk_api->header_set_http_status(r->sr, MK_HTTP_OK);
+        if (r->in_len >= 8 && memcmp(buf, "Status: ", 8) == 0) {
             status = atoi(buf + 8);
             mk_api->header_set_http_status(r->sr, status);
             endl = memchr(buf + 8, '\n', r->in_len - 8);
@@ -79,11 +108,11 @@ int process_cgi_data(struct cgi_request *r)
             }
             else {
                 endl++;
-                outptr = endl;
                 r->in_len -= endl - buf;
+                memmove(buf, endl, r->in_len);
             }
         }
-        else if (memcmp(buf, "HTTP", 4) == 0) {
+        else if (r->in_len >= 8 && memcmp(buf, "HTTP", 4) == 0) {
             status = atoi(buf + 9);
             mk_api->header_set_http_status(r->sr, status);
 
@@ -93,26 +122,41 @@ int process_cgi_data(struct cgi_request *r)
             }
             else {
                 endl++;
-                outptr = endl;
                 r->in_len -= endl - buf;
+                memmove(buf, endl, r->in_len);
             }
         }
-        mk_api->header_prepare(r->plugin, r->cs, r->sr);
         r->status_done = 1;
     }
 
     if (!r->all_headers_done) {
-        advance = 4;
-
-        /* Write the rest of the headers without chunking */
-        end = getearliestbreak(outptr, r->in_len, &advance);
-        if (!end) {
-            /* Let's return until we have the headers break */
+        if (r->in_len == 0) {
             return MK_PLUGIN_RET_EVENT_OWNED;
         }
-        end += advance;
-        len = end - outptr;
-        channel_write(r, outptr, len);
+
+        /* No headers at all, the output starts with the empty line */
+        if (*outptr == '\n' || *outptr == '\r') {
+            if (*outptr == '\r' && r->in_len < 2) {
+                return MK_PLUGIN_RET_EVENT_OWNED;
+            }
+            len = (*outptr == '\n') ? 1 : 2;
+            cgi_headers_start(r);
+            channel_write(r, MK_CRLF, 2);
+        }
+        else {
+            advance = 4;
+
+            /* Write the rest of the headers without chunking */
+            end = getearliestbreak(outptr, r->in_len, &advance);
+            if (!end) {
+                /* Let's return until we have the headers break */
+                return MK_PLUGIN_RET_EVENT_OWNED;
+            }
+            end += advance;
+            len = end - outptr;
+            cgi_headers_start(r);
+            channel_write(r, outptr, len);
+        }
         outptr += len;
         r->in_len -= len;
 
@@ -18,6 +18,8 @@
  *  limitations under the License.
  */
 
+#define MK_PLUGIN_API_EXTERN
+
 #include "cgi.h"
 
 struct cgi_request *cgi_req_create(int fd, int socket,
@@ -0,0 +1,149 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#define MK_PLUGIN_API_EXTERN
+
+#include "cgi.h"
+
+#include <spawn.h>
+#include <fcntl.h>
+
+/*
+ * Start the CGI process with its stdin and stdout set to the given pipes,
+ * stderr goes to /dev/null. The pipes are expected to be close-on-exec,
+ * so the child does not keep the other ends open.
+ *
+ * A fork(2) from a worker duplicates the page tables of the whole server
+ * on every request. posix_spawn(3) creates the process sharing our
+ * address space until it calls execve(2), the worker is blocked just for
+ * that short while.
+ */
+
+#ifdef MK_HAVE_SPAWN_CHDIR
+static pid_t cgi_spawn_exec(const char *path, char **argv, char **env,
+                            const char *dir, int fd_in, int fd_out)
+{
+    int ret;
+    pid_t pid;
+    sigset_t sigs;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fd_in, 0);
+    posix_spawn_file_actions_adddup2(&actions, fd_out, 1);
+    posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+#ifdef MK_HAVE_SPAWN_CLOSEFROM
+    /* the client sockets and any other descriptor of the server */
+    posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+#endif
+    posix_spawn_file_actions_addchdir_np(&actions, dir);
+
+    /* Restore signals for the child */
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    sigaddset(&sigs, SIGPIPE);
+    sigaddset(&sigs, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                             POSIX_SPAWN_SETSIGDEF);
+
+    ret = posix_spawn(&pid, path, &actions, &attr, argv, env);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (ret != 0) {
+        errno = ret;
+        return -1;
+    }
+
+    return pid;
+}
+#else
+/*
+ * Without posix_spawn_file_actions_addchdir_np() the working directory
+ * can't be set, fallback to vfork(2): the child only runs async-signal
+ * safe calls on data prepared by the parent.
+ */
+static pid_t cgi_spawn_exec(const char *path, char **argv, char **env,
+                            const char *dir, int fd_in, int fd_out)
+{
+    int fd;
+    pid_t pid;
+
+    pid = vfork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    if (dup2(fd_in, 0) < 0 || dup2(fd_out, 1) < 0) {
+        _exit(1);
+    }
+
+    fd = open("/dev/null", O_WRONLY);
+    if (fd == -1 || dup2(fd, 2) < 0) {
+        _exit(1);
+    }
+    close(fd);
+
+    if (chdir(dir)) {
+        _exit(1);
+    }
+
+    /* Restore signals for the child */
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+
+    execve(path, argv, env);
+    _exit(1);
+}
+#endif
+
+pid_t cgi_spawn(const char *file, const char *interpreter, char **env,
+                int fd_in, int fd_out)
+{
+    pid_t pid;
+    char *argv[3] = { NULL };
+    char dir[PATHLEN];
+    char base[PATHLEN];
+    const char *path = file;
+
+    /* dirname(3) and basename(3) may modify their argument */
+    snprintf(dir, sizeof(dir), "%s", file);
+    if (interpreter) {
+        snprintf(base, sizeof(base), "%s", interpreter);
+        argv[0] = basename(base);
+        argv[1] = (char *) file;
+        path = interpreter;
+    }
+    else {
+        snprintf(base, sizeof(base), "%s", file);
+        argv[0] = basename(base);
+    }
+
+    pid = cgi_spawn_exec(path, argv, env, dirname(dir), fd_in, fd_out);
+    if (pid == -1) {
+        mk_libc_error("spawn");
+    }
+
+    return pid;
+}
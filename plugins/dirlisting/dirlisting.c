@@ -790,7 +790,7 @@ static int mk_dirhtml_init(struct mk_plugin *plugin,
     sr->headers.content_type = mk_dirhtml_default_mime;
     sr->headers.content_length = -1;
 
-    if (sr->protocol >= MK_HTTP_PROTOCOL_11) {
+    if (sr->protocol == MK_HTTP_PROTOCOL_11) {
         sr->headers.transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
         request->chunked = MK_TRUE;
     }
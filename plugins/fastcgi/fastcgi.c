@@ -21,31 +21,24 @@
 
 #include "fastcgi.h"
 #include "fcgi_handler.h"
+#include "fcgi_pool.h"
 
-static int mk_fastcgi_config(char *path)
+struct mk_fcgi_conf fcgi_conf;
+
+/* Read a [FASTCGI_SERVER] section */
+static struct fcgi_server *mk_fastcgi_config_server(struct mk_rconf_section *section)
 {
     int ret;
     int sep;
-    char *file = NULL;
     char *cnf_srv_name = NULL;
     char *cnf_srv_addr = NULL;
     char *cnf_srv_port = NULL;
     char *cnf_srv_path = NULL;
-    unsigned long len;
+    char *cnf_keepalive = NULL;
+    int cnf_max_idle;
+    int cnf_idle_timeout;
     struct file_info finfo;
-    struct mk_rconf *conf;
-    struct mk_rconf_section *section;
-
-    mk_api->str_build(&file, &len, "%sfastcgi.conf", path);
-    conf = mk_api->config_open(file);
-    if (!conf) {
-        return -1;
-    }
-
-    section = mk_api->config_section_get(conf, "FASTCGI_SERVER");
-    if (!section) {
-        return -1;
-    }
+    struct fcgi_server *server;
 
     /* Get section values */
     cnf_srv_name = mk_api->config_section_get_key(section,
@@ -57,11 +50,20 @@ static int mk_fastcgi_config(char *path)
     cnf_srv_path = mk_api->config_section_get_key(section,
                                                   "ServerPath",
                                                   MK_RCONF_STR);
+    cnf_keepalive = mk_api->config_section_get_key(section,
+                                                   "KeepAlive",
+                                                   MK_RCONF_STR);
+    cnf_max_idle = (size_t) mk_api->config_section_get_key(section,
+                                                           "MaxIdleConnections",
+                                                           MK_RCONF_NUM);
+    cnf_idle_timeout = (size_t) mk_api->config_section_get_key(section,
+                                                               "IdleTimeout",
+                                                               MK_RCONF_NUM);
 
     /* Validations */
     if (!cnf_srv_name) {
         mk_warn("[fastcgi] Invalid ServerName in configuration.");
-        return -1;
+        return NULL;
     }
 
     /* Split the address, try to lookup the TCP port */
@@ -69,7 +71,7 @@ static int mk_fastcgi_config(char *path)
         sep = mk_api->str_char_search(cnf_srv_addr, ':', strlen(cnf_srv_addr));
         if (sep <= 0) {
             mk_warn("[fastcgi] Missing TCP port con ServerAddress key");
-            return -1;
+            return NULL;
         }
 
         cnf_srv_port = mk_api->str_dup(cnf_srv_addr + sep + 1);
@@ -79,7 +81,13 @@ static int mk_fastcgi_config(char *path)
     /* Just one mode can exist (for now) */
     if (cnf_srv_path && cnf_srv_addr) {
         mk_warn("[fastcgi] Use ServerAddr or ServerPath, not both");
-        return -1;
+        return NULL;
+    }
+
+    if (!cnf_srv_path && !cnf_srv_addr) {
+        mk_warn("[fastcgi] Missing ServerAddr or ServerPath for %s",
+                cnf_srv_name);
+        return NULL;
     }
 
     /* Unix socket path */
@@ -87,39 +95,131 @@ static int mk_fastcgi_config(char *path)
         ret = mk_api->file_get_info(cnf_srv_path, &finfo, MK_FILE_READ);
         if (ret == -1) {
             mk_warn("[fastcgi] Cannot open unix socket: %s", cnf_srv_path);
-            return -1;
+            return NULL;
         }
     }
 
-    /* Set the global configuration */
-    fcgi_conf.server_name = cnf_srv_name;
-    fcgi_conf.server_addr = cnf_srv_addr;
-    fcgi_conf.server_port = cnf_srv_port;
-    fcgi_conf.server_path = cnf_srv_path;
+    server = mk_api->mem_alloc_z(sizeof(struct fcgi_server));
+    if (!server) {
+        return NULL;
+    }
+    server->server_name = cnf_srv_name;
+    server->server_addr = cnf_srv_addr;
+    server->server_port = cnf_srv_port;
+    server->server_path = cnf_srv_path;
+
+    /* Persistent connections */
+    server->keepalive = FCGI_KEEPALIVE_DEFAULT;
+    if (cnf_keepalive && strcasecmp(cnf_keepalive, "off") == 0) {
+        server->keepalive = MK_FALSE;
+    }
 
-    return 0;
-}
+    server->max_idle = cnf_max_idle;
+    if (server->max_idle <= 0) {
+        server->max_idle = FCGI_MAX_IDLE_DEFAULT;
+    }
+
+    server->idle_timeout = cnf_idle_timeout;
+    if (server->idle_timeout <= 0) {
+        server->idle_timeout = FCGI_IDLE_TIMEOUT_DEFAULT;
+    }
+
+    /* Balancing and passive health checks */
+    server->max_requests = (size_t) mk_api->config_section_get_key(section,
+                                                                   "MaxRequests",
+                                                                   MK_RCONF_NUM);
+    if (server->max_requests < 0) {
+        server->max_requests = 0;
+    }
+
+    server->max_fails = (size_t) mk_api->config_section_get_key(section,
+                                                                "MaxFails",
+                                                                MK_RCONF_NUM);
+    if (server->max_fails <= 0) {
+        server->max_fails = FCGI_MAX_FAILS_DEFAULT;
+    }
+
+    server->fail_timeout = (size_t) mk_api->config_section_get_key(section,
+                                                                   "FailTimeout",
+                                                                   MK_RCONF_NUM);
+    if (server->fail_timeout <= 0) {
+        server->fail_timeout = FCGI_FAIL_TIMEOUT_DEFAULT;
+    }
 
+    server->slow_time = (size_t) mk_api->config_section_get_key(section,
+                                                                "SlowTime",
+                                                                MK_RCONF_NUM);
+    if (server->slow_time < 0) {
+        server->slow_time = 0;
+    }
+
+    return server;
+}
 
-/* Entry point for thread/co-routine */
-static void mk_fastcgi_stage30_thread(struct mk_plugin *plugin,
-                                      struct mk_http_session *cs,
-                                      struct mk_http_request *sr,
-                                      int n_params,
-                                      struct mk_list *params)
+static int mk_fastcgi_config(char *path)
 {
-    struct fcgi_handler *handler;
-    (void) plugin;
-    (void) n_params;
-    (void) params;
+    char *file = NULL;
+    char *cnf_balance = NULL;
+    unsigned long len;
+    struct mk_list *head;
+    struct mk_rconf *conf;
+    struct mk_rconf_section *section;
+    struct fcgi_server *server;
 
-    printf("entering thread\n");
-    handler = fcgi_handler_new(cs, sr);
-    if (!handler) {
-        fprintf(stderr, "Could not create handler");
+    mk_api->str_build(&file, &len, "%sfastcgi.conf", path);
+    conf = mk_api->config_open(file);
+    mk_api->mem_free(file);
+    if (!conf) {
+        return -1;
     }
+
+    mk_list_init(&fcgi_conf.servers);
+    fcgi_conf.servers_count = 0;
+    fcgi_conf.balance = FCGI_BALANCE_LEAST;
+
+    /* Optional global settings */
+    section = mk_api->config_section_get(conf, "FASTCGI");
+    if (section) {
+        cnf_balance = mk_api->config_section_get_key(section,
+                                                     "Balance",
+                                                     MK_RCONF_STR);
+    }
+    if (cnf_balance) {
+        if (strcasecmp(cnf_balance, "two_choices") == 0) {
+            fcgi_conf.balance = FCGI_BALANCE_TWO_CHOICES;
+        }
+        else if (strcasecmp(cnf_balance, "least_requests") != 0) {
+            mk_warn("[fastcgi] Invalid Balance mode: %s", cnf_balance);
+            return -1;
+        }
+    }
+
+    /*
+     * We don't use mk_config_section_get() because we can have multiple
+     * [FASTCGI_SERVER] sections, one per backend.
+     */
+    mk_list_foreach(head, &conf->sections) {
+        section = mk_list_entry(head, struct mk_rconf_section, _head);
+        if (strcasecmp(section->name, "FASTCGI_SERVER") != 0) {
+            continue;
+        }
+
+        server = mk_fastcgi_config_server(section);
+        if (!server) {
+            return -1;
+        }
+        server->id = fcgi_conf.servers_count++;
+        mk_list_add(&server->_head, &fcgi_conf.servers);
+    }
+
+    if (fcgi_conf.servers_count == 0) {
+        return -1;
+    }
+
+    return 0;
 }
 
+
 /* Callback handler */
 int mk_fastcgi_stage30(struct mk_plugin *plugin,
                        struct mk_http_session *cs,
@@ -127,24 +227,30 @@ int mk_fastcgi_stage30(struct mk_plugin *plugin,
                        int n_params,
                        struct mk_list *params)
 {
+    int status;
+    struct fcgi_handler *handler;
     (void) n_params;
     (void) params;
-    struct fcgi_handler *handler;
 
-    /*
-     * This plugin uses the Monkey Thread model (co-routines), for hence
-     * upon return MK_PLUGIN_RET_CONTINUE, Monkey core will create a
-     * new thread (co-routine) and defer the control to the stage30_thread
-     * callback function (mk_fastcgi_stage30_thread).
-     *
-     * We don't do any validation, so we are OK with MK_PLUGIN_RET_CONTINUE.
-     */
+    /* The request is already being processed */
+    if (sr->handler_data) {
+        return MK_PLUGIN_RET_CONTINUE;
+    }
 
-    return MK_PLUGIN_RET_CONTINUE;
+    /* The worker could not set up its backend pools */
+    if (mk_unlikely(!fcgi_pool_worker())) {
+        mk_api->header_set_http_status(sr, MK_SERVER_SERVICE_UNAV);
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
 
-    ret = mk_fastcgi_start_processing(cs, sr);
-    if (ret == 0) {
-        return MK_PLUGIN_RET_CONTINUE;
+    /*
+     * The request is sent to the FastCGI server from the worker event loop,
+     * the response headers are prepared once the application replies.
+     */
+    handler = fcgi_handler_new(plugin, cs, sr, &status);
+    if (!handler) {
+        mk_api->header_set_http_status(sr, status);
+        return MK_PLUGIN_RET_CLOSE_CONX;
     }
 
     return MK_PLUGIN_RET_CONTINUE;
@@ -163,50 +269,67 @@ int mk_fastcgi_stage30_hangup(struct mk_plugin *plugin,
         return -1;
     }
 
-    if (handler->hangup == MK_TRUE) {
-        return 0;
-    }
-
+    /* the client is gone, just release the backend side */
     handler->active = MK_FALSE;
     handler->hangup = MK_TRUE;
 
-    fcgi_exit(sr->handler_data);
+    fcgi_exit(handler);
 
     return 0;
 }
 
-int mk_fastcgi_plugin_init(struct plugin_api **api, char *confdir)
+int mk_fastcgi_plugin_init(struct mk_plugin *plugin, char *confdir)
 {
     int ret;
 
-    mk_api = *api;
+    mk_api = plugin->api;
 
     /* read global configuration */
     ret = mk_fastcgi_config(confdir);
     if (ret == -1) {
         mk_warn("[fastcgi] configuration error/missing, plugin disabled.");
+        return -1;
     }
-	return ret;
+
+    return fcgi_pool_init();
 }
 
-int mk_fastcgi_plugin_exit()
+int mk_fastcgi_plugin_exit(struct mk_plugin *plugin)
 {
+    (void) plugin;
     return 0;
 }
 
 int mk_fastcgi_master_init(struct mk_server *server)
 {
-    (void) server;
-    return 0;
+    struct mk_list *head;
+    struct mk_plugin *plugin;
+
+    /* Requests are written to the backend through the plain network layer */
+    mk_list_foreach(head, &server->plugins) {
+        plugin = mk_list_entry(head, struct mk_plugin, _head);
+        if (plugin->capabilities & MK_CAP_SOCK_PLAIN) {
+            fcgi_conf.network = plugin->network;
+            return 0;
+        }
+    }
+
+    mk_warn("[fastcgi] no plain sockets network layer available");
+    return -1;
 }
 
-void mk_fastcgi_worker_init()
+void mk_fastcgi_worker_init(struct mk_server *server)
 {
+    (void) server;
+
+    if (fcgi_pool_worker_init() == -1 && !fcgi_pool_worker()) {
+        mk_err("[fastcgi] cannot initialize worker state, "
+               "its requests get a 503");
+    }
 }
 
 struct mk_plugin_stage mk_plugin_stage_fastcgi = {
     .stage30        = &mk_fastcgi_stage30,
-    .stage30_thread = &mk_fastcgi_stage30_thread,
     .stage30_hangup = &mk_fastcgi_stage30_hangup
 };
 
@@ -226,8 +349,5 @@ struct mk_plugin mk_plugin_fastcgi = {
     .worker_init   = mk_fastcgi_worker_init,
 
     /* Type */
-    .stage         = &mk_plugin_stage_fastcgi,
-
-    /* Flags */
-    .flags         = MK_PLUGIN_THREAD
+    .stage         = &mk_plugin_stage_fastcgi
 };
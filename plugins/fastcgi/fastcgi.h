@@ -20,7 +20,19 @@
 #ifndef MK_FASTCGI_H
 #define MK_FASTCGI_H
 
-struct mk_fcgi_conf {
+#define FCGI_KEEPALIVE_DEFAULT        MK_TRUE
+#define FCGI_MAX_IDLE_DEFAULT         4
+#define FCGI_IDLE_TIMEOUT_DEFAULT     30
+#define FCGI_MAX_FAILS_DEFAULT        1
+#define FCGI_FAIL_TIMEOUT_DEFAULT     10
+
+/* Balancing modes */
+#define FCGI_BALANCE_LEAST            0    /* least outstanding requests */
+#define FCGI_BALANCE_TWO_CHOICES      1    /* power of two random choices */
+
+/* A FastCGI backend, one per [FASTCGI_SERVER] section */
+struct fcgi_server {
+    int id;                  /* position in the workers pools array */
     char *server_name;
 
     /* Unix Socket */
@@ -29,8 +41,32 @@ struct mk_fcgi_conf {
     /* TCP Server */
     char *server_addr;
     char *server_port;
+
+    /* Persistent backend connections */
+    int keepalive;           /* reuse connections (FCGI_KEEP_CONN) */
+    int max_idle;            /* idle connections kept per worker   */
+    int idle_timeout;        /* seconds an idle connection is kept */
+
+    /* Balancing */
+    int max_requests;        /* outstanding requests per worker, 0: no limit */
+    int max_fails;           /* failures in a row that eject the backend */
+    int fail_timeout;        /* seconds an ejected backend is left out   */
+    int slow_time;           /* milliseconds, a slower reply is a failure */
+
+    struct mk_list _head;
+};
+
+struct mk_fcgi_conf {
+    int balance;
+
+    /* backends, the order of the configuration is kept */
+    int servers_count;
+    struct mk_list servers;
+
+    /* plain sockets network layer, used to write the requests */
+    struct mk_plugin_network *network;
 };
 
-struct mk_fcgi_conf fcgi_conf;
+extern struct mk_fcgi_conf fcgi_conf;
 
 #endif
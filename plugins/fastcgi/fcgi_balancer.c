@@ -0,0 +1,146 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+
+#define MK_PLUGIN_API_EXTERN
+
+#include <monkey/mk_api.h>
+
+#include "fastcgi.h"
+#include "fcgi_balancer.h"
+
+/*
+ * Backends are balanced by each worker on its own: the outstanding
+ * requests, failures and ejections tracked here are the ones of the
+ * calling worker, no locking is involved.
+ */
+
+/* Get an id for a new request, used to not pick a backend twice */
+uint64_t fcgi_balancer_request()
+{
+    struct fcgi_worker *worker = fcgi_pool_worker();
+
+    return ++worker->requests;
+}
+
+static inline int fcgi_balancer_available(struct fcgi_pool *pool,
+                                          uint64_t request, time_t now)
+{
+    /* already tried by this request */
+    if (pool->tried == request) {
+        return MK_FALSE;
+    }
+
+    /* ejected after failing */
+    if (pool->ejected > now) {
+        return MK_FALSE;
+    }
+
+    /* too many requests waiting on it */
+    if (pool->server->max_requests > 0 &&
+        pool->requests >= pool->server->max_requests) {
+        return MK_FALSE;
+    }
+
+    return MK_TRUE;
+}
+
+/*
+ * Pick the backend for a request among the available ones, the one with
+ * less outstanding requests or the best of two random choices. It returns
+ * NULL if no backend can take the request.
+ */
+struct fcgi_pool *fcgi_balancer_pick(uint64_t request)
+{
+    int i;
+    int a;
+    int b;
+    int n = 0;
+    time_t now;
+    struct fcgi_pool *pool;
+    struct fcgi_pool *best;
+    struct fcgi_worker *worker = fcgi_pool_worker();
+
+    /* start from a different backend each time, so ties are spread */
+    now = time(NULL);
+    for (i = 0; i < worker->size; i++) {
+        pool = &worker->pools[(worker->next + i) % worker->size];
+        if (fcgi_balancer_available(pool, request, now) == MK_TRUE) {
+            worker->choices[n++] = pool;
+        }
+    }
+    worker->next = (worker->next + 1) % worker->size;
+
+    if (n == 0) {
+        return NULL;
+    }
+
+    if (fcgi_conf.balance == FCGI_BALANCE_TWO_CHOICES && n > 2) {
+        a = rand_r(&worker->seed) % n;
+        b = rand_r(&worker->seed) % (n - 1);
+        if (b >= a) {
+            b++;
+        }
+        best = worker->choices[a];
+        if (worker->choices[b]->requests < best->requests) {
+            best = worker->choices[b];
+        }
+    }
+    else {
+        best = worker->choices[0];
+        for (i = 1; i < n; i++) {
+            if (worker->choices[i]->requests < best->requests) {
+                best = worker->choices[i];
+            }
+        }
+    }
+
+    MK_TRACE("[fastcgi] request %lu to %s (%i outstanding)",
+             request, best->server->server_name, best->requests);
+
+    best->tried = request;
+    best->requests++;
+    return best;
+}
+
+/*
+ * A request left the backend. Failures in a row (connection errors or
+ * slow replies) eject it for a while.
+ */
+void fcgi_balancer_done(struct fcgi_pool *pool, int failed)
+{
+    pool->requests--;
+
+    if (failed == MK_FALSE) {
+        pool->fails = 0;
+        return;
+    }
+
+    /* a single backend is never left out, there is no other one */
+    pool->fails++;
+    if (pool->fails < pool->server->max_fails ||
+        fcgi_conf.servers_count == 1) {
+        return;
+    }
+
+    mk_warn("[fastcgi] server %s failing, ejected for %i seconds",
+            pool->server->server_name, pool->server->fail_timeout);
+    pool->ejected = time(NULL) + pool->server->fail_timeout;
+    pool->fails = 0;
+}
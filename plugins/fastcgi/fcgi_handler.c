@@ -17,12 +17,15 @@
  *  limitations under the License.
  */
 
+#define MK_PLUGIN_API_EXTERN
+
 #include <monkey/mk_api.h>
-#include <monkey/mk_net.h>
 #include <monkey/mk_stream.h>
 
 #include "fastcgi.h"
 #include "fcgi_handler.h"
+#include "fcgi_pool.h"
+#include "fcgi_balancer.h"
 
 #define FCGI_BUF(h)           (char *) h->buf_data + h->buf_len
 #define FCGI_PARAM_DYN(str)   str, strlen(str), MK_FALSE
@@ -30,7 +33,7 @@
 #define FCGI_PARAM_PTR(ptr)   ptr.data, ptr.len, MK_FALSE
 #define FCGI_PARAM_DUP(str)   mk_api->str_dup(str), strlen(str), MK_TRUE
 
-int fcgi_pad[256] = {0};
+static int fcgi_pad[256] = {0};
 
 static inline void fcgi_build_header(struct fcgi_record_header *rec,
                                      uint8_t type, uint16_t request_id,
@@ -44,10 +47,16 @@ static inline void fcgi_build_header(struct fcgi_record_header *rec,
     rec->reserved        = 0;
 }
 
-static inline void fcgi_build_request_body(struct fcgi_begin_request_body *body)
+static inline void fcgi_build_request_body(struct fcgi_begin_request_body *body,
+                                           int keepalive)
 {
     fcgi_encode16(&body->role, FCGI_RESPONDER);
-    body->flags       = 0;
+    if (keepalive == MK_TRUE) {
+        body->flags   = FCGI_KEEP_CONN;
+    }
+    else {
+        body->flags   = 0;
+    }
     memset(body->reserved, '\0', sizeof(body->reserved));
 }
 
@@ -71,7 +80,8 @@ static inline int fcgi_add_param_empty(struct fcgi_handler *handler)
     char *p;
 
     p = FCGI_BUF(handler);
-    fcgi_build_header((struct fcgi_record_header *) p, FCGI_PARAMS, 1, 0);
+    fcgi_build_header((struct fcgi_record_header *) p, FCGI_PARAMS,
+                      FCGI_REQUEST_ID, 0);
     mk_api->iov_add(handler->iov, p,
                     sizeof(struct fcgi_record_header), MK_FALSE);
     handler->buf_len += sizeof(struct fcgi_record_header);
@@ -96,7 +106,8 @@ static inline int fcgi_add_param(struct fcgi_handler *handler,
 	len += key_len > 127 ? 4 : 1;
 	len += val_len > 127 ? 4 : 1;
 
-    fcgi_build_header((struct fcgi_record_header *) p, FCGI_PARAMS, 1, len);
+    fcgi_build_header((struct fcgi_record_header *) p, FCGI_PARAMS,
+                      FCGI_REQUEST_ID, len);
     padding = ~(len - 1) & 7;
     if (padding) {
         h = (struct fcgi_record_header *) p;
@@ -176,7 +187,7 @@ static inline int fcgi_add_param_net(struct fcgi_handler *handler)
     /* This is to identify whether its IPV4 or IPV6 */
     struct sockaddr_storage addr;
     int port = 0;
-	socklen_t addr_len = sizeof(struct sockaddr_in);
+    socklen_t addr_len = sizeof(struct sockaddr_storage);
 
     ret = getsockname(handler->cs->socket, (struct sockaddr *)&addr, &addr_len);
     if (ret == -1) {
@@ -220,6 +231,7 @@ static inline int fcgi_add_param_net(struct fcgi_handler *handler)
                    FCGI_PARAM_DUP(buffer));
 
 
+    addr_len = sizeof(struct sockaddr_storage);
     ret = getpeername(handler->cs->socket, (struct sockaddr *)&addr, &addr_len);
     if (ret == -1) {
         perror("getpeername");
@@ -247,7 +259,7 @@ static inline int fcgi_add_param_net(struct fcgi_handler *handler)
             struct sockaddr_in *s4 = (struct sockaddr_in *)&addr4;
             memset(&addr4, 0, sizeof(addr4));
             addr4.sin_family = AF_INET;
-            addr4.sin_port = &s->sin6_port;
+            addr4.sin_port = s->sin6_port;
             memcpy(&addr4.sin_addr.s_addr,
                    s->sin6_addr.s6_addr + 12,
                    sizeof(addr4.sin_addr.s_addr));
@@ -299,7 +311,7 @@ static inline int fcgi_stdin_chunk(struct fcgi_handler *handler)
 
     p = FCGI_BUF(handler);
     h = (struct fcgi_record_header *) p;
-    fcgi_build_header(h, FCGI_STDIN, 1, chunk);
+    fcgi_build_header(h, FCGI_STDIN, FCGI_REQUEST_ID, chunk);
     h->padding_length = ~(chunk - 1) & 7;
 
     MK_TRACE("[fastcgi] STDIN: length=%i", chunk);
@@ -323,7 +335,8 @@ static inline int fcgi_stdin_chunk(struct fcgi_handler *handler)
 
     if (handler->stdin_offset + chunk == handler->stdin_length) {
         eof = FCGI_BUF(handler);
-        fcgi_build_header((struct fcgi_record_header *) eof, FCGI_STDIN, 1, 0);
+        fcgi_build_header((struct fcgi_record_header *) eof, FCGI_STDIN,
+                          FCGI_REQUEST_ID, 0);
         mk_api->iov_add(handler->iov, eof, FCGI_RECORD_HEADER_SIZE, MK_FALSE);
         handler->buf_len += FCGI_RECORD_HEADER_SIZE + padding;
     }
@@ -334,10 +347,19 @@ static inline int fcgi_stdin_chunk(struct fcgi_handler *handler)
 
 static inline int fcgi_add_stdin(struct fcgi_handler *handler)
 {
+    char *eof;
     uint64_t bytes = handler->sr->data.len;
 
+    /* No request body, the empty record still tells the end of stdin */
     if (bytes <= 0) {
-        return -1;
+        handler->stdin_length = 0;
+        handler->stdin_offset = 0;
+        eof = FCGI_BUF(handler);
+        fcgi_build_header((struct fcgi_record_header *) eof, FCGI_STDIN,
+                          FCGI_REQUEST_ID, 0);
+        mk_api->iov_add(handler->iov, eof, FCGI_RECORD_HEADER_SIZE, MK_FALSE);
+        handler->buf_len += FCGI_RECORD_HEADER_SIZE;
+        return 0;
     }
 
     handler->stdin_length = bytes;
@@ -353,14 +375,15 @@ static int fcgi_encode_request(struct fcgi_handler *handler)
     int ret;
     struct mk_http_header *header;
     struct fcgi_begin_request_record *request;
+    struct mk_server *server = handler->plugin->server_ctx;
 
     MK_TRACE("ENCODE REQUEST");
 
     request = &handler->header_request;
-    fcgi_build_header(&request->header, FCGI_BEGIN_REQUEST, 1,
+    fcgi_build_header(&request->header, FCGI_BEGIN_REQUEST, FCGI_REQUEST_ID,
                       FCGI_BEGIN_REQUEST_BODY_SIZE);
 
-    fcgi_build_request_body(&request->body);
+    fcgi_build_request_body(&request->body, handler->pool->server->keepalive);
 
     /* BEGIN_REQUEST */
     mk_api->iov_add(handler->iov,
@@ -381,7 +404,7 @@ static int fcgi_encode_request(struct fcgi_handler *handler)
     /* Server Software */
     fcgi_add_param(handler,
                    FCGI_PARAM_CONST("SERVER_SOFTWARE"),
-                   FCGI_PARAM_DYN(mk_api->config->server_signature));
+                   FCGI_PARAM_DYN(server->server_signature));
 
     /* Server Name */
     fcgi_add_param(handler,
@@ -483,19 +506,6 @@ size_t fcgi_read_header(void *p, struct fcgi_record_header *h)
 	return sizeof(*h);
 }
 
-static inline int fcgi_buffer_consume(struct fcgi_handler *handler, size_t bytes)
-{
-    if (bytes >= handler->buf_len) {
-        handler->buf_len = 0;
-        return 0;
-    }
-
-    memmove(handler->buf_data, handler->buf_data + bytes,
-            handler->buf_len - bytes);
-    handler->buf_len -= bytes;
-    return 0;
-}
-
 static char *getearliestbreak(const char buf[], const unsigned bufsize,
                               unsigned char * const advance)
 {
@@ -524,160 +534,542 @@ static char *getearliestbreak(const char buf[], const unsigned bufsize,
     return crend;
 }
 
+/* Release the copy of the response data once it was sent to the client */
+static void fcgi_write_finished(struct mk_stream_input *in)
+{
+    mk_api->mem_free(in->buffer);
+}
+
+/* Queue a copy of response data for the client */
 static int fcgi_write(struct fcgi_handler *handler, char *buf, size_t len)
 {
-    mk_stream_in_raw(handler->stream,
-                      NULL,
-                      buf, len,
-                      NULL, NULL);
+    char *p;
 
-    if (handler->headers_set == MK_TRUE) {
-        mk_stream_in_raw(handler->stream,
-                          NULL,
-                          "\r\n", 2,
-                          NULL, NULL);
+    p = mk_api->mem_alloc(len);
+    if (!p) {
+        return -1;
+    }
+    memcpy(p, buf, len);
+
+    return mk_stream_in_raw(&handler->sr->stream, NULL, p, len,
+                            NULL, fcgi_write_finished);
+}
+
+static inline void fcgi_rbuf_release(struct fcgi_rbuf *rbuf)
+{
+    if (--rbuf->refs == 0) {
+        mk_api->mem_free(rbuf);
+    }
+}
+
+static void fcgi_rbuf_finished(struct mk_stream_input *in)
+{
+    fcgi_rbuf_release(in->context);
+}
+
+/*
+ * Get room to read the response. The buffer is recycled if no queued
+ * slice references it, otherwise a new one takes over. Just the bytes of
+ * an incomplete record header are carried.
+ */
+static struct fcgi_rbuf *fcgi_rbuf_get(struct fcgi_handler *handler)
+{
+    unsigned int left;
+    struct fcgi_rbuf *rbuf = handler->rbuf;
+    struct fcgi_rbuf *new;
+
+    if (rbuf && rbuf->len < sizeof(rbuf->data) &&
+        (rbuf->refs > 1 || rbuf->offset < rbuf->len)) {
+        return rbuf;
     }
+
+    left = 0;
+    if (rbuf) {
+        left = rbuf->len - rbuf->offset;
+        if (rbuf->refs == 1) {
+            memmove(rbuf->data, rbuf->data + rbuf->offset, left);
+            rbuf->len = left;
+            rbuf->offset = 0;
+            return rbuf;
+        }
+    }
+
+    new = mk_api->mem_alloc(sizeof(struct fcgi_rbuf));
+    if (!new) {
+        return NULL;
+    }
+    new->refs = 1;
+    new->offset = 0;
+    new->len = left;
+
+    if (rbuf) {
+        memcpy(new->data, rbuf->data + rbuf->offset, left);
+        fcgi_rbuf_release(rbuf);
+    }
+    handler->rbuf = new;
+
+    return new;
+}
+
+/* Queue a response slice from the read buffer, no copies involved */
+static int fcgi_rbuf_write(struct fcgi_handler *handler, char *buf, size_t len)
+{
+    int ret;
+    struct mk_stream *stream = &handler->sr->stream;
+    struct mk_stream_input *in;
+
+    ret = mk_stream_in_raw(stream, NULL, buf, len, NULL, fcgi_rbuf_finished);
+    if (ret == -1) {
+        return -1;
+    }
+
+    in = mk_list_entry_last(&stream->inputs, struct mk_stream_input, _head);
+    in->context = handler->rbuf;
+    handler->rbuf->refs++;
+
     return 0;
 }
 
-void fcgi_stream_eof(struct mk_stream_input *in)
+/*
+ * Send the STDOUT payloads collected from the read buffer, with the
+ * chunk framing if required: all of them go in a single chunk.
+ */
+static int fcgi_out_flush(struct fcgi_handler *handler)
 {
-    (void) in;
-    // FIXME
-    //struct fcgi_handler *handler;
+    int i;
+    int len;
+    char *p = NULL;
+
+    if (handler->out_count == 0) {
+        return 0;
+    }
 
-    //handler = stream->data;
-    //if (handler->hangup == MK_FALSE) {
-    //    fcgi_exit(handler);
-    //}
+    if (handler->chunked == MK_TRUE) {
+        p = mk_api->mem_alloc(16);
+        if (!p) {
+            return -1;
+        }
+        len = snprintf(p, 16, "%lx\r\n", (unsigned long) handler->out_len);
+        mk_stream_in_raw(&handler->sr->stream, NULL, p, len,
+                         NULL, fcgi_write_finished);
+    }
+
+    for (i = 0; i < handler->out_count; i++) {
+        if (fcgi_rbuf_write(handler, handler->out[i].iov_base,
+                            handler->out[i].iov_len) == -1) {
+            return -1;
+        }
+    }
+
+    if (handler->chunked == MK_TRUE) {
+        mk_stream_in_raw(&handler->sr->stream, NULL, "\r\n", 2, NULL, NULL);
+    }
+
+    handler->out_count = 0;
+    handler->out_len = 0;
+
+    return 0;
 }
 
-int fcgi_exit(struct fcgi_handler *handler)
+static inline int fcgi_out_add(struct fcgi_handler *handler,
+                               char *buf, size_t len)
 {
-    /* Always disable any backend notification first */
-    if (handler->server_fd > 0) {
-        mk_api->ev_del(mk_api->sched_loop(), &handler->event);
-        close(handler->server_fd);
-        handler->server_fd = -1;
+    if (handler->out_count == FCGI_OUT_SLICES &&
+        fcgi_out_flush(handler) == -1) {
+        return -1;
     }
 
-    /*
-     * Before to exit our handler, we need to verify that our parent
-     * channel have sent the whole information, otherwise we may face
-     * some corruption. If there is still some data enqueued, just
-     * defer the exit process.
-     */
-    if (mk_channel_is_empty(handler->cs->channel) != 0 &&
-        handler->eof == MK_FALSE &&
-        handler->active == MK_TRUE) {
-        MK_TRACE("[fastcgi=%i] deferring exit, EOF stream",
-                 handler->server_fd);
+    handler->out[handler->out_count].iov_base = buf;
+    handler->out[handler->out_count].iov_len = len;
+    handler->out_count++;
+    handler->out_len += len;
 
-        /* Now set an EOF stream/callback to resume the exiting process */
-        mk_stream_in_eof(handler->stream,
-                         NULL,
-                         fcgi_stream_eof);
-        handler->eof = MK_TRUE;
-        return 1;
+    return 0;
+}
+
+/* Is there a part of the response not processed yet ? */
+static inline int fcgi_response_pending(struct fcgi_handler *handler)
+{
+    if (handler->in_record == MK_TRUE) {
+        return MK_TRUE;
+    }
+
+    if (handler->rbuf && handler->rbuf->offset < handler->rbuf->len) {
+        return MK_TRUE;
+    }
+
+    return MK_FALSE;
+}
+
+/*
+ * Stop using the backend connection: it goes back to the pool if the
+ * request ended cleanly, otherwise it's closed.
+ */
+static void fcgi_backend_release(struct fcgi_handler *handler, int reuse)
+{
+    if (handler->server_fd == -1) {
+        return;
     }
 
+    if (mk_timer_wheel_node_active(&handler->slow)) {
+        mk_timer_wheel_del(&fcgi_pool_worker()->slow, &handler->slow);
+    }
+
+    mk_api->ev_del(mk_api->sched_loop(), &handler->event);
+    if (mk_list_is_empty(&handler->fcgi_channel.streams) != 0) {
+        mk_stream_release(&handler->fcgi_stream);
+    }
+
+    if (reuse == MK_TRUE && fcgi_response_pending(handler) == MK_FALSE) {
+        fcgi_pool_put(handler->pool, handler->server_fd);
+    }
+    else {
+        close(handler->server_fd);
+    }
+    handler->server_fd = -1;
+}
+
+int fcgi_exit(struct fcgi_handler *handler)
+{
     MK_TRACE("[fastcgi] exiting");
 
-    if (handler->iov) {
-        mk_api->iov_free(handler->iov);
-        mk_api->sched_event_free((struct mk_event *) handler);
-        handler->iov = NULL;
+    fcgi_backend_release(handler, MK_FALSE);
+    handler->sr->handler_data = NULL;
+
+    if (handler->pool) {
+        fcgi_balancer_done(handler->pool, handler->failed);
+        handler->pool = NULL;
     }
 
+    /*
+     * If the client is still there, the core sends whatever is still queued
+     * and ends the request after it.
+     */
     if (handler->active == MK_TRUE) {
         handler->active = MK_FALSE;
         mk_api->http_request_end(handler->plugin, handler->cs, handler->hangup);
     }
 
-    return 1;
+    if (handler->iov) {
+        mk_api->iov_free(handler->iov);
+        handler->iov = NULL;
+    }
+    if (handler->rbuf) {
+        fcgi_rbuf_release(handler->rbuf);
+        handler->rbuf = NULL;
+    }
+    mk_api->sched_event_free(&handler->event);
+
+    return 0;
 }
 
-int fcgi_error(struct fcgi_handler *handler)
+/* Flush the queued response, the client may have gone away meanwhile */
+static int fcgi_flush(struct fcgi_handler *handler)
 {
-    fcgi_exit(handler);
-    mk_api->http_request_error(500, handler->cs, handler->sr, handler->plugin);
+    int ret;
+
+    ret = mk_api->channel_flush(handler->cs->channel);
+    if (ret & MK_CHANNEL_ERROR) {
+        handler->hangup = MK_TRUE;
+        fcgi_exit(handler);
+        return -1;
+    }
+
     return 0;
 }
 
-static int fcgi_response(struct fcgi_handler *handler, char *buf, size_t len)
+static char *fcgi_status_line(char *buf, size_t len)
+{
+    char *p = buf;
+    char *end = buf + len;
+
+    while (p < end) {
+        if (end - p >= 8 && strncasecmp(p, "Status: ", 8) == 0) {
+            return p + 8;
+        }
+        p = memchr(p, '\n', end - p);
+        if (!p) {
+            break;
+        }
+        p++;
+    }
+
+    return NULL;
+}
+
+/*
+ * Look for the response headers block. If it's split across records the
+ * parts are joined in the handler buffer. It returns the bytes of 'buf'
+ * that belong to the headers, the rest is response body.
+ */
+static int fcgi_response_headers(struct fcgi_handler *handler,
+                                 char *buf, size_t len)
 {
     int status;
     int diff;
-    int xlen;
-    char tmp[16];
     char *p;
     char *end;
-    size_t p_len;
+    char *hdr = buf;
+    size_t hdr_len = len;
+    unsigned int joined = handler->buf_len;
     unsigned char advance;
 
+    if (joined > 0) {
+        if (joined + len > sizeof(handler->buf_data)) {
+            return -1;
+        }
+        memcpy(handler->buf_data + joined, buf, len);
+        hdr = handler->buf_data;
+        hdr_len = joined + len;
+    }
+
+    advance = 4;
+    end = getearliestbreak(hdr, hdr_len, &advance);
+    if (!end) {
+        /* we need more data */
+        if (joined == 0) {
+            memcpy(handler->buf_data, buf, len);
+        }
+        handler->buf_len = hdr_len;
+        return len;
+    }
+
+    status = 200;
+    diff = (end - hdr) + advance;
+    p = fcgi_status_line(hdr, diff);
+    if (p) {
+        sscanf(p, "%d", &status);
+        MK_TRACE("FastCGI status %i", status);
+    }
+    mk_api->header_set_http_status(handler->sr, status);
+
+    /* The application response headers close the header block */
+    handler->sr->headers.cgi = SH_CGI;
+
+    /* Set transfer encoding */
+    if (handler->sr->protocol == MK_HTTP_PROTOCOL_11 &&
+        handler->sr->method != MK_METHOD_HEAD) {
+        handler->sr->headers.transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
+        handler->chunked = MK_TRUE;
+    }
+    else if (handler->sr->method != MK_METHOD_HEAD) {
+        /* the end of the response is the end of the connection */
+        handler->hangup = MK_TRUE;
+        handler->cs->close_now = MK_TRUE;
+    }
+
+    mk_api->header_prepare(handler->plugin, handler->cs, handler->sr);
+    fcgi_write(handler, hdr, diff);
+
+    handler->write_rounds++;
+    handler->headers_set = MK_TRUE;
+    handler->buf_len = 0;
+
+    /* the headers end lies in 'buf', the joined part did not have it */
+    return diff - joined;
+}
+
+/* Process a FCGI_STDOUT payload, or part of it */
+static int fcgi_response(struct fcgi_handler *handler, char *buf, size_t len)
+{
+    int ret;
+
     MK_TRACE("[fastcgi=%i] process response len=%lu",
              handler->server_fd, len);
 
-    p = buf;
-    p_len = len;
+    if (handler->headers_set == MK_FALSE) {
+        ret = fcgi_response_headers(handler, buf, len);
+        if (ret == -1) {
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+
+    if (len > 0 && handler->sr->method != MK_METHOD_HEAD) {
+        return fcgi_out_add(handler, buf, len);
+    }
+
+    return 0;
+}
+
+/* The application finished the request */
+static void fcgi_response_end(struct fcgi_handler *handler)
+{
+    if (handler->headers_set == MK_FALSE) {
+        /* no response headers at all */
+        fcgi_backend_release(handler, MK_FALSE);
+        mk_api->http_request_error(MK_SERVER_BAD_GATEWAY, handler->cs,
+                                   handler->sr, handler->plugin);
+        fcgi_exit(handler);
+        return;
+    }
 
-    if (len == 0 && handler->chunked && handler->headers_set == MK_TRUE) {
+    if (handler->chunked == MK_TRUE) {
         MK_TRACE("[fastcgi=%i] sending EOF", handler->server_fd);
-        mk_stream_in_raw(handler->stream,
-                          NULL,
-                          "0\r\n\r\n", 5,
-                          NULL, NULL);
-        mk_api->channel_flush(handler->cs->channel);
-        return 0;
+        mk_stream_in_raw(&handler->sr->stream, NULL, "0\r\n\r\n", 5,
+                         NULL, NULL);
     }
 
-    if (handler->headers_set == MK_FALSE) {
-        advance = 4;
+    /* without FCGI_KEEP_CONN the application closes the connection */
+    fcgi_backend_release(handler, handler->pool->server->keepalive);
+    if (fcgi_flush(handler) == 0) {
+        fcgi_exit(handler);
+    }
+}
 
-        if (!buf) {
-            return -1;
-        }
+static int fcgi_backend_connect(struct fcgi_handler *handler);
+static int fcgi_backend_start(struct fcgi_handler *handler);
 
-        end = getearliestbreak(buf, len, &advance);
-        if (!end) {
-            /* we need more data */
-            return -1;
-        }
+/*
+ * The connection with the backend failed. A connection taken from the
+ * pool could have been closed by the application just before we used it,
+ * if nothing was received yet the request is sent again on a new one.
+ * A request that was already written is only replayed when it's
+ * idempotent: the application may have run it before it died.
+ */
+static void fcgi_backend_error(struct fcgi_handler *handler)
+{
+    int replay;
+
+    fcgi_backend_release(handler, MK_FALSE);
+
+    replay = (handler->sent_bytes == 0 ||
+              handler->sr->method == MK_METHOD_GET ||
+              handler->sr->method == MK_METHOD_HEAD);
 
-        handler->sr->headers.cgi = MK_TRUE;
-        if (strncasecmp(buf, "Status: ", 8) == 0) {
-            sscanf(buf + 8, "%d", &status);
-            MK_TRACE("FastCGI status %i", status);
-            mk_api->header_set_http_status(handler->sr, status);
+    if (handler->reused == MK_TRUE && handler->retried == MK_FALSE &&
+        handler->read_bytes == 0 && replay) {
+        MK_TRACE("[fastcgi] retrying on a new connection");
+        handler->retried = MK_TRUE;
+        if (fcgi_backend_connect(handler) == 0) {
+            return;
         }
-        else {
-            mk_api->header_set_http_status(handler->sr, 200);
+    }
+    handler->failed = MK_TRUE;
+
+    /* Nothing reached the application, the next backend can take it */
+    if (handler->sent_bytes == 0) {
+        fcgi_balancer_done(handler->pool, MK_TRUE);
+        handler->pool = NULL;
+        if (fcgi_backend_start(handler) == 0) {
+            return;
         }
+    }
+
+    if (handler->headers_set == MK_FALSE) {
+        mk_api->http_request_error(MK_SERVER_BAD_GATEWAY, handler->cs,
+                                   handler->sr, handler->plugin);
+    }
+    else {
+        /* the response is incomplete, the client must notice it */
+        handler->hangup = MK_TRUE;
+    }
+    fcgi_exit(handler);
+}
 
-        /* Set transfer encoding */
-        if (handler->sr->protocol >= MK_HTTP_PROTOCOL_11) {
-            handler->sr->headers.transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
-            handler->chunked = MK_TRUE;
+/*
+ * The backend did not start replying within SlowTime: it counts as failed.
+ * If the request did not reach the application yet the next backend can
+ * take it, otherwise the client gets a 504.
+ */
+void fcgi_handler_slow(struct mk_timer_wheel_node *node, void *data)
+{
+    struct fcgi_handler *handler;
+    (void) data;
+
+    handler = mk_list_entry(node, struct fcgi_handler, slow);
+    mk_warn("[fastcgi] server %s did not reply within %i ms",
+            handler->pool->server->server_name,
+            handler->pool->server->slow_time);
+
+    fcgi_backend_release(handler, MK_FALSE);
+    handler->failed = MK_TRUE;
+
+    if (handler->sent_bytes == 0) {
+        fcgi_balancer_done(handler->pool, MK_TRUE);
+        handler->pool = NULL;
+        if (fcgi_backend_start(handler) == 0) {
+            return;
         }
+    }
 
-        mk_api->header_prepare(handler->plugin, handler->cs, handler->sr);
+    mk_api->http_request_error(MK_SERVER_GATEWAY_TIMEOUT, handler->cs,
+                               handler->sr, handler->plugin);
+    fcgi_exit(handler);
+}
 
-        diff = (end - buf) + advance;
-        fcgi_write(handler, buf, diff);
+/*
+ * Parse the records in the read buffer, a record can be processed in parts
+ * as its content arrives. It returns FCGI_END_REQUEST once the application
+ * finished the request, -1 on error.
+ */
+static int fcgi_records(struct fcgi_handler *handler)
+{
+    int ret;
+    char *p;
+    unsigned int len;
+    unsigned int avail;
+    struct fcgi_rbuf *rbuf = handler->rbuf;
+    struct fcgi_record_header header;
 
-        p = buf + diff;
-        p_len -= diff;
-        handler->write_rounds++;
-        handler->headers_set = MK_TRUE;
-    }
+    while (rbuf->offset < rbuf->len) {
+        p = rbuf->data + rbuf->offset;
+        avail = rbuf->len - rbuf->offset;
+
+        if (handler->in_record == MK_FALSE) {
+            if (avail < FCGI_RECORD_HEADER_SIZE) {
+                /* we need more data */
+                break;
+            }
+
+            /* decode the header */
+            fcgi_read_header(p, &header);
+            if (header.type != FCGI_STDOUT && header.type != FCGI_STDERR &&
+                header.type != FCGI_END_REQUEST) {
+                return -1;
+            }
+
+            MK_TRACE("[fastcgi=%i] record type=%i content_length=%i",
+                     handler->server_fd, header.type, header.content_length);
 
-    if (p_len > 0) {
-        xlen = snprintf(tmp, 16, "%x\r\n", (unsigned int) p_len);
-        mk_stream_in_raw(handler->stream,
-                          NULL,
-                          tmp, xlen,
-                          NULL, NULL);
-        fcgi_write(handler, p, p_len);
+            handler->in_record = MK_TRUE;
+            handler->rec_type = header.type;
+            handler->rec_left = header.content_length;
+            handler->pad_left = header.padding_length;
+            rbuf->offset += FCGI_RECORD_HEADER_SIZE;
+        }
+        else if (handler->rec_left > 0) {
+            len = handler->rec_left;
+            if (len > avail) {
+                len = avail;
+            }
+
+            /* STDERR content is discarded */
+            if (handler->rec_type == FCGI_STDOUT) {
+                ret = fcgi_response(handler, p, len);
+                if (ret == -1) {
+                    return -1;
+                }
+            }
+            rbuf->offset += len;
+            handler->rec_left -= len;
+        }
+        else {
+            len = handler->pad_left;
+            if (len > avail) {
+                len = avail;
+            }
+            rbuf->offset += len;
+            handler->pad_left -= len;
+        }
+
+        if (handler->rec_left == 0 && handler->pad_left == 0) {
+            handler->in_record = MK_FALSE;
+            if (handler->rec_type == FCGI_END_REQUEST) {
+                return FCGI_END_REQUEST;
+            }
+        }
     }
 
     return 0;
@@ -686,97 +1078,54 @@ static int fcgi_response(struct fcgi_handler *handler, char *buf, size_t len)
 int cb_fastcgi_on_read(void *data)
 {
     int n;
-    int ret = 0;
-    int avail;
-    char *body;
-    size_t offset;
+    int ret;
+    struct fcgi_rbuf *rbuf;
     struct fcgi_handler *handler = data;
-    struct fcgi_record_header header;
 
-    if (handler->active == MK_FALSE) {
-        fcgi_exit(handler);
+    rbuf = fcgi_rbuf_get(handler);
+    if (!rbuf) {
+        fcgi_backend_error(handler);
         return -1;
     }
 
-    avail = FCGI_BUF_SIZE - handler->buf_len;
-    n = read(handler->server_fd, handler->buf_data + handler->buf_len, avail);
+    n = read(handler->server_fd, rbuf->data + rbuf->len,
+             sizeof(rbuf->data) - rbuf->len);
     MK_TRACE("[fastcgi=%i] read()=%i", handler->server_fd, n);
     if (n <= 0) {
+        if (n == -1 && errno == EAGAIN) {
+            return 0;
+        }
         MK_TRACE("[fastcgi=%i] FastCGI server ended", handler->server_fd);
-        fcgi_exit(handler);
+        fcgi_backend_error(handler);
         return -1;
     }
-    else {
-        handler->buf_len += n;
-    }
 
-    if ((unsigned) handler->buf_len < FCGI_RECORD_HEADER_SIZE) {
-        /* wait for more data */
-        return n;
+    /* the backend replied in time */
+    if (mk_timer_wheel_node_active(&handler->slow)) {
+        mk_timer_wheel_del(&fcgi_pool_worker()->slow, &handler->slow);
     }
 
-    while (1) {
-        /* decode the header */
-        fcgi_read_header(&handler->buf_data, &header);
+    rbuf->len += n;
+    handler->read_bytes += n;
 
-        if (header.type != FCGI_STDOUT && header.type != FCGI_STDERR &&
-            header.type != FCGI_END_REQUEST) {
-            fcgi_exit(handler);
-            return -1;
-        }
-
-        /* Check if the package is complete */
-        if (handler->buf_len < (FCGI_RECORD_HEADER_SIZE + header.content_length)) {
-            /* we need more data */
-            return n;
-        }
-
-        body = handler->buf_data + FCGI_RECORD_HEADER_SIZE;
-        switch (header.type) {
-        case FCGI_STDOUT:
-            MK_TRACE("[fastcgi=%i] FCGI_STDOUT content_length=%i",
-                     handler->server_fd, header.content_length);
-            /*
-             * Issue seen with Chrome & Firefox browsers:
-             * Sometimes content length is coming as ZERO and we are encoding a
-             * HTTP response packet with ZERO size data. This makes Chrome & Firefox
-             * browsers fail to proceed furhter and subsequent content loading fails.
-             * However, IE/Safari discards the packets with ZERO size data.
-             */
-            if (0 != header.content_length) {
-                ret = fcgi_response(handler, body, header.content_length);
-            }
-            else {
-                MK_TRACE("[fastcgi=%i] ZERO byte content length in FCGI_STDOUT, discard!!",
-                         handler->server_fd);
-                ret = 0;
-            }
-            break;
-        case FCGI_STDERR:
-            MK_TRACE("[fastcgi=%i] FCGI_STDERR content_length=%i",
-                     handler->server_fd, header.content_length);
-            break;
-        case FCGI_END_REQUEST:
-            MK_TRACE("[fastcgi=%i] FCGI_END_REQUEST content_length=%i",
-                     handler->server_fd, header.content_length);
-            ret = fcgi_response(handler, NULL, 0);
-            break;
-        default:
-            //fcgi_exit(handler);
-            return -1;
-        }
-
-        if (ret == -1) {
-            /* Missing header breaklines ? */
-            return n;
-        }
+    ret = fcgi_records(handler);
+    if (fcgi_out_flush(handler) == -1) {
+        ret = -1;
+    }
 
-        /* adjust buffer content */
-        offset = FCGI_RECORD_HEADER_SIZE +
-            header.content_length + header.padding_length;
+    if (ret == -1) {
+        fcgi_backend_error(handler);
+        return -1;
+    }
+    else if (ret == FCGI_END_REQUEST) {
+        fcgi_response_end(handler);
+        return n;
+    }
 
-        fcgi_buffer_consume(handler, offset);
+    if (handler->headers_set == MK_TRUE) {
+        fcgi_flush(handler);
     }
+
     return n;
 }
 
@@ -790,21 +1139,17 @@ int cb_fastcgi_request_flush(void *data)
 
     MK_TRACE("[fastcgi=%i] %lu bytes, ret=%i",
              handler->server_fd, count, ret);
+    handler->sent_bytes += count;
 
     if (ret == MK_CHANNEL_DONE || ret == MK_CHANNEL_EMPTY) {
         /* Do we have more data for the stdin ? */
         if (handler->stdin_length - handler->stdin_offset > 0) {
             mk_api->iov_free(handler->iov);
             handler->iov = mk_api->iov_create(64, 0);
+            handler->buf_len = 0;
             fcgi_stdin_chunk(handler);
-
-            mk_api->stream_set(&handler->fcgi_stream,
-                               MK_STREAM_IOV,
-                               &handler->fcgi_channel,
-                               handler->iov,
-                               -1,
-                               handler,
-                               NULL, NULL, NULL);
+            mk_stream_in_iov(&handler->fcgi_stream, NULL, handler->iov,
+                             NULL, NULL);
             return MK_CHANNEL_FLUSH;
         }
 
@@ -815,34 +1160,59 @@ int cb_fastcgi_request_flush(void *data)
                              handler->server_fd,
                              MK_EVENT_CUSTOM, MK_EVENT_READ, handler);
         if (ret == -1) {
-            goto error;
+            fcgi_backend_error(handler);
+            return -1;
         }
     }
-    else if (ret == MK_CHANNEL_ERROR) {
-        fcgi_exit(handler);
-    }
-    else if (ret == MK_CHANNEL_BUSY) {
+    else if (ret & MK_CHANNEL_ERROR) {
+        fcgi_backend_error(handler);
         return -1;
     }
 
     return ret;
-
- error:
-    return -1;
 }
 
-/* Callback: on connect to the backend server */
-static int fastcgi_on_connect(struct fcgi_handler *handler)
+/*
+ * Get a connection to the picked backend, encode the request and wait
+ * until the socket is writable to send it.
+ */
+static int fcgi_backend_connect(struct fcgi_handler *handler)
 {
     int ret;
-    int s_err;
-    size_t count;
-    socklen_t s_len = sizeof(s_err);
-    struct mk_list *head;
-    struct mk_plugin *pio;
+    int entries;
     struct mk_channel *channel;
 
+    handler->server_fd = fcgi_pool_get(handler->pool, &handler->reused);
+    if (handler->server_fd == -1) {
+        return -1;
+    }
+    handler->failed = MK_FALSE;
+    handler->sent_bytes = 0;
+    handler->read_bytes = 0;
+    handler->in_record = MK_FALSE;
+    if (handler->rbuf) {
+        handler->rbuf->offset = handler->rbuf->len;
+    }
+
+    /* the backend must start replying within SlowTime */
+    if (handler->pool->server->slow_time > 0) {
+        mk_timer_wheel_add(&fcgi_pool_worker()->slow, &handler->slow,
+                           mk_timer_wheel_clock(),
+                           handler->pool->server->slow_time);
+    }
+
     /* Convert the original request to FCGI format */
+    if (handler->iov) {
+        mk_api->iov_free(handler->iov);
+    }
+    entries = 128 + (handler->cs->parser.header_count * 3);
+    handler->iov = mk_api->iov_create(entries, 0);
+    if (!handler->iov) {
+        goto error;
+    }
+
+    /* Params buffer set an offset to include the header */
+    handler->buf_len = FCGI_RECORD_HEADER_SIZE;
     ret = fcgi_encode_request(handler);
     if (ret == -1) {
         goto error;
@@ -850,118 +1220,104 @@ static int fastcgi_on_connect(struct fcgi_handler *handler)
 
     /* Prepare the channel */
     channel = &handler->fcgi_channel;
-    channel->type = MK_CHANNEL_SOCKET;
-    channel->fd   = handler->server_fd;
-
-    /* FIXME: Discovery process needs to be fast */
-    mk_list_foreach(head, &mk_api->config->plugins) {
-        pio = mk_list_entry(head, struct mk_plugin, _head);
-        if (strncmp(pio->shortname, "liana", 5) == 0) {
-            break;
-        }
-        pio = NULL;
-    }
-    channel->io   = pio->network;
-
+    channel->type   = MK_CHANNEL_SOCKET;
+    channel->fd     = handler->server_fd;
+    channel->status = MK_CHANNEL_OK;
+    channel->io     = fcgi_conf.network;
     mk_list_init(&channel->streams);
-    mk_api->stream_set(&handler->fcgi_stream,
-                       MK_STREAM_IOV,
-                       &handler->fcgi_channel,
-                       handler->iov,
-                       -1,
-                       handler,
-                       NULL, NULL, NULL);
 
+    mk_stream_set(&handler->fcgi_stream, channel, handler, NULL, NULL, NULL);
+    mk_stream_in_iov(&handler->fcgi_stream, NULL, handler->iov, NULL, NULL);
+
+    /* a new connection is writable once connected */
+    MK_EVENT_NEW(&handler->event);
     handler->event.handler = cb_fastcgi_request_flush;
-    handler->event.data = handler;
+    ret = mk_api->ev_add(mk_api->sched_loop(), handler->server_fd,
+                         MK_EVENT_CUSTOM, MK_EVENT_WRITE, handler);
+    if (ret == -1) {
+        goto error;
+    }
 
     return 0;
 
  error:
-    fcgi_error(handler);
-    mk_api->channel_write(handler->cs->channel, &count);
-    return 0;
+    if (mk_list_is_empty(&handler->fcgi_channel.streams) != 0) {
+        mk_stream_release(&handler->fcgi_stream);
+    }
+    close(handler->server_fd);
+    handler->server_fd = -1;
+    return -1;
+}
+
+/*
+ * Send the request to a backend picked by the balancer, the ones that
+ * cannot be reached are skipped. It returns the HTTP error status if no
+ * backend took it.
+ */
+static int fcgi_backend_start(struct fcgi_handler *handler)
+{
+    int status = MK_SERVER_SERVICE_UNAV;
+
+    while ((handler->pool = fcgi_balancer_pick(handler->request_id))) {
+        if (fcgi_backend_connect(handler) == 0) {
+            return 0;
+        }
+
+        mk_warn("[fastcgi] cannot connect to server %s",
+                handler->pool->server->server_name);
+        fcgi_balancer_done(handler->pool, MK_TRUE);
+        handler->pool = NULL;
+        status = MK_SERVER_BAD_GATEWAY;
+    }
+
+    return status;
 }
 
 struct fcgi_handler *fcgi_handler_new(struct mk_plugin *plugin,
                                       struct mk_http_session *cs,
-                                      struct mk_http_request *sr)
+                                      struct mk_http_request *sr,
+                                      int *status)
 {
     int ret;
-    int entries;
     struct fcgi_handler *h = NULL;
-    struct mk_net_connection *conn = NULL;
 
     /* Allocate handler instance and set fields */
     h = mk_api->mem_alloc_z(sizeof(struct fcgi_handler));
     if (!h) {
+        *status = MK_SERVER_INTERNAL_ERROR;
         return NULL;
     }
 
-    stream = mk_stream_set(NULL, cs->channel, h,
-                           NULL, NULL, NULL);
-    if (!stream) {
-        mk_api->mem_free(h);
-        return NULL;
-    }
-
-    h->stream = stream;
     h->plugin = plugin;
     h->cs = cs;
     h->sr = sr;
     h->write_rounds = 0;
     h->active = MK_TRUE;
     h->server_fd = -1;
-    h->eof = MK_FALSE;
     h->stdin_length = 0;
     h->stdin_offset = 0;
     h->stdin_buffer = NULL;
-    h->conn         = NULL;
-
-    /* Allocate enough space for our data */
-    entries = 128 + (cs->parser.header_count * 3);
-    h->iov = mk_api->iov_create(entries, 0);
-
-    /* Associate the handler with the Session Request */
-    sr->handler_data = h;
+    h->request_id = fcgi_balancer_request();
+    mk_list_init(&h->fcgi_channel.streams);
 
-    if (sr->protocol >= MK_HTTP_PROTOCOL_11) {
+    if (sr->protocol == MK_HTTP_PROTOCOL_11) {
         h->hangup = MK_FALSE;
     }
     else {
         h->hangup = MK_TRUE;
     }
 
-    /* Params buffer set an offset to include the header */
-    h->buf_len = FCGI_RECORD_HEADER_SIZE;
-
-    /* Request and async connection to the server */
-    if (fcgi_conf.server_addr) {
-        conn = mk_api->net_conn_create(fcgi_conf.server_addr,
-                                       atoi(fcgi_conf.server_port));
-        if (!conn) {
-            goto error;
+    ret = fcgi_backend_start(h);
+    if (ret != 0) {
+        *status = ret;
+        if (h->iov) {
+            mk_api->iov_free(h->iov);
         }
-        h->conn      = conn;
-        h->server_fd = conn->fd;
-    }
-    else if (fcgi_conf.server_path) {
-        /* FIXME: unix socket connection NOT FUNCTIONAL for now */
-        h->server_fd = mk_api->socket_open(fcgi_conf.server_path, MK_TRUE);
-    }
-
-    if (h->server_fd == -1) {
-        goto error;
+        mk_api->mem_free(h);
+        return NULL;
     }
 
-    fastcgi_on_connect(h);
+    /* Associate the handler with the Session Request */
+    sr->handler_data = h;
     return h;
-
- error:
-    mk_api->iov_free(h->iov);
-    mk_api->mem_free(h);
-    sr->handler_data = NULL;
-    mk_api->http_request_error(500, cs, sr, plugin);
-
-    return NULL;
 }
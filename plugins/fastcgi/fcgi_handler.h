@@ -51,12 +51,28 @@ struct fcgi_begin_request_record {
 #define FCGI_VERSION_1               1
 #define FCGI_RECORD_MAX_SIZE         65535
 #define FCGI_RECORD_HEADER_SIZE      sizeof(struct fcgi_record_header)
-#define FCGI_BUF_SIZE                FCGI_RECORD_MAX_SIZE + FCGI_RECORD_HEADER_SIZE
+#define FCGI_PADDING_MAX_SIZE        255
+#define FCGI_BUF_SIZE                (FCGI_RECORD_HEADER_SIZE + \
+                                      FCGI_RECORD_MAX_SIZE +    \
+                                      FCGI_PADDING_MAX_SIZE)
 #define FCGI_BEGIN_REQUEST_BODY_SIZE sizeof(struct fcgi_begin_request_body)
+#define FCGI_OUT_SLICES              32
 #define FCGI_RESPONDER  1
 #define FCGI_AUTHORIZER 2
 #define FCGI_FILTER     3
 
+/*
+ * Mask for flags component of FCGI_BeginRequestBody: the application
+ * keeps the connection open once the request is done.
+ */
+#define FCGI_KEEP_CONN  1
+
+/*
+ * Requests are not multiplexed, a connection serves one request at a
+ * time so they all use the same request id.
+ */
+#define FCGI_REQUEST_ID 1
+
 /*
  * Values for type component of FCGI_Header
  */
@@ -71,6 +87,18 @@ struct fcgi_begin_request_record {
 #define FCGI_GET_VALUES          9
 #define FCGI_GET_VALUES_RESULT  10
 
+/*
+ * Buffer the backend response is read into. The STDOUT payloads are
+ * queued for the client straight from here: every queued slice holds a
+ * reference, the buffer is released once all of them were sent.
+ */
+struct fcgi_rbuf {
+    int refs;
+    unsigned int len;            /* bytes read                     */
+    unsigned int offset;         /* bytes parsed                   */
+    char data[FCGI_BUF_SIZE];
+};
+
 /*
  * FastCGI Handler context, it keeps information of states and other
  * request/response references.
@@ -79,36 +107,56 @@ struct fcgi_handler {
     struct mk_event event;       /* built-in event-loop data */
 
     int server_fd;               /* backend FastCGI server         */
+    int reused;                  /* connection taken from pool ?   */
+    int retried;                 /* request sent a second time ?   */
+    int failed;                  /* backend failed or was slow ?   */
     int chunked;                 /* chunked response ?             */
     int active;                  /* is this handler active ?       */
     int hangup;                  /* hangup connection once ready ? */
     int headers_set;             /* headers set ?                  */
-    int eof;                     /* exiting: MK_TRUE / MK_FALSE    */
 
     /* stdin data */
     uint64_t stdin_length;
     uint64_t stdin_offset;
     char *stdin_buffer;
 
+    struct mk_plugin *plugin;    /* plugin context                 */
     struct mk_http_session *cs;  /* HTTP session context           */
     struct mk_http_request *sr;  /* HTTP request context           */
 
+    /* Backend picked by the balancer */
+    struct fcgi_pool *pool;
+    uint64_t request_id;
+    struct mk_timer_wheel_node slow; /* SlowTime reply deadline    */
+
     /* FastCGI */
     struct fcgi_begin_request_record header_request;
 
+    uint64_t sent_bytes;
+    uint64_t read_bytes;
     uint64_t write_rounds;
+
+    /* request records, later the response headers if they are split */
     unsigned int buf_len;
     char buf_data[FCGI_BUF_SIZE];
 
+    /* response records parsing */
+    struct fcgi_rbuf *rbuf;
+    int rec_type;
+    int in_record;
+    unsigned int rec_left;       /* content bytes left             */
+    unsigned int pad_left;       /* padding bytes left             */
+
+    /* STDOUT payloads of a read round, sent as a single chunk */
+    int out_count;
+    size_t out_len;
+    struct mk_iovec out[FCGI_OUT_SLICES];
+
     /* Channel to stream request to the FCGI server */
     struct mk_channel fcgi_channel;
     struct mk_stream  fcgi_stream;
 
     struct mk_iov *iov;
-    struct mk_list _head;
-
-    /* TCP connection context */
-    struct mk_net_connection *conn;
 };
 
 static inline void fcgi_encode16(void *a, unsigned b)
@@ -121,8 +169,10 @@ static inline void fcgi_encode16(void *a, unsigned b)
 
 struct fcgi_handler *fcgi_handler_new(struct mk_plugin *plugin,
                                       struct mk_http_session *cs,
-                                      struct mk_http_request *sr);
+                                      struct mk_http_request *sr,
+                                      int *status);
 
 int fcgi_exit(struct fcgi_handler *handler);
+void fcgi_handler_slow(struct mk_timer_wheel_node *node, void *data);
 
 #endif
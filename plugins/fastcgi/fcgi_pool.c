@@ -0,0 +1,296 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#define MK_PLUGIN_API_EXTERN
+
+#include <monkey/mk_api.h>
+
+#include "fastcgi.h"
+#include "fcgi_pool.h"
+#include "fcgi_handler.h"
+
+static pthread_key_t fcgi_worker_key;
+
+/* Open a new non-blocking connection to the backend */
+static int fcgi_conn_open(struct fcgi_server *server)
+{
+    int fd;
+
+    if (server->server_addr) {
+        fd = mk_api->socket_connect(server->server_addr,
+                                    atoi(server->server_port), MK_TRUE);
+        if (fd != -1) {
+            mk_api->socket_set_tcp_nodelay(fd);
+        }
+    }
+    else {
+        fd = mk_api->socket_open(server->server_path, MK_TRUE);
+    }
+
+    return fd;
+}
+
+/*
+ * Health check for an idle connection: nothing must be readable from it,
+ * the backend either closed it or sent something we did not ask for.
+ */
+static int fcgi_conn_check(int fd)
+{
+    int ret;
+    char c;
+
+    ret = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+
+    return -1;
+}
+
+/* Unlink an idle connection from the pool and return its socket */
+static int fcgi_conn_take(struct fcgi_conn *conn)
+{
+    int fd = conn->fd;
+
+    mk_api->ev_del(mk_api->sched_loop(), &conn->event);
+    mk_list_del(&conn->_head);
+    conn->pool->count--;
+    mk_api->sched_event_free(&conn->event);
+
+    return fd;
+}
+
+static void fcgi_pool_evict(struct fcgi_pool *pool, time_t now)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct fcgi_conn *conn;
+
+    /* oldest connections are at the beginning of the list */
+    mk_list_foreach_safe(head, tmp, &pool->idle) {
+        conn = mk_list_entry(head, struct fcgi_conn, _head);
+        if (now - conn->last_used < pool->server->idle_timeout) {
+            break;
+        }
+
+        MK_TRACE("[fastcgi=%i] closing idle connection", conn->fd);
+        close(fcgi_conn_take(conn));
+    }
+}
+
+/* The backend closed an idle connection (or wrote on it) */
+static int cb_fcgi_conn_idle(void *data)
+{
+    struct fcgi_conn *conn = data;
+
+    MK_TRACE("[fastcgi=%i] idle connection dropped by the backend", conn->fd);
+    close(fcgi_conn_take(conn));
+
+    return 0;
+}
+
+static int cb_fcgi_pool_timer(void *data)
+{
+    int i;
+    time_t now;
+    uint64_t val;
+    struct fcgi_worker *worker = data;
+
+    if (read(worker->timer.fd, &val, sizeof(val)) <= 0) {
+        return 0;
+    }
+
+    now = time(NULL);
+    for (i = 0; i < worker->size; i++) {
+        fcgi_pool_evict(&worker->pools[i], now);
+    }
+
+    return 0;
+}
+
+static int cb_fcgi_slow_timer(void *data)
+{
+    uint64_t val;
+    struct fcgi_worker *worker;
+
+    worker = mk_list_entry(data, struct fcgi_worker, slow_timer);
+
+    if (read(worker->slow_timer.fd, &val, sizeof(val)) <= 0) {
+        return 0;
+    }
+
+    mk_timer_wheel_expire(&worker->slow, mk_timer_wheel_clock(),
+                          fcgi_handler_slow, NULL);
+    return 0;
+}
+
+int fcgi_pool_init()
+{
+    return pthread_key_create(&fcgi_worker_key, NULL);
+}
+
+int fcgi_pool_worker_init()
+{
+    int fd;
+    int ret = 0;
+    int slow = MK_FALSE;
+    int interval = 0;
+    struct mk_list *head;
+    struct fcgi_pool *pool;
+    struct fcgi_server *server;
+    struct fcgi_worker *worker;
+
+    worker = mk_api->mem_alloc_z(sizeof(struct fcgi_worker));
+    if (!worker) {
+        return -1;
+    }
+
+    worker->size = fcgi_conf.servers_count;
+    worker->pools = mk_api->mem_alloc_z(sizeof(struct fcgi_pool) *
+                                        worker->size);
+    worker->choices = mk_api->mem_alloc_z(sizeof(struct fcgi_pool *) *
+                                          worker->size);
+    if (!worker->pools || !worker->choices) {
+        mk_api->mem_free(worker->pools);
+        mk_api->mem_free(worker->choices);
+        mk_api->mem_free(worker);
+        return -1;
+    }
+    worker->seed = time(NULL) ^ (uintptr_t) worker;
+
+    mk_list_foreach(head, &fcgi_conf.servers) {
+        server = mk_list_entry(head, struct fcgi_server, _head);
+        pool = &worker->pools[server->id];
+        pool->server = server;
+        mk_list_init(&pool->idle);
+
+        if (server->keepalive == MK_TRUE &&
+            (interval == 0 || server->idle_timeout < interval)) {
+            interval = server->idle_timeout;
+        }
+        if (server->slow_time > 0) {
+            slow = MK_TRUE;
+        }
+    }
+    mk_timer_wheel_init(&worker->slow, FCGI_SLOW_TICK,
+                        mk_timer_wheel_clock());
+    pthread_setspecific(fcgi_worker_key, worker);
+
+    /*
+     * Idle connections are checked every IdleTimeout seconds (the shortest
+     * one), the timer is dispatched as a custom event so it reaches our
+     * own handler.
+     */
+    if (interval > 0) {
+        fd = mk_api->ev_timeout_create(mk_api->sched_loop(),
+                                       interval, 0, &worker->timer);
+        if (fd == -1) {
+            mk_warn("[fastcgi] cannot create idle connections timer");
+            ret = -1;
+        }
+        else {
+            worker->timer.type    = MK_EVENT_CUSTOM;
+            worker->timer.handler = cb_fcgi_pool_timer;
+        }
+    }
+
+    /* Requests waiting for a reply longer than SlowTime */
+    if (slow == MK_TRUE) {
+        fd = mk_api->ev_timeout_create(mk_api->sched_loop(), 0,
+                                       FCGI_SLOW_TICK * 1000000,
+                                       &worker->slow_timer);
+        if (fd == -1) {
+            mk_warn("[fastcgi] cannot create slow requests timer");
+            ret = -1;
+        }
+        else {
+            worker->slow_timer.type    = MK_EVENT_CUSTOM;
+            worker->slow_timer.handler = cb_fcgi_slow_timer;
+        }
+    }
+
+    return ret;
+}
+
+struct fcgi_worker *fcgi_pool_worker()
+{
+    return pthread_getspecific(fcgi_worker_key);
+}
+
+/*
+ * Get a connection to the backend: the most recently used idle connection
+ * that passes the health check or a new one, 'reused' tells which.
+ */
+int fcgi_pool_get(struct fcgi_pool *pool, int *reused)
+{
+    int fd;
+    struct fcgi_conn *conn;
+
+    *reused = MK_FALSE;
+
+    fcgi_pool_evict(pool, time(NULL));
+    while (pool->count > 0) {
+        conn = mk_list_entry_last(&pool->idle, struct fcgi_conn, _head);
+        fd = fcgi_conn_take(conn);
+        if (fcgi_conn_check(fd) == 0) {
+            MK_TRACE("[fastcgi=%i] reusing connection", fd);
+            *reused = MK_TRUE;
+            return fd;
+        }
+        close(fd);
+    }
+
+    return fcgi_conn_open(pool->server);
+}
+
+/* Give back a connection whose last request ended cleanly */
+void fcgi_pool_put(struct fcgi_pool *pool, int fd)
+{
+    int ret;
+    struct fcgi_conn *conn;
+
+    if (pool->server->keepalive == MK_FALSE ||
+        pool->count >= pool->server->max_idle) {
+        close(fd);
+        return;
+    }
+
+    conn = mk_api->mem_alloc_z(sizeof(struct fcgi_conn));
+    if (!conn) {
+        close(fd);
+        return;
+    }
+    conn->fd = fd;
+    conn->pool = pool;
+    conn->last_used = time(NULL);
+
+    /* watch it while idle, so a backend close is noticed right away */
+    MK_EVENT_NEW(&conn->event);
+    conn->event.handler = cb_fcgi_conn_idle;
+    ret = mk_api->ev_add(mk_api->sched_loop(), fd,
+                         MK_EVENT_CUSTOM, MK_EVENT_READ, conn);
+    if (ret == -1) {
+        close(fd);
+        mk_api->mem_free(conn);
+        return;
+    }
+
+    mk_list_add(&conn->_head, &pool->idle);
+    pool->count++;
+}
@@ -0,0 +1,75 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_FASTCGI_POOL_H
+#define MK_FASTCGI_POOL_H
+
+#include <monkey/mk_api.h>
+
+#include "fastcgi.h"
+
+struct fcgi_pool;
+
+/* Milliseconds, resolution of the SlowTime deadlines */
+#define FCGI_SLOW_TICK  100
+
+/*
+ * Idle connection to a FastCGI backend. Every worker keeps its own lists
+ * of them, so a connection is only used by the event loop owning it.
+ */
+struct fcgi_conn {
+    struct mk_event event;       /* notified if the backend drops it */
+    int fd;
+    time_t last_used;
+    struct fcgi_pool *pool;
+    struct mk_list _head;
+};
+
+/* State of a backend in a worker */
+struct fcgi_pool {
+    struct fcgi_server *server;
+    int count;                   /* idle connections in the list     */
+    struct mk_list idle;
+
+    /* balancing */
+    int requests;                /* outstanding requests             */
+    int fails;                   /* failures in a row                */
+    time_t ejected;              /* left out until this time         */
+    uint64_t tried;              /* last request that picked it      */
+};
+
+struct fcgi_worker {
+    struct mk_event timer;       /* periodic idle eviction           */
+    struct mk_event slow_timer;  /* ticks the reply deadlines        */
+    struct mk_timer_wheel slow;  /* requests waiting for a reply     */
+    unsigned int seed;           /* random choices                   */
+    unsigned int next;           /* first backend checked on a pick  */
+    uint64_t requests;           /* request ids                      */
+    int size;
+    struct fcgi_pool *pools;     /* one per backend                  */
+    struct fcgi_pool **choices;  /* scratch list used by the picks   */
+};
+
+int fcgi_pool_init();
+int fcgi_pool_worker_init();
+struct fcgi_worker *fcgi_pool_worker();
+int fcgi_pool_get(struct fcgi_pool *pool, int *reused);
+void fcgi_pool_put(struct fcgi_pool *pool, int fd);
+
+#endif
@@ -54,38 +54,45 @@ int mk_liana_plugin_exit(struct mk_plugin *plugin)
     return 0;
 }
 
-int mk_liana_read(struct mk_plugin *plugin, int socket_fd, void *buf, int count)
+int mk_liana_read(struct mk_plugin *plugin, int socket_fd, void *buf, int count,
+                  void *data)
 {
     (void) plugin;
+    (void) data;
 
     return recv(socket_fd, (void*)buf, count, 0);
 }
 
-int mk_liana_write(struct mk_plugin *plugin, int socket_fd, const void *buf, size_t count )
+int mk_liana_write(struct mk_plugin *plugin, int socket_fd, const void *buf, size_t count,
+                   void *data)
 {
     ssize_t bytes_sent = -1;
 
     (void) plugin;
+    (void) data;
 
     bytes_sent = send(socket_fd, buf, count, 0);
 
     return bytes_sent;
 }
 
-int mk_liana_writev(struct mk_plugin *plugin, int socket_fd, struct mk_iov *mk_io)
+int mk_liana_writev(struct mk_plugin *plugin, int socket_fd, struct mk_iov *mk_io,
+                    void *data)
 {
     ssize_t bytes_sent = -1;
 
     (void) plugin;
+    (void) data;
 
     bytes_sent = plugin->api->iov_send(socket_fd, mk_io);
 
     return bytes_sent;
 }
 
-int mk_liana_close(struct mk_plugin *plugin, int socket_fd)
+int mk_liana_close(struct mk_plugin *plugin, int socket_fd, void *data)
 {
     (void) plugin;
+    (void) data;
 
 #ifdef _WIN32
     return closesocket(socket_fd);
@@ -95,11 +102,12 @@ int mk_liana_close(struct mk_plugin *plugin, int socket_fd)
 }
 
 int mk_liana_send_file(struct mk_plugin *plugin, int socket_fd, int file_fd, off_t *file_offset,
-                       size_t file_count)
+                       size_t file_count, void *data)
 {
     ssize_t ret = -1;
 
     (void) plugin;
+    (void) data;
 
 #if defined (__linux__)
     ret = sendfile(socket_fd, file_fd, file_offset, file_count);
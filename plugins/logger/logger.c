@@ -23,7 +23,7 @@
 
 /* System Headers */
 #include <time.h>
-#include <sys/ioctl.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -31,6 +31,39 @@
 #include "logger.h"
 #include "pointers.h"
 
+static int mk_logger_timeout;
+static size_t mk_logger_buffer_size;
+static size_t mk_logger_flush_size;
+
+/* MasterLog variables */
+static char *mk_logger_master_path;
+static FILE *mk_logger_master_stdout;
+static FILE *mk_logger_master_stderr;
+
+static pthread_key_t cache_content_length;
+static pthread_key_t cache_status;
+static pthread_key_t cache_ip_str;
+static pthread_key_t cache_iov;
+static pthread_key_t cache_ring;
+
+static struct mk_server *mk_logger_server;
+
+/* Log targets, also indexed by their id */
+static struct mk_list targets_list;
+static struct log_target **targets;
+static int targets_size;
+
+/* Worker rings, drained by the writer thread */
+static struct mk_list rings_list;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Writer thread, workers and signals wake it up through this pipe */
+static pthread_t writer_tid;
+static int writer_running;
+static int writer_stop;
+static int writer_wake[2] = {-1, -1};
+static volatile sig_atomic_t writer_reopen;
+
 struct status_response {
     int   i_status;
     char *s_status;
@@ -73,157 +106,264 @@ static struct iov *mk_logger_get_cache()
     return pthread_getspecific(cache_iov);
 }
 
-static ssize_t _mk_logger_append(int pipe_fd_in,
-        int file_fd_out,
-        size_t bytes)
+static void mk_logger_wakeup()
 {
+    char c = 0;
+
+    /* If the pipe is full the writer is already pending to run */
+    if (write(writer_wake[1], &c, 1) == -1 && errno != EAGAIN) {
+        MK_TRACE("could not wake up the log writer");
+    }
+}
+
+/*
+ * Runs in whatever thread took the signal: only async-signal-safe calls,
+ * and errno is kept for the code it interrupted.
+ */
+static void mk_logger_reopen_signal(int signo)
+{
+    int saved_errno = errno;
+    char c = 0;
     ssize_t ret;
-#ifdef MK_HAVE_SPLICE
-    ret = splice(pipe_fd_in, NULL, file_fd_out,
-            NULL, bytes, SPLICE_F_MOVE);
-    return ret;
-#else
-    unsigned char buffer[4096];
-    ssize_t buffer_used;
-    size_t bytes_written = 0;
-
-    while (bytes_written < bytes) {
-        ret = read(pipe_fd_in, buffer, sizeof(buffer));
-        if (ret < 0) {
-            break;
-        }
-        buffer_used = ret;
-        ret = write(file_fd_out, buffer, buffer_used);
-        if (ret < 0) {
-            break;
-        }
-        bytes_written += ret;
+    (void) signo;
+
+    writer_reopen = MK_TRUE;
+
+    /* If the pipe is full the writer is already pending to run */
+    ret = write(writer_wake[1], &c, 1);
+    (void) ret;
+
+    errno = saved_errno;
+}
+
+/* Append a line to the ring of the calling worker */
+static int mk_logger_ring_push(struct log_ring *ring,
+                               struct log_target *target,
+                               struct mk_iov *iov)
+{
+    int i;
+    char *p;
+    size_t off;
+    size_t skip = 0;
+    size_t need;
+    uint64_t head;
+    uint64_t tail;
+    struct log_record *rec;
+
+    need = MK_LOGGER_RECORD_SIZE(iov->total_len);
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    /* Records are contiguous, skip the end of the buffer if required */
+    off = head & ring->mask;
+    if (off + need > ring->size) {
+        skip = ring->size - off;
     }
-    if (ret < 0 && bytes_written == 0)
+
+    if (head + skip + need - tail > ring->size) {
+        ring->dropped++;
+        if (__atomic_exchange_n(&ring->kicked, MK_TRUE, __ATOMIC_ACQ_REL) == MK_FALSE) {
+            mk_logger_wakeup();
+        }
         return -1;
-    else
-        return bytes_written;
-#endif
+    }
+
+    if (skip > 0) {
+        rec = (struct log_record *) (ring->buf + off);
+        rec->len = 0;
+        head += skip;
+    }
+
+    rec = (struct log_record *) (ring->buf + (head & ring->mask));
+    rec->len = iov->total_len;
+    rec->target = target->id;
+
+    p = (char *) (rec + 1);
+    for (i = 0; i < iov->iov_idx; i++) {
+        memcpy(p, iov->io[i].iov_base, iov->io[i].iov_len);
+        p += iov->io[i].iov_len;
+    }
+
+    head += need;
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    ring->lines++;
+
+    /* Don't wait for the flush timeout once enough data is buffered */
+    if (head - tail >= mk_logger_flush_size &&
+        __atomic_exchange_n(&ring->kicked, MK_TRUE, __ATOMIC_ACQ_REL) == MK_FALSE) {
+        ring->kicks++;
+        mk_logger_wakeup();
+    }
+
+    return 0;
 }
 
-static void mk_logger_start_worker(void *args)
+static int mk_logger_target_open(struct log_target *target)
 {
     int fd;
-    int bytes, err;
-    int max_events = mk_api->config->nhosts;
-    int flog;
-    int clk;
-    long slen;
-    int timeout;
-    char *target;
-    (void) args;
-    struct mk_list *head;
-    struct log_target *entry;
-    struct mk_event *event;
-    struct mk_event_loop *evl;
-
-    /* pipe_size:
-     * ----------
-     * Linux set a pipe size usingto the PAGE_SIZE,
-     * check linux/include/pipe_fs_i.h for details:
-     *
-     *       #define PIPE_SIZE               PAGE_SIZE
-     *
-     * In the same header file we can found that every
-     * pipe has 16 pages, so our real memory allocation
-     * is: (PAGE_SIZE*PIPE_BUFFERS)
-     */
-    long pipe_size;
 
-    /* buffer_limit:
-     * -------------
-     * it means the maximum data that a monkey log pipe can contain.
-     */
-    long buffer_limit;
+    fd = open(target->file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        if (target->open_failed == MK_FALSE) {
+            mk_warn("Could not open logfile '%s' (%s)",
+                    target->file, strerror(errno));
+            target->open_failed = MK_TRUE;
+        }
+        return -1;
+    }
 
-    mk_api->worker_rename("monkey: logger");
+    if (target->fd != -1) {
+        close(target->fd);
+    }
+    target->fd = fd;
+    target->open_failed = MK_FALSE;
 
-    /* Monkey allow just 75% of a pipe capacity */
-    pipe_size = sysconf(_SC_PAGESIZE) * 16;
-    buffer_limit = (pipe_size * MK_LOGGER_PIPE_LIMIT);
+    return 0;
+}
 
-    /* Creating poll */
-    evl = mk_api->ev_loop_create(max_events);
+/* Write the collected lines of a target, they are dropped on errors */
+static void mk_logger_target_write(struct log_target *target)
+{
+    int count = target->iov_count;
+    ssize_t ret;
+    struct iovec *iov = target->iov;
 
-    /* Registering targets for virtualhosts */
-    mk_list_foreach(head, &targets_list) {
-        entry = mk_list_entry(head, struct log_target, _head);
-        event = &entry->event;
-        event->mask  = MK_EVENT_EMPTY;
-        event->data  = entry;
-        event->handler = NULL;
-        event->status = MK_EVENT_NONE;
+    target->iov_count = 0;
+
+    if (target->fd == -1 && mk_logger_target_open(target) == -1) {
+        return;
+    }
+
+    while (count > 0) {
+        ret = writev(target->fd, iov, count);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            mk_warn("Could not write to log file '%s' (%s)",
+                    target->file, strerror(errno));
+            return;
+        }
 
-        /* Add access log file */
-        if (entry->pipe[0] > 0) {
-            event->fd = entry->pipe[0];
-            mk_api->ev_add(evl, entry->pipe[0],
-                           MK_EVENT_CONNECTION, MK_EVENT_READ, entry);
+        while (count > 0 && (size_t) ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + ret;
+            iov->iov_len -= ret;
         }
     }
+}
 
-    /* Set initial timeout */
-    timeout = time(NULL) + mk_logger_timeout;
+/* Writer thread: move the buffered lines of a ring to the log files */
+static void mk_logger_ring_drain(struct log_ring *ring)
+{
+    int i;
+    size_t off;
+    uint64_t head;
+    uint64_t tail;
+    struct log_record *rec;
+    struct log_target *target;
 
-    /* Reading pipe buffer */
-    while (1) {
-        usleep(1200);
+    /* Lines pushed from now on can ask for a flush again */
+    __atomic_store_n(&ring->kicked, MK_FALSE, __ATOMIC_RELEASE);
 
-        /* wait for events */
-        mk_api->ev_wait(evl);
+    tail = ring->tail;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
 
-        /* get current time */
-        clk = mk_api->time_unix();
+    while (tail < head) {
+        off = tail & ring->mask;
+        rec = (struct log_record *) (ring->buf + off);
+        if (rec->len == 0) {
+            tail += ring->size - off;
+            continue;
+        }
 
-        /* translate the backend events triggered */
-        mk_event_foreach(event, evl) {
-            entry = (struct log_target *) event;
-            target = entry->file;
-            fd = entry->pipe[0];
+        target = targets[rec->target];
+        if (target->iov_count == MK_LOGGER_IOV_MAX) {
+            mk_logger_target_write(target);
+        }
+        target->iov[target->iov_count].iov_base = rec + 1;
+        target->iov[target->iov_count].iov_len = rec->len;
+        target->iov_count++;
 
-            err = ioctl(fd, FIONREAD, &bytes);
-            if (mk_unlikely(err == -1)){
-                perror("ioctl");
-            }
+        tail += MK_LOGGER_RECORD_SIZE(rec->len);
+    }
 
-            if (bytes < buffer_limit && clk <= timeout) {
-                continue;
-            }
+    for (i = 0; i < targets_size; i++) {
+        if (targets[i]->iov_count > 0) {
+            mk_logger_target_write(targets[i]);
+        }
+    }
 
-            timeout = clk + mk_logger_timeout;
+    /* The space is given back to the worker once it's written */
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void mk_logger_flush()
+{
+    uint64_t dropped;
+    struct mk_list *head;
+    struct log_ring *ring;
+
+    pthread_mutex_lock(&rings_mutex);
+    mk_list_foreach(head, &rings_list) {
+        ring = mk_list_entry(head, struct log_ring, _head);
+        mk_logger_ring_drain(ring);
+
+        dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->dropped_reported) {
+            mk_warn("[logger] worker buffer full, %lu lines dropped "
+                    "(%lu logged), consider a larger BufferSize",
+                    (unsigned long) (dropped - ring->dropped_reported),
+                    (unsigned long) __atomic_load_n(&ring->lines,
+                                                    __ATOMIC_RELAXED));
+            ring->dropped_reported = dropped;
+        }
+    }
+    pthread_mutex_unlock(&rings_mutex);
+}
+
+static void mk_logger_start_worker(void *args)
+{
+    int i;
+    int ret;
+    char buf[64];
+    struct pollfd pfd;
+    (void) args;
 
-            flog = open(target, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
-            if (mk_unlikely(flog == -1)) {
-                mk_warn("Could not open logfile '%s' (%s)", target, strerror(errno));
+    mk_api->worker_rename("monkey: logger");
 
-                int consumed = 0;
-                char buf[255];
-                do {
-                    slen = read(fd, buf, 255);
-                    if (slen > 0) {
-                        consumed += slen;
-                    }
-                    else {
-                        break;
-                    }
-                } while (consumed < bytes);
+    for (i = 0; i < targets_size; i++) {
+        mk_logger_target_open(targets[i]);
+    }
 
-                continue;
-            }
+    pfd.fd = writer_wake[0];
+    pfd.events = POLLIN;
+
+    /*
+     * Lines are written when a worker buffered FlushSize bytes or when
+     * FlushTimeout expires, whatever happens first.
+     */
+    while (1) {
+        ret = poll(&pfd, 1, mk_logger_timeout * 1000);
+        if (ret > 0) {
+            while (read(writer_wake[0], buf, sizeof(buf)) > 0);
+        }
 
-            lseek(flog, 0, SEEK_END);
-            slen = _mk_logger_append(fd, flog, bytes);
-            if (mk_unlikely(slen == -1)) {
-                mk_warn("Could not write to log file: splice() = %ld", slen);
+        if (writer_reopen == MK_TRUE) {
+            writer_reopen = MK_FALSE;
+            for (i = 0; i < targets_size; i++) {
+                mk_logger_target_open(targets[i]);
             }
+        }
+
+        mk_logger_flush();
 
-            MK_TRACE("written %i bytes", bytes);
-            close(flog);
+        if (__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE) == MK_TRUE) {
+            break;
         }
     }
 }
@@ -231,6 +371,7 @@ static void mk_logger_start_worker(void *args)
 static int mk_logger_read_config(char *path)
 {
     int timeout;
+    int size;
     char *logfilename = NULL;
     unsigned long len;
     char *default_file = NULL;
@@ -257,6 +398,22 @@ static int mk_logger_read_config(char *path)
         mk_logger_timeout = timeout;
         MK_TRACE("FlushTimeout %i seconds", mk_logger_timeout);
 
+        /* BufferSize */
+        size = (size_t) mk_api->config_section_get_key(section,
+                                                       "BufferSize",
+                                                       MK_RCONF_NUM);
+        if (size > 0) {
+            mk_logger_buffer_size = size * 1024;
+        }
+
+        /* FlushSize */
+        size = (size_t) mk_api->config_section_get_key(section,
+                                                       "FlushSize",
+                                                       MK_RCONF_NUM);
+        if (size > 0) {
+            mk_logger_flush_size = size * 1024;
+        }
+
         /* MasterLog */
         logfilename = mk_api->config_section_get_key(section,
                                                      "MasterLog",
@@ -281,7 +438,7 @@ static void mk_logger_print_listeners()
     struct mk_list *head;
     struct mk_config_listener *listener;
 
-    mk_list_foreach(head, &mk_api->config->listeners) {
+    mk_list_foreach(head, &mk_logger_server->listeners) {
         listener = mk_list_entry(head, struct mk_config_listener, _head);
         printf("    listen on %s:%s\n",
                listener->address,
@@ -304,27 +461,46 @@ static void mk_logger_print_details(void)
            current->tm_min,
            current->tm_sec);
     printf("   version          : %s\n", MK_VERSION_STR);
-    printf("   number of workers: %i\n", mk_api->config->workers);
+    printf("   number of workers: %i\n", mk_logger_server->workers);
     mk_logger_print_listeners();
     fflush(stdout);
 }
 
-int mk_logger_plugin_init(struct plugin_api **api, char *confdir)
+int mk_logger_plugin_init(struct mk_plugin *plugin, char *confdir)
 {
     int fd;
-    mk_api = *api;
+    size_t size;
+
+    mk_api = plugin->api;
+    mk_logger_server = plugin->server_ctx;
 
     /* Specific thread key */
     pthread_key_create(&cache_iov, NULL);
     pthread_key_create(&cache_content_length, NULL);
     pthread_key_create(&cache_status, NULL);
     pthread_key_create(&cache_ip_str, NULL);
+    pthread_key_create(&cache_ring, NULL);
+
+    mk_list_init(&targets_list);
+    mk_list_init(&rings_list);
 
     /* Global configuration */
     mk_logger_timeout = MK_LOGGER_TIMEOUT_DEFAULT;
+    mk_logger_buffer_size = MK_LOGGER_BUFFER_DEFAULT * 1024;
+    mk_logger_flush_size = MK_LOGGER_FLUSH_DEFAULT * 1024;
     mk_logger_master_path = NULL;
     mk_logger_read_config(confdir);
 
+    /* Rings are addressed with a mask */
+    size = 4096;
+    while (size < mk_logger_buffer_size) {
+        size <<= 1;
+    }
+    mk_logger_buffer_size = size;
+    if (mk_logger_flush_size > mk_logger_buffer_size / 2) {
+        mk_logger_flush_size = mk_logger_buffer_size / 2;
+    }
+
     /* Check masterlog */
     if (mk_logger_master_path) {
         fd = open(mk_logger_master_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
@@ -342,40 +518,94 @@ int mk_logger_plugin_init(struct plugin_api **api, char *confdir)
     return 0;
 }
 
-int mk_logger_plugin_exit()
+int mk_logger_plugin_exit(struct mk_plugin *plugin)
 {
+    int i;
     struct mk_list *head, *tmp;
     struct log_target *entry;
+    struct log_ring *ring;
+
+    (void) plugin;
+
+    /* Write what is still buffered, then release everything */
+    if (writer_running == MK_TRUE) {
+        __atomic_store_n(&writer_stop, MK_TRUE, __ATOMIC_RELEASE);
+        mk_logger_wakeup();
+        if (!pthread_equal(writer_tid, pthread_self())) {
+            pthread_join(writer_tid, NULL);
+        }
+        writer_running = MK_FALSE;
+    }
+
+    mk_list_foreach_safe(head, tmp, &rings_list) {
+        ring = mk_list_entry(head, struct log_ring, _head);
+        mk_list_del(&ring->_head);
+        mk_api->mem_free(ring->buf);
+        mk_api->mem_free(ring);
+    }
 
     mk_list_foreach_safe(head, tmp, &targets_list) {
         entry = mk_list_entry(head, struct log_target, _head);
         mk_list_del(&entry->_head);
-        if (entry->pipe[0] > 0) close(entry->pipe[0]);
-        if (entry->pipe[1] > 0) close(entry->pipe[1]);
+        if (entry->fd != -1) close(entry->fd);
+        mk_api->mem_free(entry->iov);
         mk_api->mem_free(entry->file);
         mk_api->mem_free(entry);
     }
+    mk_api->mem_free(targets);
+    targets = NULL;
+    targets_size = 0;
+
+    for (i = 0; i < 2; i++) {
+        if (writer_wake[i] != -1) {
+            close(writer_wake[i]);
+            writer_wake[i] = -1;
+        }
+    }
 
     mk_api->mem_free(mk_logger_master_path);
 
     return 0;
 }
 
-int mk_logger_master_init(struct mk_server_config *config)
+static struct log_target *mk_logger_target_new(struct mk_vhost *host,
+                                               char *file, int is_ok)
 {
-    int ret;
     struct log_target *new;
+
+    new = mk_api->mem_alloc_z(sizeof(struct log_target));
+    new->iov = mk_api->mem_alloc(sizeof(struct iovec) * MK_LOGGER_IOV_MAX);
+    if (!new->iov) {
+        mk_err("Could not allocate log target");
+        exit(EXIT_FAILURE);
+    }
+
+    new->id = targets_size++;
+    new->is_ok = is_ok;
+    new->fd = -1;
+    new->file = file;
+    new->host = host;
+    mk_list_add(&new->_head, &targets_list);
+
+    return new;
+}
+
+int mk_logger_master_init(struct mk_server *server)
+{
+    int i;
+    int ret;
+    struct sigaction act;
     struct mk_vhost *entry_host;
-    struct mk_list *hosts = &mk_api->config->hosts;
+    struct mk_list *hosts = &server->hosts;
     struct mk_list *head_host;
+    struct mk_list *head;
     struct mk_rconf_section *section;
+    struct log_target *target;
     char *access_file_name = NULL;
     char *error_file_name = NULL;
-    pthread_t tid;
-    (void) config;
 
     /* Restore STDOUT if we are in background mode */
-    if (mk_logger_master_path != NULL && mk_api->config->is_daemon == MK_TRUE) {
+    if (mk_logger_master_path != NULL && server->is_daemon == MK_TRUE) {
         mk_logger_master_stdout = freopen(mk_logger_master_path, "ae", stdout);
         mk_logger_master_stderr = freopen(mk_logger_master_path, "ae", stderr);
         mk_logger_print_details();
@@ -383,8 +613,6 @@ int mk_logger_master_init(struct mk_server_config *config)
 
     MK_TRACE("Reading virtual hosts");
 
-    mk_list_init(&targets_list);
-
     mk_list_foreach(head_host, hosts) {
         entry_host = mk_list_entry(head_host, struct mk_vhost, _head);
 
@@ -400,69 +628,61 @@ int mk_logger_master_init(struct mk_server_config *config)
                                                                       MK_RCONF_STR);
 
             if (access_file_name) {
-                new = mk_api->mem_alloc(sizeof(struct log_target));
-                new->is_ok = MK_TRUE;
-
-                /* Set access pipe */
-                if (pipe(new->pipe) < 0) {
-                    mk_err("Could not create pipe");
-                    exit(EXIT_FAILURE);
-                }
-                if (fcntl(new->pipe[1], F_SETFL, O_NONBLOCK) == -1) {
-                    perror("fcntl");
-                }
-                if (fcntl(new->pipe[0], F_SETFD, FD_CLOEXEC) == -1) {
-                    perror("fcntl");
-                }
-                if (fcntl(new->pipe[1], F_SETFD, FD_CLOEXEC) == -1) {
-                    perror("fcntl");
-                }
-                new->file = access_file_name;
-                new->host = entry_host;
-                mk_list_add(&new->_head, &targets_list);
+                mk_logger_target_new(entry_host, access_file_name, MK_TRUE);
             }
-
-            /* Set error pipe */
             if (error_file_name) {
-                new = mk_api->mem_alloc(sizeof(struct log_target));
-                new->is_ok = MK_FALSE;
-
-                if (pipe(new->pipe) < 0) {
-                    mk_err("Could not create pipe");
-                    exit(EXIT_FAILURE);
-                }
-                if (fcntl(new->pipe[1], F_SETFL, O_NONBLOCK) == -1) {
-                    perror("fcntl");
-                }
-                if (fcntl(new->pipe[0], F_SETFD, FD_CLOEXEC) == -1) {
-                    perror("fcntl");
-                }
-                if (fcntl(new->pipe[1], F_SETFD, FD_CLOEXEC) == -1 ){
-                    perror("fcntl");
-                }
-                new->file = error_file_name;
-                new->host = entry_host;
-                mk_list_add(&new->_head, &targets_list);
-
+                mk_logger_target_new(entry_host, error_file_name, MK_FALSE);
             }
         }
     }
 
-    ret = mk_api->worker_spawn((void *) mk_logger_start_worker, NULL, &tid);
+    /* Records refer to their target by id */
+    targets = mk_api->mem_alloc_z(sizeof(struct log_target *) *
+                                  (targets_size + 1));
+    mk_list_foreach(head, &targets_list) {
+        target = mk_list_entry(head, struct log_target, _head);
+        targets[target->id] = target;
+    }
+
+    if (pipe(writer_wake) < 0) {
+        mk_err("Could not create pipe");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < 2; i++) {
+        if (fcntl(writer_wake[i], F_SETFL, O_NONBLOCK) == -1) {
+            perror("fcntl");
+        }
+        if (fcntl(writer_wake[i], F_SETFD, FD_CLOEXEC) == -1) {
+            perror("fcntl");
+        }
+    }
+
+    /* Log rotation: the files are opened again on the reopen signal */
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = mk_logger_reopen_signal;
+    act.sa_flags = SA_RESTART;
+    sigemptyset(&act.sa_mask);
+    sigaction(MK_LOGGER_REOPEN_SIGNAL, &act, NULL);
+
+    ret = mk_api->worker_spawn((void *) mk_logger_start_worker, NULL,
+                               &writer_tid);
     if (ret == -1) {
         return -1;
     }
+    writer_running = MK_TRUE;
 
     return 0;
 }
 
-void mk_logger_worker_init()
+void mk_logger_worker_init(struct mk_server *server)
 {
     struct mk_iov *iov_log;
+    struct log_ring *ring;
     mk_ptr_t *content_length;
     mk_ptr_t *status;
     mk_ptr_t *ip_str;
 
+    (void) server;
 
     MK_TRACE("Creating thread cache");
 
@@ -487,6 +707,21 @@ void mk_logger_worker_init()
     ip_str->data = mk_api->mem_alloc_z(INET6_ADDRSTRLEN + 1);
     ip_str->len  = -1;
     pthread_setspecific(cache_ip_str, (void *) ip_str);
+
+    /* Lines buffered by this worker */
+    ring = mk_api->mem_alloc_z(sizeof(struct log_ring));
+    ring->buf = mk_api->mem_alloc(mk_logger_buffer_size);
+    if (!ring->buf) {
+        mk_err("Could not allocate the log buffer");
+        exit(EXIT_FAILURE);
+    }
+    ring->size = mk_logger_buffer_size;
+    ring->mask = mk_logger_buffer_size - 1;
+    pthread_setspecific(cache_ring, (void *) ring);
+
+    pthread_mutex_lock(&rings_mutex);
+    mk_list_add(&ring->_head, &rings_list);
+    pthread_mutex_unlock(&rings_mutex);
 }
 
 int mk_logger_stage40(struct mk_http_session *cs, struct mk_http_request *sr)
@@ -495,6 +730,7 @@ int mk_logger_stage40(struct mk_http_session *cs, struct mk_http_request *sr)
     int array_len = ARRAY_SIZE(response_codes);
     int access;
     struct log_target *target;
+    struct log_ring *ring;
     struct mk_iov *iov;
     mk_ptr_t *date;
     mk_ptr_t *content_length;
@@ -518,6 +754,11 @@ int mk_logger_stage40(struct mk_http_session *cs, struct mk_http_request *sr)
         return 0;
     }
 
+    ring = pthread_getspecific(cache_ring);
+    if (!ring) {
+        return 0;
+    }
+
     /* Get iov cache struct and reset indexes */
     iov = (struct mk_iov *) mk_logger_get_cache();
     iov->iov_idx = 0;
@@ -647,8 +888,8 @@ int mk_logger_stage40(struct mk_http_session *cs, struct mk_http_request *sr)
                             MK_FALSE);
         }
 
-        /* Write iov array to pipe */
-        mk_api->iov_send(target->pipe[1], iov);
+        /* Hand the line to the writer thread */
+        mk_logger_ring_push(ring, target, iov);
     }
     else {
         if (mk_unlikely(!target->file)) {
@@ -821,8 +1062,8 @@ int mk_logger_stage40(struct mk_http_session *cs, struct mk_http_request *sr)
         }
 
 
-        /* Write iov array to pipe */
-        mk_api->iov_send(target->pipe[1], iov);
+        /* Hand the line to the writer thread */
+        mk_logger_ring_push(ring, target, iov);
     }
 
     return 0;
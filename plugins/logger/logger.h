@@ -22,37 +22,72 @@
 #define MK_LOGGER_H
 
 #include <stdio.h>
+#include <signal.h>
+#include <sys/uio.h>
 #include <monkey/mk_api.h>
 
-#define MK_LOGGER_PIPE_LIMIT 0.75
 #define MK_LOGGER_TIMEOUT_DEFAULT 3
+#define MK_LOGGER_BUFFER_DEFAULT  256   /* KB, ring of every worker   */
+#define MK_LOGGER_FLUSH_DEFAULT   64    /* KB, wake up the writer     */
+#define MK_LOGGER_IOV_MAX         512   /* lines per writev(2)        */
 
-int mk_logger_timeout;
-
-/* MasterLog variables */
-char *mk_logger_master_path;
-FILE *mk_logger_master_stdout;
-FILE *mk_logger_master_stderr;
-
-pthread_key_t cache_content_length;
-pthread_key_t cache_status;
-pthread_key_t cache_ip_str;
-pthread_key_t cache_iov;
+/* Logs are opened again when the server gets this signal (rotation) */
+#define MK_LOGGER_REOPEN_SIGNAL   SIGUSR1
 
 struct log_target
 {
-    struct mk_event event;
+    int id;
 
-    /* Pipes */
+    /* Log file, it's kept open by the writer thread */
     int is_ok;
-    int pipe[2];
+    int fd;
+    int open_failed;
     char *file;
 
+    /* Lines collected for the next writev(2) */
+    int iov_count;
+    struct iovec *iov;
+
     struct mk_vhost *host;
     struct mk_list _head;
 };
 
-struct mk_list targets_list;
+/*
+ * Every access line is stored in the ring of the worker that served the
+ * request, preceded by this header and padded to the header alignment.
+ * A zero length marks the unused space at the end of the buffer.
+ */
+struct log_record
+{
+    uint32_t len;
+    uint32_t target;
+};
+
+#define MK_LOGGER_RECORD_SIZE(len)                                      \
+    ((sizeof(struct log_record) + (len) + sizeof(struct log_record) - 1) \
+     & ~(sizeof(struct log_record) - 1))
 
+/*
+ * Single producer, single consumer ring: the worker appends records at
+ * 'head' and the writer thread releases them moving 'tail'. Both offsets
+ * only grow, the position in the buffer is 'offset & mask'.
+ */
+struct log_ring
+{
+    uint64_t head;
+    uint64_t tail;
+    size_t size;
+    size_t mask;
+    char *buf;
+    int kicked;                 /* the writer was asked to flush */
+
+    /* Counters, updated by the worker */
+    uint64_t lines;
+    uint64_t dropped;           /* lines lost because the ring was full */
+    uint64_t kicks;             /* flushes requested before the timeout */
+
+    uint64_t dropped_reported;  /* writer thread */
+    struct mk_list _head;
+};
 
 #endif
@@ -19,7 +19,6 @@
 
 #include <monkey/mk_plugin.h>
 
-#include "logger.h"
 #include "pointers.h"
 
 const mk_ptr_t mk_logger_iov_none = mk_ptr_init("");
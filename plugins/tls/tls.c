@@ -28,8 +28,15 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 
+#ifdef MK_HAVE_KTLS
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <linux/tls.h>
+#endif
+
 #include <mbedtls/version.h>
 #include <mbedtls/error.h>
 #include <mbedtls/net.h>
@@ -42,6 +49,8 @@
 #include <mbedtls/ssl_cache.h>
 #include <mbedtls/pk.h>
 #include <mbedtls/dhm.h>
+#include <mbedtls/cipher.h>
+#include <mbedtls/ssl_internal.h>
 #include <monkey/mk_api.h>
 
 #ifndef SENDFILE_BUF_SIZE
@@ -59,42 +68,165 @@
 #error "One or more required POLARSSL modules not built."
 #endif
 
+#ifdef MK_HAVE_KTLS
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+/* Kernel TLS state of a connection */
+#define KTLS_TX       1   /* records are encrypted by the kernel */
+#define KTLS_RX       2   /* records are decrypted by the kernel */
+#define KTLS_DONE     4   /* offload was set up or is not possible */
+
+#define KTLS_ALERT    21  /* TLS record type */
+#endif
+
 struct polar_config {
     char *cert_file;
     char *cert_chain_file;
     char *key_file;
     char *dh_param_file;
     int8_t check_client_cert;
+    int8_t kernel_tls;
+    int8_t session_tickets;
+    int ticket_lifetime;
+    int handshake_threads;
 };
 
 #if defined(MBEDTLS_SSL_CACHE_C)
+/*
+ * Sessions of clients without tickets are cached by the server. The cache
+ * is split by session id, so workers resuming different sessions do not
+ * wait for each other.
+ */
+#define POLAR_CACHE_SHARDS  16
+
 struct polar_sessions {
     pthread_mutex_t _mutex;
     mbedtls_ssl_cache_context cache;
 };
 
-static struct polar_sessions global_sessions = {
+static struct polar_sessions global_sessions[POLAR_CACHE_SHARDS];
+
+#endif
+
+/* Seconds, it's also the rotation interval of the ticket keys */
+#define TICKET_DEFAULT_LIFETIME   3600
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+/*
+ * RFC 5077 session tickets: the session state is encrypted by a key shared
+ * by all workers, so any of them can resume it. Keys only live in memory,
+ * a new one is generated every ticket lifetime and the previous one is
+ * still accepted until the next rotation.
+ */
+#define TICKET_KEY_NAME_LEN       4
+#define TICKET_KEY_LEN            32
+#define TICKET_IV_LEN             12
+#define TICKET_TAG_LEN            16
+#define TICKET_HEADER_LEN         (TICKET_KEY_NAME_LEN + TICKET_IV_LEN + 2)
+
+struct polar_ticket_key {
+    unsigned char name[TICKET_KEY_NAME_LEN];
+    unsigned char secret[TICKET_KEY_LEN];
+    time_t created;                     /* zero if never generated */
+};
+
+static struct polar_tickets {
+    pthread_mutex_t _mutex;
+    int active;
+    struct polar_ticket_key keys[2];
+} global_tickets = {
     ._mutex = PTHREAD_MUTEX_INITIALIZER,
 };
 
+/* Worker copy of a ticket key */
+struct polar_ticket_cipher {
+    unsigned char name[TICKET_KEY_NAME_LEN];
+    time_t created;
+    mbedtls_cipher_context_t cipher;
+};
 #endif
 
+/* Wait for a full socket buffer while a handshake flight is written */
+#define HANDSHAKE_WRITE_TIMEOUT   1000  /* milliseconds */
+
 struct polar_context_head {
     mbedtls_ssl_context context;
     int fd;
-    struct polar_context_head *_next;
+    struct polar_thread_context *thread;
+#ifdef MK_HAVE_KTLS
+    int ktls;
+    size_t ktls_keylen;
+    unsigned char ktls_keys[64];   /* client and server write keys */
+#endif
+
+    /* Handshake offload */
+    struct mk_event *event;                  /* connection event     */
+    uint32_t hs_mask;                        /* events to restore    */
+    int hs_ret;                              /* last handshake step  */
+    int8_t hs_pending;                       /* queued on the pool   */
+    int8_t hs_closed;                        /* closed while queued  */
+    struct polar_hs_thread *hs_thread;       /* pool thread in use   */
+    struct polar_context_head *_next_job;
+
+    struct polar_context_head *_next;        /* all thread contexts  */
+    struct polar_context_head *_next_unused; /* contexts to reuse    */
 };
 
 struct polar_thread_context {
 
     struct polar_context_head *contexts;
+    struct polar_context_head *unused;
+    struct polar_context_head *current;
     mbedtls_ctr_drbg_context ctr_drbg;
     mbedtls_pk_context pkey;
     mbedtls_ssl_config conf;
 
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    int ticket_active;
+    struct polar_ticket_cipher tickets[2];
+#endif
+
+    /* Workers get the handshakes done by the pool through a channel */
+    struct mk_event_loop *loop;
+    struct mk_event hs_event;
+    int hs_channel;
+    unsigned int hs_next;
+
     struct mk_list _head;
 };
 
+/*
+ * Handshake offload pool: the public key operations of full handshakes
+ * are the most expensive part of a TLS connection. When enabled, workers
+ * stop watching a connection while it's in the handshake and queue it on
+ * one of these threads, which runs the mbedtls handshake steps with its
+ * own engine (configuration, key and random generator) and sends the
+ * connection back to its worker when the client has to answer. A
+ * connection stays on the same pool thread until the handshake is over,
+ * since mbedtls keeps references to the engine between the steps.
+ */
+struct polar_hs_thread {
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct polar_context_head *jobs;
+    struct polar_context_head *jobs_tail;
+    struct polar_thread_context *engine;
+};
+
+static struct polar_hs_pool {
+    int size;
+    int stop;
+    struct polar_hs_thread *threads;
+} hs_pool;
+
+static pthread_once_t hs_pool_once = PTHREAD_ONCE_INIT;
+
 struct polar_server_context {
 
     struct polar_config config;
@@ -112,6 +244,11 @@ static const char *my_dhm_G = MBEDTLS_DHM_RFC5114_MODP_2048_G;
 
 static pthread_key_t local_context;
 
+#ifdef MK_HAVE_KTLS
+/* Cleared when the running kernel does not provide the TLS ULP */
+static int ktls_available = MK_TRUE;
+#endif
+
 /*
  * The following function is taken from PolarSSL sources to get
  * the number of available bytes to read from a buffer.
@@ -135,7 +272,7 @@ static void polar_debug(void *ctx, int level, const char *str)
     (void)ctx;
 
     if (level < POLAR_DEBUG_LEVEL) {
-        mk_warn("%.*s", (int)strlen(str) - 1, str);
+        mk_warn_ex(mk_api, "%.*s", (int)strlen(str) - 1, str);
     }
 }
 #endif
@@ -170,12 +307,21 @@ static int handle_return(int ret)
     }
 }
 
+static inline struct polar_sessions *tls_cache_shard(void *p,
+                                                     const mbedtls_ssl_session *session)
+{
+    struct polar_sessions *shards = p;
+
+    /* Session ids are random */
+    return &shards[session->id[0] % POLAR_CACHE_SHARDS];
+}
+
 static int tls_cache_get(void *p, mbedtls_ssl_session *session)
 {
     struct polar_sessions *session_cache;
     int ret;
 
-    session_cache = p;
+    session_cache = tls_cache_shard(p, session);
     pthread_mutex_lock(&session_cache->_mutex);
     ret = mbedtls_ssl_cache_get(&session_cache->cache, session);
     pthread_mutex_unlock(&session_cache->_mutex);
@@ -188,7 +334,7 @@ static int tls_cache_set(void *p, const mbedtls_ssl_session *session)
     struct polar_sessions *session_cache;
     int ret;
 
-    session_cache = p;
+    session_cache = tls_cache_shard(p, session);
     pthread_mutex_lock(&session_cache->_mutex);
     ret = mbedtls_ssl_cache_set(&session_cache->cache, session);
     pthread_mutex_unlock(&session_cache->_mutex);
@@ -196,6 +342,228 @@ static int tls_cache_set(void *p, const mbedtls_ssl_session *session)
     return ret;
 }
 
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+/*
+ * Refresh the worker copy of the ticket keys, rotating the active key when
+ * it's older than the ticket lifetime. Workers only get here when their
+ * active key expired or a ticket names a key they do not know.
+ */
+static int tls_ticket_keys_sync(struct polar_thread_context *thctx,
+                                time_t now)
+{
+    int i;
+    int ret = 0;
+    struct polar_ticket_key *key;
+    struct polar_ticket_cipher *tc;
+
+    pthread_mutex_lock(&global_tickets._mutex);
+
+    key = &global_tickets.keys[global_tickets.active];
+    if (key->created == 0 ||
+        now - key->created >= server_context->config.ticket_lifetime) {
+        i = 1 - global_tickets.active;
+        key = &global_tickets.keys[i];
+
+        ret = mbedtls_ctr_drbg_random(&thctx->ctr_drbg,
+                                      key->name, sizeof(key->name));
+        if (ret == 0) {
+            ret = mbedtls_ctr_drbg_random(&thctx->ctr_drbg,
+                                          key->secret, sizeof(key->secret));
+        }
+        if (ret != 0) {
+            key->created = 0;
+            goto out;
+        }
+        key->created = now;
+        global_tickets.active = i;
+    }
+
+    for (i = 0; i < 2; i++) {
+        key = &global_tickets.keys[i];
+        tc = &thctx->tickets[i];
+
+        if (tc->created == key->created &&
+            memcmp(tc->name, key->name, sizeof(tc->name)) == 0) {
+            continue;
+        }
+
+        tc->created = 0;
+        if (key->created == 0) {
+            continue;
+        }
+
+        ret = mbedtls_cipher_setkey(&tc->cipher, key->secret,
+                                    TICKET_KEY_LEN * 8, MBEDTLS_ENCRYPT);
+        if (ret != 0) {
+            goto out;
+        }
+        memcpy(tc->name, key->name, sizeof(tc->name));
+        tc->created = key->created;
+    }
+    thctx->ticket_active = global_tickets.active;
+
+ out:
+    pthread_mutex_unlock(&global_tickets._mutex);
+    return ret;
+}
+
+static struct polar_ticket_cipher *tls_ticket_key_find(struct polar_thread_context *thctx,
+                                                       const unsigned char *name)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (thctx->tickets[i].created != 0 &&
+            memcmp(thctx->tickets[i].name, name, TICKET_KEY_NAME_LEN) == 0) {
+            return &thctx->tickets[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Ticket layout, the header is authenticated with the encrypted state:
+ *
+ *   key name (4) | IV (12) | state length (2) | state | tag (16)
+ *
+ * The state is the session structure, peer certificates are not kept so
+ * tickets are not issued when client certificates are checked.
+ */
+static int tls_ticket_write(void *p, const mbedtls_ssl_session *session,
+                            unsigned char *start, const unsigned char *end,
+                            size_t *tlen, uint32_t *lifetime)
+{
+    int ret;
+    size_t clen;
+    time_t now = time(NULL);
+    unsigned char *iv = start + TICKET_KEY_NAME_LEN;
+    unsigned char *state_len = iv + TICKET_IV_LEN;
+    unsigned char *state = start + TICKET_HEADER_LEN;
+    mbedtls_ssl_session copy;
+    struct polar_ticket_cipher *tc;
+    struct polar_thread_context *thctx = p;
+
+    *tlen = 0;
+
+    if ((size_t) (end - start) <
+        TICKET_HEADER_LEN + sizeof(copy) + TICKET_TAG_LEN) {
+        return MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL;
+    }
+
+    tc = &thctx->tickets[thctx->ticket_active];
+    if (tc->created == 0 ||
+        now - tc->created >= server_context->config.ticket_lifetime) {
+        ret = tls_ticket_keys_sync(thctx, now);
+        if (ret != 0) {
+            return ret;
+        }
+        tc = &thctx->tickets[thctx->ticket_active];
+    }
+
+    ret = mbedtls_ctr_drbg_random(&thctx->ctr_drbg, iv, TICKET_IV_LEN);
+    if (ret != 0) {
+        return ret;
+    }
+
+    memcpy(start, tc->name, TICKET_KEY_NAME_LEN);
+    state_len[0] = (sizeof(copy) >> 8) & 0xff;
+    state_len[1] = sizeof(copy) & 0xff;
+
+    memcpy(&copy, session, sizeof(copy));
+#if defined(MBEDTLS_X509_CRT_PARSE_C)
+    copy.peer_cert = NULL;
+#endif
+
+    ret = mbedtls_cipher_auth_encrypt(&tc->cipher, iv, TICKET_IV_LEN,
+                                      start, TICKET_HEADER_LEN,
+                                      (unsigned char *) &copy, sizeof(copy),
+                                      state, &clen,
+                                      state + sizeof(copy), TICKET_TAG_LEN);
+    memset(&copy, 0, sizeof(copy));
+    if (ret != 0) {
+        return ret;
+    }
+
+    *tlen = TICKET_HEADER_LEN + clen + TICKET_TAG_LEN;
+    *lifetime = server_context->config.ticket_lifetime;
+
+    return 0;
+}
+
+static int tls_ticket_parse(void *p, mbedtls_ssl_session *session,
+                            unsigned char *buf, size_t len)
+{
+    int ret;
+    size_t clen;
+    size_t state_len;
+    time_t now = time(NULL);
+    unsigned char *iv = buf + TICKET_KEY_NAME_LEN;
+    unsigned char *state = buf + TICKET_HEADER_LEN;
+    struct polar_ticket_cipher *tc;
+    struct polar_thread_context *thctx = p;
+
+    if (len < TICKET_HEADER_LEN + TICKET_TAG_LEN) {
+        return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    }
+
+    state_len = (iv[TICKET_IV_LEN] << 8) | iv[TICKET_IV_LEN + 1];
+    if (state_len != sizeof(*session) ||
+        len != TICKET_HEADER_LEN + state_len + TICKET_TAG_LEN) {
+        return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    }
+
+    /* The key may have been rotated by another worker */
+    tc = tls_ticket_key_find(thctx, buf);
+    if (!tc) {
+        if (tls_ticket_keys_sync(thctx, now) == 0) {
+            tc = tls_ticket_key_find(thctx, buf);
+        }
+        if (!tc) {
+            return MBEDTLS_ERR_SSL_INVALID_MAC;
+        }
+    }
+
+    ret = mbedtls_cipher_auth_decrypt(&tc->cipher, iv, TICKET_IV_LEN,
+                                      buf, TICKET_HEADER_LEN,
+                                      state, state_len, state, &clen,
+                                      state + state_len, TICKET_TAG_LEN);
+    if (ret != 0 || clen != sizeof(*session)) {
+        if (ret == MBEDTLS_ERR_CIPHER_AUTH_FAILED) {
+            return MBEDTLS_ERR_SSL_INVALID_MAC;
+        }
+        return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    }
+
+    memcpy(session, state, sizeof(*session));
+    memset(state, 0, state_len);
+#if defined(MBEDTLS_X509_CRT_PARSE_C)
+    session->peer_cert = NULL;
+#endif
+
+    if (now - session->start > server_context->config.ticket_lifetime) {
+        return MBEDTLS_ERR_SSL_SESSION_TICKET_EXPIRED;
+    }
+
+    return 0;
+}
+#endif
+
+/* Flags enabled by default, only an explicit 'off' disables them */
+static int8_t config_flag_on(char *value)
+{
+    int8_t on = MK_TRUE;
+
+    if (value) {
+        if (strcasecmp(value, MK_RCONF_OFF) == 0) {
+            on = MK_FALSE;
+        }
+        mk_api->mem_free(value);
+    }
+
+    return on;
+}
+
 static int config_parse(const char *confdir, struct polar_config *conf)
 {
     long unsigned int len;
@@ -204,6 +572,10 @@ static int config_parse(const char *confdir, struct polar_config *conf)
     char *cert_chain_file = NULL;
     char *key_file = NULL;
     char *dh_param_file = NULL;
+    char *kernel_tls = NULL;
+    char *session_tickets = NULL;
+    int ticket_lifetime = 0;
+    int handshake_threads = 0;
     int8_t check_client_cert = MK_FALSE;
     struct mk_rconf_section *section;
     struct mk_rconf *conf_head;
@@ -234,9 +606,21 @@ static int config_parse(const char *confdir, struct polar_config *conf)
                                                    "DHParameterFile",
                                                    MK_RCONF_STR);
 
-    check_client_cert = mk_api->config_section_get_key(section,
-                                                   "CheckClientCert",
-                                                   MK_RCONF_BOOL);
+    check_client_cert = (size_t) mk_api->config_section_get_key(section,
+                                                            "CheckClientCert",
+                                                            MK_RCONF_BOOL);
+    kernel_tls = mk_api->config_section_get_key(section,
+                                                "KernelTLS",
+                                                MK_RCONF_STR);
+    session_tickets = mk_api->config_section_get_key(section,
+                                                     "SessionTickets",
+                                                     MK_RCONF_STR);
+    ticket_lifetime = (size_t) mk_api->config_section_get_key(section,
+                                                              "SessionTicketLifetime",
+                                                              MK_RCONF_NUM);
+    handshake_threads = (size_t) mk_api->config_section_get_key(section,
+                                                                "HandshakeThreads",
+                                                                MK_RCONF_NUM);
 fallback:
     /* Set default name if not specified */
     if (!cert_file) {
@@ -304,6 +688,21 @@ fallback:
     /* Set client cert check */
     conf->check_client_cert = check_client_cert;
 
+    /* Kernel TLS and session tickets are used unless they are turned off */
+    conf->kernel_tls = config_flag_on(kernel_tls);
+    conf->session_tickets = config_flag_on(session_tickets);
+
+    conf->ticket_lifetime = ticket_lifetime;
+    if (conf->ticket_lifetime <= 0) {
+        conf->ticket_lifetime = TICKET_DEFAULT_LIFETIME;
+    }
+
+    /* Handshakes run on the workers unless a pool is requested */
+    conf->handshake_threads = handshake_threads;
+    if (conf->handshake_threads < 0) {
+        conf->handshake_threads = 0;
+    }
+
     if (conf_head) {
         mk_api->config_free(conf_head);
     }
@@ -319,20 +718,21 @@ static int polar_load_certs(const struct polar_config *conf)
     ret = mbedtls_x509_crt_parse_file(&server_context->cert, conf->cert_file);
     if (ret < 0) {
         mbedtls_strerror(ret, err_buf, sizeof(err_buf));
-        mk_warn("[tls] Load cert '%s' failed: %s",
+        mk_warn_ex(mk_api, "[tls] Load cert '%s' failed: %s",
                conf->cert_file,
                err_buf);
 
 #if defined(MBEDTLS_CERTS_C)
-        mk_warn("[tls] Using test certificates, "
+        mk_warn_ex(mk_api, "[tls] Using test certificates, "
                 "please set 'CertificateFile' in tls.conf");
 
         ret = mbedtls_x509_crt_parse(&server_context->cert,
-                             (unsigned char *)mbedtls_test_srv_crt, strlen(mbedtls_test_srv_crt));
+                             (unsigned char *)mbedtls_test_srv_crt, strlen(mbedtls_test_srv_crt) + 1);
 
         if (ret) {
             mbedtls_strerror(ret, err_buf, sizeof(err_buf));
-            mk_warn("[tls] Load built-in cert failed: %s", err_buf);
+            mk_warn_ex(mk_api, "[tls] Load built-in cert failed: %s",
+                       err_buf);
             return -1;
         }
 
@@ -347,7 +747,7 @@ static int polar_load_certs(const struct polar_config *conf)
 
         if (ret) {
             mbedtls_strerror(ret, err_buf, sizeof(err_buf));
-            mk_warn("[tls] Load cert chain '%s' failed: %s",
+            mk_warn_ex(mk_api, "[tls] Load cert chain '%s' failed: %s",
                     conf->cert_chain_file,
                     err_buf);
         }
@@ -375,10 +775,11 @@ static int polar_load_key(struct polar_thread_context *thread_context,
 
         ret = mbedtls_pk_parse_key(&thread_context->pkey,
                            (unsigned char *)mbedtls_test_srv_key,
-                           strlen(mbedtls_test_srv_key), NULL, 0);
+                           strlen(mbedtls_test_srv_key) + 1, NULL, 0);
         if (ret) {
             mbedtls_strerror(ret, err_buf, sizeof(err_buf));
-            mk_err("[tls] Failed to load built-in RSA key: %s", err_buf);
+            mk_err_ex(mk_api, "[tls] Failed to load built-in RSA key: %s",
+                      err_buf);
             return -1;
         }
 #else
@@ -402,13 +803,13 @@ static int polar_load_dh_param(const struct polar_config *conf)
         ret = mbedtls_mpi_read_string(&server_context->dhm.P, 16, my_dhm_P);
         if (ret < 0) {
             mbedtls_strerror(ret, err_buf, sizeof(err_buf));
-            mk_err("[tls] Load DH parameter failed: %s", err_buf);
+            mk_err_ex(mk_api, "[tls] Load DH parameter failed: %s", err_buf);
             return -1;
         }
         ret = mbedtls_mpi_read_string(&server_context->dhm.G, 16, my_dhm_G);
         if (ret < 0) {
             mbedtls_strerror(ret, err_buf, sizeof(err_buf));
-            mk_err("[tls] Load DH parameter failed: %s", err_buf);
+            mk_err_ex(mk_api, "[tls] Load DH parameter failed: %s", err_buf);
             return -1;
         }
     }
@@ -418,10 +819,15 @@ static int polar_load_dh_param(const struct polar_config *conf)
 
 static int mk_tls_init()
 {
+    int i;
+
     pthread_key_create(&local_context, NULL);
 
 #if defined(MBEDTLS_SSL_CACHE_C)
-    mbedtls_ssl_cache_init(&global_sessions.cache);
+    for (i = 0; i < POLAR_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&global_sessions[i]._mutex, NULL);
+        mbedtls_ssl_cache_init(&global_sessions[i].cache);
+    }
 #endif
 
     pthread_mutex_lock(&server_context->mutex);
@@ -481,117 +887,633 @@ static void config_free(struct polar_config *conf)
     if (conf->dh_param_file) mk_api->mem_free(conf->dh_param_file);
 }
 
-/* Contexts may be requested from outside workers on exit so we should
- * be prepared for an empty context.
+/*
+ * A context is attached to every connection when it's accepted, the core
+ * hands it back on each I/O callback. Released contexts are kept by the
+ * worker and reused for the next connections.
  */
-static mbedtls_ssl_context *context_get(int fd)
+static struct polar_context_head *context_new(struct mk_channel *channel)
 {
     struct polar_thread_context *thctx = local_thread_context();
-    struct polar_context_head **cur = &thctx->contexts;
+    struct polar_context_head *head;
+    mbedtls_ssl_context *ssl;
 
-    if (cur == NULL) {
-        return NULL;
+    if (thctx->unused) {
+        head = thctx->unused;
+        thctx->unused = head->_next_unused;
     }
+    else {
+        PLUGIN_TRACE("[polarssl %d] New ssl context.", channel->fd);
 
-    for (; *cur; cur = &(*cur)->_next) {
-        if ((*cur)->fd == fd) {
-            return &(*cur)->context;
+        head = mk_api->mem_alloc(sizeof(*head));
+        if (head == NULL) {
+            return NULL;
         }
+        head->thread = thctx;
+        head->_next = thctx->contexts;
+        thctx->contexts = head;
+
+        ssl = &head->context;
+
+        mbedtls_ssl_init(ssl);
+        mbedtls_ssl_setup(ssl, &thctx->conf);
+
+        mbedtls_ssl_set_bio(ssl, &head->fd,
+                            mbedtls_net_send, mbedtls_net_recv, NULL);
     }
 
-    return NULL;
+    head->fd = channel->fd;
+    head->event = channel->event;
+    head->hs_ret = 0;
+    head->hs_pending = MK_FALSE;
+    head->hs_closed = MK_FALSE;
+    head->hs_thread = NULL;
+    head->_next_job = NULL;
+    head->_next_unused = NULL;
+#ifdef MK_HAVE_KTLS
+    head->ktls = 0;
+    head->ktls_keylen = 0;
+#endif
+
+    return head;
 }
 
-static mbedtls_ssl_context *context_new(int fd)
+static int context_unset(int fd, struct polar_context_head *head)
 {
-    struct polar_thread_context *thctx = local_thread_context();
-    struct polar_context_head **cur = &thctx->contexts;
-    mbedtls_ssl_context *ssl = NULL;
-    mbedtls_ssl_cache_context cache;
+    struct polar_thread_context *thctx = head->thread;
 
-    mbedtls_ssl_cache_init(&cache);
+    if (head->fd == fd) {
+        head->fd = -1;
+        head->event = NULL;
+        mbedtls_ssl_session_reset(&head->context);
+#ifdef MK_HAVE_KTLS
+        memset(head->ktls_keys, 0, sizeof(head->ktls_keys));
+        head->ktls_keylen = 0;
+#endif
+        head->_next_unused = thctx->unused;
+        thctx->unused = head;
+    }
+    else {
+        mk_err_ex(mk_api, "[polarssl %d] Context already unset.", fd);
+    }
 
-    assert(cur != NULL);
+    return 0;
+}
 
-    for (; *cur; cur = &(*cur)->_next) {
-        if ((*cur)->fd == -1) {
-            break;
-        }
+/* Handshake steps running from here belong to this connection */
+static inline void context_use(struct polar_context_head *head)
+{
+    head->thread->current = head;
+}
+
+#ifdef MK_HAVE_KTLS
+/*
+ * Called by mbedtls when the key block of a session is derived, the
+ * write keys are kept until the handshake is over.
+ */
+static int ktls_export_keys(void *p, const unsigned char *ms,
+                            const unsigned char *kb, size_t maclen,
+                            size_t keylen, size_t ivlen)
+{
+    struct polar_thread_context *thctx = p;
+    struct polar_context_head *head = thctx->current;
+
+    (void) ms;
+    (void) ivlen;
+
+    if (head && keylen * 2 <= sizeof(head->ktls_keys)) {
+        /* client write key followed by the server write key */
+        memcpy(head->ktls_keys, kb + maclen * 2, keylen * 2);
+        head->ktls_keylen = keylen;
     }
 
-    if (*cur == NULL) {
-        PLUGIN_TRACE("[polarssl %d] New ssl context.", fd);
+    return 0;
+}
 
-        *cur = mk_api->mem_alloc(sizeof(**cur));
-        if (*cur == NULL) {
-            return NULL;
+static int ktls_set_key(int fd, int direction, int cipher,
+                        const unsigned char *key,
+                        const unsigned char *salt,
+                        const unsigned char *seq)
+{
+    int ret;
+    socklen_t len;
+    union {
+        struct tls12_crypto_info_aes_gcm_128 gcm128;
+        struct tls12_crypto_info_aes_gcm_256 gcm256;
+    } info;
+
+    memset(&info, 0, sizeof(info));
+
+    /* The explicit nonce of every record starts at its sequence number */
+    if (cipher == MBEDTLS_CIPHER_AES_128_GCM) {
+        info.gcm128.info.version = TLS_1_2_VERSION;
+        info.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy(info.gcm128.key, key, TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+        memcpy(info.gcm128.salt, salt, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+        memcpy(info.gcm128.iv, seq, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+        memcpy(info.gcm128.rec_seq, seq, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+        len = sizeof(info.gcm128);
+    }
+    else {
+        info.gcm256.info.version = TLS_1_2_VERSION;
+        info.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy(info.gcm256.key, key, TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+        memcpy(info.gcm256.salt, salt, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+        memcpy(info.gcm256.iv, seq, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+        memcpy(info.gcm256.rec_seq, seq, TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+        len = sizeof(info.gcm256);
+    }
+
+    ret = setsockopt(fd, SOL_TLS, direction, &info, len);
+    memset(&info, 0, sizeof(info));
+
+    return ret;
+}
+
+/*
+ * Once the handshake is over and mbedtls holds no pending records, pass
+ * the session keys and sequence numbers to the kernel. From that point
+ * the socket takes plain data, so responses can be sent with writev(2)
+ * and sendfile(2) like on a plain connection. Only TLS 1.2 AES-GCM
+ * sessions can be offloaded, others keep using mbedtls.
+ */
+static void ktls_setup(struct polar_context_head *head)
+{
+    int ret;
+    int err;
+    int cipher;
+    mbedtls_ssl_context *ssl = &head->context;
+
+    if ((head->ktls & KTLS_DONE) ||
+        ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER) {
+        return;
+    }
+
+    if (ssl->out_left > 0 || ssl->in_left > 0 || ssl->in_offt != NULL) {
+        return;
+    }
+
+    /* Callers report the result of the last mbedtls call through errno */
+    err = errno;
+    head->ktls = KTLS_DONE;
+
+    if (!server_context->config.kernel_tls || ktls_available == MK_FALSE ||
+        head->ktls_keylen == 0 ||
+        ssl->minor_ver != MBEDTLS_SSL_MINOR_VERSION_3) {
+        goto out;
+    }
+
+    cipher = ssl->transform_out->ciphersuite_info->cipher;
+    if (cipher != MBEDTLS_CIPHER_AES_128_GCM &&
+        cipher != MBEDTLS_CIPHER_AES_256_GCM) {
+        goto out;
+    }
+
+    ret = setsockopt(head->fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls"));
+    if (ret == -1) {
+        if (errno == ENOENT || errno == ENOPROTOOPT) {
+            mk_info_ex(mk_api, "[tls] Kernel TLS is not available, "
+                       "records will be encrypted by the server");
+            ktls_available = MK_FALSE;
         }
-        (*cur)->_next = NULL;
+        goto out;
+    }
 
-        ssl = &(*cur)->context;
+    ret = ktls_set_key(head->fd, TLS_RX, cipher, head->ktls_keys,
+                       ssl->transform_in->iv_dec, ssl->in_ctr);
+    if (ret == 0) {
+        head->ktls |= KTLS_RX;
+    }
 
-        mbedtls_ssl_init(ssl);
-        mbedtls_ssl_setup(ssl, &thctx->conf);
+    ret = ktls_set_key(head->fd, TLS_TX, cipher,
+                       head->ktls_keys + head->ktls_keylen,
+                       ssl->transform_out->iv_enc, ssl->out_ctr);
+    if (ret == 0) {
+        head->ktls |= KTLS_TX;
+    }
 
-        mbedtls_ssl_conf_session_cache(&thctx->conf,
-                                       &global_sessions,
-                                       tls_cache_get,
-                                       tls_cache_set);
+    PLUGIN_TRACE("[fd %i] kernel TLS tx=%i rx=%i", head->fd,
+                 (head->ktls & KTLS_TX) != 0, (head->ktls & KTLS_RX) != 0);
 
-        mbedtls_ssl_set_bio(ssl, &(*cur)->fd,
-                            mbedtls_net_send, mbedtls_net_recv, NULL);
+ out:
+    memset(head->ktls_keys, 0, sizeof(head->ktls_keys));
+    head->ktls_keylen = 0;
+    errno = err;
+}
+
+/* The kernel sends non application records when they are flagged */
+static void ktls_close_notify(int fd)
+{
+    unsigned char alert[2] = {MBEDTLS_SSL_ALERT_LEVEL_WARNING,
+                              MBEDTLS_SSL_ALERT_MSG_CLOSE_NOTIFY};
+    char buf[CMSG_SPACE(sizeof(unsigned char))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = alert;
+    iov.iov_len = sizeof(alert);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = sizeof(buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_TLS;
+    cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+    *CMSG_DATA(cmsg) = KTLS_ALERT;
+
+    sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+#endif
 
-        mbedtls_ssl_conf_rng(&thctx->conf, mbedtls_ctr_drbg_random,
-                             &thctx->ctr_drbg);
+/*
+ * Set up a handshake engine, used by every worker and pool thread: the
+ * server configuration with its own random generator, private key and
+ * ticket keys.
+ */
+static int thread_context_init(struct polar_thread_context *thctx)
+{
+    int ret;
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    int i;
+#endif
+    const char *pers = "monkey";
+
+    thctx->contexts = NULL;
+    thctx->unused = NULL;
+    thctx->current = NULL;
+    thctx->hs_channel = -1;
+    mk_list_init(&thctx->_head);
+
+    /* SSL confniguration */
+    mbedtls_ssl_config_init(&thctx->conf);
+    mbedtls_ssl_config_defaults(&thctx->conf,
+                                MBEDTLS_SSL_IS_SERVER,
+                                MBEDTLS_SSL_TRANSPORT_STREAM,
+                                MBEDTLS_SSL_PRESET_DEFAULT);
+
+#ifdef MK_HAVE_KTLS
+    if (server_context->config.kernel_tls == MK_TRUE) {
+        mbedtls_ssl_conf_export_keys_cb(&thctx->conf, ktls_export_keys, thctx);
+    }
+#endif
+
+    mbedtls_ctr_drbg_init(&thctx->ctr_drbg);
+    ret = mbedtls_ctr_drbg_seed(&thctx->ctr_drbg,
+                                entropy_func_safe, &server_context->entropy,
+                                (const unsigned char *) pers,
+                                strlen(pers));
+    if (ret != 0) {
+        return -1;
+    }
+
+    mbedtls_pk_init(&thctx->pkey);
+
+    PLUGIN_TRACE("[tls] Load RSA key.");
+    if (polar_load_key(thctx, &server_context->config)) {
+        return -1;
+    }
+
+    mbedtls_ssl_conf_rng(&thctx->conf, mbedtls_ctr_drbg_random,
+                         &thctx->ctr_drbg);
 
 #if (POLAR_DEBUG_LEVEL > 0)
-        mbedtls_ssl_conf_dbg(ssl, polar_debug, 0);
+    mbedtls_ssl_conf_dbg(&thctx->conf, polar_debug, 0);
 #endif
 
-        mbedtls_ssl_conf_own_cert(&thctx->conf, &server_context->cert, &thctx->pkey);
-        mbedtls_ssl_conf_ca_chain(&thctx->conf, &server_context->ca_cert, NULL);
-        mbedtls_ssl_conf_dh_param_ctx(&thctx->conf, &server_context->dhm);
+    mbedtls_ssl_conf_session_cache(&thctx->conf,
+                                   global_sessions,
+                                   tls_cache_get,
+                                   tls_cache_set);
+
+    mbedtls_ssl_conf_own_cert(&thctx->conf, &server_context->cert, &thctx->pkey);
+    mbedtls_ssl_conf_ca_chain(&thctx->conf, &server_context->ca_cert, NULL);
+    mbedtls_ssl_conf_dh_param_ctx(&thctx->conf, &server_context->dhm);
 
-        if (server_context->config.check_client_cert == MK_TRUE) {
-          mbedtls_ssl_conf_authmode(&thctx->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    if (server_context->config.check_client_cert == MK_TRUE) {
+        mbedtls_ssl_conf_authmode(&thctx->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    }
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    thctx->ticket_active = 0;
+    for (i = 0; i < 2; i++) {
+        thctx->tickets[i].created = 0;
+        mbedtls_cipher_init(&thctx->tickets[i].cipher);
+        ret = mbedtls_cipher_setup(&thctx->tickets[i].cipher,
+                                   mbedtls_cipher_info_from_type(MBEDTLS_CIPHER_AES_256_GCM));
+        if (ret != 0) {
+            return -1;
         }
     }
-    else {
-        ssl = &(*cur)->context;
+
+    if (server_context->config.session_tickets == MK_TRUE &&
+        server_context->config.check_client_cert == MK_FALSE) {
+        mbedtls_ssl_conf_session_tickets_cb(&thctx->conf,
+                                            tls_ticket_write,
+                                            tls_ticket_parse,
+                                            thctx);
     }
+#endif
+
+    return 0;
+}
 
-    (*cur)->fd = fd;
+static void thread_context_free(struct polar_thread_context *thctx)
+{
+    contexts_free(thctx->contexts);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_cipher_free(&thctx->tickets[0].cipher);
+    mbedtls_cipher_free(&thctx->tickets[1].cipher);
+#endif
+    mbedtls_ssl_config_free(&thctx->conf);
+    mbedtls_ctr_drbg_free(&thctx->ctr_drbg);
+    mbedtls_pk_free(&thctx->pkey);
+    mk_api->mem_free(thctx);
+}
+
+/* Run the handshake steps of a connection until the client has to answer */
+static void tls_handshake_run(struct polar_thread_context *engine,
+                              struct polar_context_head *head)
+{
+    int ret;
+    struct pollfd pfd;
+    mbedtls_ssl_context *ssl = &head->context;
+
+    ssl->conf = &engine->conf;
+    engine->current = head;
 
-    return ssl;
+    while ((ret = mbedtls_ssl_handshake(ssl)) == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        pfd.fd = head->fd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, HANDSHAKE_WRITE_TIMEOUT) <= 0) {
+            break;
+        }
+    }
+
+    engine->current = NULL;
+    ssl->conf = &head->thread->conf;
+    head->hs_ret = ret;
 }
 
-static int context_unset(int fd, mbedtls_ssl_context *ssl)
+static void tls_handshake_thread(void *data)
 {
+    int fd;
+    struct polar_hs_thread *th = data;
     struct polar_context_head *head;
 
-    head = container_of(ssl, struct polar_context_head, context);
+    mk_api->worker_rename("monkey: tls");
 
-    if (head->fd == fd) {
-        head->fd = -1;
-        mbedtls_ssl_session_reset(ssl);
+    while (1) {
+        pthread_mutex_lock(&th->mutex);
+        while (th->jobs == NULL && hs_pool.stop == MK_FALSE) {
+            pthread_cond_wait(&th->cond, &th->mutex);
+        }
+        if (th->jobs == NULL) {
+            pthread_mutex_unlock(&th->mutex);
+            break;
+        }
+        head = th->jobs;
+        th->jobs = head->_next_job;
+        if (th->jobs == NULL) {
+            th->jobs_tail = NULL;
+        }
+        pthread_mutex_unlock(&th->mutex);
+
+        tls_handshake_run(th->engine, head);
+
+        /* The worker owns the context again once it reads it */
+        fd = head->thread->hs_channel;
+        if (write(fd, &head, sizeof(head)) != sizeof(head)) {
+            mk_err_ex(mk_api, "[tls] Could not resume a handshake: %s",
+                      strerror(errno));
+        }
+    }
+}
+
+/* Started by the first worker, threads can't be created before forking */
+static void tls_handshake_pool_start(void)
+{
+    int i;
+    int n = server_context->config.handshake_threads;
+    struct polar_hs_thread *th;
+
+    hs_pool.threads = mk_api->mem_alloc_z(sizeof(struct polar_hs_thread) * n);
+    if (!hs_pool.threads) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        th = &hs_pool.threads[i];
+        th->engine = mk_api->mem_alloc_z(sizeof(struct polar_thread_context));
+        if (!th->engine || thread_context_init(th->engine) != 0) {
+            break;
+        }
+
+        pthread_mutex_init(&th->mutex, NULL);
+        pthread_cond_init(&th->cond, NULL);
+        if (mk_api->worker_spawn(tls_handshake_thread, th, &th->tid) != 0) {
+            pthread_mutex_destroy(&th->mutex);
+            pthread_cond_destroy(&th->cond);
+            break;
+        }
+    }
+
+    if (i < n) {
+        mk_warn_ex(mk_api, "[tls] Started %i of %i handshake threads",
+                   i, n);
+        if (th->engine) {
+            thread_context_free(th->engine);
+            th->engine = NULL;
+        }
+    }
+    hs_pool.size = i;
+}
+
+static void tls_handshake_pool_stop(void)
+{
+    int i;
+    struct polar_hs_thread *th;
+
+    for (i = 0; i < hs_pool.size; i++) {
+        th = &hs_pool.threads[i];
+        pthread_mutex_lock(&th->mutex);
+        hs_pool.stop = MK_TRUE;
+        pthread_cond_signal(&th->cond);
+        pthread_mutex_unlock(&th->mutex);
+    }
+
+    for (i = 0; i < hs_pool.size; i++) {
+        th = &hs_pool.threads[i];
+        pthread_join(th->tid, NULL);
+        pthread_mutex_destroy(&th->mutex);
+        pthread_cond_destroy(&th->cond);
+        thread_context_free(th->engine);
+    }
+
+    if (hs_pool.threads) {
+        mk_api->mem_free(hs_pool.threads);
+    }
+    hs_pool.threads = NULL;
+    hs_pool.size = 0;
+}
+
+/*
+ * Stop watching the connection and queue its next handshake steps on the
+ * pool. The core is told to wait for more data, the connection is watched
+ * again once the pool is done.
+ */
+static int tls_handshake_offload(struct polar_context_head *head)
+{
+    struct polar_thread_context *thctx = head->thread;
+    struct mk_event *event = head->event;
+    struct polar_hs_thread *th;
+
+    /* A failed handshake is reported on the next read */
+    if (head->hs_ret < 0 && head->hs_ret != MBEDTLS_ERR_SSL_WANT_READ) {
+        return handle_return(head->hs_ret);
+    }
+
+    if (!head->hs_thread) {
+        head->hs_thread = &hs_pool.threads[thctx->hs_next++ % hs_pool.size];
+    }
+    th = head->hs_thread;
+
+    /* Edge-triggered events report the fired directions in the mask */
+    if (event->mask & MK_EVENT_EDGE) {
+        head->hs_mask = MK_EVENT_EDGE | MK_EVENT_READ | MK_EVENT_WRITE;
+    }
+    else if (event->mask == MK_EVENT_EMPTY) {
+        head->hs_mask = MK_EVENT_READ;
+    }
+    else {
+        head->hs_mask = event->mask;
+    }
+
+    mk_api->ev_del(thctx->loop, event);
+    head->hs_pending = MK_TRUE;
+
+    pthread_mutex_lock(&th->mutex);
+    if (th->jobs_tail) {
+        th->jobs_tail->_next_job = head;
     }
     else {
-        mk_err("[polarssl %d] Context already unset.", fd);
+        th->jobs = head;
+    }
+    th->jobs_tail = head;
+    head->_next_job = NULL;
+    pthread_cond_signal(&th->cond);
+    pthread_mutex_unlock(&th->mutex);
+
+    errno = EAGAIN;
+    return -1;
+}
+
+/* Channel handler: connections coming back from the handshake pool */
+static int tls_handshake_resume(void *data)
+{
+    int i;
+    int fd;
+    ssize_t n;
+    struct mk_event *event = data;
+    struct polar_thread_context *thctx = event->data;
+    struct polar_context_head *heads[64];
+    struct polar_context_head *head;
+
+    n = read(event->fd, heads, sizeof(heads));
+    if (n <= 0) {
+        return 0;
+    }
+
+    for (i = 0; i < n / (ssize_t) sizeof(head); i++) {
+        head = heads[i];
+        head->hs_pending = MK_FALSE;
+
+        /* The core dropped the connection, its socket was kept open */
+        if (head->hs_closed == MK_TRUE) {
+            fd = head->fd;
+            context_unset(fd, head);
+            close(fd);
+            continue;
+        }
+
+        if (head->hs_ret < 0 && head->hs_ret != MBEDTLS_ERR_SSL_WANT_READ) {
+            /* Wake up the core so it reads the error and closes */
+            shutdown(head->fd, SHUT_RDWR);
+        }
+#ifdef MK_HAVE_KTLS
+        else if (head->hs_ret == 0) {
+            ktls_setup(head);
+        }
+#endif
+
+        mk_api->ev_add(thctx->loop, head->fd, MK_EVENT_CONNECTION,
+                       head->hs_mask, head->event);
     }
 
     return 0;
 }
 
-int mk_tls_read(int fd, void *buf, int count)
+static int tls_handshake_channel_create(struct polar_thread_context *thctx)
 {
+    int ret;
+    int fd_r;
+
+    thctx->loop = mk_api->sched_loop();
+    ret = mk_api->ev_channel_create(thctx->loop, &fd_r, &thctx->hs_channel,
+                                    &thctx->hs_event);
+    if (ret != 0) {
+        return -1;
+    }
+
+    /* Channels are registered as notifications, handle them here instead */
+    thctx->hs_event.data = thctx;
+    thctx->hs_event.handler = tls_handshake_resume;
+
+    return mk_api->ev_add(thctx->loop, fd_r, MK_EVENT_CUSTOM, MK_EVENT_READ,
+                          &thctx->hs_event);
+}
+
+int mk_tls_conn_open(struct mk_plugin *plugin, struct mk_channel *channel)
+{
+    struct polar_context_head *head;
+
+    (void) plugin;
+
+    head = context_new(channel);
+    if (!head) {
+        return -1;
+    }
+
+    channel->net_data = head;
+    return 0;
+}
+
+int mk_tls_read(struct mk_plugin *plugin, int fd, void *buf, int count,
+                void *data)
+{
+    int ret;
     size_t avail;
-    mbedtls_ssl_context *ssl = context_get(fd);
+    mbedtls_ssl_context *ssl;
+    struct polar_context_head *head = data;
 
-    if (!ssl) {
-        ssl = context_new(fd);
+    (void) plugin;
+
+#ifdef MK_HAVE_KTLS
+    if (head->ktls & KTLS_RX) {
+        return recv(fd, buf, count, 0);
     }
+#endif
 
-    int ret = handle_return(mbedtls_ssl_read(ssl, buf, count));
+    ssl = &head->context;
+    if (hs_pool.size > 0 && ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER) {
+        return tls_handshake_offload(head);
+    }
+
+    context_use(head);
+    ret = handle_return(mbedtls_ssl_read(ssl, buf, count));
     PLUGIN_TRACE("IN: %i SSL READ: %i ; CORE COUNT: %i",
                  ssl->in_msglen,
                  ret, count);
@@ -608,36 +1530,61 @@ int mk_tls_read(int fd, void *buf, int count)
             ret += avail;
         }
     }
+
+#ifdef MK_HAVE_KTLS
+    ktls_setup(head);
+#endif
     return ret;
 }
 
-int mk_tls_write(int fd, const void *buf, size_t count)
+int mk_tls_write(struct mk_plugin *plugin, int fd, const void *buf,
+                 size_t count, void *data)
 {
-    mbedtls_ssl_context *ssl = context_get(fd);
-    if (!ssl) {
-        ssl = context_new(fd);
+    int ret;
+    struct polar_context_head *head = data;
+
+    (void) plugin;
+
+#ifdef MK_HAVE_KTLS
+    if (head->ktls & KTLS_TX) {
+        return send(fd, buf, count, 0);
     }
+#else
+    (void) fd;
+#endif
+
+    context_use(head);
+    ret = handle_return(mbedtls_ssl_write(&head->context, buf, count));
 
-    return handle_return(mbedtls_ssl_write(ssl, buf, count));
+#ifdef MK_HAVE_KTLS
+    ktls_setup(head);
+#endif
+    return ret;
 }
 
-int mk_tls_writev(int fd, struct mk_iov *mk_io)
+int mk_tls_writev(struct mk_plugin *plugin, int fd, struct mk_iov *mk_io,
+                  void *data)
 {
-    mbedtls_ssl_context *ssl = context_get(fd);
     const int iov_len = mk_io->iov_idx;
     const struct iovec *io = mk_io->io;
     const size_t len = mk_io->total_len;
     unsigned char *buf;
     size_t used = 0;
     int ret = 0, i;
+    struct polar_context_head *head = data;
 
-    if (!ssl) {
-        ssl = context_new(fd);
+#ifdef MK_HAVE_KTLS
+    if (head->ktls & KTLS_TX) {
+        return plugin->api->iov_send(fd, mk_io);
     }
+#else
+    (void) plugin;
+    (void) fd;
+#endif
 
     buf = mk_api->mem_alloc(len);
     if (buf == NULL) {
-        mk_err("malloc failed: %s", strerror(errno));
+        mk_err_ex(mk_api, "malloc failed: %s", strerror(errno));
         return -1;
     }
 
@@ -647,24 +1594,39 @@ int mk_tls_writev(int fd, struct mk_iov *mk_io)
     }
 
     assert(used == len);
-    ret = mbedtls_ssl_write(ssl, buf, len);
+    context_use(head);
+    ret = mbedtls_ssl_write(&head->context, buf, len);
     mk_api->mem_free(buf);
 
-    return handle_return(ret);
+    ret = handle_return(ret);
+
+#ifdef MK_HAVE_KTLS
+    ktls_setup(head);
+#endif
+    return ret;
 }
 
-int mk_tls_send_file(int fd, int file_fd, off_t *file_offset,
-        size_t file_count)
+int mk_tls_send_file(struct mk_plugin *plugin, int fd, int file_fd,
+                     off_t *file_offset, size_t file_count, void *data)
 {
-    mbedtls_ssl_context *ssl = context_get(fd);
+    mbedtls_ssl_context *ssl;
     unsigned char *buf;
     ssize_t used, remain = file_count, sent = 0;
     int ret;
+    struct polar_context_head *head = data;
 
-    if (!ssl) {
-        ssl = context_new(fd);
+    (void) plugin;
+
+#ifdef MK_HAVE_KTLS
+    if (head->ktls & KTLS_TX) {
+        return sendfile(fd, file_fd, file_offset, file_count);
     }
+#else
+    (void) fd;
+#endif
 
+    ssl = &head->context;
+    context_use(head);
     buf = mk_api->mem_alloc(SENDFILE_BUF_SIZE);
     if (buf == NULL) {
         return -1;
@@ -676,7 +1638,8 @@ int mk_tls_send_file(int fd, int file_fd, off_t *file_offset,
             ret = 0;
         }
         else if (used < 0) {
-            mk_err("[tls] Read from file failed: %s", strerror(errno));
+            mk_err_ex(mk_api, "[tls] Read from file failed: %s",
+                      strerror(errno));
             ret = -1;
         }
         else if (remain > 0) {
@@ -705,33 +1668,52 @@ int mk_tls_send_file(int fd, int file_fd, off_t *file_offset,
     }
 }
 
-int mk_tls_close(int fd)
+int mk_tls_close(struct mk_plugin *plugin, int fd, void *data)
 {
-    mbedtls_ssl_context *ssl = context_get(fd);
+    struct polar_context_head *head = data;
+
+    (void) plugin;
 
     PLUGIN_TRACE("[fd %d] Closing connection", fd);
 
-    if (ssl) {
-        mbedtls_ssl_close_notify(ssl);
-        context_unset(fd, ssl);
+    /* The pool still uses the socket, it's closed when it's given back */
+    if (head && head->hs_pending == MK_TRUE) {
+        head->hs_closed = MK_TRUE;
+        head->event = NULL;
+        return 0;
+    }
+
+    /* Sockets dropped before they became a connection have no context */
+    if (head) {
+#ifdef MK_HAVE_KTLS
+        if (head->ktls & KTLS_TX) {
+            ktls_close_notify(fd);
+        }
+        else {
+            mbedtls_ssl_close_notify(&head->context);
+        }
+#else
+        mbedtls_ssl_close_notify(&head->context);
+#endif
+        context_unset(fd, head);
     }
 
     close(fd);
     return 0;
 }
 
-int mk_tls_plugin_init(struct plugin_api **api, char *confdir)
+int mk_tls_plugin_init(struct mk_plugin *plugin, char *confdir)
 {
     int used;
     struct mk_list *head;
     struct mk_config_listener *listen;
 
     /* Evil global config stuff */
-    mk_api = *api;
+    mk_api = plugin->api;
 
     /* Check if the plugin will be used by some listener */
     used = MK_FALSE;
-    mk_list_foreach(head, &mk_api->config->listeners) {
+    mk_list_foreach(head, &plugin->server_ctx->listeners) {
         listen = mk_list_entry(head, struct mk_config_listener, _head);
         if (listen->flags & MK_CAP_SOCK_TLS) {
             used = MK_TRUE;
@@ -751,47 +1733,32 @@ int mk_tls_plugin_init(struct plugin_api **api, char *confdir)
     }
 }
 
-void mk_tls_worker_init(void)
+void mk_tls_worker_init(struct mk_server *server)
 {
-    int ret;
     struct polar_thread_context *thctx;
-    const char *pers = "monkey";
+
+    (void) server;
 
     PLUGIN_TRACE("[tls] Init thread context.");
 
-    thctx = mk_api->mem_alloc(sizeof(*thctx));
+    thctx = mk_api->mem_alloc_z(sizeof(*thctx));
     if (thctx == NULL) {
         goto error;
     }
-    thctx->contexts = NULL;
-    mk_list_init(&thctx->_head);
-
 
-    /* SSL confniguration */
-    mbedtls_ssl_config_init(&thctx->conf);
-    mbedtls_ssl_config_defaults(&thctx->conf,
-                                MBEDTLS_SSL_IS_SERVER,
-                                MBEDTLS_SSL_TRANSPORT_STREAM,
-                                MBEDTLS_SSL_PRESET_DEFAULT);
+    if (thread_context_init(thctx) != 0) {
+        goto error;
+    }
 
     pthread_mutex_lock(&server_context->mutex);
     mk_list_add(&thctx->_head, &server_context->threads._head);
     pthread_mutex_unlock(&server_context->mutex);
 
-    mbedtls_ctr_drbg_init(&thctx->ctr_drbg);
-    ret = mbedtls_ctr_drbg_seed(&thctx->ctr_drbg,
-                                entropy_func_safe, &server_context->entropy,
-                                (const unsigned char *) pers,
-                                strlen(pers));
-    if (ret != 0) {
-        goto error;
-    }
-
-    mbedtls_pk_init(&thctx->pkey);
-
-    PLUGIN_TRACE("[tls] Load RSA key.");
-    if (polar_load_key(thctx, &server_context->config)) {
-        goto error;
+    if (server_context->config.handshake_threads > 0) {
+        pthread_once(&hs_pool_once, tls_handshake_pool_start);
+        if (hs_pool.size > 0 && tls_handshake_channel_create(thctx) != 0) {
+            goto error;
+        }
     }
 
     PLUGIN_TRACE("[tls] Set local thread context.");
@@ -803,26 +1770,35 @@ void mk_tls_worker_init(void)
     exit(EXIT_FAILURE);
 }
 
-int mk_tls_plugin_exit()
+int mk_tls_plugin_exit(struct mk_plugin *plugin)
 {
+    int i;
     struct mk_list *cur, *tmp;
     struct polar_thread_context *thctx;
 
+    (void) plugin;
+
+    tls_handshake_pool_stop();
+
     mbedtls_x509_crt_free(&server_context->cert);
     mbedtls_x509_crt_free(&server_context->ca_cert);
     mbedtls_dhm_free(&server_context->dhm);
 
     mk_list_foreach_safe(cur, tmp, &server_context->threads._head) {
         thctx = mk_list_entry(cur, struct polar_thread_context, _head);
-        contexts_free(thctx->contexts);
-        mk_api->mem_free(thctx);
-
-        mbedtls_pk_free(&thctx->pkey);
+        thread_context_free(thctx);
     }
     pthread_mutex_destroy(&server_context->mutex);
 
 #if defined(MBEDTLS_SSL_CACHE_C)
-    mbedtls_ssl_cache_free(&global_sessions.cache);
+    for (i = 0; i < POLAR_CACHE_SHARDS; i++) {
+        mbedtls_ssl_cache_free(&global_sessions[i].cache);
+        pthread_mutex_destroy(&global_sessions[i]._mutex);
+    }
+#endif
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    memset(global_tickets.keys, 0, sizeof(global_tickets.keys));
 #endif
 
     config_free(&server_context->config);
@@ -833,6 +1809,7 @@ int mk_tls_plugin_exit()
 
 /* Network Layer plugin Callbacks */
 struct mk_plugin_network mk_plugin_network_tls = {
+    .conn_open     = mk_tls_conn_open,
     .read          = mk_tls_read,
     .write         = mk_tls_write,
     .writev        = mk_tls_writev,
@@ -0,0 +1,268 @@
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_lib.h>
+#include <monkey/monkey.h>
+#include <monkey/mk_http2_hpack.h>
+
+#include "mk_tests.h"
+
+/* Decoded fields are flattened as 'name: value\n' lines */
+struct test_fields {
+    size_t len;
+    char buf[1024];
+};
+
+struct test_block {
+    const char *hex;
+    const char *fields;
+    uint32_t table_size;
+};
+
+static void cb_field(void *data, char *name, size_t name_len,
+                     char *value, size_t value_len)
+{
+    struct test_fields *f = data;
+
+    if (f->len + name_len + value_len + 3 >= sizeof(f->buf)) {
+        return;
+    }
+    memcpy(f->buf + f->len, name, name_len);
+    f->len += name_len;
+    f->buf[f->len++] = ':';
+    f->buf[f->len++] = ' ';
+    memcpy(f->buf + f->len, value, value_len);
+    f->len += value_len;
+    f->buf[f->len++] = '\n';
+    f->buf[f->len] = '\0';
+}
+
+static size_t hex_decode(const char *hex, uint8_t *out)
+{
+    size_t n = 0;
+    unsigned int byte;
+
+    while (*hex) {
+        if (*hex == ' ') {
+            hex++;
+            continue;
+        }
+        sscanf(hex, "%2x", &byte);
+        out[n++] = byte;
+        hex += 2;
+    }
+
+    return n;
+}
+
+/* Decode a sequence of header blocks sharing the same dynamic table */
+static void check_blocks(struct test_block *blocks, int count,
+                         uint32_t limit)
+{
+    int i;
+    int ret;
+    size_t len;
+    uint8_t buf[512];
+    struct test_fields f;
+    struct mk_http2_hpack ctx;
+
+    TEST_CHECK(mk_http2_hpack_init(&ctx, limit) == 0);
+
+    for (i = 0; i < count; i++) {
+        len = hex_decode(blocks[i].hex, buf);
+        f.len = 0;
+        f.buf[0] = '\0';
+
+        ret = mk_http2_hpack_decode(&ctx, buf, len, cb_field, &f);
+        TEST_CHECK(ret == 0);
+        TEST_CHECK(strcmp(f.buf, blocks[i].fields) == 0);
+        TEST_MSG("block %i: %s", i, f.buf);
+        TEST_CHECK(ctx.size == blocks[i].table_size);
+    }
+
+    mk_http2_hpack_exit(&ctx);
+}
+
+/* RFC 7541 C.3: requests without Huffman coding */
+void test_hpack_requests(void)
+{
+    struct test_block blocks[] = {
+        {
+            "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+            ":method: GET\n:scheme: http\n:path: /\n"
+            ":authority: www.example.com\n",
+            57
+        },
+        {
+            "8286 84be 5808 6e6f 2d63 6163 6865",
+            ":method: GET\n:scheme: http\n:path: /\n"
+            ":authority: www.example.com\ncache-control: no-cache\n",
+            110
+        },
+        {
+            "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f"
+            "6d2d 7661 6c75 65",
+            ":method: GET\n:scheme: https\n:path: /index.html\n"
+            ":authority: www.example.com\ncustom-key: custom-value\n",
+            164
+        }
+    };
+
+    check_blocks(blocks, 3, MK_HTTP2_HPACK_TABLE_SIZE);
+}
+
+/* RFC 7541 C.4: requests with Huffman coding */
+void test_hpack_requests_huffman(void)
+{
+    struct test_block blocks[] = {
+        {
+            "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+            ":method: GET\n:scheme: http\n:path: /\n"
+            ":authority: www.example.com\n",
+            57
+        },
+        {
+            "8286 84be 5886 a8eb 1064 9cbf",
+            ":method: GET\n:scheme: http\n:path: /\n"
+            ":authority: www.example.com\ncache-control: no-cache\n",
+            110
+        },
+        {
+            "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+            ":method: GET\n:scheme: https\n:path: /index.html\n"
+            ":authority: www.example.com\ncustom-key: custom-value\n",
+            164
+        }
+    };
+
+    check_blocks(blocks, 3, MK_HTTP2_HPACK_TABLE_SIZE);
+}
+
+/* RFC 7541 C.6: responses with Huffman coding, entries get evicted */
+void test_hpack_responses_eviction(void)
+{
+    struct test_block blocks[] = {
+        {
+            "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005"
+            "9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8"
+            "e9ae 82ae 43d3",
+            ":status: 302\ncache-control: private\n"
+            "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+            "location: https://www.example.com\n",
+            222
+        },
+        {
+            "4883 640e ffc1 c0bf",
+            ":status: 307\ncache-control: private\n"
+            "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+            "location: https://www.example.com\n",
+            222
+        },
+        {
+            "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d"
+            "1bff c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b"
+            "3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed"
+            "4ee5 b106 3d50 07",
+            ":status: 200\ncache-control: private\n"
+            "date: Mon, 21 Oct 2013 20:13:22 GMT\n"
+            "location: https://www.example.com\ncontent-encoding: gzip\n"
+            "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; "
+            "version=1\n",
+            215
+        }
+    };
+
+    check_blocks(blocks, 3, 256);
+}
+
+/* Our encoder output must decode back to the same fields */
+void test_hpack_roundtrip(void)
+{
+    int i;
+    int n;
+    int round;
+    size_t len;
+    uint8_t out[512];
+    struct test_fields f;
+    struct mk_http2_hpack enc;
+    struct mk_http2_hpack dec;
+    const char *fields[][2] = {
+        {":status", "200"},
+        {"server", "Monkey"},
+        {"content-type", "text/html"},
+        {"etag", "\"5a3b-1f\""},
+        {"content-length", "1234"},
+    };
+    const char *expected =
+        ":status: 200\nserver: Monkey\ncontent-type: text/html\n"
+        "etag: \"5a3b-1f\"\ncontent-length: 1234\n";
+
+    TEST_CHECK(mk_http2_hpack_init(&enc, MK_HTTP2_HPACK_TABLE_SIZE) == 0);
+    TEST_CHECK(mk_http2_hpack_init(&dec, MK_HTTP2_HPACK_TABLE_SIZE) == 0);
+
+    /* the second round is mostly made of dynamic table references */
+    for (round = 0; round < 2; round++) {
+        len = mk_http2_hpack_encode_begin(&enc, out, sizeof(out));
+        for (i = 0; i < 5; i++) {
+            n = mk_http2_hpack_encode(&enc, out + len, sizeof(out) - len,
+                                      fields[i][0], strlen(fields[i][0]),
+                                      fields[i][1], strlen(fields[i][1]),
+                                      i == 4 ? MK_HTTP2_HPACK_NO_INDEX :
+                                      MK_HTTP2_HPACK_INDEX);
+            TEST_CHECK(n > 0);
+            len += n;
+        }
+
+        f.len = 0;
+        f.buf[0] = '\0';
+        TEST_CHECK(mk_http2_hpack_decode(&dec, out, len, cb_field, &f) == 0);
+        TEST_CHECK(strcmp(f.buf, expected) == 0);
+        TEST_CHECK(enc.size == dec.size);
+    }
+
+    /* the peer shrinks the table: a size update leads the next block */
+    mk_http2_hpack_set_limit(&enc, 0);
+    len = mk_http2_hpack_encode_begin(&enc, out, sizeof(out));
+    TEST_CHECK(len > 0);
+    n = mk_http2_hpack_encode(&enc, out + len, sizeof(out) - len,
+                              "server", 6, "Monkey", 6,
+                              MK_HTTP2_HPACK_INDEX);
+    TEST_CHECK(n > 0);
+    len += n;
+
+    mk_http2_hpack_set_limit(&dec, 0);
+    f.len = 0;
+    f.buf[0] = '\0';
+    TEST_CHECK(mk_http2_hpack_decode(&dec, out, len, cb_field, &f) == 0);
+    TEST_CHECK(strcmp(f.buf, "server: Monkey\n") == 0);
+    TEST_CHECK(enc.size == 0 && dec.size == 0);
+
+    /* a literal name longer than the block is rejected */
+    len = hex_decode("400a 6375", out);
+    TEST_CHECK(mk_http2_hpack_decode(&dec, out, len, cb_field, &f) == -1);
+
+    mk_http2_hpack_exit(&enc);
+    mk_http2_hpack_exit(&dec);
+}
+
+TEST_LIST = {
+    {"hpack_requests",            test_hpack_requests},
+    {"hpack_requests_huffman",    test_hpack_requests_huffman},
+    {"hpack_responses_eviction",  test_hpack_responses_eviction},
+    {"hpack_roundtrip",           test_hpack_roundtrip},
+    {NULL, NULL}
+};
@@ -0,0 +1,98 @@
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Eduardo Silva <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_lib.h>
+#include <monkey/monkey.h>
+
+#include "mk_tests.h"
+
+#define N_TIMERS 1000
+
+struct test_timer {
+    uint64_t deadline;
+    uint64_t fired;
+    struct mk_timer_wheel_node node;
+};
+
+static uint64_t test_now;
+
+static void cb_expired(struct mk_timer_wheel_node *node, void *data)
+{
+    int *count = data;
+    struct test_timer *t;
+
+    t = mk_list_entry(node, struct test_timer, node);
+    t->fired = test_now;
+    (*count)++;
+}
+
+void test_timer_wheel_expire(void)
+{
+    int i;
+    int count = 0;
+    struct mk_timer_wheel wheel;
+    struct test_timer *timers;
+
+    timers = mk_mem_alloc_z(sizeof(struct test_timer) * N_TIMERS);
+    TEST_CHECK(timers != NULL);
+
+    /* 10ms ticks, deadlines spread over the first three levels */
+    test_now = 5000;
+    mk_timer_wheel_init(&wheel, 10, test_now);
+
+    for (i = 0; i < N_TIMERS; i++) {
+        timers[i].deadline = test_now + ((i * 7919) % 600000) + 1;
+        mk_timer_wheel_node_init(&timers[i].node);
+        mk_timer_wheel_add(&wheel, &timers[i].node, test_now,
+                           timers[i].deadline - test_now);
+    }
+    TEST_CHECK(wheel.count == N_TIMERS);
+
+    /* disarm every other timer */
+    for (i = 0; i < N_TIMERS; i += 2) {
+        mk_timer_wheel_del(&wheel, &timers[i].node);
+    }
+    TEST_CHECK(wheel.count == N_TIMERS / 2);
+
+    while (test_now < 5000 + 600000 + 20) {
+        test_now += 3;
+        mk_timer_wheel_expire(&wheel, test_now, cb_expired, &count);
+    }
+
+    TEST_CHECK(count == N_TIMERS / 2);
+    TEST_CHECK(wheel.count == 0);
+
+    for (i = 0; i < N_TIMERS; i++) {
+        if (i % 2 == 0) {
+            TEST_CHECK(timers[i].fired == 0);
+            continue;
+        }
+        /* never early, at most one tick plus one step late */
+        TEST_CHECK(timers[i].fired >= timers[i].deadline);
+        TEST_CHECK(timers[i].fired < timers[i].deadline + 10 + 3);
+    }
+
+    mk_mem_free(timers);
+}
+
+TEST_LIST = {
+    {
+        "timer_wheel_expire",
+        test_timer_wheel_expire,
+    },
+    {NULL, NULL}
+};